@@ -0,0 +1,42 @@
+#ifndef DNSR_BUFFER_POOL_H
+#define DNSR_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFFER_POOL_SIZE 64 ///< Number of buffers preallocated by each worker
+
+/// Pool of fixed-size receive buffers, owned by one worker
+typedef struct buffer_pool {
+	char * slab; ///< Memory of all preallocated buffers
+	char ** free; ///< Stack of free buffers
+	unsigned int capacity; ///< Number of preallocated buffers
+	unsigned int free_count; ///< Number of buffers in the free stack
+	unsigned int in_use; ///< Number of buffers handed out, including fallbacks
+	size_t buffer_size; ///< Size of each buffer
+
+	/**
+	 * @brief Take a buffer from the pool
+	 * Falls back to malloc when every preallocated buffer is in use.
+	 * @param pool The buffer pool
+	 * @return A buffer of buffer_size bytes, not zero-filled
+	 */
+	char * (* alloc)(struct buffer_pool * pool);
+
+	/**
+	 * @brief Return a buffer to the pool
+	 * @param pool The buffer pool
+	 * @param buf The buffer taken by alloc
+	 */
+	void (* release)(struct buffer_pool * pool, char * buf);
+} Buffer_Pool;
+
+/**
+ * @brief Create a new buffer pool
+ * @param capacity Number of buffers to preallocate
+ * @param buffer_size Size of each buffer
+ * @return The new buffer pool
+ */
+Buffer_Pool * new_buffer_pool(unsigned int capacity, size_t buffer_size);
+
+#endif //DNSR_BUFFER_POOL_H
@@ -1,18 +1,72 @@
 #ifndef DNSR_CACHE_H
 #define DNSR_CACHE_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <uv.h>
 
+#include "domain_trie.h"
 #include "linklist_rbtree.h"
 
-#define CACHE_SIZE 30
+#define CACHE_SIZE 65536 ///< Most answers in the cache
+#define CACHE_STRIPES 64 ///< Independently locked parts of the cache, a power of two
+#define CACHE_STRIPE_SIZE (CACHE_SIZE / CACHE_STRIPES) ///< Most answers in one stripe, also its number of buckets
 
-/// Cash struct
+/// Where the answer to a question was found
+typedef enum cache_source {
+	CACHE_MISS, ///< Nowhere
+	CACHE_HIT, ///< An answer cached from a remote server
+	CACHE_HOSTS, ///< The hosts file
+	CACHE_BLOCKED ///< The hosts file, which blocks the name
+} Cache_Source;
+
+/// Answer in the cache, reachable by readers without a lock until it is retired
+typedef struct cache_entry {
+	struct cache_entry * _Atomic next; ///< Next entry in the same bucket
+	unsigned int hash; ///< Hash of the name
+	time_t expire_time; ///< Expiration time
+	Rbtree_Value * value; ///< The answer, its first record carries the name
+	atomic_bool referenced; ///< Set by every hit, cleared by the clock hand, an entry not hit for a whole turn is evicted
+	unsigned int slot; ///< Position of the entry on the clock of its stripe
+	unsigned int bytes; ///< Memory allocated for the entry and its answer
+	uint64_t retired; ///< Epoch the entry was unlinked in
+	struct cache_entry * retire_next; ///< Next entry waiting to be freed
+} Cache_Entry;
+
+/// Independently locked part of the cache, the writers of one stripe take its lock, the readers never do
+typedef struct cache_stripe {
+	uv_mutex_t lock; ///< Serializes the writers of the stripe
+	Cache_Entry * _Atomic buckets[CACHE_STRIPE_SIZE]; ///< Chains of entries by hash
+	Cache_Entry * clock[CACHE_STRIPE_SIZE]; ///< Entries in the order the clock hand visits them
+	unsigned int size; ///< Number of entries
+	size_t bytes; ///< Memory allocated for the entries and their answers, those in limbo left out
+	unsigned int hand; ///< Next position of the clock hand
+	Cache_Entry * limbo; ///< Entries unlinked but maybe still read, newest first
+} Cache_Stripe;
+
+/// Epoch announcement of a thread reading the cache
+typedef struct cache_reader {
+	atomic_uint_fast64_t epoch; ///< Epoch the thread entered the cache in, 0 while the thread is outside
+	struct cache_reader * next; ///< Next registered reader
+} Cache_Reader;
+
+/// Hosts records replaced at run time, freed once no reader can see them
+typedef struct cache_retired {
+	void * ptr; ///< The records, a list node or its value
+	void (* release)(void * ptr); ///< Frees them
+	uint64_t retired; ///< Epoch they were unlinked in
+	struct cache_retired * next; ///< Next records waiting to be freed
+} Cache_Retired;
+
+/// Cache struct
 typedef struct cache_ {
-    Dns_RR_LinkList * head; ///< LRU header node
-    Dns_RR_LinkList * tail; ///< LRU tail node
-    int size; ///< LRU size
-    Rbtree * tree; ///< Red–black tree
+	Cache_Stripe * stripes; ///< Stripes of the hash table, picked by the low bits of the hash
+	Domain_Trie * hosts; ///< Entries of the hosts file, each name holds a linked list of its records, replaced as a whole on changes
+	uv_mutex_t hosts_lock; ///< Serializes the changes of the hosts entries
+	Cache_Retired * hosts_limbo; ///< Hosts records and trie arrays unlinked but maybe still read, newest first
+	atomic_uint_fast64_t epoch; ///< Global epoch, an entry retired in epoch e is freed once the epoch reaches e + 2
+	Cache_Reader * _Atomic readers; ///< Epoch announcements of every thread that read the cache
 
 	/**
  	* @brief Insert a DNS message into the cache.
@@ -22,12 +76,57 @@ typedef struct cache_ {
     void (* insert)(struct cache_ * cache, const Dns_Msg * msg);
 
 	/**
- 	* @brief Query the cache for a DNS question.
+ 	* @brief Query the cache for a DNS question, without taking any lock.
  	* @param cache The cache to query.
  	* @param que The DNS question.
-	* @return The value found in the cache or NULL if not found.
+ 	* @param source Set to where the answer was found.
+	* @return A copy of the value found in the cache or NULL if not found.
  	*/
-    Rbtree_Value * (* query)(struct cache_ * cache, const Dns_Que * que);
+    Rbtree_Value * (* query)(struct cache_ * cache, const Dns_Que * que, Cache_Source * source);
+
+	/**
+	 * @brief Measure the cache, locking one stripe at a time.
+	 * @param cache The cache.
+	 * @param entries Number of answers in the cache.
+	 * @param bytes Memory allocated for them.
+	 */
+	void (* usage)(struct cache_ * cache, size_t * entries, size_t * bytes);
+
+	/**
+	 * @brief Drop answers from the cache, locking one stripe at a time.
+	 * @param cache The cache.
+	 * @param name Name of the answers, with or without the trailing dot, NULL for every answer.
+	 * @param suffix Whether the answers of the subdomains of the name are dropped too.
+	 * @return Number of answers dropped.
+	 */
+	size_t (* flush)(struct cache_ * cache, const char * name, bool suffix);
+
+	/**
+	 * @brief Visit answers of the cache, with the lock of their stripe held.
+	 * @param cache The cache.
+	 * @param name Name of the answers, with or without the trailing dot, NULL for every answer.
+	 * @param visit Called with each answer, must not use the cache, returns false to stop the walk.
+	 * @param arg Passed on to visit.
+	 */
+	void (* walk)(struct cache_ * cache, const char * name, bool (* visit)(const Cache_Entry * entry, void * arg), void * arg);
+
+	/**
+	 * @brief Add a record to the hosts entries, seen by the next lookups of the name.
+	 * @param cache The cache.
+	 * @param name The domain name.
+	 * @param ip Its address, IPv4 or IPv6, 0.0.0.0 blocks the name.
+	 * @return 0 on success, UV_EINVAL if the name or the address is illegitimate, UV_EEXIST if the record is there already.
+	 */
+	int (* hosts_add)(struct cache_ * cache, const char * name, const char * ip);
+
+	/**
+	 * @brief Remove records from the hosts entries, seen by the next lookups of the name.
+	 * @param cache The cache.
+	 * @param name The domain name.
+	 * @param ip Address of the record to remove, NULL for every record of the name.
+	 * @return Number of records removed, UV_EINVAL if the address is illegitimate.
+	 */
+	int (* hosts_remove)(struct cache_ * cache, const char * name, const char * ip);
 } Cache;
 
 /**
@@ -37,4 +136,4 @@ typedef struct cache_ {
  */
 Cache * new_cache(FILE * hosts_file);
 
-#endif //DNSR_CACHE_H
\ No newline at end of file
+#endif //DNSR_CACHE_H
@@ -1,11 +1,50 @@
 #ifndef DNSR_CONFIG_H
 #define DNSR_CONFIG_H
 
-extern char * REMOTE_HOST; ///< Remote DNS server address
+#include <uv.h>
+
+#define LISTEN_MAX_ADDRESSES 8 ///< Most addresses listened on
+#define REMOTE_MAX_HOSTS 16 ///< Most remote DNS servers, those of forwarded zones included
+#define FORWARD_MAX_ZONES 32 ///< Most zones forwarded to their own remote servers
+#define RRL_MAX_EXEMPT 32 ///< Most client prefixes exempt from response rate limiting
+#define UPSTREAM_MAX_SOCKETS 64 ///< Most UDP sockets per address family for the remote DNS servers
+
+extern char * REMOTE_HOSTS[REMOTE_MAX_HOSTS]; ///< Remote DNS server addresses, IPv4 or IPv6
+extern int REMOTE_COUNT; ///< Number of addresses in REMOTE_HOSTS
+extern char * FORWARD_RULES[FORWARD_MAX_ZONES]; ///< Forwarded zones, each as zone=server[,server...]
+extern int FORWARD_COUNT; ///< Number of rules in FORWARD_RULES
 extern int LOG_MASK; ///< Log print level, a four-bit binary number where the lowest to highest bits represent FATAL, ERROR, INFO and DEBUG
 extern int CLIENT_PORT; ///< Local DNS client port
 extern char * HOSTS_PATH; ///< Hosts file path
 extern char * LOG_PATH; ///< Log file path
+extern int THREAD_COUNT; ///< Number of worker threads, each with its own event loop, sockets and query pool
+extern int PIPELINE_WORKERS; ///< Number of parse workers behind the sockets of each worker thread, 0 parses on the worker thread itself
+extern int UDP_PAYLOAD_SIZE; ///< Largest UDP payload received, sizes the receive buffers
+extern int TCP_IDLE_TIMEOUT; ///< Time in milliseconds after which an idle TCP connection of a client is closed
+extern int TCP_MAX_CONNECTIONS; ///< Most TCP connections of clients open at once in each worker, 0 disables TCP
+extern int UPSTREAM_TCP; ///< Whether every query is sent to the remote server over TCP instead of UDP
+extern int UPSTREAM_SOCKETS; ///< Number of UDP sockets on random ports per address family each worker sends queries from
+extern int UPSTREAM_TCP_CONNECTIONS; ///< Number of TCP connections to the remote server in each worker when UPSTREAM_TCP is set
+extern _Atomic int HEDGE_BUDGET; ///< Most hedged requests to a second remote server, in percent of the queries sent
+extern _Atomic int QUERY_TIMEOUT; ///< Time in milliseconds after which a query gets SERVFAIL if no remote server replied
+extern _Atomic int RETRIES; ///< Number of retransmissions of a query over UDP before QUERY_TIMEOUT
+extern _Atomic int SHED_TARGET; ///< Time in milliseconds queries may wait in a worker before they are sent on, beyond which the admission control sheds load, 0 disables it
+extern int SHED_RCODE; ///< Response code of the queries shed, DNS_RCODE_SERVFAIL or DNS_RCODE_REFUSED
+extern int RRL_RATE; ///< Responses per second allowed to each client prefix in each worker, 0 disables response rate limiting
+extern int RRL_SLIP; ///< Every RRL_SLIP-th query over the rate gets a truncated response instead of none, 0 drops them all
+extern char * RRL_EXEMPT[RRL_MAX_EXEMPT]; ///< Client prefixes never rate limited, each as address[/length]
+extern int RRL_EXEMPT_COUNT; ///< Number of prefixes in RRL_EXEMPT
+extern int MAX_QUERIES; ///< Most queries in flight at once in each worker
+extern char * LISTEN_ADDRESSES[LISTEN_MAX_ADDRESSES]; ///< Addresses the server listens on, IPv4 or IPv6
+extern int LISTEN_COUNT; ///< Number of addresses in LISTEN_ADDRESSES
+extern int PIN_THREADS; ///< Whether to pin each worker thread to its own CPU core
+extern int TRACE_STAGES; ///< Whether every query is timed stage by stage into the stage histograms
+extern int TRACE_SAMPLE; ///< One query in TRACE_SAMPLE has its stage times logged, 0 disables it
+extern char * METRICS_LISTEN; ///< Where the metrics are served over HTTP, address:port or the path of a Unix socket, NULL disables it
+extern char * QUERY_LOG; ///< Where every query and response is recorded, a file or unix: and the path of a collector socket, NULL disables it
+extern int QUERY_LOG_SIZE; ///< Megabytes after which the query log file is rotated, 0 never rotates it
+extern char * CONTROL_PATH; ///< Path of the Unix socket of the control commands, NULL disables it
+extern int HEAVY_HITTERS; ///< Counters of each summary of the most frequent names and clients, 0 disables the tracking
 
 /**
  * @brief Parse command line arguments
@@ -14,4 +53,21 @@ extern char * LOG_PATH; ///< Log file path
  */
 void init_config(int argc, char * const * argv);
 
+/**
+ * @brief Convert an IPv4 or IPv6 address string to a socket address
+ * @param host The address string
+ * @param port The port
+ * @param addr The socket address
+ * @return 0 on success, a libuv error code if the string is neither an IPv4 nor an IPv6 address
+ */
+int parse_address(const char * host, int port, struct sockaddr_storage * addr);
+
+/**
+ * @brief Convert an address:port string to a socket address, an IPv6 address in brackets as [address]:port
+ * @param str The string
+ * @param addr The socket address
+ * @return 0 on success, a libuv error code if the string is malformed
+ */
+int parse_endpoint(const char * str, struct sockaddr_storage * addr);
+
 #endif //DNSR_CONFIG_H
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef DNSR_CONTROL_H
+#define DNSR_CONTROL_H
+
+#include <uv.h>
+
+#include "cache.h"
+
+#define CONTROL_LINE_MAX 1024 ///< Longest command line, a longer one gets an error and the connection is closed
+#define CONTROL_ARGS_MAX 8 ///< Most words of a command line
+#define CONTROL_TEXT_INIT 4096 ///< Initial size of the buffer a reply is written into
+#define CONTROL_DUMP_MAX (1 << 20) ///< Longest reply of cache dump, the answers past it are left out
+
+/// Connection of an administrator, commands are read line by line and each one gets its reply
+typedef struct control_conn {
+	uv_pipe_t handle; ///< The connection
+	uv_shutdown_t shutdown; ///< Closes the connection once the replies are written, after a line too long
+	size_t len; ///< Length of the command line read so far
+	char line[CONTROL_LINE_MAX]; ///< The command line
+} Control_Conn;
+
+/// Reply to a command, freed once written
+typedef struct control_reply {
+	uv_write_t write; ///< Write request of the reply
+	char * data; ///< Lines of the reply, the last one OK or ERROR and the reason
+	size_t len; ///< Length of the reply
+	size_t cap; ///< Size of data
+} Control_Reply;
+
+/**
+ * @brief Take control commands on the Unix socket at CONTROL_PATH
+ * The commands flush or show the cache, change the hosts entries, the name servers and the timeouts,
+ * each change applies to the queries that follow without a restart, and list the busiest names and clients.
+ * @param loop The libuv event loop running the commands
+ * @param cache The cache
+ */
+void init_control(uv_loop_t * loop, Cache * cache);
+
+#endif //DNSR_CONTROL_H
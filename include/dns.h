@@ -5,6 +5,7 @@
 
 #define DNS_STRING_MAX_SIZE 8192
 #define DNS_RR_NAME_MAX_SIZE 512
+#define DNS_NAME_WIRE_MAX 255 ///< Longest name on the wire, the root label included (RFC 1035 2.3.4)
 
 #define DNS_QR_QUERY 0
 #define DNS_QR_ANSWER 1
@@ -23,12 +24,16 @@
 #define DNS_TYPE_MX 15
 #define DNS_TYPE_TXT 16
 #define DNS_TYPE_AAAA 28
+#define DNS_TYPE_OPT 41
+
+#define DNS_UDP_MIN_SIZE 512 ///< UDP payload size every client accepts (RFC 1035 4.2.1)
 
 #define DNS_CLASS_IN 1
 
 #define DNS_RCODE_OK 0
 #define DNS_RCODE_NXDOMAIN 3
 #define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_REFUSED 5
 
 /// Header Section structure of DNS message
 typedef struct dns_header {
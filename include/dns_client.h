@@ -4,17 +4,22 @@
 #include <uv.h>
 
 #include "dns.h"
+#include "upstream.h"
 
 /**
- * @brief Initialize the DNS client
+ * @brief Initialize the DNS client and the remote servers of the worker
  * @param loop The libuv event loop
+ * @param worker_id Index of the worker owning the client, a custom client port is offset by it
  */
-void init_client(uv_loop_t * loop);
+void init_client(uv_loop_t * loop, unsigned int worker_id);
 
 /**
- * @brief Send a DNS query message to the remote server
+ * @brief Send a DNS query message to a remote server
+ * @param up The remote server
+ * @param socket The upstream socket to send from, ignored with UPSTREAM_TCP set
  * @param msg The DNS message to be sent
+ * @return false if the query could not be sent or queued for sending
  */
-void send_to_remote(const Dns_Msg * msg);
+bool send_to_remote(Upstream * up, uint8_t socket, const Dns_Msg * msg);
 
 #endif //DNSR_DNS_CLIENT_H
\ No newline at end of file
@@ -1,24 +1,46 @@
 #ifndef DNSR_DNS_PARSE_H
 #define DNSR_DNS_PARSE_H
 
+#include <stdbool.h>
+
 #include "dns.h"
 
 /**
  * @brief Convert a byte stream to a DNS message structure
  * @param pmsg The DNS message structure to populate
+ * @param pstring The byte stream to read from, at least DNS_STRING_MAX_SIZE long
+ * @return false if the message is malformed, the structure is then only fit to be released
+ */
+bool string_to_dnsmsg(Dns_Msg * pmsg, const char * pstring);
+
+/**
+ * @brief Convert a byte stream of known length to a DNS message structure
+ * @param pmsg The DNS message structure to populate
  * @param pstring The byte stream to read from
+ * @param len The length of the byte stream, nothing after it is read
+ * @return false if the message is malformed, the structure is then only fit to be released
  */
-void string_to_dnsmsg(Dns_Msg * pmsg, const char * pstring);
+bool string_to_dnsmsg_limit(Dns_Msg * pmsg, const char * pstring, unsigned len);
 
 /**
- * @brief Write a NAME field to a byte stream
- * @param pname The NAME field
- * @param pstring The start of the byte stream
- * @param offset The offset in the byte stream
- * @note After writing, the offset increases to the position after the NAME field
+ * @brief Convert a DNS message structure to a byte stream
+ * @param pmsg The DNS message structure to convert
+ * @param pstring The byte stream to write to, at least DNS_STRING_MAX_SIZE long
+ * @return The total length of the byte stream
  */
 unsigned dnsmsg_to_string(const Dns_Msg * pmsg, char * pstring);
 
+/**
+ * @brief Convert a DNS message structure to a byte stream of limited length
+ * @param pmsg The DNS message structure to convert
+ * @param pstring The byte stream to write to
+ * @param limit The largest length of the byte stream
+ * @return The total length of the byte stream
+ * @note Resource Records that do not fit are left out, the TC bit is set and the counts are adjusted,
+ * the OPT pseudo-RR is always kept
+ */
+unsigned dnsmsg_to_string_limit(const Dns_Msg * pmsg, char * pstring, unsigned limit);
+
 /**
  * @brief Release memory allocated for a Resource Record
  * @param prr The Resource Record to release
@@ -5,17 +5,40 @@
 
 #include "dns.h"
 
+#define SERVER_BATCH_SIZE 20 ///< Datagrams received by one recvmmsg and sent by one sendmmsg at most
+#define UDP_DGRAM_MAX_SIZE 65536 ///< Size of the receive slot of one datagram, as expected by libuv
+
 /**
  * @brief Initialize the DNS server
+ * Binds one socket to each address in LISTEN_ADDRESSES, addresses that cannot be bound are skipped.
  * @param loop The libuv event loop
  */
 void init_server(uv_loop_t * loop);
 
+/**
+ * @brief Let every worker bind its own listening socket to the same port
+ * @param handle The socket, already initialized but not bound
+ */
+void set_reuseport(uv_handle_t * handle);
+
 /**
  * @brief Send a DNS response message to local clients
+ * @param socket The listening socket the query came in on
  * @param addr The address of the local client
  * @param msg The DNS message to be sent
+ * @param max_len The largest UDP payload the client accepts, the response is truncated to fit
+ * @note The response is sent together with the others produced in the same loop iteration
+ */
+void send_to_local(uv_udp_t * socket, const struct sockaddr * addr, const Dns_Msg * msg, unsigned int max_len);
+
+/**
+ * @brief Send a serialized DNS response message to local clients
+ * @param socket The listening socket the query came in on
+ * @param addr The address of the local client
+ * @param data The serialized message, at most DNS_STRING_MAX_SIZE bytes
+ * @param len Length of the message
+ * @note The response is sent together with the others produced in the same loop iteration
  */
-void send_to_local(const struct sockaddr * addr, const Dns_Msg * msg);
+void send_raw_to_local(uv_udp_t * socket, const struct sockaddr * addr, const char * data, unsigned int len);
 
 #endif //DNSR_DNS_SERVER_H
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef DNSR_DOMAIN_TRIE_H
+#define DNSR_DOMAIN_TRIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Child nodes of a node sorted by label, replaced as a whole by the inserts into a shared trie
+typedef struct domain_trie_children {
+	unsigned int count; ///< Number of child nodes
+	unsigned int capacity; ///< Allocated number of child nodes
+	struct domain_trie_children * retired_next; ///< Next array replaced while the trie was shared
+	struct domain_trie_node * nodes[]; ///< The child nodes
+} Domain_Trie_Children;
+
+/// Node of the domain trie, standing for one label below its parent
+typedef struct domain_trie_node {
+	uint8_t * label; ///< Label in lower case, not terminated
+	uint8_t len; ///< Length of the label
+	void * _Atomic value; ///< Value attached to the name ending at this node, NULL if there is none
+	Domain_Trie_Children * _Atomic children; ///< Child nodes, NULL if there are none
+} Domain_Trie_Node;
+
+/// Trie of domain names over their labels in reverse order, so that a name and all of its subdomains share a path
+typedef struct domain_trie {
+	Domain_Trie_Node root; ///< Node of the root domain
+	bool shared; ///< Whether other threads look names up while names are inserted, inserts then copy the arrays they change
+	Domain_Trie_Children * retired; ///< Arrays replaced while shared, for the owner to free once no reader can see them
+
+	/**
+	 * @brief Get the value slot of a domain name, creating the nodes on its path as needed
+	 * @param trie The domain trie
+	 * @param name The domain name, with or without the trailing dot
+	 * @return The value slot of the name, NULL if the name is invalid
+	 */
+	void * _Atomic * (* insert)(struct domain_trie * trie, const uint8_t * name);
+
+	/**
+	 * @brief Look up a domain name in a single pass over its labels from the right
+	 * @param trie The domain trie
+	 * @param name The domain name, with or without the trailing dot
+	 * @param exact Whether only the value of the name itself matches, rather than the value of its longest suffix
+	 * @return The value found, NULL if there is none
+	 */
+	void * (* lookup)(struct domain_trie * trie, const uint8_t * name, bool exact);
+} Domain_Trie;
+
+/**
+ * @brief Create a new domain trie
+ * @return The new domain trie
+ */
+Domain_Trie * new_domain_trie();
+
+#endif //DNSR_DOMAIN_TRIE_H
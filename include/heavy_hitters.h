@@ -0,0 +1,94 @@
+#ifndef DNSR_HEAVY_HITTERS_H
+#define DNSR_HEAVY_HITTERS_H
+
+#include <stdint.h>
+#include <uv.h>
+
+#include "config.h"
+#include "dns.h"
+
+#define HEAVY_HITTERS_MAX 1024 ///< Most counters of each summary
+#define HEAVY_HITTERS_WINDOW 60000 ///< Length of a window in milliseconds
+#define HEAVY_HITTERS_WINDOWS 5 ///< Windows kept, the current one included, so the counts cover the last four to five minutes
+#define HEAVY_HITTERS_KEY_MAX 255 ///< Longest key, a name as text or the bytes of an address
+#define HEAVY_HITTERS_METRICS 10 ///< Keys of each kind exposed as metrics
+
+/// What a summary counts
+typedef enum heavy_hitter_kind {
+	HEAVY_HITTERS_QNAME, ///< Names of the queries received, in lower case
+	HEAVY_HITTERS_CLIENT, ///< Addresses of the clients that sent the queries, the rate limited ones included
+	HEAVY_HITTERS_NXDOMAIN, ///< Names of the NXDOMAIN responses sent
+	HEAVY_HITTERS_KINDS ///< Number of kinds
+} Heavy_Hitter_Kind;
+
+/// Counter of a key
+typedef struct heavy_hitter {
+	uint64_t count; ///< Occurrences of the key, in one summary an overestimate by at most error, see heavy_hitters_top for a sum
+	uint64_t error; ///< Count of the key this counter was taken over from, 0 if the counter started with the key
+	uint32_t hash; ///< Hash of the key
+	unsigned int heap; ///< Position of the counter in the heap of its summary
+	unsigned int slot; ///< Position of the counter in the hash table of its summary
+	uint8_t len; ///< Length of the key
+	uint8_t key[HEAVY_HITTERS_KEY_MAX]; ///< The key
+} Heavy_Hitter;
+
+/**
+ * Space-Saving summary of one window: a key without a counter takes over the counter with the smallest count,
+ * so every key counted more often than the window size divided by HEAVY_HITTERS has a counter.
+ */
+typedef struct heavy_hitters_window {
+	uint64_t number; ///< Number of the window, the time in milliseconds divided by HEAVY_HITTERS_WINDOW
+	unsigned int size; ///< Counters in use
+	Heavy_Hitter * counters; ///< HEAVY_HITTERS counters
+	unsigned int * heap; ///< Positions of the counters in use, a min-heap by count
+	unsigned int * slots; ///< Hash table of the counters by key, each slot holds the position of a counter plus one, 0 if empty
+	unsigned int mask; ///< Slots in the hash table minus one, at least twice HEAVY_HITTERS
+} Heavy_Hitters_Window;
+
+/// Summaries of one thread, locked by the thread for each update and by the readers while they copy them
+typedef struct heavy_hitters {
+	uv_mutex_t lock; ///< Taken by the thread and the readers
+	Heavy_Hitters_Window windows[HEAVY_HITTERS_KINDS][HEAVY_HITTERS_WINDOWS]; ///< Summaries of each kind, picked by the window number
+	struct heavy_hitters * next; ///< Summaries of the next thread
+} Heavy_Hitters;
+
+struct sockaddr;
+
+/**
+ * @brief Count the client of a query received, before it is rate limited or parsed, if HEAVY_HITTERS is set
+ * @param addr The address of the client
+ */
+void heavy_hitters_client(const struct sockaddr * addr);
+
+/**
+ * @brief Count the name of a query parsed, if HEAVY_HITTERS is set
+ * @param msg The parsed query
+ */
+void heavy_hitters_query(const Dns_Msg * msg);
+
+/**
+ * @brief Count the name of a response sent if it is NXDOMAIN and HEAVY_HITTERS is set
+ * @param msg The response
+ */
+void heavy_hitters_response(const Dns_Msg * msg);
+
+/**
+ * @brief Get the keys of a kind counted most often over the windows kept, summed over the threads
+ * @param kind The kind
+ * @param top Storage for the counters, most frequent first
+ * @param n Most counters stored
+ * @return Number of counters stored
+ * @note A key that lost its counter in some summaries may be undercounted, the error only bounds the overestimate
+ */
+unsigned int heavy_hitters_top(Heavy_Hitter_Kind kind, Heavy_Hitter * top, unsigned int n);
+
+/**
+ * @brief Write the key of a counter as text, a name or an address
+ * @param kind The kind of the counter
+ * @param hitter The counter
+ * @param buf Storage for the text, HEAVY_HITTERS_KEY_MAX + 1 bytes
+ * @return buf
+ */
+char * heavy_hitter_key(Heavy_Hitter_Kind kind, const Heavy_Hitter * hitter, char * buf);
+
+#endif //DNSR_HEAVY_HITTERS_H
@@ -2,24 +2,33 @@
 #define DNSR_INDEX_POOL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "queue.h"
+#define INDEX_POOL_INIT_SIZE 1024 ///< Initial number of buckets of the index table, a power of two
+#define INDEX_POOL_MAX_SIZE (1 << 20) ///< Most indices in the pool
+#define INDEX_POOL_RANDOM_BATCH 128 ///< Random IDs fetched from the system at once
+#define INDEX_POOL_ID_TRIES 16 ///< Random IDs tried before an insertion gives up
+#define INDEX_SOCKET_TCP 255 ///< Socket of the indices of queries sent over TCP
 
-#define INDEX_POOL_MAX_SIZE 65535
-
-/// Index structure
+/// Index structure, keyed by the socket, the ID and the question hash
 typedef struct index_
 {
+	uint32_t qhash; ///< Hash of the question of the sent DNS query message
+	uint32_t prev_id; ///< The corresponding query ID
 	uint16_t id; ///< The ID of the sent DNS query message
-	uint16_t prev_id; ///< The corresponding query ID
+	uint8_t socket; ///< The upstream socket the message was sent on, INDEX_SOCKET_TCP over TCP
+	uint8_t used; ///< Whether the bucket holds an index
 } Index;
 
-/// Index pool
+/// Index pool, an open-addressing hash table of the queries sent to remote servers
 typedef struct index_pool
 {
-	Index * pool[INDEX_POOL_MAX_SIZE]; ///< Index pool
-	unsigned short count; ///< Number of indices in the pool
-	Queue * queue; ///< Queue of unallocated indices
+	Index * table; ///< Buckets with linear probing
+	unsigned int capacity; ///< Number of buckets, a power of two
+	unsigned int count; ///< Number of indices in the pool
+	uint32_t seed; ///< Random seed of the bucket hash
+	uint16_t random[INDEX_POOL_RANDOM_BATCH]; ///< Random numbers not used yet
+	unsigned int random_left; ///< Number of random numbers left
 
 	/**
 	 * @brief Check if the index pool is full
@@ -29,28 +38,38 @@ typedef struct index_pool
 	bool (* full)(struct index_pool * ipool);
 
 	/**
-	 * @brief Insert an index into the pool
+	 * @brief Draw a random number from the system random source
+	 * @param ipool The index pool
+	 * @return The random number
+	 */
+	uint16_t (* random_id)(struct index_pool * ipool);
+
+	/**
+	 * @brief Insert an index into the pool under a random ID
 	 * @param ipool The index pool
-	 * @param req The index to insert
-	 * @return The ID of the inserted index
+	 * @param req The index to insert, with its socket, question hash and query ID set, its ID is filled in
+	 * @return True if the index was inserted, false if no free ID was found
 	 */
-	uint16_t (* insert)(struct index_pool * ipool, Index * req);
+	bool (* insert)(struct index_pool * ipool, Index * req);
 
 	/**
-	 * @brief Query if an index exists in the pool
+	 * @brief Query an index in the pool
 	 * @param ipool The index pool
-	 * @param index The index to query
-	 * @return True if the index exists, false otherwise
+	 * @param socket The socket the reply came in on
+	 * @param id The ID of the reply
+	 * @param qhash Hash of the question of the reply
+	 * @return The index, NULL if it does not exist, valid until the next insertion or deletion
 	 */
-	bool (* query)(struct index_pool * ipool, uint16_t index);
+	Index * (* query)(struct index_pool * ipool, uint8_t socket, uint16_t id, uint32_t qhash);
 
 	/**
 	* @brief Delete an index from the pool
 	* @param ipool The index pool
-	* @param index The index to delete
-	* @return The deleted index
+	* @param socket The socket of the index
+	* @param id The ID of the index
+	* @param qhash The question hash of the index
 	*/
-	Index * (* delete)(struct index_pool * ipool, uint16_t index);
+	void (* delete)(struct index_pool * ipool, uint8_t socket, uint16_t id, uint32_t qhash);
 
 	/**
 	 * @brief Destroy the index pool
@@ -65,4 +84,4 @@ typedef struct index_pool
  */
 Index_Pool * new_ipool();
 
-#endif //DNSR_INDEX_POOL_H
\ No newline at end of file
+#endif //DNSR_INDEX_POOL_H
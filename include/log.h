@@ -1,55 +1,109 @@
 #ifndef DNSR_LOG_H
 #define DNSR_LOG_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "config.h"
 
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_FATAL 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO ///< Least level compiled in, the calls below it compile to nothing
+#endif
+
+#define LOG_RING_SIZE (1 << 18) ///< Bytes of formatted messages each thread may have waiting for the writer, a power of two
+#define LOG_LINE_MAX 1024 ///< Longest formatted message, longer ones are cut
+#define LOG_FLUSH_INTERVAL 10 ///< Time in milliseconds the writer sleeps when there is nothing to write
+#define LOG_ERROR_BURST 10 ///< Messages of one error call site per thread and second, the rest are counted and suppressed
+
 extern FILE * log_file;
 
+/// Messages formatted by one thread, waiting for the writer
+typedef struct log_ring {
+	char data[LOG_RING_SIZE]; ///< Formatted messages, one after the other
+	atomic_size_t head; ///< Position the writer reads from
+	atomic_size_t tail; ///< Position the thread writes to
+	atomic_size_t dropped; ///< Messages dropped because the ring was full
+	size_t dropped_reported; ///< Dropped messages already reported by the writer
+	struct log_ring * next; ///< Ring of the next thread
+} Log_Ring;
+
+/// Rate limit of the errors of one call site in one thread
+typedef struct log_limit {
+	uint64_t second; ///< Second the count started in
+	unsigned int count; ///< Messages in that second
+	unsigned int suppressed; ///< Messages suppressed since the last one written
+} Log_Limit;
+
+/**
+ * @brief Format a message into the log ring of the calling thread, written out by the writer thread
+ * @param level Level of the message
+ * @param file Source file of the call
+ * @param line Source line of the call
+ * @param format Format of the message, as printf
+ * @note Before init_log the message is written right away
+ */
+void log_write(int level, const char * file, int line, const char * format, ...) __attribute__((format(printf, 4, 5)));
+
+/**
+ * @brief Put preformatted text into the log ring of the calling thread as it is
+ * @param text The text, lines ended with a newline
+ * @param len Length of the text
+ */
+void log_raw(const char * text, size_t len);
+
+/**
+ * @brief Check if an error call site may log again, noting the messages it suppressed before
+ * @param limit The rate limit of the call site
+ * @param file Source file of the call
+ * @param line Source line of the call
+ * @return True if the message is written, false if it is suppressed
+ */
+bool log_allow(Log_Limit * limit, const char * file, int line);
+
+/**
+ * @brief Write every waiting message to the log file right away
+ */
+void log_flush();
+
+/**
+ * @brief Start the writer thread, from then on the calls only format into their ring
+ */
+void init_log();
+
 #define log_debug(args...) \
-    if (LOG_MASK & 1) \
+    if (LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG && (LOG_MASK & 1)) \
     { \
-        if (log_file != stderr) \
-            fprintf(log_file, "[DEBUG] %s:%d ", __FILE__, __LINE__); \
-        else \
-            fprintf(log_file, "\x1b[37m[DEBUG]\x1b[36m %s:%d \x1b[0m", __FILE__, __LINE__); \
-        fprintf(log_file, args); \
-        fprintf(log_file, "\n"); \
+        log_write(LOG_LEVEL_DEBUG, __FILE__, __LINE__, args); \
     }
 
 #define log_info(args...) \
-    if (LOG_MASK & 2) \
+    if (LOG_MIN_LEVEL <= LOG_LEVEL_INFO && (LOG_MASK & 2)) \
     { \
-        if (log_file != stderr) \
-            fprintf(log_file, "[INFO ] %s:%d ", __FILE__, __LINE__); \
-        else \
-            fprintf(log_file, "\x1b[34m[INFO ]\x1b[36m %s:%d \x1b[0m", __FILE__, __LINE__); \
-        fprintf(log_file, args); \
-        fprintf(log_file, "\n"); \
+        log_write(LOG_LEVEL_INFO, __FILE__, __LINE__, args); \
     }
 
 #define log_error(args...) \
-    if (LOG_MASK & 4) \
+    if (LOG_MIN_LEVEL <= LOG_LEVEL_ERROR && (LOG_MASK & 4)) \
     { \
-        if (log_file != stderr) \
-            fprintf(log_file, "[ERROR] %s:%d ", __FILE__, __LINE__); \
-        else \
-            fprintf(log_file, "\x1b[33m[ERROR]\x1b[36m %s:%d \x1b[0m", __FILE__, __LINE__); \
-        fprintf(log_file, args); \
-        fprintf(log_file, "\n"); \
+        static _Thread_local Log_Limit log_limit; \
+        if (log_allow(&log_limit, __FILE__, __LINE__)) \
+            log_write(LOG_LEVEL_ERROR, __FILE__, __LINE__, args); \
     }
 
 #define log_fatal(args...) \
     if (LOG_MASK & 8) \
     { \
-        if (log_file != stderr) \
-            fprintf(log_file, "[FATAL] %s:%d ", __FILE__, __LINE__); \
-        else \
-            fprintf(log_file, "\x1b[31m[FATAL]\x1b[36m %s:%d \x1b[0m", __FILE__, __LINE__); \
-        fprintf(log_file, args); \
-        fprintf(log_file, "\n"); \
+        log_write(LOG_LEVEL_FATAL, __FILE__, __LINE__, args); \
+        log_flush(); \
         exit(EXIT_FAILURE); \
     }
 
-#endif //DNSR_LOG_H
\ No newline at end of file
+#endif //DNSR_LOG_H
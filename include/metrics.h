@@ -0,0 +1,109 @@
+#ifndef DNSR_METRICS_H
+#define DNSR_METRICS_H
+
+#include <stdint.h>
+#include <uv.h>
+
+#include "config.h"
+
+#define METRICS_BATCH_BUCKETS 6 ///< Buckets of the batch size histograms: 1, 2-3, 4-7, 8-15, 16-31, 32+
+#define METRICS_LATENCY_BUCKETS 16 ///< Buckets of the latency histograms, the last one without an upper bound
+#define METRICS_REPORT_INTERVAL 60000 ///< Interval of the periodic metrics report in milliseconds
+
+/// Latency histogram, each bucket counts the samples up to its bound in metrics_latency_bounds and above the previous one
+typedef struct metrics_histogram {
+	uint64_t buckets[METRICS_LATENCY_BUCKETS]; ///< Samples per bucket
+	uint64_t sum; ///< Sum of the samples in nanoseconds
+} Metrics_Histogram;
+
+/// Counters of the relay
+typedef struct metrics {
+	uint64_t rx_packets; ///< Datagrams received from local clients
+	uint64_t rx_syscalls; ///< Receive system calls that returned at least one datagram
+	uint64_t rx_batches[METRICS_BATCH_BUCKETS]; ///< Histogram of datagrams per receive system call
+	uint64_t tx_packets; ///< Datagrams sent to local clients
+	uint64_t tx_syscalls; ///< Send system calls issued for local clients
+	uint64_t tx_batches[METRICS_BATCH_BUCKETS]; ///< Histogram of datagrams per send system call
+	uint64_t tx_queued; ///< Datagrams handed to the libuv send queue because the socket would block
+	uint64_t buffer_high_water; ///< Most receive buffers in use at once, the highest of the workers once aggregated
+	uint64_t buffer_fallbacks; ///< Receive buffers allocated with malloc because the buffer pool was empty
+	uint64_t send_slot_high_water; ///< Most send slots in use at once, the highest of the workers once aggregated
+	uint64_t send_slot_fallbacks; ///< Send slots allocated with malloc because the send pool was empty
+	uint64_t tcp_accepted; ///< TCP connections accepted
+	uint64_t tcp_rejected; ///< TCP connections closed right away because of the connection cap
+	uint64_t tcp_idle_closed; ///< TCP connections closed after staying idle
+	uint64_t tcp_queries; ///< Queries received over TCP
+	uint64_t upstream_tcp_connects; ///< TCP connections to the remote server established
+	uint64_t upstream_tcp_failures; ///< TCP connections to the remote server that failed or broke
+	uint64_t upstream_hedges; ///< Hedged requests sent to a second remote server
+	uint64_t upstream_hedge_wins; ///< Hedged requests answered before the first request
+	uint64_t upstream_retransmits; ///< Queries sent again after their retransmission timeout expired
+	uint64_t upstream_servfails; ///< Queries answered with SERVFAIL because no server replied in time
+	uint64_t queries_coalesced; ///< Queries that waited for the answer to the same question already in flight
+	uint64_t queries_shed_full; ///< Queries answered right away with SHED_RCODE because the query pool was full
+	uint64_t queries_shed_codel; ///< Queries answered right away with SHED_RCODE by the admission control
+	uint64_t rrl_dropped; ///< Queries over the rate limit of their client prefix dropped without a response
+	uint64_t rrl_truncated; ///< Queries over the rate limit of their client prefix answered with a truncated response
+	uint64_t pipeline_jobs; ///< Queries handed to the parse workers
+	uint64_t pipeline_answered; ///< Queries the parse workers answered from the cache
+	uint64_t pipeline_dropped; ///< Queries dropped because every parse worker was backlogged
+	uint64_t query_high_water; ///< Most queries in flight at once, the highest of the workers once aggregated
+	uint64_t cache_hits; ///< Questions answered from the cache
+	uint64_t hosts_hits; ///< Questions answered from the hosts file
+	uint64_t blocked_hits; ///< Questions answered with NXDOMAIN because the hosts file blocks the name
+	uint64_t cache_misses; ///< Questions neither the cache nor the hosts file had an answer for
+	uint64_t replies_unmatched; ///< Replies of remote servers dropped because no query in flight matched them
+	uint64_t queries_in_flight; ///< Queries in the query pool right now
+	uint64_t indices_in_flight; ///< Indices in the index pool right now
+	Metrics_Histogram local_latency; ///< Time from a query to its answer from the cache or the hosts file
+	Metrics_Histogram remote_latency; ///< Time from a query to the answer of a remote server or SERVFAIL
+	Metrics_Histogram upstream_rtt[REMOTE_MAX_HOSTS]; ///< RTT of each remote server in REMOTE_HOSTS, retransmissions left out
+} Metrics;
+
+extern _Thread_local Metrics metrics; ///< Counters of the current thread, written through metrics_add and metrics_set
+
+/**
+ * Add to a counter of the current thread. Only the thread writes its counters, so a relaxed atomic store
+ * of the new value suffices: it costs a plain store and lets metrics_aggregate read the counter from another thread.
+ */
+#define metrics_add(field, n) __atomic_store_n(&metrics.field, metrics.field + (n), __ATOMIC_RELAXED)
+
+/// Set a gauge of the current thread, stored atomically as in metrics_add
+#define metrics_set(field, value) __atomic_store_n(&metrics.field, (value), __ATOMIC_RELAXED)
+extern const uint64_t metrics_latency_bounds[METRICS_LATENCY_BUCKETS - 1]; ///< Upper bounds of the latency buckets in microseconds
+
+/**
+ * @brief Record the size of a batch in a batch size histogram
+ * @param hist The histogram with METRICS_BATCH_BUCKETS buckets
+ * @param size The number of datagrams in the batch
+ */
+void metrics_record_batch(uint64_t * hist, unsigned size);
+
+/**
+ * @brief Record a latency in a latency histogram
+ * @param hist The histogram
+ * @param ns The latency in nanoseconds
+ */
+void metrics_record_latency(Metrics_Histogram * hist, uint64_t ns);
+
+/**
+ * @brief Register the counters of the current thread, so that they are summed up with the others
+ * @note Once per thread, init_metrics does it for the workers
+ */
+void metrics_register(void);
+
+/**
+ * @brief Sum up the counters of every registered thread, the high-water marks are the highest of the threads
+ * @param total The sum
+ * @note The counters are read while the threads update them, so the sum is a close snapshot rather than an exact one
+ */
+void metrics_aggregate(Metrics * total);
+
+/**
+ * @brief Register the counters of the current worker, the first worker also reports the metrics periodically in the log
+ * @param loop The libuv event loop of the worker
+ * @param worker_id Index of the worker
+ */
+void init_metrics(uv_loop_t * loop, unsigned int worker_id);
+
+#endif //DNSR_METRICS_H
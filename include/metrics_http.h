@@ -0,0 +1,31 @@
+#ifndef DNSR_METRICS_HTTP_H
+#define DNSR_METRICS_HTTP_H
+
+#include <uv.h>
+
+#include "cache.h"
+
+#define METRICS_HTTP_REQUEST_MAX 4096 ///< Longest request head read from a scraper, a longer one gets 431
+#define METRICS_HTTP_TEXT_INIT 16384 ///< Initial size of the buffer the exposition is written into
+
+/// Connection of a scraper, closed once the response is written
+typedef struct metrics_conn {
+	union {
+		uv_tcp_t tcp;
+		uv_pipe_t pipe;
+	} handle; ///< The connection, over TCP or a Unix socket like the listener
+	uv_write_t write; ///< Write request of the response
+	char * response; ///< The response, head and body
+	size_t len; ///< Length of the request head read so far
+	char request[METRICS_HTTP_REQUEST_MAX]; ///< The request head
+} Metrics_Conn;
+
+/**
+ * @brief Serve the metrics of every thread in the Prometheus text format on METRICS_LISTEN
+ * Each scrape sums up the thread-local counters, the threads themselves never synchronize for it.
+ * @param loop The libuv event loop serving the scrapers
+ * @param cache The cache, measured on each scrape
+ */
+void init_metrics_http(uv_loop_t * loop, Cache * cache);
+
+#endif //DNSR_METRICS_HTTP_H
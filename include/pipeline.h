@@ -0,0 +1,72 @@
+#ifndef DNSR_PIPELINE_H
+#define DNSR_PIPELINE_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+#include "cache.h"
+#include "dns.h"
+#include "ring.h"
+#include "trace.h"
+
+#define PIPELINE_RING_SIZE 1024 ///< Queries queued for each parse worker, a power of two
+
+/// Query handed from the I/O thread to a parse worker, and its outcome handed back
+typedef struct pipeline_job {
+	uv_udp_t * socket; ///< Listening socket the query came in on
+	struct sockaddr_storage addr; ///< Address of the client
+	Dns_Msg * msg; ///< The parsed query when the cache has no answer for it, NULL when data holds the response
+	uint64_t received_at; ///< High-resolution time the query was received in nanoseconds, for the latency histogram
+	Trace trace; ///< Trace of the query, carried between the threads with the job
+	unsigned int len; ///< Length of data, 0 once a malformed query is dropped
+	unsigned int capacity; ///< Size of data
+	char data[]; ///< The query as received, replaced by the serialized response when the cache answers it
+} Pipeline_Job;
+
+/// Parse worker thread with its own event loop
+typedef struct parse_worker {
+	uv_thread_t thread; ///< The thread
+	uv_loop_t loop; ///< Event loop of the thread, only woken by wakeup
+	uv_async_t wakeup; ///< Signalled by the I/O thread when jobs are queued
+	Spsc_Ring * jobs; ///< Jobs from the I/O thread
+	bool signal; ///< Whether jobs were queued since the I/O thread last signalled wakeup, owned by the I/O thread
+	struct pipeline * pipeline; ///< The pipeline
+} Parse_Worker;
+
+/// Pool of parse workers behind the sockets of one I/O thread
+typedef struct pipeline {
+	Parse_Worker * workers; ///< The parse workers
+	unsigned int count; ///< Number of parse workers
+	unsigned int next; ///< Parse worker the next job goes to
+	Mpsc_Ring * done; ///< Jobs handed back to the I/O thread
+	uv_async_t done_async; ///< Signalled by the parse workers when jobs are handed back
+	Cache * cache; ///< Cache looked up by the parse workers
+
+	/**
+	 * @brief Hand a query received by the I/O thread to a parse worker
+	 * @param pipeline The pipeline
+	 * @param socket The listening socket the query came in on
+	 * @param addr The address of the client
+	 * @param data The query message
+	 * @param len Length of the query message
+	 * @return True if the query was queued, false if every parse worker is backlogged
+	 */
+	bool (* submit)(struct pipeline * pipeline, uv_udp_t * socket, const struct sockaddr * addr, const char * data,
+	                size_t len);
+
+	/**
+	 * @brief Wake the parse workers that got jobs since the last flush, once per loop iteration of the I/O thread
+	 * @param pipeline The pipeline
+	 */
+	void (* flush)(struct pipeline * pipeline);
+} Pipeline;
+
+/**
+ * @brief Create a new pipeline and start PIPELINE_WORKERS parse workers
+ * @param loop The event loop of the I/O thread
+ * @param cache The cache
+ * @return The new pipeline
+ */
+Pipeline * new_pipeline(uv_loop_t * loop, Cache * cache);
+
+#endif //DNSR_PIPELINE_H
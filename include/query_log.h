@@ -0,0 +1,108 @@
+#ifndef DNSR_QUERY_LOG_H
+#define DNSR_QUERY_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dns.h"
+
+#define QUERY_LOG_MAGIC "DNSRQL" ///< Start of each log file and of each connection to a collector
+#define QUERY_LOG_VERSION 2 ///< Version of the format, big-endian after the magic
+#define QUERY_LOG_HEAD_SIZE 8 ///< Bytes of the magic and the version
+#define QUERY_LOG_RECORD_FIXED 22 ///< Bytes of a record before the client address
+#define QUERY_LOG_RECORD_MAX (QUERY_LOG_RECORD_FIXED + 16 + 1 + 255) ///< Longest record, an IPv6 client and a full name
+#define QUERY_LOG_RING_SIZE (1 << 20) ///< Bytes of records each thread may have waiting for the writer, a power of two
+#define QUERY_LOG_FLUSH_INTERVAL 10 ///< Time in milliseconds the writer sleeps when there is nothing to write
+#define QUERY_LOG_RETRY_INTERVAL 1000 ///< Time in milliseconds between attempts to reach a collector that is down
+#define QUERY_LOG_ROTATIONS 9 ///< Rotated files kept, as path.1 (newest) to path.9
+
+#define QUERY_LOG_FLAG_TCP 1 ///< The client came over TCP
+#define QUERY_LOG_FLAG_IPV6 2 ///< The client address is IPv6, 16 bytes instead of 4
+
+/*
+ * Each record is framed by its length as a big-endian 16-bit number, all of its numbers are big-endian too:
+ *   0  type        1 byte, Query_Log_Type
+ *   1  flags       1 byte, QUERY_LOG_FLAG_*
+ *   2  time        8 bytes, microseconds since the Unix epoch
+ *  10  id          2 bytes, message ID of the client
+ *  12  qtype       2 bytes
+ *  14  rcode       1 byte, 0 in a query or a drop
+ *  15  outcome     1 byte, Query_Log_Outcome, 0 in a query
+ *  16  latency     4 bytes, microseconds from receiving the query to sending the response, 0 in a query or a drop
+ *  20  port        2 bytes, port of the client
+ *  22  address     4 or 16 bytes, address of the client
+ *      qname       1 byte of length, then the name as text
+ */
+
+/// Kind of a record
+typedef enum query_log_type {
+	QUERY_LOG_QUERY = 1, ///< A query was received and parsed
+	QUERY_LOG_RESPONSE, ///< A response was sent
+	QUERY_LOG_DROP ///< A query was dropped without a response, the outcome says why
+} Query_Log_Type;
+
+/// Where the answer of a response came from or why a query was dropped, the local answers numbered like Cache_Source
+typedef enum query_log_outcome {
+	QUERY_LOG_CACHE = 1, ///< The cache
+	QUERY_LOG_HOSTS, ///< The hosts file
+	QUERY_LOG_BLOCKED, ///< A name blocked by the hosts file, answered NXDOMAIN
+	QUERY_LOG_UPSTREAM, ///< A remote server
+	QUERY_LOG_TIMEOUT, ///< No remote server answered in time, answered SERVFAIL
+	QUERY_LOG_SHED, ///< Shed by the admission control, answered SHED_RCODE
+	QUERY_LOG_RRL_SLIP, ///< Over the rate limit, answered truncated so that a real client retries over TCP
+	QUERY_LOG_RRL_DROP, ///< Over the rate limit, dropped
+	QUERY_LOG_BACKLOG, ///< Every parse worker was backlogged, dropped
+	QUERY_LOG_UNSENT, ///< The query could not be sent to a remote server, answered SERVFAIL
+	QUERY_LOG_OUTCOMES ///< Number of outcomes, plus one
+} Query_Log_Outcome;
+
+/// Records of one thread, waiting for the writer
+typedef struct query_log_ring {
+	uint8_t data[QUERY_LOG_RING_SIZE]; ///< Framed records, one after the other
+	atomic_size_t head; ///< Position the writer reads from
+	atomic_size_t tail; ///< Position the thread writes to
+	atomic_size_t dropped; ///< Records dropped because the ring was full
+	size_t dropped_reported; ///< Dropped records already reported by the writer
+	struct query_log_ring * next; ///< Ring of the next thread
+} Query_Log_Ring;
+
+struct sockaddr;
+
+/**
+ * @brief Record a query received from a client, if QUERY_LOG is set
+ * @param addr The address of the client
+ * @param tcp Whether the query came over TCP
+ * @param msg The parsed query
+ */
+void query_log_query(const struct sockaddr * addr, bool tcp, const Dns_Msg * msg);
+
+/**
+ * @brief Record a response sent to a client, if QUERY_LOG is set
+ * @param addr The address of the client
+ * @param tcp Whether the response goes over TCP
+ * @param msg The response
+ * @param outcome Where the answer came from
+ * @param latency Time from receiving the query to sending the response in nanoseconds
+ */
+void query_log_response(const struct sockaddr * addr, bool tcp, const Dns_Msg * msg, Query_Log_Outcome outcome,
+                        uint64_t latency);
+
+/**
+ * @brief Record a query that is not parsed, with the fields read from the wire, if QUERY_LOG is set
+ * @param type QUERY_LOG_RESPONSE for a truncated response sent, QUERY_LOG_DROP for a query dropped
+ * @param addr The address of the client
+ * @param data The query message
+ * @param len Length of the query message
+ * @param outcome Why the query was not parsed
+ */
+void query_log_unparsed(Query_Log_Type type, const struct sockaddr * addr, const uint8_t * data, size_t len,
+                        Query_Log_Outcome outcome);
+
+/**
+ * @brief Open QUERY_LOG and start the writer thread, from then on records are only copied into the ring of their thread
+ */
+void init_query_log(void);
+
+#endif //DNSR_QUERY_LOG_H
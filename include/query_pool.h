@@ -6,27 +6,107 @@
 
 #include "dns.h"
 #include "index_pool.h"
+#include "queue.h"
 #include "cache.h"
+#include "tcp_server.h"
+#include "trace.h"
+#include "upstream.h"
 
-#define QUERY_POOL_MAX_SIZE 256
+#define QUERY_POOL_INIT_SIZE 256 ///< Initial number of slots of the query pool, doubled as needed up to MAX_QUERIES
+#define QUERY_CHUNK_SIZE 64 ///< Queries allocated together in one slab chunk
+#define QUERY_MAX_ATTEMPTS 2 ///< Most transmissions of a query to remote servers, the first one and a hedged one
+#define QUERY_HEDGE_BURST 10.0 ///< Most hedged requests the budget saves up
+#define QUERY_PENDING_BUCKETS 256 ///< Buckets of the table of questions in flight
+#define QUERY_MAX_WAITERS 64 ///< Most clients waiting on one query in flight, the next one sends its own query
+#define QUERY_SHED_INTERVAL 100 ///< Time in milliseconds queries must wait longer than SHED_TARGET before shedding starts
+
+/// Client waiting for the answer to an identical question already in flight
+typedef struct query_waiter {
+	uint16_t prev_id; ///< Original DNS query message ID of the client
+	struct sockaddr_storage addr; ///< Address of the client
+	uv_udp_t * socket; ///< Listening socket the query came in on, NULL if the query came over TCP
+	Tcp_Conn * conn; ///< TCP connection of the client, NULL if the query came over UDP
+	uint16_t udp_size; ///< Largest UDP payload the client accepts
+	uint64_t started_at; ///< High-resolution time the query came in in nanoseconds, for the query log
+	struct query_waiter * next; ///< Next waiter of the same query
+} Query_Waiter;
+
+/// One transmission of a query to a remote server
+typedef struct query_attempt {
+	uint16_t id; ///< ID of the query message sent, key of its index in the index pool with socket and the question hash
+	uint8_t socket; ///< Upstream socket the query message was sent on, INDEX_SOCKET_TCP over TCP
+	Upstream * upstream; ///< Remote server the query was sent to
+	uint64_t sent_at; ///< High-resolution time the query was sent in nanoseconds
+	unsigned int retransmits; ///< Number of times the query was sent again, a reply is then no RTT sample (Karn)
+} Query_Attempt;
 
 /// DNS query structure
 typedef struct dns_query {
-	uint16_t id; ///< Query ID
+	uint32_t id; ///< Query ID, the slot in the low 16 bits and the generation of the slot above them
 	uint16_t prev_id; ///< Original DNS query message ID
-	struct sockaddr addr; ///< Address of the requester
+	struct sockaddr_storage addr; ///< Address of the requester
+	uv_udp_t * socket; ///< Listening socket the query came in on, NULL if the query came over TCP
+	Tcp_Conn * conn; ///< TCP connection of the requester, NULL if the query came over UDP
+	uint16_t udp_size; ///< Largest UDP payload the requester accepts
+	uint64_t started_at; ///< High-resolution time the query came in in nanoseconds, for the latency histogram
+	Trace trace; ///< Trace of the query, finished by the send slot of the response
+	bool tcp_retry; ///< Whether the query was resent over TCP after a truncated reply
+	Query_Attempt attempts[QUERY_MAX_ATTEMPTS]; ///< Transmissions to remote servers still waiting for a reply
+	unsigned int attempt_count; ///< Number of transmissions in attempts, 0 if answered locally
 	Dns_Msg * msg; ///< DNS query message
-	uv_timer_t timer; ///< Timer
+	Query_Waiter * waiters; ///< Other clients that asked the same question while it was in flight
+	unsigned int waiter_count; ///< Number of waiters, at most QUERY_MAX_WAITERS
+	uint16_t flags; ///< RD, CD, DO and the EDNS version of the query, only queries with the same flags wait on it
+	unsigned int group; ///< Bit mask over REMOTE_HOSTS of the servers the query may go to
+	unsigned int hash; ///< Hash of the question, keys the table of questions in flight and the indices of the query
+	struct dns_query * pending_next; ///< Next query in the same bucket of the table of questions in flight
+	bool pending; ///< Whether the query is in the table of questions in flight
+	struct query_pool * qpool; ///< Query pool holding the query
+	uv_timer_t timer; ///< Gives up the query once QUERY_TIMEOUT has passed
+	uv_timer_t hedge_timer; ///< Sends a hedged request to another server when the first one is slow
+	uv_timer_t retransmit_timer; ///< Sends the first request again when its retransmission timeout expires
+	unsigned int handles; ///< Number of timers not yet closed, the query is freed once they are
+	struct query_chunk * chunk; ///< Slab chunk the query was allocated from
+	struct dns_query * free_next; ///< Next free query of the chunk
 } Dns_Query;
 
+/// Slab chunk of queries, released once none of its queries is in use
+typedef struct query_chunk {
+	struct query_chunk * prev; ///< Previous chunk with free queries
+	struct query_chunk * next; ///< Next chunk with free queries
+	Dns_Query * free; ///< Free queries of the chunk
+	unsigned int used; ///< Number of queries of the chunk in use
+	Dns_Query queries[QUERY_CHUNK_SIZE]; ///< Queries of the chunk
+} Query_Chunk;
+
+/// Slot of the query pool
+typedef struct query_slot {
+	Dns_Query * query; ///< Query in the slot, NULL if the slot is free
+	uint16_t generation; ///< Bumped each time the slot is freed, so that the IDs of old queries never match
+} Query_Slot;
+
+/// CoDel state of the admission control, driven by how long queries wait in the worker before they are sent on (RFC 8289)
+typedef struct query_codel {
+	uint64_t first_above; ///< Loop time at which queries will have waited too long for an interval, 0 if not
+	uint64_t shed_next; ///< Loop time from which the next query is shed
+	unsigned int count; ///< Queries shed in the current shedding period
+	bool shedding; ///< Whether the pool is in a shedding period
+} Query_Codel;
+
 /// DNS query pool
 typedef struct query_pool {
-	Dns_Query * pool[QUERY_POOL_MAX_SIZE]; ///< Query pool
-	unsigned short count; ///< Number of queries in the pool
-	Queue * queue; ///< Queue of unassigned query IDs
+	Query_Slot * slots; ///< Map from the slot of a query ID to the query
+	unsigned int capacity; ///< Number of slots
+	unsigned int count; ///< Number of queries in the pool
+	Queue * queue; ///< Queue of free slots
+	Query_Chunk * partial; ///< Slab chunks with free queries
+	unsigned int empty_chunks; ///< Number of chunks with no query in use, one is kept to avoid churn
 	Index_Pool * ipool; ///< Index pool
 	uv_loop_t * loop; ///< Event loop
 	Cache * cache; ///< Cache
+	double hedge_tokens; ///< Hedged requests that may still be sent, refilled by HEDGE_BUDGET percent of each query
+	Dns_Query * pending[QUERY_PENDING_BUCKETS]; ///< Queries sent to remote servers by question, for coalescing
+	Query_Codel codel; ///< Admission control of the queries that need a remote server
 
 	/**
  	* @brief Check if the query pool is full
@@ -40,20 +120,45 @@ typedef struct query_pool {
  	* This function creates a new query and inserts it into the query pool.
  	* If the query is found in the cache, it is immediately processed and sent to the local client.
  	* Otherwise, it is sent to the remote DNS server and a timeout timer is started.
+ 	* The query is retransmitted with exponential backoff from the RTO of the server, up to RETRIES times,
+ 	* and answered with SERVFAIL once QUERY_TIMEOUT has passed.
+ 	* If the same question is already in flight, the client waits for its answer instead.
+ 	* Cache hits are always answered. A query that needs a remote server is answered right away with SHED_RCODE
+ 	* when the pool is full or the admission control sheds it.
  	* @param qpool The query pool
  	* @param addr The address of the client
+ 	* @param socket The listening socket the query came in on, NULL if the query came over TCP
+ 	* @param conn The TCP connection of the client, NULL if the query came over UDP
  	* @param msg The DNS message containing the query
  	*/
-	void (* insert)(struct query_pool * qpool, const struct sockaddr * addr, const Dns_Msg * msg);
+	void (* insert)(struct query_pool * qpool, const struct sockaddr * addr, uv_udp_t * socket, Tcp_Conn * conn,
+	                const Dns_Msg * msg);
+
+	/**
+ 	* @brief Insert a query the cache has no answer for into the query pool
+ 	* Same as insert without the cache lookup, for queries already looked up by a parse worker.
+ 	* @param qpool The query pool
+ 	* @param addr The address of the client
+ 	* @param socket The listening socket the query came in on, NULL if the query came over TCP
+ 	* @param conn The TCP connection of the client, NULL if the query came over UDP
+ 	* @param msg The DNS message containing the query
+ 	* @param received_at High-resolution time the query was received in nanoseconds, for the admission control
+ 	*/
+	void (* forward)(struct query_pool * qpool, const struct sockaddr * addr, uv_udp_t * socket, Tcp_Conn * conn,
+	                 const Dns_Msg * msg, uint64_t received_at);
 
 	/**
  	* @brief Finish processing a query
  	* This function is called when a response is received for a query.
  	* It processes the response, updates the cache if necessary, and sends the response to the local client.
+ 	* A truncated reply is not used, the query is resent over TCP instead.
+ 	* The first reply to any transmission of a hedged query wins, the index of the other one is retired.
  	* @param qpool The query pool
  	* @param msg The DNS message containing the response
+ 	* @param socket The upstream socket the response came in on, INDEX_SOCKET_TCP over TCP
+ 	* @param addr Address the response came from, the server of the connection over TCP
  	*/
-	void (* finish)(struct query_pool * qpool, const Dns_Msg * msg);
+	void (* finish)(struct query_pool * qpool, const Dns_Msg * msg, uint8_t socket, const struct sockaddr * addr);
 
 	/**
  	* @brief Delete a query from the query pool
@@ -61,7 +166,7 @@ typedef struct query_pool {
  	* @param qpool The query pool
  	* @param id The ID of the query to be deleted
  	*/
-	void (* delete)(struct query_pool * qpool, uint16_t id);
+	void (* delete)(struct query_pool * qpool, uint32_t id);
 } Query_Pool;
 
 /**
@@ -73,4 +178,22 @@ typedef struct query_pool {
  */
 Query_Pool *new_qpool(uv_loop_t * loop, Cache * cache);
 
+/**
+ * @brief Look up the answer to a query in the cache and the hosts file
+ * @param cache The cache
+ * @param msg The query
+ * @param reply The reply to fill in, its header must point to storage for the header
+ * @param source Set to where the answer was found
+ * @return The cache value holding the records of the reply, to be freed with destroy_dnsrr and free once the reply is sent,
+ * NULL if there is no answer
+ */
+Rbtree_Value * cache_answer(Cache * cache, const Dns_Msg * msg, Dns_Msg * reply, Cache_Source * source);
+
+/**
+ * @brief Get the largest UDP payload a client accepts
+ * @param msg The DNS message containing the query
+ * @return The payload size of the EDNS OPT record, or 512 without one (RFC 6891 6.2.3)
+ */
+uint16_t client_udp_size(const Dns_Msg * msg);
+
 #endif //DNSR_QUERY_POOL_H
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef DNSR_RATE_LIMIT_H
+#define DNSR_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "config.h"
+
+#define RRL_TABLE_SIZE 8192 ///< Token buckets of each worker, a power of two
+#define RRL_WAYS 4 ///< Buckets probed for a prefix, the least recently seen of them is replaced by a new prefix
+#define RRL_V4_PREFIX 24 ///< Length of the IPv4 prefixes sharing a token bucket
+#define RRL_V6_PREFIX 56 ///< Length of the IPv6 prefixes sharing a token bucket
+
+/// Verdict of the rate limiter on a query
+typedef enum {
+	RRL_PASS, ///< The query is served
+	RRL_DROP, ///< The query is dropped without a response
+	RRL_TRUNCATE ///< The query gets a truncated response, so that a real client retries over TCP
+} Rrl_Verdict;
+
+/// Token bucket of a client prefix
+typedef struct rrl_bucket {
+	uint64_t key; ///< Address family and prefix of the clients, 0 if the bucket is free
+	uint32_t tokens; ///< Tokens left, in thousandths of a response
+	uint32_t stamp; ///< Loop time in milliseconds of the last refill
+	uint32_t limited; ///< Queries limited since the prefix got its last token, drives the slip
+} Rrl_Bucket;
+
+/// Prefix of clients that are never rate limited
+typedef struct rrl_prefix {
+	int family; ///< AF_INET or AF_INET6
+	uint8_t addr[16]; ///< Address of the prefix in network byte order
+	int len; ///< Length of the prefix in bits
+} Rrl_Prefix;
+
+/// Response rate limiter, a fixed-size hashed table of token buckets owned by one worker
+typedef struct rate_limiter {
+	Rrl_Bucket * table; ///< Token buckets
+	uint64_t seed; ///< Random seed of the bucket hash, so that clients cannot aim at one set of buckets
+	Rrl_Prefix exempt[RRL_MAX_EXEMPT]; ///< Exempt prefixes
+	int exempt_count; ///< Number of exempt prefixes
+	uv_loop_t * loop; ///< Event loop whose time refills the buckets
+
+	/**
+	 * @brief Take a token from the bucket of the prefix of a client
+	 * @param rrl The rate limiter
+	 * @param addr The address of the client
+	 * @return RRL_PASS if the client is within its rate or exempt, RRL_TRUNCATE for every RRL_SLIP-th query limited, RRL_DROP otherwise
+	 */
+	Rrl_Verdict (* check)(struct rate_limiter * rrl, const struct sockaddr * addr);
+
+	/**
+	 * @brief Destroy the rate limiter
+	 * @param rrl The rate limiter to destroy
+	 */
+	void (* destroy)(struct rate_limiter * rrl);
+} Rate_Limiter;
+
+/**
+ * @brief Parse a prefix of the form address[/length]
+ * @param str The prefix string
+ * @param prefix The parsed prefix, a host prefix if the length is missing
+ * @return 0 on success, -1 if the address or the length is invalid
+ */
+int parse_prefix(const char * str, Rrl_Prefix * prefix);
+
+/**
+ * @brief Create a new rate limiter allowing RRL_RATE responses per second to each prefix
+ * @param loop The event loop of the worker
+ * @return The new rate limiter
+ */
+Rate_Limiter * new_rate_limiter(uv_loop_t * loop);
+
+#endif //DNSR_RATE_LIMIT_H
@@ -0,0 +1,79 @@
+#ifndef DNSR_RING_H
+#define DNSR_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RING_CACHE_LINE 64 ///< Size of a cache line, the indices of the two sides of a ring are padded apart by it
+
+/// Bounded lock-free ring of pointers with a single producer thread and a single consumer thread
+typedef struct spsc_ring {
+	void ** slots; ///< Slots, a power of two of them
+	size_t mask; ///< Number of slots minus one
+	alignas(RING_CACHE_LINE) atomic_size_t head; ///< Next slot to pop, written by the consumer
+	size_t tail_cache; ///< Last tail seen by the consumer
+	alignas(RING_CACHE_LINE) atomic_size_t tail; ///< Next slot to push, written by the producer
+	size_t head_cache; ///< Last head seen by the producer
+
+	/**
+	 * @brief Push a pointer, called by the producer only
+	 * @param ring The ring
+	 * @param item The pointer, not NULL
+	 * @return True if the pointer was pushed, false if the ring is full
+	 */
+	bool (* push)(struct spsc_ring * ring, void * item);
+
+	/**
+	 * @brief Pop a pointer, called by the consumer only
+	 * @param ring The ring
+	 * @return The oldest pointer, NULL if the ring is empty
+	 */
+	void * (* pop)(struct spsc_ring * ring);
+} Spsc_Ring;
+
+/// Slot of a multi-producer ring, its sequence tells whose turn it is
+typedef struct mpsc_cell {
+	atomic_size_t seq; ///< Position the slot is ready to be pushed at, or that plus one once it holds a pointer
+	void * item; ///< The pointer
+} Mpsc_Cell;
+
+/// Bounded lock-free ring of pointers with any number of producer threads and a single consumer thread
+typedef struct mpsc_ring {
+	Mpsc_Cell * cells; ///< Slots, a power of two of them
+	size_t mask; ///< Number of slots minus one
+	alignas(RING_CACHE_LINE) atomic_size_t tail; ///< Next position to push, claimed by the producers
+	alignas(RING_CACHE_LINE) size_t head; ///< Next position to pop, owned by the consumer
+
+	/**
+	 * @brief Push a pointer, called by any producer
+	 * @param ring The ring
+	 * @param item The pointer, not NULL
+	 * @return True if the pointer was pushed, false if the ring is full
+	 */
+	bool (* push)(struct mpsc_ring * ring, void * item);
+
+	/**
+	 * @brief Pop a pointer, called by the consumer only
+	 * @param ring The ring
+	 * @return The oldest pointer, NULL if the ring is empty
+	 */
+	void * (* pop)(struct mpsc_ring * ring);
+} Mpsc_Ring;
+
+/**
+ * @brief Create a new single-producer single-consumer ring
+ * @param capacity Number of slots, a power of two
+ * @return The new ring
+ */
+Spsc_Ring * new_spsc_ring(size_t capacity);
+
+/**
+ * @brief Create a new multi-producer single-consumer ring
+ * @param capacity Number of slots, a power of two
+ * @return The new ring
+ */
+Mpsc_Ring * new_mpsc_ring(size_t capacity);
+
+#endif //DNSR_RING_H
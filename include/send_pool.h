@@ -0,0 +1,54 @@
+#ifndef DNSR_SEND_POOL_H
+#define DNSR_SEND_POOL_H
+
+#include <uv.h>
+
+#include "dns.h"
+#include "trace.h"
+
+#define SEND_POOL_SIZE 256 ///< Number of send slots preallocated by each worker
+
+/// Outgoing message, serialized in place and sent with its own send request
+typedef struct send_slot {
+	union {
+		uv_udp_send_t udp; ///< Datagram send request
+		uv_write_t tcp; ///< Stream write request
+	} req; ///< Send request, used only when the socket would block
+	struct sockaddr_storage addr; ///< Destination address
+	unsigned int len; ///< Length of the serialized message
+	Trace trace; ///< Trace of the query answered by the message, finished when the slot is released after the send
+	struct send_slot * next; ///< Next slot in the free list
+	char data[DNS_STRING_MAX_SIZE]; ///< Serialized message
+} Send_Slot;
+
+/// Pool of send slots, owned by one worker
+typedef struct send_pool {
+	Send_Slot * slab; ///< Memory of all preallocated slots
+	Send_Slot * free; ///< Free list of slots
+	unsigned int capacity; ///< Number of preallocated slots
+	unsigned int in_use; ///< Number of slots handed out, including fallbacks
+
+	/**
+	 * @brief Take a send slot from the pool
+	 * Falls back to malloc when every preallocated slot is in use.
+	 * @param pool The send pool
+	 * @return A send slot whose request data points back to the pool
+	 */
+	Send_Slot * (* alloc)(struct send_pool * pool);
+
+	/**
+	 * @brief Return a send slot to the pool
+	 * @param pool The send pool
+	 * @param slot The slot taken by alloc
+	 */
+	void (* release)(struct send_pool * pool, Send_Slot * slot);
+} Send_Pool;
+
+/**
+ * @brief Create a new send pool
+ * @param capacity Number of slots to preallocate
+ * @return The new send pool
+ */
+Send_Pool * new_send_pool(unsigned int capacity);
+
+#endif //DNSR_SEND_POOL_H
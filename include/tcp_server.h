@@ -0,0 +1,46 @@
+#ifndef DNSR_TCP_SERVER_H
+#define DNSR_TCP_SERVER_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+#include "dns.h"
+
+#define TCP_BUFFER_INIT_SIZE 1024 ///< Initial size of the receive buffer of a connection
+#define TCP_BUFFER_MAX_SIZE (2 + 65535) ///< Largest length-prefixed DNS message
+
+/// DNS-over-TCP connection from a local client
+typedef struct tcp_conn {
+	uv_tcp_t handle; ///< Connection handle
+	uv_timer_t idle_timer; ///< Closes the connection when it stays idle
+	struct sockaddr_storage addr; ///< Address of the local client
+	char * buf; ///< Received bytes not yet split into messages
+	unsigned int len; ///< Number of bytes in buf
+	unsigned int cap; ///< Size of buf
+	unsigned int pending; ///< Number of queries of the connection still in the query pool
+	unsigned int handles; ///< Number of libuv handles not yet closed
+	bool eof; ///< Whether the client has finished sending, the connection closes once every query is answered
+	bool closing; ///< Whether the connection is being closed, responses to it are dropped
+} Tcp_Conn;
+
+/**
+ * @brief Initialize the DNS-over-TCP server
+ * Listens on each address in LISTEN_ADDRESSES, addresses that cannot be bound are skipped.
+ * @param loop The libuv event loop
+ */
+void init_tcp_server(uv_loop_t * loop);
+
+/**
+ * @brief Send a DNS response message on a TCP connection
+ * @param conn The connection of the local client
+ * @param msg The DNS message to be sent
+ */
+void send_to_tcp(Tcp_Conn * conn, const Dns_Msg * msg);
+
+/**
+ * @brief Release a query of a connection once it has been answered or dropped
+ * @param conn The connection of the query
+ */
+void tcp_conn_release(Tcp_Conn * conn);
+
+#endif //DNSR_TCP_SERVER_H
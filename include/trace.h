@@ -0,0 +1,90 @@
+#ifndef DNSR_TRACE_H
+#define DNSR_TRACE_H
+
+#include <stdint.h>
+#include <uv.h>
+
+#include "config.h"
+#include "dns.h"
+
+#define TRACE_HDR_SUB_BITS 5 ///< Bits of a value kept below its leading one, bounds the error of a bucket to 1/32
+#define TRACE_HDR_SUB_BUCKETS (1 << TRACE_HDR_SUB_BITS) ///< Linear sub-buckets of each power of two
+#define TRACE_HDR_MAX_BITS 36 ///< Values of 2^36 nanoseconds (about 68 s) and more fall into the last bucket
+#define TRACE_HDR_BUCKETS ((TRACE_HDR_MAX_BITS - TRACE_HDR_SUB_BITS + 1) * TRACE_HDR_SUB_BUCKETS) ///< Buckets of a stage histogram
+
+/// Point a query passes on its way through the relay
+typedef enum trace_point {
+	TRACE_RECEIVED, ///< The query was received
+	TRACE_PARSED, ///< The query was parsed by string_to_dnsmsg
+	TRACE_LOOKED_UP, ///< The cache and the hosts file were looked up
+	TRACE_UPSTREAM_SENT, ///< The query was sent to a remote server
+	TRACE_UPSTREAM_REPLIED, ///< The reply of the remote server was matched in qpool_finish
+	TRACE_SERIALIZED, ///< The response was serialized
+	TRACE_SENT, ///< The response was handed to the kernel
+	TRACE_POINTS ///< Number of points
+} Trace_Point;
+
+#define TRACE_STAGE_COUNT TRACE_POINTS ///< Stages timed, each from the point before it the query passed to its own point, and the whole query as stage 0
+
+/// Times a query passed each point
+typedef struct trace {
+	uint64_t at[TRACE_POINTS]; ///< High-resolution time of each point in nanoseconds, 0 if the query did not pass it
+	uint32_t sample; ///< Number of the trace in the log if the query was sampled, 0 otherwise
+} Trace;
+
+/// Log-linear histogram of the durations of a stage in nanoseconds, exact below 32 ns and within 1/32 above
+typedef struct trace_histogram {
+	uint64_t counts[TRACE_HDR_BUCKETS]; ///< Durations per bucket
+	uint64_t max; ///< Longest duration
+} Trace_Histogram;
+
+/// Stage histograms of one thread
+typedef struct trace_stats {
+	Trace_Histogram stages[TRACE_STAGE_COUNT]; ///< Histogram of each stage
+	struct trace_stats * next; ///< Histograms of the next thread
+} Trace_Stats;
+
+extern _Thread_local Trace * trace_current; ///< Trace of the query the current thread works on, NULL if it is not traced
+
+/**
+ * @brief Start the trace of a query just received, if TRACE_STAGES is set or the query is sampled
+ * @param trace The trace, it becomes trace_current if the query is traced, otherwise it is marked as not traced
+ */
+void trace_begin(Trace * trace);
+
+/**
+ * @brief Log the question of a sampled query
+ * @param msg The parsed query
+ */
+void trace_question(const Dns_Msg * msg);
+
+/**
+ * @brief Copy the trace of the current query where the query goes on, a send slot or a query in flight
+ * @param trace The copy, marked as not traced if there is no current trace
+ */
+void trace_attach(Trace * trace);
+
+/**
+ * @brief Finish a trace once its response was sent, its stages are recorded and a sampled trace is logged
+ * @param trace The trace
+ */
+void trace_finish(Trace * trace);
+
+/**
+ * @brief Write the percentiles of every stage, summed over the threads, to the log
+ */
+void trace_dump(void);
+
+/**
+ * @brief Dump the stage histograms whenever the process gets SIGUSR1
+ * @param loop The event loop handling the signal
+ */
+void init_trace(uv_loop_t * loop);
+
+#define trace_mark(point) \
+    if (trace_current) \
+    { \
+        trace_current->at[point] = uv_hrtime(); \
+    }
+
+#endif //DNSR_TRACE_H
@@ -0,0 +1,142 @@
+#ifndef DNSR_UPSTREAM_H
+#define DNSR_UPSTREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "config.h"
+
+#define UPSTREAM_RTT_INIT 100.0 ///< Smoothed RTT of a server before its first reply in milliseconds
+#define UPSTREAM_EWMA_WEIGHT 0.125 ///< Weight of a new sample in the smoothed RTT and loss rate
+#define UPSTREAM_RTTVAR_WEIGHT 0.25 ///< Weight of a new sample in the RTT deviation
+#define UPSTREAM_PROBE_INTERVAL 32 ///< One query in this many goes to a server other than the best one
+#define UPSTREAM_DOWN_FAILURES 3 ///< Consecutive timeouts after which a server is marked down
+#define UPSTREAM_DOWN_MIN 1000 ///< First period a server stays down in milliseconds
+#define UPSTREAM_DOWN_MAX 60000 ///< Upper bound of the period a server stays down in milliseconds
+#define UPSTREAM_QUANTILE_STEP 0.25 ///< Step of the p95 RTT estimate relative to the smoothed RTT
+#define UPSTREAM_HEDGE_MIN 10 ///< Shortest delay before a hedged request in milliseconds
+#define UPSTREAM_RTO_MIN 30 ///< Shortest retransmission timeout in milliseconds
+#define UPSTREAM_RTO_MAX 2000 ///< Longest retransmission timeout before backoff in milliseconds
+
+/// Remote DNS server with its health as seen by the current worker
+typedef struct upstream {
+	unsigned int index; ///< Position of the server in REMOTE_HOSTS
+	struct sockaddr_storage addr; ///< Address of the server
+	double srtt; ///< Smoothed RTT in milliseconds
+	double rttvar; ///< Smoothed mean deviation of the RTT in milliseconds
+	double rtt_p95; ///< Running estimate of the 95th percentile of the RTT in milliseconds
+	double loss; ///< Smoothed loss rate, from 0 to 1
+	unsigned int failures; ///< Consecutive timeouts
+	unsigned int down_period; ///< Period of the last down mark in milliseconds, 0 while the server is up
+	uint64_t down_until; ///< Loop time until which the server is down
+} Upstream;
+
+/**
+ * @brief Build the routing table of the forwarded zones from FORWARD_RULES
+ * @note Must run before the workers start
+ */
+void init_routes(void);
+
+/**
+ * @brief Add a remote server to the group of the names outside every forwarded zone
+ * @param host The address of the server
+ * @return NULL on success, otherwise why the server cannot be added
+ * @note Must run on a single thread at a time, after the workers started
+ */
+const char *upstream_add(const char * host);
+
+/**
+ * @brief Remove a remote server from the group of the names outside every forwarded zone
+ * @param host The address of the server
+ * @return NULL on success, otherwise why the server cannot be removed
+ * @note The server keeps its position in REMOTE_HOSTS and its forwarded zones, queries in flight may still use it
+ */
+const char *upstream_remove(const char * host);
+
+/**
+ * @brief Get the group of the names outside every forwarded zone
+ * @return Bit mask over REMOTE_HOSTS of the servers given with -a or added since
+ */
+unsigned int upstream_default_group(void);
+
+/**
+ * @brief Find the group of remote servers of a domain name
+ * @param qname The domain name
+ * @return Bit mask over REMOTE_HOSTS of the servers of the longest forwarded zone containing the name,
+ * or of the servers given with -a if there is none
+ */
+unsigned int upstream_route(const uint8_t * qname);
+
+/**
+ * @brief Initialize the remote servers of the current worker from REMOTE_HOSTS
+ * @param loop The libuv event loop
+ * @return Number of servers set up
+ */
+unsigned int init_upstreams(uv_loop_t * loop);
+
+/**
+ * @brief Get a remote server
+ * @param index Position of the server in REMOTE_HOSTS
+ * @return The server
+ */
+Upstream *upstream_get(unsigned int index);
+
+/**
+ * @brief Pick the remote server of a new query
+ * @param group Bit mask over REMOTE_HOSTS of the servers to pick from
+ * @return The healthy server with the lowest expected latency, or now and then another server to probe it
+ */
+Upstream *upstream_select(unsigned int group);
+
+/**
+ * @brief Pick a remote server for a hedged request
+ * @param exclude The server the query was already sent to
+ * @param group Bit mask over REMOTE_HOSTS of the servers to pick from
+ * @return The healthy server of the group with the lowest expected latency other than exclude, NULL if there is none
+ */
+Upstream *upstream_select_other(const Upstream * exclude, unsigned int group);
+
+/**
+ * @brief Delay before a query to a remote server is hedged
+ * @param up The server
+ * @return The p95 RTT of the server in whole milliseconds, at least UPSTREAM_HEDGE_MIN
+ */
+uint64_t upstream_hedge_delay(const Upstream * up);
+
+/**
+ * @brief Retransmission timeout of a remote server (RFC 6298)
+ * @param up The server
+ * @return SRTT + 4 * RTTVAR in whole milliseconds, clamped to UPSTREAM_RTO_MIN and UPSTREAM_RTO_MAX
+ */
+uint64_t upstream_rto(const Upstream * up);
+
+/**
+ * @brief Check if a remote server is down
+ * @param up The server
+ * @return true if the server is marked down and the period has not passed yet
+ */
+bool upstream_is_down(const Upstream * up);
+
+/**
+ * @brief Record a reply of a remote server
+ * @param up The server
+ * @param rtt Time between the query and the reply in milliseconds
+ * @param sample Whether rtt is a valid RTT sample, false for replies to retransmitted queries
+ */
+void upstream_success(Upstream * up, double rtt, bool sample);
+
+/**
+ * @brief Record a request to a remote server whose retransmission timeout expired
+ * @param up The server
+ * @note Only the loss rate is updated, a lossy server is not marked down as long as its queries get through
+ */
+void upstream_loss(Upstream * up);
+
+/**
+ * @brief Record a query of a remote server that timed out
+ * @param up The server
+ */
+void upstream_timeout(Upstream * up);
+
+#endif //DNSR_UPSTREAM_H
@@ -0,0 +1,31 @@
+#ifndef DNSR_UPSTREAM_TCP_H
+#define DNSR_UPSTREAM_TCP_H
+
+#include <uv.h>
+
+#include "dns.h"
+#include "upstream.h"
+
+#define UPSTREAM_TCP_MAX_CONNS 16 ///< Upper bound of UPSTREAM_TCP_CONNECTIONS
+#define UPSTREAM_TCP_BACKOFF_MIN 100 ///< Reconnect backoff after the first failure in milliseconds
+#define UPSTREAM_TCP_BACKOFF_MAX 10000 ///< Upper bound of the reconnect backoff in milliseconds
+#define UPSTREAM_TCP_BACKLOG_MAX 256 ///< Most queries of a link waiting for its connection
+
+/**
+ * @brief Initialize the TCP transport to the remote servers
+ * Each server gets its own pool of connections, opened on first use and kept open for the queries that follow.
+ * A connection that fails is reopened after an exponential backoff.
+ * @param loop The libuv event loop
+ */
+void init_upstream_tcp(uv_loop_t * loop);
+
+/**
+ * @brief Send a DNS query message to a remote server over TCP
+ * @param up The remote server
+ * @param msg The DNS message to be sent
+ * @return false if no connection is established and the backlog of the link is full, the query is not sent
+ * @note Queries are pipelined over the connection pool, replies are matched to queries by ID in the query pool
+ */
+bool send_to_remote_tcp(Upstream * up, const Dns_Msg * msg);
+
+#endif //DNSR_UPSTREAM_TCP_H
@@ -0,0 +1,24 @@
+#ifndef DNSR_WORKER_H
+#define DNSR_WORKER_H
+
+#include <uv.h>
+
+#include "cache.h"
+
+/// Worker thread, owning an event loop with its own listening socket, upstream socket and query pool
+typedef struct worker {
+	unsigned int id; ///< Index of the worker, also used as the CPU core it is pinned to
+	uv_thread_t thread; ///< Thread running the worker
+	uv_loop_t loop; ///< Event loop of the worker
+	Cache * cache; ///< Cache shared by all workers
+} Worker;
+
+/**
+ * @brief Start THREAD_COUNT workers and wait for them to finish
+ * The calling thread runs the first worker itself.
+ * @param cache The cache shared by all workers
+ * @return The exit status of the event loops
+ */
+int run_workers(Cache * cache);
+
+#endif //DNSR_WORKER_H
@@ -0,0 +1,71 @@
+#include "../include/buffer_pool.h"
+
+#include <stdlib.h>
+
+#include "../include/log.h"
+#include "../include/metrics.h"
+
+/**
+ * @brief Take a buffer from the pool
+ * Falls back to malloc when every preallocated buffer is in use.
+ * @param pool The buffer pool
+ * @return A buffer of buffer_size bytes, not zero-filled
+ */
+static char *bpool_alloc(Buffer_Pool *pool) {
+	char *buf;
+	if (pool->free_count)
+		buf = pool->free[--pool->free_count];
+	else {
+		buf = (char *) malloc(pool->buffer_size);
+		if (!buf)
+			log_fatal("Memory allocation error")
+		metrics_add(buffer_fallbacks, 1);
+	}
+	if (++pool->in_use > metrics.buffer_high_water)
+		metrics_set(buffer_high_water, pool->in_use);
+	return buf;
+}
+
+/**
+ * @brief Return a buffer to the pool
+ * @param pool The buffer pool
+ * @param buf The buffer taken by alloc
+ */
+static void bpool_release(Buffer_Pool *pool, char *buf) {
+	if (buf == NULL)
+		return;
+	--pool->in_use;
+	if (buf >= pool->slab && buf < pool->slab + pool->capacity * pool->buffer_size)
+		pool->free[pool->free_count++] = buf;
+	else
+		free(buf);
+}
+
+/**
+ * @brief Create a new buffer pool
+ * @param capacity Number of buffers to preallocate
+ * @param buffer_size Size of each buffer
+ * @return The new buffer pool
+ */
+Buffer_Pool *new_buffer_pool(unsigned int capacity, size_t buffer_size) {
+	log_debug("Initializing buffer pool")
+	Buffer_Pool *pool = (Buffer_Pool *) calloc(1, sizeof(Buffer_Pool));
+	if (!pool) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	pool->slab = (char *) malloc(capacity * buffer_size);
+	pool->free = (char **) malloc(capacity * sizeof(char *));
+	if (!pool->slab || !pool->free)
+		log_fatal("Memory allocation error")
+	pool->capacity = capacity;
+	pool->buffer_size = buffer_size;
+	for (unsigned int i = 0; i < capacity; ++i)
+		pool->free[i] = pool->slab + (capacity - 1 - i) * buffer_size;
+	pool->free_count = capacity;
+	pool->in_use = 0;
+
+	pool->alloc = &bpool_alloc;
+	pool->release = &bpool_release;
+	return pool;
+}
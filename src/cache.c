@@ -1,11 +1,13 @@
 #include "../include/cache.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <uv.h>
 
 #include "../include/log.h"
 #include "../include/dns_parse.h"
+#include "../include/metrics.h"
 
 /**
  * @brief Compute the hash of a string using the BKDR hash algorithm.
@@ -40,17 +42,201 @@ static uint32_t get_min_ttl(const Dns_RR *prr) {
 	return ttl;
 }
 
+/**
+ * @brief Memory allocated for an entry and its answer, as copy_dnsrr allocates it.
+ * @param entry The entry.
+ * @return The size in bytes.
+ */
+static unsigned int entry_bytes(const Cache_Entry *entry) {
+	unsigned int bytes = sizeof(Cache_Entry) + sizeof(Rbtree_Value);
+	for (const Dns_RR *prr = entry->value->rr; prr; prr = prr->next)
+		bytes += sizeof(Dns_RR) + 2 * DNS_RR_NAME_MAX_SIZE;
+	return bytes;
+}
+
+/**
+ * @brief Hash of a name, spread over the stripes and buckets.
+ * @param name The name.
+ * @return The hash value.
+ */
+static unsigned int name_hash(const uint8_t *name) {
+	unsigned int hash = BKDRHash(name);
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/**
+ * @brief Bucket of a hash in its stripe.
+ * @param stripe The stripe picked by the low bits of the hash.
+ * @param hash The hash.
+ * @return The bucket.
+ */
+static Cache_Entry *_Atomic *cache_bucket(Cache_Stripe *stripe, unsigned int hash) {
+	return &stripe->buckets[(hash / CACHE_STRIPES) & (CACHE_STRIPE_SIZE - 1)];
+}
+
+/**
+ * @brief Check if an entry answers a question.
+ * @param entry The entry.
+ * @param hash Hash of the name of the question.
+ * @param que The DNS question.
+ * @param now The current time.
+ * @return True if the entry has not expired and answers the question, false otherwise.
+ */
+static bool entry_match(const Cache_Entry *entry, unsigned int hash, const Dns_Que *que, time_t now) {
+	return entry->hash == hash && (entry->expire_time == -1 || entry->expire_time > now) &&
+	       (entry->value->type == 255 || entry->value->type == que->qtype) &&
+	       strcmp((char *) entry->value->rr->name, (char *) que->qname) == 0;
+}
+
+/**
+ * @brief Register the calling thread as a reader of the cache, once per thread.
+ * @param cache The cache.
+ * @return The epoch announcement of the thread.
+ * @note The announcements live as long as the cache, like the threads of the relay.
+ */
+static Cache_Reader *cache_reader(Cache *cache) {
+	static _Thread_local Cache_Reader *reader;
+	static _Thread_local Cache *reader_cache;
+	if (reader_cache == cache)
+		return reader;
+	reader = (Cache_Reader *) calloc(1, sizeof(Cache_Reader));
+	if (!reader) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	atomic_init(&reader->epoch, 0);
+	reader->next = atomic_load(&cache->readers);
+	while (!atomic_compare_exchange_weak(&cache->readers, &reader->next, reader));
+	reader_cache = cache;
+	return reader;
+}
+
+/**
+ * @brief Enter the cache as a reader, entries retired from now on stay allocated until the reader leaves.
+ * @param cache The cache.
+ * @param reader The epoch announcement of the calling thread.
+ */
+static void reader_enter(Cache *cache, Cache_Reader *reader) {
+	uint_fast64_t epoch;
+	do { // Announce an epoch that was still current after the announcement became visible
+		epoch = atomic_load(&cache->epoch);
+		atomic_store(&reader->epoch, epoch);
+		atomic_thread_fence(memory_order_seq_cst);
+	} while (atomic_load(&cache->epoch) != epoch);
+}
+
+/**
+ * @brief Leave the cache as a reader.
+ * @param reader The epoch announcement of the calling thread.
+ */
+static void reader_leave(Cache_Reader *reader) {
+	atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+/**
+ * @brief Advance the global epoch if every reader inside the cache has entered in the current one.
+ * @param cache The cache.
+ */
+static void epoch_try_advance(Cache *cache) {
+	uint_fast64_t epoch = atomic_load(&cache->epoch);
+	for (Cache_Reader *reader = atomic_load(&cache->readers); reader; reader = reader->next) {
+		uint_fast64_t seen = atomic_load(&reader->epoch);
+		if (seen && seen != epoch)
+			return;
+	}
+	atomic_compare_exchange_strong(&cache->epoch, &epoch, epoch + 1);
+}
+
+/**
+ * @brief Free an entry and its answer.
+ * @param entry The entry.
+ */
+static void entry_free(Cache_Entry *entry) {
+	destroy_dnsrr(entry->value->rr);
+	free(entry->value);
+	free(entry);
+}
+
+/**
+ * @brief Unlink an entry from its bucket and put it in limbo, with the stripe lock held.
+ * @param cache The cache.
+ * @param stripe The stripe of the entry.
+ * @param entry The entry.
+ */
+static void entry_retire(Cache *cache, Cache_Stripe *stripe, Cache_Entry *entry) {
+	Cache_Entry *_Atomic *link = cache_bucket(stripe, entry->hash);
+	while (atomic_load_explicit(link, memory_order_relaxed) != entry)
+		link = &atomic_load_explicit(link, memory_order_relaxed)->next;
+	atomic_store_explicit(link, atomic_load_explicit(&entry->next, memory_order_relaxed), memory_order_release);
+	stripe->bytes -= entry->bytes;
+	atomic_thread_fence(memory_order_seq_cst); // The unlink is visible before the epoch is read, see reader_enter
+	entry->retired = atomic_load(&cache->epoch);
+	entry->retire_next = stripe->limbo;
+	stripe->limbo = entry;
+}
+
+/**
+ * @brief Free the entries of a stripe no reader can still see, with the stripe lock held.
+ * @param cache The cache.
+ * @param stripe The stripe.
+ */
+static void stripe_reclaim(Cache *cache, Cache_Stripe *stripe) {
+	if (!stripe->limbo)
+		return;
+	epoch_try_advance(cache);
+	uint_fast64_t epoch = atomic_load(&cache->epoch);
+	Cache_Entry **link = &stripe->limbo;
+	while (*link && (*link)->retired + 2 > epoch) // The newest entries come first
+		link = &(*link)->retire_next;
+	Cache_Entry *entry = *link;
+	*link = NULL;
+	while (entry) {
+		Cache_Entry *next = entry->retire_next;
+		entry_free(entry);
+		entry = next;
+	}
+}
+
+/**
+ * @brief Free a position on the clock of a full stripe, with the stripe lock held.
+ * @param cache The cache.
+ * @param stripe The stripe.
+ * @return The position, its entry retired.
+ *
+ * The hand clears the reference bit of every entry it passes and evicts the first entry that was not hit
+ * since the hand last passed it, or that has expired.
+ */
+static unsigned int stripe_evict(Cache *cache, Cache_Stripe *stripe) {
+	time_t now = time(NULL);
+	for (;;) {
+		unsigned int slot = stripe->hand;
+		stripe->hand = (stripe->hand + 1) % CACHE_STRIPE_SIZE;
+		Cache_Entry *entry = stripe->clock[slot];
+		bool expired = entry->expire_time != -1 && entry->expire_time <= now;
+		if (!expired && atomic_exchange_explicit(&entry->referenced, false, memory_order_relaxed))
+			continue;
+		entry_retire(cache, stripe, entry);
+		return slot;
+	}
+}
+
 /**
  * @brief Insert a DNS message into the cache.
  * @param cache The cache where the message will be inserted.
  * @param msg The DNS message to be inserted.
+ *
+ * The answer replaces the one cached for the same name and type, or takes the place of an entry evicted by the clock.
+ * It is published to the readers only once it is complete.
  */
 static void cache_insert(Cache *cache, const Dns_Msg *msg) {
 	if (msg->rr == NULL) return;
 	log_debug("Inserting into cache")
-
+	Cache_Entry *entry = (Cache_Entry *) calloc(1, sizeof(Cache_Entry));
 	Rbtree_Value *value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-	if (!value) {
+	if (!entry || !value) {
 		log_fatal("Memory allocation error")
 		return;
 	}
@@ -59,100 +245,447 @@ static void cache_insert(Cache *cache, const Dns_Msg *msg) {
 	value->nscount = msg->header->nscount;
 	value->arcount = msg->header->arcount;
 	value->type = msg->que->qtype;
-	Dns_RR_LinkList *new_list_node = new_linklist();
-	new_list_node->value = value;
-	new_list_node->expire_time = time(NULL) + get_min_ttl(value->rr);
-	if (cache->size == CACHE_SIZE) {
-		cache->head->delete_next(cache->head); // Remove the least recently accessed element
-		--cache->size;
-	}
-	log_debug("Inserting into cache")
-	cache->tail->insert(cache->tail, new_list_node);
-	cache->tail = cache->tail->next;
-	++cache->size;
+	entry->value = value;
+	entry->hash = name_hash(value->rr->name);
+	entry->expire_time = time(NULL) + get_min_ttl(value->rr);
+	entry->bytes = entry_bytes(entry);
+	atomic_init(&entry->referenced, false);
 
-	value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-	if (!value) {
+	Cache_Stripe *stripe = &cache->stripes[entry->hash & (CACHE_STRIPES - 1)];
+	Cache_Entry *_Atomic *bucket = cache_bucket(stripe, entry->hash);
+	uv_mutex_lock(&stripe->lock);
+	unsigned int slot = CACHE_STRIPE_SIZE;
+	for (Cache_Entry *old = atomic_load_explicit(bucket, memory_order_relaxed); old;
+	     old = atomic_load_explicit(&old->next, memory_order_relaxed))
+		if (old->hash == entry->hash && old->value->type == value->type &&
+		    strcmp((char *) old->value->rr->name, (char *) value->rr->name) == 0) {
+			slot = old->slot;
+			entry_retire(cache, stripe, old);
+			break;
+		}
+	if (slot == CACHE_STRIPE_SIZE)
+		slot = stripe->size < CACHE_STRIPE_SIZE ? stripe->size++ : stripe_evict(cache, stripe);
+	entry->slot = slot;
+	stripe->clock[slot] = entry;
+	stripe->bytes += entry->bytes;
+	atomic_init(&entry->next, atomic_load_explicit(bucket, memory_order_relaxed));
+	atomic_store_explicit(bucket, entry, memory_order_release);
+	stripe_reclaim(cache, stripe);
+	uv_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * @brief Copy the value of an entry for the caller.
+ * @param value The value.
+ * @return The copy.
+ */
+static Rbtree_Value *value_copy(const Rbtree_Value *value) {
+	Rbtree_Value *copy = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
+	if (!copy) {
 		log_fatal("Memory allocation error")
-		return;
+		return NULL;
 	}
-
-	value->rr = copy_dnsrr(msg->rr);
-	value->ancount = msg->header->ancount;
-	value->nscount = msg->header->nscount;
-	value->arcount = msg->header->arcount;
-	value->type = msg->que->qtype;
-	new_list_node = new_linklist();
-	new_list_node->value = value;
-	new_list_node->expire_time = time(NULL) + get_min_ttl(value->rr);
-	cache->tree->insert(cache->tree, BKDRHash(value->rr->name), new_list_node); // Insert into red-black tree
+	memcpy(copy, value, sizeof(Rbtree_Value));
+	copy->rr = copy_dnsrr(value->rr);
+	return copy;
 }
 
 /**
- * @brief Query the cache for a DNS question.
+ * @brief Query the cache for a DNS question, without taking any lock.
  * @param cache The cache to query.
  * @param que The DNS question.
- * @return The value found in the cache or NULL if not found.
- */
-static Rbtree_Value *cache_query(Cache *cache, const Dns_Que *que) {
-	log_info("Querying cache")
-	Dns_RR_LinkList *list = cache->head->query_next(cache->head, que->qname, que->qtype);
-	if (list != NULL) {
-		log_info("Cache hit")
-		Dns_RR_LinkList *temp = list->next;
-		if (temp != cache->tail) {
-			list->next = list->next->next;
-			cache->tail->insert(cache->tail, temp);
-			cache->tail = cache->tail->next;
+ * @param source Set to where the answer was found.
+ * @return A copy of the value found in the cache or NULL if not found.
+ *
+ * The hosts entries are looked up first, then the bucket of the name, both under the protection of an epoch.
+ * A hit only sets the reference bit of its entry.
+ */
+static Rbtree_Value *cache_query(Cache *cache, const Dns_Que *que, Cache_Source *source) {
+	log_debug("Querying cache")
+	Cache_Reader *reader = cache_reader(cache);
+	reader_enter(cache, reader);
+	for (Dns_RR_LinkList *list = cache->hosts->lookup(cache->hosts, que->qname, true); list != NULL; list = list->next)
+		if (list->value->type == 255 || list->value->type == que->qtype) {
+			log_debug("Hosts hit")
+			if (list->value->rr->type == 255 && *(int *) list->value->rr->rdata == 0) {
+				metrics_add(blocked_hits, 1);
+				*source = CACHE_BLOCKED;
+			} else {
+				metrics_add(hosts_hits, 1);
+				*source = CACHE_HOSTS;
+			}
+			Rbtree_Value *value = value_copy(list->value);
+			reader_leave(reader);
+			return value;
 		}
+	unsigned int hash = name_hash(que->qname);
+	Cache_Stripe *stripe = &cache->stripes[hash & (CACHE_STRIPES - 1)];
+	time_t now = time(NULL);
+	Rbtree_Value *value = NULL;
+	for (Cache_Entry *entry = atomic_load_explicit(cache_bucket(stripe, hash), memory_order_acquire); entry;
+	     entry = atomic_load_explicit(&entry->next, memory_order_acquire))
+		if (entry_match(entry, hash, que, now)) {
+			if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) // Keep the cache line shared when it is set
+				atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+			value = value_copy(entry->value);
+			break;
+		}
+	reader_leave(reader);
+	if (value) {
+		log_debug("Cache hit")
+		metrics_add(cache_hits, 1);
+		*source = CACHE_HIT;
+	} else {
+		log_debug("Cache miss")
+		metrics_add(cache_misses, 1);
+		*source = CACHE_MISS;
+	}
+	return value;
+}
 
-		Rbtree_Value *value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-		if (!value) {
-			log_fatal("Memory allocation error")
-			return NULL;
+/**
+ * @brief Measure the cache, locking one stripe at a time.
+ * @param cache The cache.
+ * @param entries Number of answers in the cache.
+ * @param bytes Memory allocated for them.
+ * @note Expired answers count until they are replaced or evicted, the hosts file is left out.
+ */
+static void cache_usage(Cache *cache, size_t *entries, size_t *bytes) {
+	*entries = *bytes = 0;
+	for (int i = 0; i < CACHE_STRIPES; ++i) {
+		Cache_Stripe *stripe = &cache->stripes[i];
+		uv_mutex_lock(&stripe->lock);
+		*entries += stripe->size;
+		*bytes += stripe->bytes;
+		uv_mutex_unlock(&stripe->lock);
+	}
+}
+
+/**
+ * @brief Bring a name to the form of the names in the cache, with the trailing dot.
+ * @param name The name, with or without the trailing dot.
+ * @param target Storage for the name, DNS_RR_NAME_MAX_SIZE bytes.
+ * @return Length of the name, 0 if it is too long.
+ */
+static size_t name_target(const char *name, char *target) {
+	size_t len = strlen(name);
+	if (len && name[len - 1] == '.')
+		--len;
+	if (len + 2 > DNS_RR_NAME_MAX_SIZE)
+		return 0;
+	memcpy(target, name, len);
+	target[len++] = '.';
+	target[len] = 0;
+	return len;
+}
+
+/**
+ * @brief Check if the name of an entry is a name or one of its subdomains, ignoring case.
+ * @param entry The entry.
+ * @param name The name, with the trailing dot.
+ * @param len Length of the name.
+ * @param suffix Whether the subdomains of the name match too.
+ * @return True if the entry matches.
+ */
+static bool entry_name_match(const Cache_Entry *entry, const char *name, size_t len, bool suffix) {
+	const char *entry_name = (const char *) entry->value->rr->name;
+	size_t entry_len = strlen(entry_name);
+	if (entry_len < len || (entry_len > len && !suffix))
+		return false;
+	if (entry_len > len && len > 1 && entry_name[entry_len - len - 1] != '.') // The root matches every name
+		return false;
+	for (size_t i = 0; i < len; ++i)
+		if (tolower((unsigned char) entry_name[entry_len - len + i]) != tolower((unsigned char) name[i]))
+			return false;
+	return true;
+}
+
+/**
+ * @brief Drop answers from the cache, locking one stripe at a time.
+ * @param cache The cache.
+ * @param name Name of the answers, with or without the trailing dot, NULL for every answer.
+ * @param suffix Whether the answers of the subdomains of the name are dropped too.
+ * @return Number of answers dropped.
+ *
+ * The entries dropped are retired like the evicted ones, the last entry on the clock takes the place of each.
+ */
+static size_t cache_flush(Cache *cache, const char *name, bool suffix) {
+	char target[DNS_RR_NAME_MAX_SIZE];
+	size_t len = 0;
+	if (name && !(len = name_target(name, target)))
+		return 0;
+	size_t flushed = 0;
+	for (int i = 0; i < CACHE_STRIPES; ++i) {
+		Cache_Stripe *stripe = &cache->stripes[i];
+		uv_mutex_lock(&stripe->lock);
+		for (unsigned int slot = 0; slot < stripe->size;) {
+			Cache_Entry *entry = stripe->clock[slot];
+			if (name && !entry_name_match(entry, target, len, suffix)) {
+				++slot;
+				continue;
+			}
+			entry_retire(cache, stripe, entry);
+			stripe->clock[slot] = stripe->clock[--stripe->size];
+			stripe->clock[slot]->slot = slot;
+			++flushed;
 		}
-		memcpy(value, temp->value, sizeof(Rbtree_Value));
-		value->rr = copy_dnsrr(temp->value->rr);
-		return value;
-	}
-
-	log_info("Cache miss")
-	list = cache->tree->query(cache->tree, BKDRHash(que->qname));
-	while (list != NULL) {
-		if (strcmp((char *)list->value->rr->name, (char *)que->qname) == 0 &&
-		    (list->value->type == 255 || list->value->type == que->qtype)) {
-			log_info("Red-black tree hit")
-			Rbtree_Value *value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-			if (!value) {
-				log_fatal("Memory allocation error")
-				return NULL;
+		if (stripe->hand >= stripe->size)
+			stripe->hand = 0;
+		stripe_reclaim(cache, stripe);
+		uv_mutex_unlock(&stripe->lock);
+	}
+	log_info("Flushed %zu answers from the cache", flushed)
+	return flushed;
+}
+
+/**
+ * @brief Visit answers of the cache, with the lock of their stripe held.
+ * @param cache The cache.
+ * @param name Name of the answers, with or without the trailing dot, NULL for every answer.
+ * @param visit Called with each answer, must not use the cache, returns false to stop the walk.
+ * @param arg Passed on to visit.
+ * @note Expired answers are visited too, until they are replaced or evicted.
+ *
+ * The answers of a name are the ones a query of that name would get, so they are found in the bucket of its hash
+ * and only the stripe of that hash is locked.
+ */
+static void cache_walk(Cache *cache, const char *name, bool (*visit)(const Cache_Entry *entry, void *arg), void *arg) {
+	if (name) {
+		char target[DNS_RR_NAME_MAX_SIZE];
+		if (!name_target(name, target))
+			return;
+		unsigned int hash = name_hash((const uint8_t *) target);
+		Cache_Stripe *stripe = &cache->stripes[hash & (CACHE_STRIPES - 1)];
+		uv_mutex_lock(&stripe->lock);
+		for (Cache_Entry *entry = atomic_load(cache_bucket(stripe, hash)); entry; entry = atomic_load(&entry->next))
+			if (entry->hash == hash && strcmp((const char *) entry->value->rr->name, target) == 0 && !visit(entry, arg))
+				break;
+		uv_mutex_unlock(&stripe->lock);
+		return;
+	}
+	for (int i = 0; i < CACHE_STRIPES; ++i) {
+		Cache_Stripe *stripe = &cache->stripes[i];
+		bool more = true;
+		uv_mutex_lock(&stripe->lock);
+		for (unsigned int slot = 0; more && slot < stripe->size; ++slot)
+			more = visit(stripe->clock[slot], arg);
+		uv_mutex_unlock(&stripe->lock);
+		if (!more)
+			return;
+	}
+}
+
+/**
+ * @brief Build a hosts record.
+ * @param ip The address, IPv4 or IPv6, 0.0.0.0 blocks the name.
+ * @param domain The domain name, with or without the trailing dot.
+ * @return A list node holding the record, NULL if the address or the name is illegitimate.
+ */
+static Dns_RR_LinkList *hosts_record(const char *ip, const char *domain) {
+	uint8_t rdata[16];
+	int family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+	if (uv_inet_pton(family, ip, rdata))
+		return NULL;
+	Dns_RR *rr = (Dns_RR *) calloc(1, sizeof(Dns_RR));
+	if (!rr) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	rr->name = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
+	if (!rr->name) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	if (!name_target(domain, (char *) rr->name) || rr->name[0] == '.') {
+		destroy_dnsrr(rr);
+		return NULL;
+	}
+	rr->class = DNS_CLASS_IN;
+	rr->ttl = -1; // Permanent
+	if (family == AF_INET) {
+		if (strcmp(ip, "0.0.0.0") == 0)
+			rr->type = 255;
+		else
+			rr->type = DNS_TYPE_A;
+		rr->rdlength = 4;
+	} else {
+		rr->type = DNS_TYPE_AAAA;
+		rr->rdlength = 16;
+	}
+	rr->rdata = (uint8_t *) malloc(rr->rdlength);
+	if (!rr->rdata) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	memcpy(rr->rdata, rdata, rr->rdlength);
+	Rbtree_Value *value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
+	if (!value) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	value->rr = rr;
+	value->ancount = 1;
+	value->type = rr->type;
+	Dns_RR_LinkList *list = new_linklist();
+	list->value = value;
+	list->expire_time = -1;
+	return list;
+}
+
+/**
+ * @brief Free a hosts record no longer reachable.
+ * @param ptr The value of the record.
+ */
+static void hosts_value_free(void *ptr) {
+	Rbtree_Value *value = (Rbtree_Value *) ptr;
+	destroy_dnsrr(value->rr);
+	free(value);
+}
+
+/**
+ * @brief Check if two hosts records have the same type and address.
+ * @param a A record.
+ * @param b Another record.
+ * @return True if they are the same.
+ */
+static bool hosts_record_equal(const Dns_RR *a, const Dns_RR *b) {
+	return a->type == b->type && a->rdlength == b->rdlength && memcmp(a->rdata, b->rdata, a->rdlength) == 0;
+}
+
+/**
+ * @brief Put hosts records in limbo until no reader can see them, with the hosts lock held.
+ * @param cache The cache.
+ * @param ptr The records.
+ * @param release Frees them.
+ */
+static void hosts_retire(Cache *cache, void *ptr, void (*release)(void *ptr)) {
+	Cache_Retired *retired = (Cache_Retired *) malloc(sizeof(Cache_Retired));
+	if (!retired) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	retired->ptr = ptr;
+	retired->release = release;
+	atomic_thread_fence(memory_order_seq_cst); // The records were unlinked before the epoch is read, see reader_enter
+	retired->retired = atomic_load(&cache->epoch);
+	retired->next = cache->hosts_limbo;
+	cache->hosts_limbo = retired;
+}
+
+/**
+ * @brief Retire the trie arrays replaced by the last change and free the hosts records no reader can still see,
+ * with the hosts lock held.
+ * @param cache The cache.
+ */
+static void hosts_reclaim(Cache *cache) {
+	while (cache->hosts->retired) {
+		Domain_Trie_Children *children = cache->hosts->retired;
+		cache->hosts->retired = children->retired_next;
+		hosts_retire(cache, children, free);
+	}
+	if (!cache->hosts_limbo)
+		return;
+	epoch_try_advance(cache);
+	uint_fast64_t epoch = atomic_load(&cache->epoch);
+	Cache_Retired **link = &cache->hosts_limbo;
+	while (*link && (*link)->retired + 2 > epoch) // The newest records come first
+		link = &(*link)->next;
+	Cache_Retired *retired = *link;
+	*link = NULL;
+	while (retired) {
+		Cache_Retired *next = retired->next;
+		retired->release(retired->ptr);
+		free(retired);
+		retired = next;
+	}
+}
+
+/**
+ * @brief Add a record to the hosts entries, seen by the next lookups of the name.
+ * @param cache The cache.
+ * @param name The domain name.
+ * @param ip Its address, IPv4 or IPv6, 0.0.0.0 blocks the name.
+ * @return 0 on success, UV_EINVAL if the name or the address is illegitimate, UV_EEXIST if the record is there already.
+ *
+ * The record is put in front of the list of the name, published by a single store of the head.
+ */
+static int cache_hosts_add(Cache *cache, const char *name, const char *ip) {
+	Dns_RR_LinkList *list = hosts_record(ip, name);
+	if (!list)
+		return UV_EINVAL;
+	uv_mutex_lock(&cache->hosts_lock);
+	void *_Atomic *slot = cache->hosts->insert(cache->hosts, list->value->rr->name);
+	int ret = slot ? 0 : UV_EINVAL;
+	Dns_RR_LinkList *head = slot ? atomic_load_explicit(slot, memory_order_relaxed) : NULL;
+	for (Dns_RR_LinkList *node = head; node && !ret; node = node->next)
+		if (hosts_record_equal(node->value->rr, list->value->rr))
+			ret = UV_EEXIST;
+	if (!ret) {
+		list->next = head;
+		atomic_store_explicit(slot, list, memory_order_release);
+	}
+	hosts_reclaim(cache);
+	uv_mutex_unlock(&cache->hosts_lock);
+	if (ret) {
+		hosts_value_free(list->value);
+		free(list);
+	} else
+		log_info("Added hosts entry %s %s", ip, name)
+	return ret;
+}
+
+/**
+ * @brief Remove records from the hosts entries, seen by the next lookups of the name.
+ * @param cache The cache.
+ * @param name The domain name.
+ * @param ip Address of the record to remove, NULL for every record of the name.
+ * @return Number of records removed, UV_EINVAL if the address is illegitimate.
+ *
+ * The records kept are linked into a new list that replaces the old one as a whole,
+ * the old list and the records removed stay allocated until no reader can see them.
+ */
+static int cache_hosts_remove(Cache *cache, const char *name, const char *ip) {
+	Dns_RR_LinkList *match = NULL;
+	if (ip && !(match = hosts_record(ip, name)))
+		return UV_EINVAL;
+	int removed = 0;
+	uv_mutex_lock(&cache->hosts_lock);
+	Dns_RR_LinkList *head = cache->hosts->lookup(cache->hosts, (const uint8_t *) name, true);
+	if (head) {
+		Dns_RR_LinkList *kept = NULL, **tail = &kept;
+		for (Dns_RR_LinkList *node = head; node; node = node->next)
+			if (!match || hosts_record_equal(node->value->rr, match->value->rr))
+				++removed;
+			else {
+				Dns_RR_LinkList *copy = new_linklist();
+				copy->value = node->value;
+				copy->expire_time = node->expire_time;
+				*tail = copy;
+				tail = &copy->next;
 			}
-			memcpy(value, list->value, sizeof(Rbtree_Value));
-			value->rr = copy_dnsrr(list->value->rr);
-			Dns_RR_LinkList *new_list_node = new_linklist();
-			new_list_node->value = value;
-			new_list_node->expire_time = list->expire_time;
-			if (cache->size == CACHE_SIZE) {
-				cache->head->delete_next(cache->head); // Remove the least recently accessed element
-				--cache->size;
+		if (removed) {
+			atomic_store_explicit(cache->hosts->insert(cache->hosts, (const uint8_t *) name), kept, memory_order_release);
+			for (Dns_RR_LinkList *node = head; node; node = node->next) {
+				if (!match || hosts_record_equal(node->value->rr, match->value->rr))
+					hosts_retire(cache, node->value, hosts_value_free);
+				hosts_retire(cache, node, free);
 			}
-			cache->tail->insert(cache->tail, new_list_node);
-			cache->tail = cache->tail->next;
-			++cache->size;
-
-			value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-			if (!value) {
-				log_fatal("Memory allocation error")
-				return NULL;
+		} else
+			while (kept) {
+				Dns_RR_LinkList *next = kept->next;
+				free(kept);
+				kept = next;
 			}
-			memcpy(value, list->value, sizeof(Rbtree_Value));
-			value->rr = copy_dnsrr(list->value->rr);
-			return value;
-		}
-		list = list->next;
 	}
-	log_info("Red-black tree miss")
-	return NULL;
+	hosts_reclaim(cache);
+	uv_mutex_unlock(&cache->hosts_lock);
+	if (match) {
+		hosts_value_free(match->value);
+		free(match);
+	}
+	if (removed)
+		log_info("Removed %d hosts entries of %s", removed, name)
+	return removed;
 }
 
 /**
@@ -162,67 +695,51 @@ static Rbtree_Value *cache_query(Cache *cache, const Dns_Que *que) {
  */
 Cache *new_cache(FILE *hosts_file) {
 	log_info("Initializing cache")
-	Cache *cache = (Cache *) malloc(sizeof(Cache));
+	Cache *cache = (Cache *) calloc(1, sizeof(Cache));
 	if (!cache) {
 		log_fatal("Memory allocation error")
 		return NULL;
 	}
-	Rbtree *tree = new_rbtree();
+	Domain_Trie *hosts = new_domain_trie();
 	if (hosts_file != NULL) {
 		char ip[DNS_RR_NAME_MAX_SIZE], domain[DNS_RR_NAME_MAX_SIZE];
 		while (fscanf(hosts_file, "%s %s", ip, domain) != EOF) { // Read domain-IP from file
-			Dns_RR *rr = (Dns_RR *) calloc(1, sizeof(Dns_RR));
-			if (!rr) {
-				log_fatal("Memory allocation error")
-				return NULL;
+			Dns_RR_LinkList *list = hosts_record(ip, domain);
+			if (!list) {
+				log_error("Illegitimate hosts entry %s %s", ip, domain)
+				continue;
 			}
-			rr->name = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
-			if (!rr->name)
-				log_fatal("Memory allocation error")
-			memcpy(rr->name, domain, strlen(domain) + 1);
-			rr->name[strlen(domain) + 1] = 0;
-			rr->name[strlen(domain)] = '.';
-			rr->class = DNS_CLASS_IN;
-			rr->ttl = -1; // Permanent
-			if (strchr(ip, '.') != NULL) { // IPv4
-				if (strcmp(ip, "0.0.0.0") == 0)
-					rr->type = 255;
-				else
-					rr->type = DNS_TYPE_A;
-				rr->rdlength = 4;
-				rr->rdata = (uint8_t *) calloc(4, sizeof(uint8_t));
-				if (!rr->rdata) {
-					log_fatal("Memory allocation error")
-					exit(1);
-				}
-				uv_inet_pton(AF_INET, ip, rr->rdata);
-			} else { // IPv6
-				rr->type = DNS_TYPE_AAAA;
-				rr->rdlength = 16;
-				rr->rdata = (uint8_t *) calloc(16, sizeof(uint8_t));
-				if (!rr->rdata)
-					log_fatal("Memory allocation error")
-				uv_inet_pton(AF_INET6, ip, rr->rdata);
-			}
-			Rbtree_Value *value = (Rbtree_Value *) calloc(1, sizeof(Rbtree_Value));
-			if (!value) {
-				log_fatal("Memory allocation error")
-				return NULL;
-			}
-			value->rr = rr;
-			value->ancount = 1;
-			value->type = rr->type;
-			Dns_RR_LinkList *list = new_linklist();
-			list->value = value;
-			list->expire_time = -1;
-			tree->insert(tree, BKDRHash(rr->name), list);
+			void *_Atomic *slot = hosts->insert(hosts, list->value->rr->name);
+			if (!slot)
+				continue;
+			Dns_RR_LinkList *head = atomic_load_explicit(slot, memory_order_relaxed);
+			if (head)
+				head->insert(head, list);
+			else
+				atomic_store_explicit(slot, list, memory_order_relaxed);
 		}
 	}
+	hosts->shared = true; // Looked up by every worker from now on
 
-	cache->tree = tree;
-	cache->head = cache->tail = new_linklist();
-	cache->size = 0;
+	cache->hosts = hosts;
+	if (uv_mutex_init(&cache->hosts_lock))
+		log_fatal("Failed to initialize the hosts lock")
+	cache->stripes = (Cache_Stripe *) calloc(CACHE_STRIPES, sizeof(Cache_Stripe));
+	if (!cache->stripes) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	for (int i = 0; i < CACHE_STRIPES; ++i)
+		if (uv_mutex_init(&cache->stripes[i].lock))
+			log_fatal("Failed to initialize the cache lock")
+	atomic_init(&cache->epoch, 1);
+	atomic_init(&cache->readers, NULL);
 	cache->query = &cache_query;
 	cache->insert = &cache_insert;
+	cache->usage = &cache_usage;
+	cache->flush = &cache_flush;
+	cache->walk = &cache_walk;
+	cache->hosts_add = &cache_hosts_add;
+	cache->hosts_remove = &cache_hosts_remove;
 	return cache;
 }
\ No newline at end of file
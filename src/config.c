@@ -5,13 +5,234 @@
 #include <stdlib.h>
 #include <uv.h>
 
+#include "../include/dns.h"
+#include "../include/heavy_hitters.h"
 #include "../include/log.h"
+#include "../include/rate_limit.h"
 
-char *REMOTE_HOST = "8.8.8.8";
+char *REMOTE_HOSTS[REMOTE_MAX_HOSTS] = {"8.8.8.8"};
+int REMOTE_COUNT = 1;
+char *FORWARD_RULES[FORWARD_MAX_ZONES];
+int FORWARD_COUNT = 0;
 int LOG_MASK = 15;
 int CLIENT_PORT = 0;
 char *HOSTS_PATH = "../dnsrelay.txt";
 char *LOG_PATH = NULL;
+int THREAD_COUNT = 1;
+int PIN_THREADS = 0;
+int PIPELINE_WORKERS = 0;
+int UDP_PAYLOAD_SIZE = 4096;
+int TCP_IDLE_TIMEOUT = 10000;
+int TCP_MAX_CONNECTIONS = 256;
+int UPSTREAM_TCP = 0;
+int UPSTREAM_TCP_CONNECTIONS = 2;
+int UPSTREAM_SOCKETS = 4;
+_Atomic int HEDGE_BUDGET = 5;
+_Atomic int QUERY_TIMEOUT = 5000;
+_Atomic int RETRIES = 2;
+int MAX_QUERIES = 4096;
+int RRL_RATE = 0;
+int RRL_SLIP = 2;
+char *RRL_EXEMPT[RRL_MAX_EXEMPT];
+int RRL_EXEMPT_COUNT = 0;
+_Atomic int SHED_TARGET = 20;
+int SHED_RCODE = DNS_RCODE_SERVFAIL;
+char *LISTEN_ADDRESSES[LISTEN_MAX_ADDRESSES] = {"0.0.0.0", "::"};
+int LISTEN_COUNT = 2;
+char *METRICS_LISTEN = NULL;
+char *QUERY_LOG = NULL;
+int QUERY_LOG_SIZE = 64;
+char *CONTROL_PATH = NULL;
+int HEAVY_HITTERS = 0;
+int TRACE_STAGES = 0;
+int TRACE_SAMPLE = 0;
+
+/**
+ * @brief Convert an IPv4 or IPv6 address string to a socket address
+ * @param host The address string
+ * @param port The port
+ * @param addr The socket address
+ * @return 0 on success, a libuv error code if the string is neither an IPv4 nor an IPv6 address
+ */
+int parse_address(const char *host, int port, struct sockaddr_storage *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if (uv_ip4_addr(host, port, (struct sockaddr_in *) addr) == 0)
+		return 0;
+	return uv_ip6_addr(host, port, (struct sockaddr_in6 *) addr);
+}
+
+/**
+ * @brief Convert an address:port string to a socket address, an IPv6 address in brackets as [address]:port
+ * @param str The string
+ * @param addr The socket address
+ * @return 0 on success, a libuv error code if the string is malformed
+ */
+int parse_endpoint(const char *str, struct sockaddr_storage *addr) {
+	const char *colon = strrchr(str, ':');
+	if (!colon || colon == str)
+		return UV_EINVAL;
+	char *end;
+	long port = strtol(colon + 1, &end, 10);
+	if (*end || end == colon + 1 || port < 1 || port > 65535)
+		return UV_EINVAL;
+	size_t len = colon - str;
+	if (str[0] == '[') {
+		if (len < 2 || str[len - 1] != ']')
+			return UV_EINVAL;
+		++str;
+		len -= 2;
+	}
+	char host[64];
+	if (len >= sizeof(host))
+		return UV_EINVAL;
+	memcpy(host, str, len);
+	host[len] = 0;
+	return parse_address(host, (int) port, addr);
+}
+
+/**
+ * @brief Parse a long command line option of the form --name value
+ * @param name Name of the option, without the leading dashes
+ * @param value Value of the option
+ */
+static void parse_long_option(const char *name, const char *value) {
+	static int listen_set = 0; // The first --listen replaces the default addresses
+	if (strcmp(name, "threads") == 0) {
+		int threads = (int)strtol(value, NULL, 10);
+		if (threads < 0 || threads > 1024)
+			log_fatal("Command line parameter is wrong, threads must be an integer of 0-1024")
+		THREAD_COUNT = threads ? threads : (int)uv_available_parallelism();
+	} else if (strcmp(name, "pipeline") == 0) {
+		int workers = (int)strtol(value, NULL, 10);
+		if (workers < 0 || workers > 64)
+			log_fatal("Command line parameter is wrong, parse workers must be an integer of 0-64")
+		PIPELINE_WORKERS = workers;
+	} else if (strcmp(name, "pin-threads") == 0) {
+		PIN_THREADS = (int)strtol(value, NULL, 10) != 0;
+	} else if (strcmp(name, "udp-payload") == 0) {
+		int size = (int)strtol(value, NULL, 10);
+		if (size < 512 || size > 65535)
+			log_fatal("Command line parameter is wrong, UDP payload size must be an integer of 512-65535")
+		UDP_PAYLOAD_SIZE = size;
+	} else if (strcmp(name, "tcp-idle-timeout") == 0) {
+		int timeout = (int)strtol(value, NULL, 10);
+		if (timeout < 1)
+			log_fatal("Command line parameter is wrong, TCP idle timeout must be a positive integer")
+		TCP_IDLE_TIMEOUT = timeout;
+	} else if (strcmp(name, "tcp-max-conns") == 0) {
+		int conns = (int)strtol(value, NULL, 10);
+		if (conns < 0)
+			log_fatal("Command line parameter is wrong, TCP connection cap must be a non-negative integer")
+		TCP_MAX_CONNECTIONS = conns;
+	} else if (strcmp(name, "upstream-tcp") == 0) {
+		UPSTREAM_TCP = (int)strtol(value, NULL, 10) != 0;
+	} else if (strcmp(name, "upstream-sockets") == 0) {
+		int sockets = (int)strtol(value, NULL, 10);
+		if (sockets < 1 || sockets > UPSTREAM_MAX_SOCKETS)
+			log_fatal("Command line parameter is wrong, upstream sockets must be an integer of 1-64")
+		UPSTREAM_SOCKETS = sockets;
+	} else if (strcmp(name, "upstream-tcp-conns") == 0) {
+		int conns = (int)strtol(value, NULL, 10);
+		if (conns < 1 || conns > 16)
+			log_fatal("Command line parameter is wrong, upstream TCP connections must be an integer of 1-16")
+		UPSTREAM_TCP_CONNECTIONS = conns;
+	} else if (strcmp(name, "hedge-budget") == 0) {
+		int budget = (int)strtol(value, NULL, 10);
+		if (budget < 0 || budget > 100)
+			log_fatal("Command line parameter is wrong, hedge budget must be an integer of 0-100")
+		HEDGE_BUDGET = budget;
+	} else if (strcmp(name, "query-timeout") == 0) {
+		int timeout = (int)strtol(value, NULL, 10);
+		if (timeout < 1)
+			log_fatal("Command line parameter is wrong, query timeout must be a positive integer")
+		QUERY_TIMEOUT = timeout;
+	} else if (strcmp(name, "retries") == 0) {
+		int retries = (int)strtol(value, NULL, 10);
+		if (retries < 0 || retries > 10)
+			log_fatal("Command line parameter is wrong, retries must be an integer of 0-10")
+		RETRIES = retries;
+	} else if (strcmp(name, "shed-target") == 0) {
+		int target = (int)strtol(value, NULL, 10);
+		if (target < 0 || target > 60000)
+			log_fatal("Command line parameter is wrong, shed target must be an integer of 0-60000")
+		SHED_TARGET = target;
+	} else if (strcmp(name, "shed-rcode") == 0) {
+		if (strcmp(value, "servfail") == 0)
+			SHED_RCODE = DNS_RCODE_SERVFAIL;
+		else if (strcmp(value, "refused") == 0)
+			SHED_RCODE = DNS_RCODE_REFUSED;
+		else
+			log_fatal("Command line parameter is wrong, shed rcode must be servfail or refused")
+	} else if (strcmp(name, "rrl-rate") == 0) {
+		int rate = (int)strtol(value, NULL, 10);
+		if (rate < 0 || rate > 100000)
+			log_fatal("Command line parameter is wrong, rate limit must be an integer of 0-100000")
+		RRL_RATE = rate;
+	} else if (strcmp(name, "rrl-slip") == 0) {
+		int slip = (int)strtol(value, NULL, 10);
+		if (slip < 0 || slip > 10)
+			log_fatal("Command line parameter is wrong, slip must be an integer of 0-10")
+		RRL_SLIP = slip;
+	} else if (strcmp(name, "rrl-exempt") == 0) {
+		Rrl_Prefix prefix;
+		if (parse_prefix(value, &prefix))
+			log_fatal("Command line parameter is wrong, exempt prefix must be address[/length]")
+		if (RRL_EXEMPT_COUNT == RRL_MAX_EXEMPT)
+			log_fatal("Command line parameter is wrong, too many exempt prefixes")
+		RRL_EXEMPT[RRL_EXEMPT_COUNT++] = (char *)value;
+	} else if (strcmp(name, "max-queries") == 0) {
+		int queries = (int)strtol(value, NULL, 10);
+		if (queries < 1 || queries > 65535)
+			log_fatal("Command line parameter is wrong, max queries must be an integer of 1-65535")
+		MAX_QUERIES = queries;
+	} else if (strcmp(name, "forward") == 0) {
+		if (!strchr(value, '='))
+			log_fatal("Command line parameter is wrong, forwarding rule must be zone=server[,server...]")
+		if (FORWARD_COUNT == FORWARD_MAX_ZONES)
+			log_fatal("Command line parameter is wrong, too many forwarded zones")
+		FORWARD_RULES[FORWARD_COUNT++] = (char *)value;
+	} else if (strcmp(name, "trace-stages") == 0) {
+		TRACE_STAGES = (int)strtol(value, NULL, 10) != 0;
+	} else if (strcmp(name, "trace-sample") == 0) {
+		int sample = (int)strtol(value, NULL, 10);
+		if (sample < 0 || sample > 1000000)
+			log_fatal("Command line parameter is wrong, trace sample must be an integer of 0-1000000")
+		TRACE_SAMPLE = sample;
+	} else if (strcmp(name, "metrics") == 0) {
+		struct sockaddr_storage addr;
+		if (value[0] != '/' && parse_endpoint(value, &addr))
+			log_fatal("Command line parameter is wrong, metrics must be served on address:port or a Unix socket path")
+		METRICS_LISTEN = (char *)value;
+	} else if (strcmp(name, "query-log") == 0) {
+		QUERY_LOG = (char *)value;
+	} else if (strcmp(name, "query-log-size") == 0) {
+		int size = (int)strtol(value, NULL, 10);
+		if (size < 0 || size > 65536)
+			log_fatal("Command line parameter is wrong, query log size must be an integer of 0-65536")
+		QUERY_LOG_SIZE = size;
+	} else if (strcmp(name, "control") == 0) {
+		if (value[0] != '/')
+			log_fatal("Command line parameter is wrong, control socket must be an absolute path")
+		CONTROL_PATH = (char *)value;
+	} else if (strcmp(name, "heavy-hitters") == 0) {
+		int counters = (int)strtol(value, NULL, 10);
+		if (counters < 0 || counters > HEAVY_HITTERS_MAX)
+			log_fatal("Command line parameter is wrong, heavy hitters must be an integer of 0-1024")
+		HEAVY_HITTERS = counters;
+	} else if (strcmp(name, "listen") == 0) {
+		struct sockaddr_storage addr;
+		if (parse_address(value, 53, &addr))
+			log_fatal("Command line parameter is wrong, entered illegitimate listening IP address")
+		if (!listen_set) {
+			LISTEN_COUNT = 0;
+			listen_set = 1;
+		}
+		if (LISTEN_COUNT == LISTEN_MAX_ADDRESSES)
+			log_fatal("Command line parameter is wrong, too many listening addresses")
+		LISTEN_ADDRESSES[LISTEN_COUNT++] = (char *)value;
+	} else
+		log_fatal("Command line parameter is wrong, Illegal parameter flags")
+}
 
 /**
  * @brief Parse command line arguments
@@ -21,6 +242,7 @@ char *LOG_PATH = NULL;
 void init_config(int argc, char *const *argv) {
 	argc--;
 	argv++;
+	int remote_set = 0;
 
 	fprintf(stderr, " _____ _     ____  _   _ ____    ____      _\n");
 	fprintf(stderr, "|_   _| |   |  _ \\| \\ | / ___|  |  _ \\ ___| | __ _ _   _\n");
@@ -33,11 +255,38 @@ void init_config(int argc, char *const *argv) {
 
 	if (argc == 1 && strcmp(*argv, "-h") == 0) {
 		printf("Usage:\n");
-		printf("    [-a] Use the specified name server\n");
-		printf("    [-d] Debug level mask, a 4-bit binary number, DEBUG、INFO、ERROR、FATAL in order\n");
+		printf("    [-a] Use the specified name server, IPv4 or IPv6, repeatable to fail over between several\n");
+		printf("    [-d] Debug level mask, a 4-bit binary number, DEBUG、INFO、ERROR、FATAL in order, DEBUG needs a build with LOG_MIN_LEVEL=0\n");
 		printf("    [-f] Use the specified DNS hosts file\n");
 		printf("    [-l] Log information storage location\n");
-		printf("    [-p] Custom listening ports\n");
+		printf("    [-p] Custom client port, each worker thread sends from upstream sockets ports in a row from it\n");
+		printf("    [--forward] Send the names of a zone to its own name servers, zone=server[,server...], repeatable\n");
+		printf("    [--hedge-budget] Most hedged requests to a second name server, in percent of the queries, 0 disables\n");
+		printf("    [--query-timeout] Milliseconds before a query gets SERVFAIL when no name server answers\n");
+		printf("    [--retries] Retransmissions of a query before its timeout, over UDP or TCP, 0-10\n");
+		printf("    [--max-queries] Most queries in flight at once in each worker thread, 1-65535\n");
+		printf("    [--shed-target] Milliseconds queries may wait in a worker before they are sent on, beyond which load is shed, 0 disables\n");
+		printf("    [--shed-rcode] Answer of the queries shed, servfail or refused\n");
+		printf("    [--rrl-rate] Responses per second to each /24 or /56 of clients in each worker thread, 0 disables\n");
+		printf("    [--rrl-slip] Every n-th query over the rate gets a truncated answer instead of none, 0-10, 0 drops all\n");
+		printf("    [--rrl-exempt] Never rate limit the specified address[/length], repeatable\n");
+		printf("    [--listen] Listen on the specified IPv4 or IPv6 address, repeatable, 0.0.0.0 and :: by default\n");
+		printf("    [--trace-stages] Time every stage of every query into histograms, written to the log on SIGUSR1, 0 or 1\n");
+		printf("    [--trace-sample] Log the stage times of one query in n, 0 disables\n");
+		printf("    [--metrics] Serve Prometheus metrics over HTTP on address:port, or on a Unix socket given by its path\n");
+		printf("    [--query-log] Record every query and response in a binary file, or unix:path to send them to a collector\n");
+		printf("    [--query-log-size] Megabytes after which the query log file is rotated, 0 never rotates it, 64 by default\n");
+		printf("    [--control] Take commands on a Unix socket given by its path, to flush the cache or change the name servers\n");
+		printf("    [--heavy-hitters] Track the most frequent names, clients and NXDOMAIN names with n counters each, 0-1024, 0 disables\n");
+		printf("    [--threads] Number of worker threads, 0 for one per CPU core\n");
+		printf("    [--pipeline] Parse workers behind each worker thread, which then only does socket I/O, 0-64, 0 disables\n");
+		printf("    [--pin-threads] Pin each worker thread to its own CPU core, 0 or 1\n");
+		printf("    [--udp-payload] Largest UDP payload received in bytes, 512-65535\n");
+		printf("    [--tcp-idle-timeout] Milliseconds before an idle TCP connection is closed\n");
+		printf("    [--tcp-max-conns] Most TCP connections per worker thread, 0 disables TCP\n");
+		printf("    [--upstream-tcp] Send every query to the name server over TCP, 0 or 1\n");
+		printf("    [--upstream-tcp-conns] TCP connections to the name server per worker thread, 1-16\n");
+		printf("    [--upstream-sockets] UDP sockets on random ports per worker thread to query the name server from, 1-64\n");
 		printf("    [-h] Helpful Information\n\n");
 		printf("Example:\n");
 		printf("    –d 1111 -a 192.168.0.1 -f c:\\dns-table.txt\n");
@@ -47,6 +296,26 @@ void init_config(int argc, char *const *argv) {
 		printf("    -d 1101 -l /Users/Code -p 53\n");
 		printf("        Output DEBUG、INFO、and FATAL information\n");
 		printf("        Output debugging information to /Users/Code as a file\n");
+		printf("    -a 8.8.8.8 -a 1.1.1.1 -a 2001:4860:4860::8888\n");
+		printf("        Send each query to the fastest healthy name server of the three\n");
+		printf("    -a 1.1.1.1 --forward corp.example=10.0.0.53,10.0.1.53\n");
+		printf("        Send corp.example and its subdomains to the internal name servers, every other name to 1.1.1.1\n");
+		printf("    --rrl-rate 50 --rrl-exempt 192.168.0.0/16\n");
+		printf("        Answer each outside network at most 50 times per second, local clients without limit\n");
+		printf("    --metrics 127.0.0.1:9153\n");
+		printf("        Serve the counters and latency histograms at http://127.0.0.1:9153/metrics\n");
+		printf("    --trace-stages 1 --trace-sample 10000\n");
+		printf("        Time the stages of every query, log those of one query in 10000, kill -USR1 logs the percentiles\n");
+		printf("    --query-log /var/log/dnsr/queries.qlog --query-log-size 256\n");
+		printf("        Record every query and response, rotated every 256 MB, query_log_reader -j prints them as JSON\n");
+		printf("    --control /run/dnsr.sock\n");
+		printf("        Take commands such as cache flush suffix example.com on the socket, socat - UNIX-CONNECT:/run/dnsr.sock\n");
+		printf("    --heavy-hitters 256 --control /run/dnsr.sock\n");
+		printf("        Track the busiest names and clients of the last five minutes, top clients 10 on the socket lists them\n");
+		printf("    --threads 0 --pin-threads 1\n");
+		printf("        Run one worker thread pinned to each CPU core\n");
+		printf("    --threads 1 --pipeline 7\n");
+		printf("        Receive and send on one thread, parse and look up the cache on seven others\n");
 		fflush(stdout);
 		exit(0);
 	}
@@ -60,15 +329,23 @@ void init_config(int argc, char *const *argv) {
 		if (i + 1 == argc)
 			log_fatal("Command line parameter is wrong, missing parameter values")
 
+		if (*field == '-') {
+			parse_long_option(field + 1, argv[i + 1]);
+			i += 2;
+			continue;
+		}
 		switch (*field) {
 			case 'a': {
-				char *dest = (char*)malloc(5 * sizeof(char));
-				if (!dest)
-					log_fatal("Failure to allocate memory")
-				if (uv_inet_pton(AF_INET, argv[i + 1], dest))
+				struct sockaddr_storage dest;
+				if (parse_address(argv[i + 1], 53, &dest))
 					log_fatal("Command line parameter is wrong, entered illegitimate IP address")
-				free(dest);
-				REMOTE_HOST = argv[i + 1];
+				if (!remote_set) { // The first -a replaces the default name server
+					REMOTE_COUNT = 0;
+					remote_set = 1;
+				}
+				if (REMOTE_COUNT == REMOTE_MAX_HOSTS)
+					log_fatal("Command line parameter is wrong, too many name servers")
+				REMOTE_HOSTS[REMOTE_COUNT++] = argv[i + 1];
 				i += 2;
 				break;
 			}
@@ -77,6 +354,8 @@ void init_config(int argc, char *const *argv) {
 				if (mask < 0 || mask > 15)
 					log_fatal("Command line parameter is wrong, mask must be an integer from 0-15")
 				LOG_MASK = mask;
+				if ((mask & 1) && LOG_MIN_LEVEL > LOG_LEVEL_DEBUG)
+					log_info("DEBUG messages are compiled out, rebuild with LOG_MIN_LEVEL=0 to get them")
 				i += 2;
 				break;
 			}
@@ -102,4 +381,7 @@ void init_config(int argc, char *const *argv) {
 				log_fatal("Command line parameter is wrong, Illegal parameter flags")
 		}
 	}
+	// Each worker binds UPSTREAM_SOCKETS ports in a row from the custom port, all of them must be valid
+	if (CLIENT_PORT && CLIENT_PORT + (long) THREAD_COUNT * UPSTREAM_SOCKETS - 1 > 65535)
+		log_fatal("Command line parameter is wrong, client ports of all threads and upstream sockets must be at most 65535")
 }
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "../include/control.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "../include/config.h"
+#include "../include/heavy_hitters.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/upstream.h"
+
+static uv_pipe_t listener; ///< Listening socket of the administrators
+static Cache *control_cache; ///< The cache the commands work on
+
+/// Setting that can be changed at run time, with the range its option accepts
+static const struct {
+	const char *name; ///< Name of the setting, as its command line option
+	_Atomic int *value; ///< The setting
+	int min; ///< Smallest value
+	int max; ///< Largest value
+} tunables[] = {
+	{"query-timeout", &QUERY_TIMEOUT, 1, INT_MAX},
+	{"retries", &RETRIES, 0, 10},
+	{"hedge-budget", &HEDGE_BUDGET, 0, 100},
+	{"shed-target", &SHED_TARGET, 0, 60000},
+};
+
+/**
+ * @brief Append formatted text to a reply
+ * @param reply The reply
+ * @param format Format of the text, as printf
+ */
+static void reply_printf(Control_Reply *reply, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply_printf(Control_Reply *reply, const char *format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(reply->data + reply->len, reply->cap - reply->len, format, args);
+		va_end(args);
+		if (len < 0)
+			return;
+		if ((size_t) len < reply->cap - reply->len) {
+			reply->len += len;
+			return;
+		}
+		char *data = (char *) realloc(reply->data, reply->cap * 2);
+		if (!data) {
+			log_fatal("Memory allocation error")
+			return;
+		}
+		reply->data = data;
+		reply->cap *= 2;
+	}
+}
+
+/**
+ * @brief Name a record type
+ * @param type The type
+ * @param buf Storage for the name of an unknown type
+ * @return The name, as in the presentation format
+ */
+static const char *type_name(uint16_t type, char *buf) {
+	switch (type) {
+		case DNS_TYPE_A: return "A";
+		case DNS_TYPE_NS: return "NS";
+		case DNS_TYPE_CNAME: return "CNAME";
+		case DNS_TYPE_SOA: return "SOA";
+		case DNS_TYPE_PTR: return "PTR";
+		case DNS_TYPE_MX: return "MX";
+		case DNS_TYPE_TXT: return "TXT";
+		case DNS_TYPE_AAAA: return "AAAA";
+		case 255: return "ANY";
+		default:
+			sprintf(buf, "TYPE%u", type);
+			return buf;
+	}
+}
+
+/**
+ * @brief Write a record of an answer as a line of the reply
+ * @param reply The reply
+ * @param rr The record
+ */
+static void reply_rr(Control_Reply *reply, const Dns_RR *rr) {
+	char type_buf[16], addr[64];
+	reply_printf(reply, "\t%s %s ", (const char *) rr->name, type_name(rr->type, type_buf));
+	if (rr->type == DNS_TYPE_A && rr->rdlength == 4) {
+		uv_inet_ntop(AF_INET, rr->rdata, addr, sizeof(addr));
+		reply_printf(reply, "%s\n", addr);
+	} else if (rr->type == DNS_TYPE_AAAA && rr->rdlength == 16) {
+		uv_inet_ntop(AF_INET6, rr->rdata, addr, sizeof(addr));
+		reply_printf(reply, "%s\n", addr);
+	} else if (rr->type == DNS_TYPE_CNAME || rr->type == DNS_TYPE_NS || rr->type == DNS_TYPE_PTR)
+		reply_printf(reply, "%s\n", (const char *) rr->rdata);
+	else if (rr->type == DNS_TYPE_MX && rr->rdlength > 2)
+		reply_printf(reply, "%u %s\n", (unsigned int) (rr->rdata[0] << 8 | rr->rdata[1]), (const char *) rr->rdata + 2);
+	else
+		reply_printf(reply, "<%u bytes>\n", rr->rdlength);
+}
+
+/**
+ * @brief Write an answer of the cache to the reply of cache dump or cache lookup
+ * @param entry The answer
+ * @param arg The reply
+ * @return false once the reply reaches CONTROL_DUMP_MAX bytes, which stops the walk
+ */
+static bool reply_entry(const Cache_Entry *entry, void *arg) {
+	Control_Reply *reply = (Control_Reply *) arg;
+	char type_buf[16];
+	const Rbtree_Value *value = entry->value;
+	reply_printf(reply, "%s %s", (const char *) value->rr->name, type_name(value->type, type_buf));
+	time_t now = time(NULL);
+	if (entry->expire_time == -1)
+		reply_printf(reply, " permanent\n");
+	else if (entry->expire_time <= now)
+		reply_printf(reply, " expired\n");
+	else
+		reply_printf(reply, " ttl %lld\n", (long long) (entry->expire_time - now));
+	for (const Dns_RR *rr = value->rr; rr; rr = rr->next)
+		reply_rr(reply, rr);
+	return reply->len < CONTROL_DUMP_MAX;
+}
+
+/**
+ * @brief Parse the value of a setting
+ * @param str The value
+ * @param min Smallest value allowed
+ * @param max Largest value allowed
+ * @param value Set to the value
+ * @return true if the value is an integer in range
+ */
+static bool parse_int(const char *str, int min, int max, int *value) {
+	char *end;
+	long parsed = strtol(str, &end, 10);
+	if (!*str || *end || parsed < min || parsed > max)
+		return false;
+	*value = (int) parsed;
+	return true;
+}
+
+/**
+ * @brief Write the counters summed over the threads and the size of the cache
+ * @param reply The reply
+ */
+static void command_stats(Control_Reply *reply) {
+	Metrics total;
+	metrics_aggregate(&total);
+	size_t entries, bytes;
+	control_cache->usage(control_cache, &entries, &bytes);
+	reply_printf(reply, "queries_udp %llu\n", (unsigned long long) total.rx_packets);
+	reply_printf(reply, "queries_tcp %llu\n", (unsigned long long) total.tcp_queries);
+	reply_printf(reply, "cache_hits %llu\n", (unsigned long long) total.cache_hits);
+	reply_printf(reply, "hosts_hits %llu\n", (unsigned long long) total.hosts_hits);
+	reply_printf(reply, "blocked_hits %llu\n", (unsigned long long) total.blocked_hits);
+	reply_printf(reply, "cache_misses %llu\n", (unsigned long long) total.cache_misses);
+	reply_printf(reply, "queries_coalesced %llu\n", (unsigned long long) total.queries_coalesced);
+	reply_printf(reply, "queries_shed %llu\n",
+	             (unsigned long long) (total.queries_shed_full + total.queries_shed_codel));
+	reply_printf(reply, "queries_dropped %llu\n", (unsigned long long) (total.rrl_dropped + total.pipeline_dropped));
+	reply_printf(reply, "upstream_timeouts %llu\n", (unsigned long long) total.upstream_servfails);
+	reply_printf(reply, "upstream_retransmits %llu\n", (unsigned long long) total.upstream_retransmits);
+	reply_printf(reply, "upstream_hedges %llu\n", (unsigned long long) total.upstream_hedges);
+	reply_printf(reply, "queries_in_flight %llu\n", (unsigned long long) total.queries_in_flight);
+	reply_printf(reply, "cache_entries %zu\n", entries);
+	reply_printf(reply, "cache_bytes %zu\n", bytes);
+}
+
+/**
+ * @brief Run a cache command
+ * @param reply The reply
+ * @param argc Number of words of the command
+ * @param argv Words of the command, cache first
+ * @return NULL on success, otherwise the reason of the error
+ */
+static const char *command_cache(Control_Reply *reply, int argc, char **argv) {
+	if (argc >= 2 && strcmp(argv[1], "flush") == 0) {
+		size_t flushed;
+		if (argc == 2)
+			flushed = control_cache->flush(control_cache, NULL, false);
+		else if (argc == 4 && (strcmp(argv[2], "name") == 0 || strcmp(argv[2], "suffix") == 0))
+			flushed = control_cache->flush(control_cache, argv[3], argv[2][0] == 's');
+		else
+			return "usage: cache flush [name <name> | suffix <zone>]";
+		reply_printf(reply, "flushed %zu\n", flushed);
+	} else if (argc == 2 && strcmp(argv[1], "dump") == 0) {
+		control_cache->walk(control_cache, NULL, reply_entry, reply);
+		if (reply->len >= CONTROL_DUMP_MAX)
+			reply_printf(reply, "truncated at %d bytes, see cache lookup <name>\n", CONTROL_DUMP_MAX);
+	} else if (argc == 3 && strcmp(argv[1], "lookup") == 0)
+		control_cache->walk(control_cache, argv[2], reply_entry, reply);
+	else
+		return "usage: cache flush | cache dump | cache lookup <name>";
+	return NULL;
+}
+
+/**
+ * @brief Run a hosts command
+ * @param reply The reply
+ * @param argc Number of words of the command
+ * @param argv Words of the command, hosts first
+ * @return NULL on success, otherwise the reason of the error
+ */
+static const char *command_hosts(Control_Reply *reply, int argc, char **argv) {
+	if (argc == 4 && strcmp(argv[1], "add") == 0) {
+		int ret = control_cache->hosts_add(control_cache, argv[2], argv[3]);
+		if (ret == UV_EEXIST)
+			return "the entry is there already";
+		if (ret)
+			return "illegitimate name or address";
+	} else if ((argc == 3 || argc == 4) && strcmp(argv[1], "remove") == 0) {
+		int removed = control_cache->hosts_remove(control_cache, argv[2], argc == 4 ? argv[3] : NULL);
+		if (removed < 0)
+			return "illegitimate name or address";
+		if (!removed)
+			return "no such entry";
+		reply_printf(reply, "removed %d\n", removed);
+	} else
+		return "usage: hosts add <name> <address> | hosts remove <name> [address]";
+	return NULL;
+}
+
+/**
+ * @brief Run an upstream command
+ * @param reply The reply
+ * @param argc Number of words of the command
+ * @param argv Words of the command, upstream first
+ * @return NULL on success, otherwise the reason of the error
+ */
+static const char *command_upstream(Control_Reply *reply, int argc, char **argv) {
+	if (argc == 2 && strcmp(argv[1], "list") == 0) {
+		unsigned int group = upstream_default_group();
+		for (int i = 0; i < REMOTE_COUNT; ++i)
+			reply_printf(reply, "%s %s\n", REMOTE_HOSTS[i], group & 1u << i ? "active" : "inactive");
+		return NULL;
+	}
+	if (argc == 3 && strcmp(argv[1], "add") == 0)
+		return upstream_add(argv[2]);
+	if (argc == 3 && strcmp(argv[1], "remove") == 0)
+		return upstream_remove(argv[2]);
+	return "usage: upstream list | upstream add <address> | upstream remove <address>";
+}
+
+/**
+ * @brief Run a top command, writing each key with its count and the most its count may be over
+ * @param reply The reply
+ * @param argc Number of words of the command
+ * @param argv Words of the command, top first
+ * @return NULL on success, otherwise the reason of the error
+ */
+static const char *command_top(Control_Reply *reply, int argc, char **argv) {
+	static const char *const kinds[HEAVY_HITTERS_KINDS] = {"qnames", "clients", "nxdomains"};
+	if (!HEAVY_HITTERS)
+		return "heavy hitters are not tracked, see --heavy-hitters";
+	int kind = 0, n = 10;
+	while (argc >= 2 && kind < HEAVY_HITTERS_KINDS && strcmp(argv[1], kinds[kind]) != 0)
+		++kind;
+	if (argc < 2 || argc > 3 || kind == HEAVY_HITTERS_KINDS ||
+	    (argc == 3 && !parse_int(argv[2], 1, HEAVY_HITTERS_MAX, &n)))
+		return "usage: top qnames | clients | nxdomains [n]";
+	Heavy_Hitter *top = (Heavy_Hitter *) malloc(n * sizeof(Heavy_Hitter));
+	if (!top) {
+		log_fatal("Memory allocation error")
+		return "out of memory";
+	}
+	unsigned int count = heavy_hitters_top((Heavy_Hitter_Kind) kind, top, (unsigned int) n);
+	char key[HEAVY_HITTERS_KEY_MAX + 1];
+	for (unsigned int i = 0; i < count; ++i)
+		reply_printf(reply, "%s %llu %llu\n", heavy_hitter_key((Heavy_Hitter_Kind) kind, &top[i], key),
+		             (unsigned long long) top[i].count, (unsigned long long) top[i].error);
+	free(top);
+	return NULL;
+}
+
+/**
+ * @brief Run a set command, without a value it shows the setting
+ * @param reply The reply
+ * @param argc Number of words of the command
+ * @param argv Words of the command, set first
+ * @return NULL on success, otherwise the reason of the error
+ */
+static const char *command_set(Control_Reply *reply, int argc, char **argv) {
+	if (argc == 1) {
+		for (size_t i = 0; i < sizeof(tunables) / sizeof(tunables[0]); ++i)
+			reply_printf(reply, "%s %d\n", tunables[i].name, *tunables[i].value);
+		return NULL;
+	}
+	for (size_t i = 0; i < sizeof(tunables) / sizeof(tunables[0]); ++i) {
+		if (strcmp(argv[1], tunables[i].name) != 0)
+			continue;
+		if (argc == 2) {
+			reply_printf(reply, "%s %d\n", tunables[i].name, *tunables[i].value);
+			return NULL;
+		}
+		int value;
+		if (argc != 3 || !parse_int(argv[2], tunables[i].min, tunables[i].max, &value))
+			return "value out of range";
+		*tunables[i].value = value;
+		log_info("Set %s to %d", tunables[i].name, value)
+		return NULL;
+	}
+	return "usage: set [query-timeout | retries | hedge-budget | shed-target] [value]";
+}
+
+/**
+ * @brief Run a command line and write its reply
+ * @param reply The reply
+ * @param line The command line, split into words in place
+ */
+static void run_command(Control_Reply *reply, char *line) {
+	char *argv[CONTROL_ARGS_MAX];
+	int argc = 0;
+	for (char *word = line; *word;) {
+		while (*word == ' ' || *word == '\t')
+			*word++ = 0;
+		if (!*word)
+			break;
+		if (argc == CONTROL_ARGS_MAX) {
+			reply_printf(reply, "ERROR too many words\n");
+			return;
+		}
+		argv[argc++] = word;
+		while (*word && *word != ' ' && *word != '\t')
+			++word;
+	}
+	if (!argc)
+		return;
+
+	const char *error = NULL;
+	if (strcmp(argv[0], "stats") == 0 && argc == 1)
+		command_stats(reply);
+	else if (strcmp(argv[0], "cache") == 0)
+		error = command_cache(reply, argc, argv);
+	else if (strcmp(argv[0], "hosts") == 0)
+		error = command_hosts(reply, argc, argv);
+	else if (strcmp(argv[0], "upstream") == 0)
+		error = command_upstream(reply, argc, argv);
+	else if (strcmp(argv[0], "set") == 0)
+		error = command_set(reply, argc, argv);
+	else if (strcmp(argv[0], "top") == 0)
+		error = command_top(reply, argc, argv);
+	else if (strcmp(argv[0], "help") == 0) {
+		reply_printf(reply, "stats\n");
+		reply_printf(reply, "cache flush [name <name> | suffix <zone>]\n");
+		reply_printf(reply, "cache dump\n");
+		reply_printf(reply, "cache lookup <name>\n");
+		reply_printf(reply, "hosts add <name> <address>\n");
+		reply_printf(reply, "hosts remove <name> [address]\n");
+		reply_printf(reply, "upstream list | add <address> | remove <address>\n");
+		reply_printf(reply, "set [query-timeout | retries | hedge-budget | shed-target] [value]\n");
+		reply_printf(reply, "top qnames | clients | nxdomains [n]\n");
+	} else
+		error = "unknown command, try help";
+	if (error)
+		reply_printf(reply, "ERROR %s\n", error);
+	else
+		reply_printf(reply, "OK\n");
+}
+
+/**
+ * @brief Callback function of a closed administrator connection
+ * @param handle The connection
+ */
+static void on_close(uv_handle_t *handle) {
+	free(handle->data);
+}
+
+/**
+ * @brief Callback function of a connection shut down after its last reply, the connection is closed
+ * @param req The shutdown request
+ * @param status Shutdown status
+ */
+static void on_shutdown(uv_shutdown_t *req, int status) {
+	(void) status;
+	uv_close((uv_handle_t *) req->handle, on_close);
+}
+
+/**
+ * @brief Callback function of a written reply
+ * @param req The write request
+ * @param status Write status
+ */
+static void on_write(uv_write_t *req, int status) {
+	Control_Reply *reply = (Control_Reply *) req->data;
+	if (status && status != UV_ECANCELED)
+		log_error("Control write status error %d", status)
+	free(reply->data);
+	free(reply);
+}
+
+/**
+ * @brief Send a reply on a connection
+ * @param conn The connection
+ * @param reply The reply, freed once written
+ */
+static void send_reply(Control_Conn *conn, Control_Reply *reply) {
+	uv_buf_t buf = uv_buf_init(reply->data, (unsigned int) reply->len);
+	reply->write.data = reply;
+	if (uv_write(&reply->write, (uv_stream_t *) &conn->handle, &buf, 1, on_write)) {
+		free(reply->data);
+		free(reply);
+	}
+}
+
+/**
+ * @brief Create an empty reply
+ * @return The reply
+ */
+static Control_Reply *new_reply(void) {
+	Control_Reply *reply = (Control_Reply *) calloc(1, sizeof(Control_Reply));
+	if (!reply) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	reply->data = (char *) malloc(CONTROL_TEXT_INIT);
+	if (!reply->data) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	reply->cap = CONTROL_TEXT_INIT;
+	return reply;
+}
+
+/**
+ * @brief Give the rest of the line buffer of a connection to libuv
+ * @param handle The connection
+ * @param suggested_size Suggested buffer size
+ * @param buf Buffer to be allocated
+ */
+static void alloc_line(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+	(void) suggested_size;
+	Control_Conn *conn = (Control_Conn *) handle->data;
+	*buf = uv_buf_init(conn->line + conn->len, (unsigned int) (CONTROL_LINE_MAX - 1 - conn->len));
+}
+
+/**
+ * @brief Callback function of a read on an administrator connection, each complete line is run as a command
+ * @param stream The connection
+ * @param nread Number of bytes read, negative on error or end of file
+ * @param buf The line buffer
+ */
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+	(void) buf;
+	Control_Conn *conn = (Control_Conn *) stream->data;
+	if (nread < 0) {
+		uv_close((uv_handle_t *) stream, on_close);
+		return;
+	}
+	conn->len += nread;
+	conn->line[conn->len] = 0;
+	char *line = conn->line, *end;
+	while ((end = strchr(line, '\n'))) {
+		*end = 0;
+		if (end > line && end[-1] == '\r')
+			end[-1] = 0;
+		Control_Reply *reply = new_reply();
+		run_command(reply, line);
+		if (reply->len)
+			send_reply(conn, reply);
+		else {
+			free(reply->data);
+			free(reply);
+		}
+		line = end + 1;
+	}
+	conn->len -= line - conn->line;
+	memmove(conn->line, line, conn->len + 1);
+	if (conn->len == CONTROL_LINE_MAX - 1) {
+		Control_Reply *reply = new_reply();
+		reply_printf(reply, "ERROR line too long\n");
+		send_reply(conn, reply);
+		uv_read_stop(stream);
+		if (uv_shutdown(&conn->shutdown, stream, on_shutdown))
+			uv_close((uv_handle_t *) stream, on_close);
+	}
+}
+
+/**
+ * @brief Callback function for new administrator connections
+ * @param server The listening socket
+ * @param status Connection status
+ */
+static void on_connection(uv_stream_t *server, int status) {
+	if (status < 0) {
+		log_error("Control connection error %d", status)
+		return;
+	}
+	Control_Conn *conn = (Control_Conn *) calloc(1, sizeof(Control_Conn));
+	if (!conn) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	uv_pipe_init(server->loop, &conn->handle, 0);
+	conn->handle.data = conn;
+	if (uv_accept(server, (uv_stream_t *) &conn->handle)) {
+		uv_close((uv_handle_t *) &conn->handle, on_close);
+		return;
+	}
+	uv_read_start((uv_stream_t *) &conn->handle, alloc_line, on_read);
+}
+
+/**
+ * @brief Take control commands on the Unix socket at CONTROL_PATH
+ * The commands flush or show the cache, change the hosts entries, the name servers and the timeouts,
+ * each change applies to the queries that follow without a restart.
+ * @param loop The libuv event loop running the commands
+ * @param cache The cache
+ * @note A socket file left behind by an earlier run is replaced, any other file is not.
+ * The socket is made accessible to its owner only.
+ */
+void init_control(uv_loop_t *loop, Cache *cache) {
+	control_cache = cache;
+#ifndef _WIN32
+	uv_fs_t req;
+	if (uv_fs_stat(NULL, &req, CONTROL_PATH, NULL) == 0 && S_ISSOCK(req.statbuf.st_mode)) {
+		uv_fs_req_cleanup(&req);
+		uv_fs_unlink(NULL, &req, CONTROL_PATH, NULL);
+	}
+	uv_fs_req_cleanup(&req);
+#endif
+	int ret = uv_pipe_init(loop, &listener, 0);
+	if (!ret)
+		ret = uv_pipe_bind(&listener, CONTROL_PATH);
+#ifndef _WIN32
+	if (!ret) {
+		ret = uv_fs_chmod(NULL, &req, CONTROL_PATH, 0600, NULL);
+		uv_fs_req_cleanup(&req);
+	}
+#endif
+	if (!ret)
+		ret = uv_listen((uv_stream_t *) &listener, SOMAXCONN, on_connection);
+	if (ret)
+		log_fatal("Failed to take control commands on %s: %s", CONTROL_PATH, uv_strerror(ret))
+	log_info("Taking control commands on %s", CONTROL_PATH)
+}
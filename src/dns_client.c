@@ -5,14 +5,18 @@
 #include <stdlib.h>
 
 #include "../include/log.h"
+#include "../include/buffer_pool.h"
+#include "../include/send_pool.h"
 #include "../include/dns_parse.h"
 #include "../include/dns_print.h"
 #include "../include/query_pool.h"
+#include "../include/upstream.h"
+#include "../include/upstream_tcp.h"
 
-static uv_udp_t client_socket; ///< Socket for client communication with the remote server
-static struct sockaddr_in local_addr; ///< Local address
-static struct sockaddr send_addr; ///< Remote server address
-extern Query_Pool *qpool; ///< Query pool
+static _Thread_local uv_udp_t client_sockets[2][UPSTREAM_MAX_SOCKETS]; ///< Sockets for client communication with the remote servers, IPv4 and IPv6
+extern _Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+extern _Thread_local Buffer_Pool *bpool; ///< Receive buffer pool of the current worker
+extern _Thread_local Send_Pool *spool; ///< Send slot pool of the current worker
 
 /**
  * @brief Allocate space for the buffer
@@ -21,10 +25,8 @@ extern Query_Pool *qpool; ///< Query pool
  * @param buf Buffer to be allocated
  */
 static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-	buf->base = (char *) calloc(DNS_STRING_MAX_SIZE, sizeof(char));
-	if (!buf->base)
-		log_fatal("Memory allocation error")
-	buf->len = DNS_STRING_MAX_SIZE;
+	buf->base = bpool->alloc(bpool);
+	buf->len = bpool->buffer_size;
 }
 
 /**
@@ -37,27 +39,31 @@ static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *b
  */
 static void on_read(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
 	if (nread < 0) {
-		if (buf->base)
-			free(buf->base);
+		bpool->release(bpool, buf->base);
 		log_debug("Transmission error")
 		return;
 	}
 	if (nread == 0) {
-		if (buf->base)
-			free(buf->base);
+		bpool->release(bpool, buf->base);
+		return;
+	}
+	if (flags & UV_UDP_PARTIAL) {
+		bpool->release(bpool, buf->base);
+		log_error("Response larger than the UDP payload size dropped")
 		return;
 	}
-	log_info("Received message from server")
+	log_debug("Received message from server")
 	print_dns_string(buf->base, nread);
 	Dns_Msg *msg = (Dns_Msg *) calloc(1, sizeof(Dns_Msg));
 	if (!msg)
 		log_fatal("Memory allocation error")
-	string_to_dnsmsg(msg, buf->base);
-	print_dns_message(msg);
-	qpool->finish(qpool, msg);
+	if (string_to_dnsmsg_limit(msg, buf->base, nread)) {
+		print_dns_message(msg);
+		qpool->finish(qpool, msg, (uint8_t) (uintptr_t) handle->data, addr);
+	} else // The query waits on for another reply or its retransmission
+		log_error("Malformed response from server dropped")
 	destroy_dnsmsg(msg);
-	if (buf->base)
-		free(buf->base);
+	bpool->release(bpool, buf->base);
 }
 
 /**
@@ -66,50 +72,76 @@ static void on_read(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const
  * @param status Send status, indicating whether the send was successful
  */
 static void on_send(uv_udp_send_t *req, int status) {
-	free(*(char **) req->data);
-	free(req->data);
-	free(req);
+	((Send_Pool *) req->data)->release((Send_Pool *) req->data, (Send_Slot *) req);
 	if (status)
 		log_error("Send status error %d", status)
 }
 
 /**
- * @brief Initialize the DNS client
+ * @brief Initialize the DNS client and the remote servers of the worker
  * @param loop The libuv event loop
+ * @param worker_id Index of the worker owning the client, a custom client port is offset by it
+ *
+ * Each worker opens UPSTREAM_SOCKETS sockets per address family. Without a custom client port,
+ * the system binds them to random ephemeral ports.
  */
-void init_client(uv_loop_t *loop) {
+void init_client(uv_loop_t *loop, unsigned int worker_id) {
 	log_info("Starting client")
-	uv_udp_init(loop, &client_socket);
-	uv_ip4_addr("0.0.0.0", CLIENT_PORT, &local_addr);
-	uv_udp_bind(&client_socket, (const struct sockaddr *) &local_addr, UV_UDP_REUSEADDR);
-	uv_udp_set_broadcast(&client_socket, 1);
-	uv_ip4_addr(REMOTE_HOST, 53, (struct sockaddr_in *) &send_addr);
-	uv_udp_recv_start(&client_socket, alloc_buffer, on_read);
+	unsigned int count = init_upstreams(loop);
+	bool families[2] = {false, false};
+	for (unsigned int i = 0; i < count; ++i)
+		families[upstream_get(i)->addr.ss_family == AF_INET6] = true;
+	for (int v6 = 0; v6 < 2; ++v6) {
+		if (!families[v6])
+			continue;
+		for (int i = 0; i < UPSTREAM_SOCKETS; ++i) {
+			// Bind to the wildcard address of each family of the remote servers
+			struct sockaddr_storage local_addr;
+			parse_address(v6 ? "::" : "0.0.0.0",
+			              CLIENT_PORT ? CLIENT_PORT + (int) worker_id * UPSTREAM_SOCKETS + i : 0, &local_addr);
+			uv_udp_t *client_socket = &client_sockets[v6][i];
+			uv_udp_init(loop, client_socket);
+			client_socket->data = (void *) (uintptr_t) i;
+			uv_udp_bind(client_socket, (const struct sockaddr *) &local_addr,
+			            UV_UDP_REUSEADDR | (v6 ? UV_UDP_IPV6ONLY : 0));
+			uv_udp_set_broadcast(client_socket, 1);
+			uv_udp_recv_start(client_socket, alloc_buffer, on_read);
+		}
+	}
+	init_upstream_tcp(loop);
 }
 
 /**
- * @brief Send a DNS query message to the remote server
+ * @brief Send a DNS query message to a remote server
+ * @param up The remote server
+ * @param socket The upstream socket to send from, ignored with UPSTREAM_TCP set
  * @param msg The DNS message to be sent
+ *
+ * The query is serialized into a send slot and sent right away with uv_udp_try_send,
+ * the slot only goes through the libuv send queue when the socket would block.
+ * With UPSTREAM_TCP set, the query goes over the TCP connection pool instead.
+ * @return false if the query could not be sent or queued for sending
  */
-void send_to_remote(const Dns_Msg *msg) {
-	char *str = (char *) calloc(DNS_STRING_MAX_SIZE, sizeof(char));
-	if (!str)
-		log_fatal("Memory allocation error")
-	unsigned int len = dnsmsg_to_string(msg, str);
+bool send_to_remote(Upstream *up, uint8_t socket, const Dns_Msg *msg) {
+	if (UPSTREAM_TCP)
+		return send_to_remote_tcp(up, msg);
+	uv_udp_t *client_socket = &client_sockets[up->addr.ss_family == AF_INET6][socket];
+	Send_Slot *slot = spool->alloc(spool);
+	slot->len = dnsmsg_to_string(msg, slot->data);
+	uv_buf_t send_buf = uv_buf_init(slot->data, slot->len);
 
-	uv_udp_send_t *req = malloc(sizeof(uv_udp_send_t));
-	if (!req) {
-		log_fatal("Memory allocation error")
-		return;
-	}
-	uv_buf_t send_buf = uv_buf_init((char *) malloc(len), len);
-	memcpy(send_buf.base, str, len);
-	req->data = (char **) malloc(sizeof(char **));
-	*(char **) (req->data) = send_buf.base;
-
-	log_info("Sending message to server")
+	log_debug("Sending message to server")
 	print_dns_message(msg);
-	print_dns_string(send_buf.base, len);
-	uv_udp_send(req, &client_socket, &send_buf, 1, &send_addr, on_send);
-	free(str);
+	print_dns_string(slot->data, slot->len);
+	int ret = uv_udp_try_send(client_socket, &send_buf, 1, (const struct sockaddr *) &up->addr);
+	if (ret >= 0)
+		spool->release(spool, slot);
+	else if (ret == UV_EAGAIN)
+		uv_udp_send(&slot->req.udp, client_socket, &send_buf, 1, (const struct sockaddr *) &up->addr, on_send);
+	else {
+		log_error("Send status error %d", ret)
+		spool->release(spool, slot);
+		return false;
+	}
+	return true;
 }
\ No newline at end of file
@@ -37,62 +37,49 @@ static uint32_t read_uint32(const char *pstring, unsigned *offset) {
 
 /**
  * @brief Read a NAME field from a byte stream
- * @param pname The NAME field
+ * @param pname The NAME field, DNS_RR_NAME_MAX_SIZE long
  * @param pstring The start of the byte stream
  * @param offset The offset in the byte stream
- * @return The total length of the NAME field
+ * @param len The length of the byte stream
+ * @return The length of the NAME field in the byte stream, 0 if it runs past len or does not fit in pname
  * @note After reading, the offset increases to the position after the NAME field
  */
-static unsigned string_to_rrname(uint8_t *pname, const char *pstring, unsigned *offset) {
-	unsigned start_offset = *offset;
+static unsigned string_to_rrname(uint8_t *pname, const char *pstring, unsigned *offset, unsigned len) {
+	unsigned start_offset = *offset, pos = *offset, name_len = 0;
+	bool jumped = false;
 	while (true) {
-		if ((*(pstring + *offset) >> 6) & 0x3) { // RFC1035 4.1.4. Message compression
-			unsigned new_offset = read_uint16(pstring, offset) & 0x3fff;
-			return *offset - start_offset - 2 + string_to_rrname(pname, pstring, &new_offset);
+		if (pos >= len)
+			return 0;
+		uint8_t label = (uint8_t) pstring[pos];
+		if (label >> 6) { // RFC1035 4.1.4. Message compression
+			if (pos + 2 > len)
+				return 0;
+			unsigned pointer = pos;
+			unsigned new_offset = read_uint16(pstring, &pos) & 0x3fff;
+			if (!jumped) {
+				*offset = pos;
+				jumped = true;
+			}
+			if (new_offset >= pointer) // Only backwards, and the name grows at each label, so it cannot loop
+				return 0;
+			pos = new_offset;
+			continue;
 		}
-		if (!*(pstring + *offset)) {
-			++*offset;
-			*pname = 0;
+		++pos;
+		if (!label) {
+			pname[name_len] = 0;
+			if (!jumped)
+				*offset = pos;
 			return *offset - start_offset;
 		}
-		int cur_length = (int) *(pstring + *offset);
-		++*offset;
-		memcpy(pname, pstring + *offset, cur_length);
-		pname += cur_length;
-		*offset += cur_length;
-		*pname++ = '.';
+		if (pos + label > len || name_len + label + 2 > DNS_RR_NAME_MAX_SIZE)
+			return 0;
+		memcpy(pname + name_len, pstring + pos, label);
+		name_len += label;
+		pname[name_len++] = '.';
+		pos += label;
 	}
 }
-//static unsigned string_to_rrname(uint8_t *pname, const char *pstring, unsigned *offset) {
-//	unsigned start_offset = *offset;
-//	unsigned length = 0;
-//
-//	while (true) {
-//		// 检查是否是消息压缩，根据 RFC1035 4.1.4
-//		if ((*(pstring + *offset) >> 6) & 0x3) {
-//			unsigned new_offset = read_uint16(pstring, offset) & 0x3fff;
-//			unsigned temp_offset = *offset;
-//			*offset = new_offset;
-//			length += string_to_rrname(pname, pstring, offset);
-//			*offset = temp_offset;
-//			return length;
-//		}
-//
-//		// 检查是否到达 NAME 字段的结束
-//		if (!*(pstring + *offset)) {
-//			++*offset;
-//			*pname = 0;
-//			return *offset - start_offset;
-//		}
-//
-//		int cur_length = (int) *(pstring + *offset);
-//		++*offset;
-//		memcpy(pname, pstring + *offset, cur_length);
-//		pname += cur_length;
-//		*offset += cur_length;
-//		*pname++ = '.';
-//	}
-//}
 
 /**
  * @brief Read a Header Section from a byte stream
@@ -123,15 +110,21 @@ static void string_to_dnshead(Dns_Header *phead, const char *pstring, unsigned *
  * @param pque The Question Section
  * @param pstring The start of the byte stream
  * @param offset The offset in the byte stream
+ * @param len The length of the byte stream
+ * @return false if the Question Section runs past len
  * @note After reading, the offset increases to the position after the Question Section; space is allocated for the NAME field
  */
-static void string_to_dnsque(Dns_Que *pque, const char *pstring, unsigned *offset) {
+static bool string_to_dnsque(Dns_Que *pque, const char *pstring, unsigned *offset, unsigned len) {
 	pque->qname = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
-	if (!pque->qname)
+	if (!pque->qname) {
 		log_fatal("Memory allocation error")
-	string_to_rrname(pque->qname, pstring, offset);
+		return false;
+	}
+	if (!string_to_rrname(pque->qname, pstring, offset, len) || *offset + 4 > len)
+		return false;
 	pque->qtype = read_uint16(pstring, offset);
 	pque->qclass = read_uint16(pstring, offset);
+	return true;
 }
 
 /**
@@ -139,107 +132,148 @@ static void string_to_dnsque(Dns_Que *pque, const char *pstring, unsigned *offse
  * @param prr The Resource Record
  * @param pstring The start of the byte stream
  * @param offset The offset in the byte stream
+ * @param len The length of the byte stream
+ * @return false if the Resource Record runs past len
  * @note After reading, the offset increases to the position after the Resource Record; space is allocated for the NAME and RDATA fields
+ * @note The RDATA of CNAME, NS, MX and SOA holds the names as text, and its length is the length of that text
  */
-static void string_to_dnsrr(Dns_RR *prr, const char *pstring, unsigned *offset) {
+static bool string_to_dnsrr(Dns_RR *prr, const char *pstring, unsigned *offset, unsigned len) {
 	prr->name = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
-	if (!prr->name)
+	if (!prr->name) {
 		log_fatal("Memory allocation error")
-	string_to_rrname(prr->name, pstring, offset);
+		return false;
+	}
+	if (!string_to_rrname(prr->name, pstring, offset, len) || *offset + 10 > len)
+		return false;
 	prr->type = read_uint16(pstring, offset);
 	prr->class = read_uint16(pstring, offset);
 	prr->ttl = read_uint32(pstring, offset);
 	prr->rdlength = read_uint16(pstring, offset);
+	if (*offset + prr->rdlength > len)
+		return false;
 	if (prr->type == DNS_TYPE_CNAME || prr->type == DNS_TYPE_NS) // RDATA for CNAME and NS is a domain name
 	{
 		uint8_t *temp = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
-		if (!temp)
-			log_fatal("Memory allocation error")
-		prr->rdlength = string_to_rrname(temp, pstring, offset);
-		prr->rdata = (uint8_t *) calloc(prr->rdlength, sizeof(uint8_t));
-		if (!prr->rdata)
+		if (!temp) {
 			log_fatal("Memory allocation error")
-		memcpy(prr->rdata, temp, prr->rdlength);
-		free(temp);
+			return false;
+		}
+		if (!string_to_rrname(temp, pstring, offset, len)) {
+			free(temp);
+			return false;
+		}
+		prr->rdlength = strlen((const char *) temp) + 1;
+		prr->rdata = temp;
 	} else if (prr->type == DNS_TYPE_MX) // RFC1035 3.3.9. MX RDATA format
 	{
-		uint8_t *temp = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
-		if (!temp)
+		uint8_t *temp = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE + 2, sizeof(uint8_t));
+		if (!temp) {
 			log_fatal("Memory allocation error")
+			return false;
+		}
 		unsigned temp_offset = *offset + 2;
-		prr->rdlength = string_to_rrname(temp, pstring, &temp_offset);
-		prr->rdata = (uint8_t *) calloc(prr->rdlength + 2, sizeof(uint8_t));
-		if (!prr->rdata)
-			log_fatal("Memory allocation error")
-		memcpy(prr->rdata, pstring + *offset, 2);
-		memcpy(prr->rdata + 2, temp, prr->rdlength);
-		prr->rdlength += 2;
+		if (prr->rdlength < 2 || !string_to_rrname(temp + 2, pstring, &temp_offset, len)) {
+			free(temp);
+			return false;
+		}
+		memcpy(temp, pstring + *offset, 2);
+		prr->rdlength = strlen((const char *) temp + 2) + 3;
+		prr->rdata = temp;
 		*offset = temp_offset;
-		free(temp);
 	} else if (prr->type == DNS_TYPE_SOA) // RFC1035 3.3.13. SOA RDATA format
 	{
-		uint8_t *temp = (uint8_t *) calloc(DNS_RR_NAME_MAX_SIZE, sizeof(uint8_t));
+		uint8_t *temp = (uint8_t *) calloc(2 * DNS_RR_NAME_MAX_SIZE + 20, sizeof(uint8_t));
 		if (!temp) {
 			log_fatal("Memory allocation error")
-			return;
+			return false;
 		}
-		prr->rdlength = string_to_rrname(temp, pstring, offset);
-		prr->rdlength += string_to_rrname(temp + prr->rdlength, pstring, offset);
-		prr->rdata = (uint8_t *) calloc(prr->rdlength + 20, sizeof(uint8_t));
-		if (!prr->rdata)
-			log_fatal("Memory allocation error")
-		memcpy(prr->rdata, temp, prr->rdlength);
-		memcpy(prr->rdata + prr->rdlength, pstring + *offset, 20);
+		if (!string_to_rrname(temp, pstring, offset, len)) {
+			free(temp);
+			return false;
+		}
+		unsigned names = strlen((const char *) temp) + 1;
+		if (!string_to_rrname(temp + names, pstring, offset, len) || *offset + 20 > len) {
+			free(temp);
+			return false;
+		}
+		names += strlen((const char *) temp + names) + 1;
+		memcpy(temp + names, pstring + *offset, 20);
 		*offset += 20;
-		prr->rdlength += 20;
-		free(temp);
+		prr->rdlength = names + 20;
+		prr->rdata = temp;
 	} else {
 		prr->rdata = (uint8_t *) calloc(prr->rdlength, sizeof(uint8_t));
-		if (!prr->rdata)
+		if (!prr->rdata) {
 			log_fatal("Memory allocation error")
+			return false;
+		}
 		memcpy(prr->rdata, pstring + *offset, prr->rdlength);
 		*offset += prr->rdlength;
 	}
+	return true;
 }
 
 /**
- * @brief Convert a byte stream to a DNS message structure
+ * @brief Convert a byte stream of known length to a DNS message structure
  * @param pmsg The DNS message structure to populate
  * @param pstring The byte stream to read from
+ * @param len The length of the byte stream, nothing after it is read
+ * @return false if the message is malformed, the structure is then only fit to be released
  */
-void string_to_dnsmsg(Dns_Msg *pmsg, const char *pstring) {
+bool string_to_dnsmsg_limit(Dns_Msg *pmsg, const char *pstring, unsigned len) {
 	unsigned offset = 0;
 	pmsg->header = (Dns_Header *) calloc(1, sizeof(Dns_Header));
-	if (!pmsg->header)
+	if (!pmsg->header) {
 		log_fatal("Memory allocation error")
+		return false;
+	}
+	if (len < 12)
+		return false;
 	string_to_dnshead(pmsg->header, pstring, &offset);
 	Dns_Que *que_tail = NULL; // Tail pointer for the Question Section linked list
 	for (int i = 0; i < pmsg->header->qdcount; ++i) {
 		Dns_Que *temp = (Dns_Que *) calloc(1, sizeof(Dns_Que));
-		if (!temp)
+		if (!temp) {
 			log_fatal("Memory allocation error")
+			return false;
+		}
 		if (!que_tail) // First node in the linked list
 			pmsg->que = que_tail = temp;
 		else {
 			que_tail->next = temp;
 			que_tail = temp;
 		}
-		string_to_dnsque(que_tail, pstring, &offset);
+		if (!string_to_dnsque(que_tail, pstring, &offset, len))
+			return false;
 	}
 	int tot = pmsg->header->ancount + pmsg->header->nscount + pmsg->header->arcount;
 	Dns_RR *rr_tail = NULL; // Tail pointer for the Resource Record linked list
 	for (int i = 0; i < tot; ++i) {
 		Dns_RR *temp = (Dns_RR *) calloc(1, sizeof(Dns_RR));
-		if (!temp)
+		if (!temp) {
 			log_fatal("Memory allocation error")
+			return false;
+		}
 		if (!rr_tail) // First node in the linked list
 			pmsg->rr = rr_tail = temp;
 		else {
 			rr_tail->next = temp;
 			rr_tail = temp;
 		}
-		string_to_dnsrr(rr_tail, pstring, &offset);
+		if (!string_to_dnsrr(rr_tail, pstring, &offset, len))
+			return false;
 	}
+	return true;
+}
+
+/**
+ * @brief Convert a byte stream to a DNS message structure
+ * @param pmsg The DNS message structure to populate
+ * @param pstring The byte stream to read from, at least DNS_STRING_MAX_SIZE long
+ * @return false if the message is malformed, the structure is then only fit to be released
+ */
+bool string_to_dnsmsg(Dns_Msg *pmsg, const char *pstring) {
+	return string_to_dnsmsg_limit(pmsg, pstring, DNS_STRING_MAX_SIZE);
 }
 
 /**
@@ -356,12 +390,42 @@ static void dnsrr_to_string(const Dns_RR *prr, char *pstring, unsigned *offset)
 }
 
 /**
- * @brief Convert a DNS message structure to a byte stream
+ * @brief Length of a NAME field once written to a byte stream
+ * @param pname The NAME field
+ * @return The length in bytes
+ */
+static unsigned rrname_length(const uint8_t *pname) {
+	return strlen((const char *) pname) + 1;
+}
+
+/**
+ * @brief Length of a Resource Record once written to a byte stream
+ * @param prr The Resource Record
+ * @return The length in bytes
+ */
+static unsigned dnsrr_length(const Dns_RR *prr) {
+	unsigned length = rrname_length(prr->name) + 10;
+	if (prr->type == DNS_TYPE_CNAME || prr->type == DNS_TYPE_NS)
+		return length + rrname_length(prr->rdata);
+	if (prr->type == DNS_TYPE_MX)
+		return length + 2 + rrname_length(prr->rdata + 2);
+	if (prr->type == DNS_TYPE_SOA)
+		return length + rrname_length(prr->rdata) +
+		       rrname_length(prr->rdata + strlen((const char *) prr->rdata) + 1) + 20;
+	return length + prr->rdlength;
+}
+
+/**
+ * @brief Convert a DNS message structure to a byte stream of limited length
  * @param pmsg The DNS message structure to convert
  * @param pstring The byte stream to write to
+ * @param limit The largest length of the byte stream
  * @return The total length of the byte stream
+ * @note Resource Records that do not fit are left out, the TC bit is set and the counts are adjusted (RFC 2181 9.)
+ * @note Room is kept for the OPT pseudo-RR, which a truncated response still carries (RFC 6891 7.), it is written
+ * last in the Additional Section
  */
-unsigned dnsmsg_to_string(const Dns_Msg *pmsg, char *pstring) {
+unsigned dnsmsg_to_string_limit(const Dns_Msg *pmsg, char *pstring, unsigned limit) {
 	unsigned offset = 0;
 	dnshead_to_string(pmsg->header, pstring, &offset);
 	Dns_Que *pque = pmsg->que;
@@ -369,15 +433,51 @@ unsigned dnsmsg_to_string(const Dns_Msg *pmsg, char *pstring) {
 		dnsque_to_string(pque, pstring, &offset);
 		pque = pque->next;
 	}
-	int tot = pmsg->header->ancount + pmsg->header->nscount + pmsg->header->arcount;
-	Dns_RR *prr = pmsg->rr;
-	for (int i = 0; i < tot; ++i) {
+	int answers = pmsg->header->ancount, authorities = pmsg->header->nscount;
+	int tot = answers + authorities + pmsg->header->arcount;
+	const Dns_RR *opt = NULL, *prr = pmsg->rr;
+	for (int i = 0; i < tot; ++i, prr = prr->next)
+		if (i >= answers + authorities && prr->type == DNS_TYPE_OPT)
+			opt = prr;
+	unsigned reserve = opt ? dnsrr_length(opt) : 0;
+
+	Dns_Header header = *pmsg->header;
+	header.ancount = header.nscount = header.arcount = 0;
+	prr = pmsg->rr;
+	for (int i = 0; i < tot; ++i, prr = prr->next) {
+		if (prr == opt)
+			continue;
+		if (offset + dnsrr_length(prr) + reserve > limit) { // Truncate
+			header.tc = 1;
+			break;
+		}
 		dnsrr_to_string(prr, pstring, &offset);
-		prr = prr->next;
+		if (i < answers)
+			++header.ancount;
+		else if (i < answers + authorities)
+			++header.nscount;
+		else
+			++header.arcount;
+	}
+	if (opt && offset + reserve <= limit) {
+		dnsrr_to_string(opt, pstring, &offset);
+		++header.arcount;
 	}
+	unsigned head_offset = 0;
+	dnshead_to_string(&header, pstring, &head_offset);
 	return offset;
 }
 
+/**
+ * @brief Convert a DNS message structure to a byte stream
+ * @param pmsg The DNS message structure to convert
+ * @param pstring The byte stream to write to, at least DNS_STRING_MAX_SIZE long
+ * @return The total length of the byte stream
+ */
+unsigned dnsmsg_to_string(const Dns_Msg *pmsg, char *pstring) {
+	return dnsmsg_to_string_limit(pmsg, pstring, DNS_STRING_MAX_SIZE);
+}
+
 /**
  * @brief Release memory allocated for a Resource Record
  * @param prr The Resource Record to release
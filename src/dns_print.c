@@ -2,27 +2,50 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../include/log.h"
 
+#define PRINT_BUFFER_SIZE (DNS_STRING_MAX_SIZE * 4) ///< Room for the dump of the largest message
+
+static _Thread_local char print_buffer[PRINT_BUFFER_SIZE]; ///< Dump being built by the current thread
+static _Thread_local size_t print_len; ///< Length of the dump
+
+/**
+ * @brief Append formatted text to the dump of the current thread, text past the end of the buffer is cut
+ * @param format Format of the text, as printf
+ */
+static __attribute__((format(printf, 1, 2))) void print_out(const char *format, ...) {
+	if (print_len >= PRINT_BUFFER_SIZE - 1)
+		return;
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(print_buffer + print_len, PRINT_BUFFER_SIZE - print_len, format, args);
+	va_end(args);
+	if (len > 0)
+		print_len += (size_t) len < PRINT_BUFFER_SIZE - print_len ? (size_t) len : PRINT_BUFFER_SIZE - 1 - print_len;
+}
+
 /**
  * @brief Print DNS message byte stream
  * @param pstring The byte stream
  * @param len The length of the byte stream
  */
 void print_dns_string(const char *pstring, unsigned int len) {
-	if (!(LOG_MASK & 1)) return;
+	if (LOG_MIN_LEVEL > LOG_LEVEL_DEBUG || !(LOG_MASK & 1)) return;
 	log_debug("DNS message byte stream:")
+	print_len = 0;
 	for (unsigned int i = 0; i < len; i++) {
 		if (i % 16 == 0) {
-			if (i) fprintf(log_file, "\n");
-			fprintf(log_file, "%04x ", i);
+			if (i) print_out("\n");
+			print_out("%04x ", i);
 		}
-		fprintf(log_file, "%02hhx ", pstring[i]);
+		print_out("%02hhx ", pstring[i]);
 	}
-	fprintf(log_file, "\n");
+	print_out("\n");
+	log_raw(print_buffer, print_len);
 }
 
 /**
@@ -30,7 +53,7 @@ void print_dns_string(const char *pstring, unsigned int len) {
  * @param rdata The rdata field
  */
 static void print_rr_A(const uint8_t *rdata) {
-	fprintf(log_file, "%d.%d.%d.%d", rdata[0], rdata[1], rdata[2], rdata[3]);
+	print_out("%d.%d.%d.%d", rdata[0], rdata[1], rdata[2], rdata[3]);
 }
 
 /**
@@ -39,8 +62,8 @@ static void print_rr_A(const uint8_t *rdata) {
  */
 static void print_rr_AAAA(const uint8_t *rdata) {
 	for (int i = 0; i < 16; i += 2) {
-		if (i) fprintf(log_file, ":");
-		fprintf(log_file, "%x", (rdata[i] << 8) + rdata[i + 1]);
+		if (i) print_out(":");
+		print_out("%x", (rdata[i] << 8) + rdata[i + 1]);
 	}
 }
 
@@ -49,7 +72,7 @@ static void print_rr_AAAA(const uint8_t *rdata) {
  * @param rdata The rdata field
  */
 static void print_rr_CNAME(const uint8_t *rdata) {
-	fprintf(log_file, "%s", rdata);
+	print_out("%s", rdata);
 }
 
 /**
@@ -59,14 +82,14 @@ static void print_rr_CNAME(const uint8_t *rdata) {
  */
 static void print_rr_SOA(uint16_t rdlength, const uint8_t *rdata) {
 	print_rr_CNAME(rdata);
-	fprintf(log_file, " ");
+	print_out(" ");
 	print_rr_CNAME(rdata + strlen((char *) rdata) + 1);
-	fprintf(log_file, " ");
-	fprintf(log_file, "%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 20)));
-	fprintf(log_file, "%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 16)));
-	fprintf(log_file, "%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 12)));
-	fprintf(log_file, "%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 8)));
-	fprintf(log_file, "%" PRIu32, ntohl(*(uint32_t *) (rdata + rdlength - 4)));
+	print_out(" ");
+	print_out("%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 20)));
+	print_out("%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 16)));
+	print_out("%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 12)));
+	print_out("%" PRIu32 " ", ntohl(*(uint32_t *) (rdata + rdlength - 8)));
+	print_out("%" PRIu32, ntohl(*(uint32_t *) (rdata + rdlength - 4)));
 }
 
 /**
@@ -74,7 +97,7 @@ static void print_rr_SOA(uint16_t rdlength, const uint8_t *rdata) {
  * @param rdata The rdata field
  */
 static void print_rr_MX(const uint8_t *rdata) {
-	fprintf(log_file, "%" PRIu32 " ", ntohl(*(uint32_t *) rdata));
+	print_out("%" PRIu32 " ", ntohl(*(uint32_t *) rdata));
 	print_rr_CNAME(rdata + 2);
 }
 
@@ -83,18 +106,18 @@ static void print_rr_MX(const uint8_t *rdata) {
  * @param phead The Header Section
  */
 static void print_dns_header(const Dns_Header *phead) {
-	fprintf(log_file, "ID = 0x%04" PRIx16 "\n", phead->id);
-	fprintf(log_file, "QR = %" PRIu8 "\n", phead->qr);
-	fprintf(log_file, "OPCODE = %" PRIu8 "\n", phead->opcode);
-	fprintf(log_file, "AA = %" PRIu8 "\n", phead->aa);
-	fprintf(log_file, "TC = %" PRIu8 "\n", phead->tc);
-	fprintf(log_file, "RD = %" PRIu8 "\n", phead->rd);
-	fprintf(log_file, "RA = %" PRIu8 "\n", phead->ra);
-	fprintf(log_file, "RCODE = %" PRIu16 "\n", phead->rcode);
-	fprintf(log_file, "QDCOUNT = %" PRIu16 "\n", phead->qdcount);
-	fprintf(log_file, "ANCOUNT = %" PRIu16 "\n", phead->ancount);
-	fprintf(log_file, "NSCOUNT = %" PRIu16 "\n", phead->nscount);
-	fprintf(log_file, "ARCOUNT = %" PRIu16 "\n", phead->arcount);
+	print_out("ID = 0x%04" PRIx16 "\n", phead->id);
+	print_out("QR = %" PRIu8 "\n", phead->qr);
+	print_out("OPCODE = %" PRIu8 "\n", phead->opcode);
+	print_out("AA = %" PRIu8 "\n", phead->aa);
+	print_out("TC = %" PRIu8 "\n", phead->tc);
+	print_out("RD = %" PRIu8 "\n", phead->rd);
+	print_out("RA = %" PRIu8 "\n", phead->ra);
+	print_out("RCODE = %" PRIu16 "\n", phead->rcode);
+	print_out("QDCOUNT = %" PRIu16 "\n", phead->qdcount);
+	print_out("ANCOUNT = %" PRIu16 "\n", phead->ancount);
+	print_out("NSCOUNT = %" PRIu16 "\n", phead->nscount);
+	print_out("ARCOUNT = %" PRIu16 "\n", phead->arcount);
 }
 
 /**
@@ -102,9 +125,9 @@ static void print_dns_header(const Dns_Header *phead) {
  * @param pque The Question Section
  */
 static void print_dns_question(const Dns_Que *pque) {
-	fprintf(log_file, "QNAME = %s\n", pque->qname);
-	fprintf(log_file, "QTYPE = %" PRIu16 "\n", pque->qtype);
-	fprintf(log_file, "QCLASS = %" PRIu16 "\n", pque->qclass);
+	print_out("QNAME = %s\n", pque->qname);
+	print_out("QTYPE = %" PRIu16 "\n", pque->qtype);
+	print_out("QCLASS = %" PRIu16 "\n", pque->qclass);
 }
 
 /**
@@ -112,12 +135,12 @@ static void print_dns_question(const Dns_Que *pque) {
  * @param prr The Resource Record
  */
 static void print_dns_rr(const Dns_RR *prr) {
-	fprintf(log_file, "NAME = %s\n", prr->name);
-	fprintf(log_file, "TYPE = %" PRIu16 "\n", prr->type);
-	fprintf(log_file, "CLASS = %" PRIu16 "\n", prr->class);
-	fprintf(log_file, "TTL = %" PRIu32 "\n", prr->ttl);
-	fprintf(log_file, "RDLENGTH = %" PRIu16 "\n", prr->rdlength);
-	fprintf(log_file, "RDATA = ");
+	print_out("NAME = %s\n", prr->name);
+	print_out("TYPE = %" PRIu16 "\n", prr->type);
+	print_out("CLASS = %" PRIu16 "\n", prr->class);
+	print_out("TTL = %" PRIu32 "\n", prr->ttl);
+	print_out("RDLENGTH = %" PRIu16 "\n", prr->rdlength);
+	print_out("RDATA = ");
 	if (prr->type == DNS_TYPE_A)
 		print_rr_A(prr->rdata);
 	else if (prr->type == DNS_TYPE_CNAME || prr->type == DNS_TYPE_NS)
@@ -130,8 +153,8 @@ static void print_dns_rr(const Dns_RR *prr) {
 		print_rr_SOA(prr->rdlength, prr->rdata);
 	else
 		for (int i = 0; i < prr->rdlength; ++i)
-			fprintf(log_file, "%" PRIu8, *(prr->rdata + i));
-	fprintf(log_file, "\n");
+			print_out("%" PRIu8, *(prr->rdata + i));
+	print_out("\n");
 }
 
 /**
@@ -139,30 +162,32 @@ static void print_dns_rr(const Dns_RR *prr) {
  * @param pmsg The DNS message
  */
 void print_dns_message(const Dns_Msg *pmsg) {
-	if (!(LOG_MASK & 1)) return;
+	if (LOG_MIN_LEVEL > LOG_LEVEL_DEBUG || !(LOG_MASK & 1)) return;
 	log_debug("DNS message content:")
-	fprintf(log_file, "=======Header==========\n");
+	print_len = 0;
+	print_out("=======Header==========\n");
 	print_dns_header(pmsg->header);
-	fprintf(log_file, "\n");
-	fprintf(log_file, "=======Question========\n");
+	print_out("\n");
+	print_out("=======Question========\n");
 	for (Dns_Que *pque = pmsg->que; pque; pque = pque->next) {
 		print_dns_question(pque);
-		fprintf(log_file, "\n");
+		print_out("\n");
 	}
 	Dns_RR *prr = pmsg->rr;
-	fprintf(log_file, "=======Answer==========\n");
+	print_out("=======Answer==========\n");
 	for (int i = 0; i < pmsg->header->ancount; ++i, prr = prr->next) {
 		print_dns_rr(prr);
-		fprintf(log_file, "\n");
+		print_out("\n");
 	}
-	fprintf(log_file, "=======Authority=======\n");
+	print_out("=======Authority=======\n");
 	for (int i = 0; i < pmsg->header->nscount; ++i, prr = prr->next) {
 		print_dns_rr(prr);
-		fprintf(log_file, "\n");
+		print_out("\n");
 	}
-	fprintf(log_file, "=======Additional======\n");
+	print_out("=======Additional======\n");
 	for (int i = 0; i < pmsg->header->arcount; ++i, prr = prr->next) {
 		print_dns_rr(prr);
-		fprintf(log_file, "\n");
+		print_out("\n");
 	}
+	log_raw(print_buffer, print_len);
 }
\ No newline at end of file
@@ -1,15 +1,50 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg
+#endif
+
 #include "../include/dns_server.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
 
+#include "../include/config.h"
 #include "../include/log.h"
+#include "../include/buffer_pool.h"
+#include "../include/send_pool.h"
 #include "../include/dns_parse.h"
 #include "../include/dns_print.h"
+#include "../include/heavy_hitters.h"
+#include "../include/metrics.h"
+#include "../include/pipeline.h"
+#include "../include/query_log.h"
 #include "../include/query_pool.h"
+#include "../include/rate_limit.h"
+#include "../include/trace.h"
+
+/// Socket listening on one of the configured addresses
+typedef struct udp_listener {
+	uv_udp_t socket; ///< Socket for server communication with local clients
+	Send_Slot * send_batch[SERVER_BATCH_SIZE]; ///< Responses produced in the current loop iteration
+	unsigned int send_count; ///< Number of responses in send_batch
+} Udp_Listener;
 
-static uv_udp_t server_socket; ///< Socket for server communication with local clients
-static struct sockaddr_in recv_addr; ///< Address for receiving DNS query messages
-extern Query_Pool *qpool; ///< Query pool
+static _Thread_local Udp_Listener listeners[LISTEN_MAX_ADDRESSES]; ///< Listening sockets of the worker
+static _Thread_local char *recv_slab; ///< Receive buffer split by libuv into SERVER_BATCH_SIZE datagram slots, shared by the listeners
+static _Thread_local unsigned int recv_batch; ///< Number of datagrams received by the current receive system call
+static _Thread_local uv_check_t flush_check; ///< Flushes send_batch after the I/O callbacks of each loop iteration
+static _Thread_local uv_idle_t flush_idle; ///< Keeps the loop from blocking while send_batch is not empty
+extern _Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+extern _Thread_local Buffer_Pool *bpool; ///< Receive buffer pool of the current worker
+extern _Thread_local Send_Pool *spool; ///< Send slot pool of the current worker
+extern _Thread_local Rate_Limiter *rrl; ///< Response rate limiter of the current worker, NULL if RRL_RATE is 0
+extern _Thread_local Pipeline *pipeline; ///< Parse workers of the current worker, NULL if PIPELINE_WORKERS is 0
 
 /**
  * @brief Allocate space for the buffer
@@ -17,13 +52,27 @@ extern Query_Pool *qpool; ///< Query pool
  * @param suggested_size Suggested buffer size
  * @param buf Buffer to be allocated
  *
- * Allocates a buffer of fixed size DNS_STRING_MAX_SIZE for receiving DNS query messages from local clients.
+ * Hands out the preallocated receive slab; libuv splits it into one slot per datagram when receiving with recvmmsg.
+ * The datagrams are processed before the next receive, so the slab is reused without being freed.
+ * Without recvmmsg a single buffer is taken from the buffer pool instead.
  */
 static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-	buf->base = (char *) calloc(DNS_STRING_MAX_SIZE, sizeof(char));
-	if (!buf->base)
-		log_fatal("Memory allocation error")
-	buf->len = DNS_STRING_MAX_SIZE;
+	if (uv_udp_using_recvmmsg((uv_udp_t *) handle)) {
+		buf->base = recv_slab;
+		buf->len = SERVER_BATCH_SIZE * UDP_DGRAM_MAX_SIZE;
+	} else {
+		buf->base = bpool->alloc(bpool);
+		buf->len = bpool->buffer_size;
+	}
+}
+
+/**
+ * @brief Return a receive buffer unless it is a slot of the receive slab
+ * @param buf The buffer
+ */
+static void release_buffer(const uv_buf_t *buf) {
+	if (buf->base < recv_slab || buf->base >= recv_slab + SERVER_BATCH_SIZE * UDP_DGRAM_MAX_SIZE)
+		bpool->release(bpool, buf->base);
 }
 
 /**
@@ -32,13 +81,156 @@ static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *b
  * @param status Send status, indicating whether the send was successful
  */
 static void on_send(uv_udp_send_t *req, int status) {
-	free(*(char **) req->data);
-	free(req->data);
-	free(req);
+	((Send_Pool *) req->data)->release((Send_Pool *) req->data, (Send_Slot *) req);
 	if (status)
 		log_error("Send status error %d", status)
 }
 
+/**
+ * @brief Hand a response to the libuv send queue
+ * @param listener The listener sending the response
+ * @param slot The send slot of the response, released once the send completes
+ *
+ * Used when the socket would block.
+ */
+static void queue_send(Udp_Listener *listener, Send_Slot *slot) {
+	uv_buf_t send_buf = uv_buf_init(slot->data, slot->len);
+	metrics_add(tx_queued, 1);
+	uv_udp_send(&slot->req.udp, &listener->socket, &send_buf, 1, (const struct sockaddr *) &slot->addr, on_send);
+}
+
+/**
+ * @brief Send all responses in the send batch of a listener
+ * @param listener The listener
+ *
+ * On Linux the batch goes out with sendmmsg, elsewhere one uv_udp_try_send per response.
+ * Responses that would block are handed to the libuv send queue.
+ */
+static void flush_sends(Udp_Listener *listener) {
+	Send_Slot **send_batch = listener->send_batch;
+	unsigned int send_count = listener->send_count;
+	unsigned int sent = 0;
+	if (uv_udp_get_send_queue_count(&listener->socket) == 0) { // Keep the order of responses already queued
+#ifdef __linux__
+		uv_os_fd_t fd;
+		if (uv_fileno((uv_handle_t *) &listener->socket, &fd) == 0) {
+			struct mmsghdr msgs[SERVER_BATCH_SIZE];
+			struct iovec iovs[SERVER_BATCH_SIZE];
+			memset(msgs, 0, sizeof(struct mmsghdr) * send_count);
+			for (unsigned int i = 0; i < send_count; ++i) {
+				iovs[i].iov_base = send_batch[i]->data;
+				iovs[i].iov_len = send_batch[i]->len;
+				msgs[i].msg_hdr.msg_name = &send_batch[i]->addr;
+				msgs[i].msg_hdr.msg_namelen = send_batch[i]->addr.ss_family == AF_INET6 ?
+				                              sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			while (sent < send_count) {
+				int ret = sendmmsg(fd, msgs + sent, send_count - sent, 0);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+						log_error("sendmmsg error %d", errno)
+					break;
+				}
+				metrics_add(tx_syscalls, 1);
+				metrics_add(tx_packets, ret);
+				metrics_record_batch(metrics.tx_batches, ret);
+				for (int i = 0; i < ret; ++i)
+					spool->release(spool, send_batch[sent++]);
+			}
+		}
+#else
+		for (; sent < send_count; ++sent) {
+			uv_buf_t buf = uv_buf_init(send_batch[sent]->data, send_batch[sent]->len);
+			int ret = uv_udp_try_send(&listener->socket, &buf, 1, (const struct sockaddr *) &send_batch[sent]->addr);
+			if (ret < 0)
+				break;
+			metrics_add(tx_syscalls, 1);
+			metrics_add(tx_packets, 1);
+			metrics_record_batch(metrics.tx_batches, 1);
+			spool->release(spool, send_batch[sent]);
+		}
+#endif
+	}
+	for (; sent < send_count; ++sent)
+		queue_send(listener, send_batch[sent]);
+	listener->send_count = 0;
+}
+
+/**
+ * @brief Callback function run after the I/O callbacks of each loop iteration
+ * @param handle Check handle
+ */
+static void on_check(uv_check_t *handle) {
+	for (int i = 0; i < LISTEN_COUNT; ++i)
+		if (listeners[i].send_count)
+			flush_sends(&listeners[i]);
+	uv_idle_stop(&flush_idle);
+	if (pipeline)
+		pipeline->flush(pipeline);
+}
+
+/**
+ * @brief Callback function of the idle handle, it only exists to make the loop poll without blocking
+ * @param handle Idle handle
+ */
+static void on_idle(uv_idle_t *handle) {
+}
+
+/**
+ * @brief Take a send slot for a response and add it to the send batch of a listener
+ * @param listener The listener
+ * @param addr The address of the local client
+ * @return The send slot, its data and length are left to the caller
+ */
+static Send_Slot *batch_slot(Udp_Listener *listener, const struct sockaddr *addr) {
+	if (listener->send_count == SERVER_BATCH_SIZE)
+		flush_sends(listener);
+	Send_Slot *slot = spool->alloc(spool);
+	memcpy(&slot->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	listener->send_batch[listener->send_count++] = slot;
+	uv_idle_start(&flush_idle, on_idle);
+	return slot;
+}
+
+/**
+ * @brief Answer a rate limited query with a truncated response, so that a real client retries over TCP
+ * @param listener The listener the query came in on
+ * @param addr The address of the client
+ * @param data The query message
+ * @param len Length of the query message
+ *
+ * The response is the header and the first question copied from the wire, without parsing the query any further.
+ * Responses and malformed queries are dropped instead.
+ */
+static void send_truncated(Udp_Listener *listener, const struct sockaddr *addr, const uint8_t *data, size_t len) {
+	if (len < 12 || (data[2] & 0x80) || !(data[4] | data[5])) // Not a query with a question
+		return;
+	size_t end = 12;
+	while (end < len && data[end] && (data[end] & 0xc0) != 0xc0) {
+		if (data[end] & 0xc0) // Reserved label type, a plain label has at most 63 bytes
+			return;
+		end += data[end] + 1;
+		if (end - 12 >= DNS_NAME_WIRE_MAX) // No room left for the root label
+			return;
+	}
+	end += end < len && data[end] ? 2 : 1; // Compression pointer or root label
+	end += 4; // Type and class
+	if (end > len || end > DNS_STRING_MAX_SIZE)
+		return;
+	Send_Slot *slot = batch_slot(listener, addr);
+	memcpy(slot->data, data, end);
+	slot->data[2] = (char) ((data[2] & 0x79) | 0x82); // QR and TC set, AA cleared, opcode and RD kept
+	slot->data[3] = (char) 0x80; // RA set, rcode NOERROR
+	memset(slot->data + 4, 0, 8);
+	slot->data[5] = 1; // Only the first question
+	slot->len = (unsigned int) end;
+	query_log_unparsed(QUERY_LOG_RESPONSE, addr, data, len, QUERY_LOG_RRL_SLIP);
+}
+
 /**
  * @brief Callback function for receiving query messages from local clients
  * @param handle Query handle
@@ -48,71 +240,167 @@ static void on_send(uv_udp_send_t *req, int status) {
  * @param flags Flags indicating special conditions for the received data
  */
 static void on_read(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+	if (flags & UV_UDP_MMSG_FREE) { // End of a recvmmsg batch
+		if (recv_batch) {
+			metrics_add(rx_syscalls, 1);
+			metrics_record_batch(metrics.rx_batches, recv_batch);
+		}
+		recv_batch = 0;
+		return;
+	}
 	if (nread < 0) {
-		if (buf->base)
-			free(buf->base);
+		release_buffer(buf);
 		log_debug("Transmission error")
 		return;
 	}
-	if (nread == 0) {
-		if (buf->base)
-			free(buf->base);
+	if (nread == 0 || (flags & UV_UDP_PARTIAL)) {
+		release_buffer(buf);
 		return;
 	}
+	metrics_add(rx_packets, 1);
+	if (flags & UV_UDP_MMSG_CHUNK)
+		++recv_batch;
+	else { // Received with a plain recvmsg
+		metrics_add(rx_syscalls, 1);
+		metrics_record_batch(metrics.rx_batches, 1);
+	}
+	heavy_hitters_client(addr);
+	if (rrl) { // Rate limit before the query is parsed
+		Rrl_Verdict verdict = rrl->check(rrl, addr);
+		if (verdict != RRL_PASS) {
+			if (verdict == RRL_TRUNCATE) {
+				metrics_add(rrl_truncated, 1);
+				send_truncated((Udp_Listener *) handle, addr, (const uint8_t *) buf->base, nread);
+			} else {
+				metrics_add(rrl_dropped, 1);
+				query_log_unparsed(QUERY_LOG_DROP, addr, (const uint8_t *) buf->base, nread, QUERY_LOG_RRL_DROP);
+			}
+			release_buffer(buf);
+			return;
+		}
+	}
 	log_debug("Received DNS query message from local client")
+	if (pipeline) { // Parsed, looked up and answered by a parse worker
+		if (!pipeline->submit(pipeline, handle, addr, buf->base, nread)) {
+			metrics_add(pipeline_dropped, 1);
+			query_log_unparsed(QUERY_LOG_DROP, addr, (const uint8_t *) buf->base, nread, QUERY_LOG_BACKLOG);
+		}
+		release_buffer(buf);
+		return;
+	}
 	print_dns_string(buf->base, nread);
 	Dns_Msg *msg = (Dns_Msg *) calloc(1, sizeof(Dns_Msg));
 	if (!msg)
 		log_fatal("Memory allocation error")
-	string_to_dnsmsg(msg, buf->base); // Convert byte sequence to structure
+	Trace trace;
+	trace_begin(&trace);
+	if (!string_to_dnsmsg_limit(msg, buf->base, nread)) { // Convert byte sequence to structure
+		log_debug("Malformed DNS query dropped")
+		trace_current = NULL;
+		destroy_dnsmsg(msg);
+		release_buffer(buf);
+		return;
+	}
+	trace_mark(TRACE_PARSED)
+	trace_question(msg);
 	print_dns_message(msg);
 
-	if (qpool->full(qpool)) {
-		log_error("Query pool full")
-	} else
-		qpool->insert(qpool, addr, msg); // Add DNS query to the query pool
+	qpool->insert(qpool, addr, handle, NULL, msg); // Add DNS query to the query pool
+	trace_current = NULL;
 	destroy_dnsmsg(msg);
-	if (buf->base)
-		free(buf->base);
+	release_buffer(buf);
+}
+
+/**
+ * @brief Let every worker bind its own listening socket to the same port
+ * @param handle The socket, already initialized but not bound
+ *
+ * With SO_REUSEPORT the kernel spreads the clients across the sockets of the workers.
+ */
+void set_reuseport(uv_handle_t *handle) {
+#ifdef SO_REUSEPORT
+	uv_os_fd_t fd;
+	int on = 1;
+	if (uv_fileno(handle, &fd) || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+		log_error("Failed to set SO_REUSEPORT")
+#else
+	if (THREAD_COUNT > 1)
+		log_fatal("Multiple worker threads need SO_REUSEPORT, which is not supported on this platform")
+#endif
 }
 
 /**
  * @brief Initialize the DNS server
+ * Binds one socket to each address in LISTEN_ADDRESSES, addresses that cannot be bound are skipped.
  * @param loop The libuv event loop
  */
 void init_server(uv_loop_t *loop) {
 	log_info("Starting server")
-	uv_udp_init(loop, &server_socket); // Bind server_socket to the event loop
-	uv_ip4_addr("0.0.0.0", 53, &recv_addr); // Initialize recv_addr to 0.0.0.0:53
-	uv_udp_bind(&server_socket, (struct sockaddr *) &recv_addr, UV_UDP_REUSEADDR);
-	uv_udp_recv_start(&server_socket, alloc_buffer,
-	                  on_read); // On receiving DNS query messages, allocate buffer and call callback function
+	recv_slab = (char *) malloc(SERVER_BATCH_SIZE * UDP_DGRAM_MAX_SIZE);
+	if (!recv_slab)
+		log_fatal("Memory allocation error")
+	int bound = 0;
+	for (int i = 0; i < LISTEN_COUNT; ++i) {
+		struct sockaddr_storage recv_addr; // Address for receiving DNS query messages
+		parse_address(LISTEN_ADDRESSES[i], 53, &recv_addr);
+		Udp_Listener *listener = &listeners[i];
+		if (uv_udp_init_ex(loop, &listener->socket, recv_addr.ss_family | UV_UDP_RECVMMSG)) {
+			log_error("Failed to create the server socket for %s", LISTEN_ADDRESSES[i])
+			continue;
+		}
+		set_reuseport((uv_handle_t *) &listener->socket);
+		// IPv6 sockets only take IPv6 clients so that 0.0.0.0 and :: can both be bound
+		if (uv_udp_bind(&listener->socket, (struct sockaddr *) &recv_addr,
+		                UV_UDP_REUSEADDR | (recv_addr.ss_family == AF_INET6 ? UV_UDP_IPV6ONLY : 0))) {
+			log_error("Failed to bind the server socket to %s", LISTEN_ADDRESSES[i])
+			uv_close((uv_handle_t *) &listener->socket, NULL);
+			continue;
+		}
+		uv_udp_recv_start(&listener->socket, alloc_buffer,
+		                  on_read); // On receiving DNS query messages, allocate buffer and call callback function
+		++bound;
+	}
+	if (!bound)
+		log_fatal("Failed to bind the server socket")
+	uv_check_init(loop, &flush_check);
+	uv_check_start(&flush_check, on_check);
+	uv_unref((uv_handle_t *) &flush_check);
+	uv_idle_init(loop, &flush_idle);
 }
 
 /**
  * @brief Send a DNS response message to local clients
+ * @param socket The listening socket the query came in on
  * @param addr The address of the local client
  * @param msg The DNS message to be sent
+ * @param max_len The largest UDP payload the client accepts, the response is truncated to fit
+ *
+ * The response is serialized into a send slot of the send batch, which is flushed at the end of the loop iteration.
  */
-void send_to_local(const struct sockaddr *addr, const Dns_Msg *msg) {
-	log_info("Sending DNS response message to local client")
+void send_to_local(uv_udp_t *socket, const struct sockaddr *addr, const Dns_Msg *msg, unsigned int max_len) {
+	log_debug("Sending DNS response message to local client")
 	print_dns_message(msg);
-	char *str = (char *) calloc(DNS_STRING_MAX_SIZE, sizeof(char)); // Convert DNS structure to byte stream
-	if (!str)
-		log_fatal("Memory allocation error")
-	unsigned int len = dnsmsg_to_string(msg, str);
-	uv_udp_send_t *req = malloc(sizeof(uv_udp_send_t));
-	if (!req) {
-		log_fatal("Memory allocation error")
-		return;
-	}
-
-	uv_buf_t send_buf = uv_buf_init((char *) malloc(len), len);
-	memcpy(send_buf.base, str, len); // Store byte sequence in send buffer
-	req->data = (char **) malloc(sizeof(char **));
-	*(char **) (req->data) = send_buf.base;
-	print_dns_string(send_buf.base, len);
+	Send_Slot *slot = batch_slot((Udp_Listener *) socket, addr); // The socket is the first member of its listener
+	slot->len = dnsmsg_to_string_limit(msg, slot->data, max_len); // Convert DNS structure to byte stream
+	trace_mark(TRACE_SERIALIZED)
+	trace_attach(&slot->trace);
+	print_dns_string(slot->data, slot->len);
+}
 
-	uv_udp_send(req, &server_socket, &send_buf, 1, addr, on_send);
-	free(str);
-}
\ No newline at end of file
+/**
+ * @brief Send a serialized DNS response message to local clients
+ * @param socket The listening socket the query came in on
+ * @param addr The address of the local client
+ * @param data The serialized message
+ * @param len Length of the message
+ *
+ * The response is copied into a send slot of the send batch, which is flushed at the end of the loop iteration.
+ */
+void send_raw_to_local(uv_udp_t *socket, const struct sockaddr *addr, const char *data, unsigned int len) {
+	log_debug("Sending DNS response message to local client")
+	Send_Slot *slot = batch_slot((Udp_Listener *) socket, addr);
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	trace_attach(&slot->trace);
+	print_dns_string(slot->data, slot->len);
+}
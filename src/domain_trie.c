@@ -0,0 +1,193 @@
+#include "../include/domain_trie.h"
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/log.h"
+
+/**
+ * @brief Compare a label with the label of a node, ignoring case
+ * @param label The label
+ * @param len Length of the label
+ * @param node The node
+ * @return Negative, zero or positive as the label sorts before, equal to or after the label of the node
+ */
+static int label_compare(const uint8_t *label, uint8_t len, const Domain_Trie_Node *node) {
+	if (len != node->len)
+		return len < node->len ? -1 : 1;
+	for (uint8_t i = 0; i < len; ++i) {
+		int c = tolower(label[i]);
+		if (c != node->label[i])
+			return c - node->label[i];
+	}
+	return 0;
+}
+
+/**
+ * @brief Binary search of a label among the children of a node
+ * @param children The children, NULL if the node has none
+ * @param label The label
+ * @param len Length of the label
+ * @param pos Position of the child found, or where it would be inserted
+ * @return The child, NULL if there is none with the label
+ */
+static Domain_Trie_Node *child_find(const Domain_Trie_Children *children, const uint8_t *label, uint8_t len,
+                                    unsigned int *pos) {
+	unsigned int low = 0, high = children ? children->count : 0;
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		int cmp = label_compare(label, len, children->nodes[mid]);
+		if (cmp == 0) {
+			*pos = mid;
+			return children->nodes[mid];
+		}
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	*pos = low;
+	return NULL;
+}
+
+/**
+ * @brief Add a child node for a label
+ * @param trie The domain trie
+ * @param node The parent node
+ * @param label The label
+ * @param len Length of the label
+ * @param pos Position of the child in the sorted children
+ * @return The new child, NULL if the allocation failed
+ *
+ * In a shared trie the children are copied with the new child among them and the copy is published as a whole,
+ * so a reader sees either the old array or the new one. The old array goes to the retired list of the trie.
+ */
+static Domain_Trie_Node *child_insert(Domain_Trie *trie, Domain_Trie_Node *node, const uint8_t *label, uint8_t len,
+                                      unsigned int pos) {
+	Domain_Trie_Node *child = (Domain_Trie_Node *) calloc(1, sizeof(Domain_Trie_Node));
+	if (!child) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	child->label = (uint8_t *) malloc(len ? len : 1);
+	if (!child->label) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	for (uint8_t i = 0; i < len; ++i)
+		child->label[i] = (uint8_t) tolower(label[i]);
+	child->len = len;
+
+	Domain_Trie_Children *children = atomic_load_explicit(&node->children, memory_order_relaxed);
+	unsigned int count = children ? children->count : 0;
+	Domain_Trie_Children *target = children;
+	if (trie->shared || count == (children ? children->capacity : 0)) {
+		unsigned int capacity = trie->shared ? count + 1 : count ? count * 2 : 4;
+		target = (Domain_Trie_Children *) malloc(sizeof(Domain_Trie_Children) + capacity * sizeof(Domain_Trie_Node *));
+		if (!target) {
+			log_fatal("Memory allocation error")
+			return NULL;
+		}
+		target->capacity = capacity;
+		target->retired_next = NULL;
+		if (count)
+			memcpy(target->nodes, children->nodes, count * sizeof(Domain_Trie_Node *));
+	}
+	memmove(target->nodes + pos + 1, target->nodes + pos, (count - pos) * sizeof(Domain_Trie_Node *));
+	target->nodes[pos] = child;
+	target->count = count + 1;
+	if (target != children) {
+		atomic_store_explicit(&node->children, target, memory_order_release);
+		if (children && trie->shared) {
+			children->retired_next = trie->retired;
+			trie->retired = children;
+		} else
+			free(children);
+	}
+	return child;
+}
+
+/**
+ * @brief Walk the path of a domain name from its rightmost label
+ * @param trie The domain trie
+ * @param name The domain name, with or without the trailing dot
+ * @param create Whether missing nodes are created
+ * @param exact Whether only the node of the name itself is of interest
+ * @return The node of the name when exact is set or nodes are created,
+ * otherwise the deepest node on the path that has a value, NULL if none is found or the name is invalid
+ */
+static Domain_Trie_Node *trie_walk(Domain_Trie *trie, const uint8_t *name, bool create, bool exact) {
+	Domain_Trie_Node *node = &trie->root;
+	Domain_Trie_Node *best = atomic_load_explicit(&node->value, memory_order_acquire) ? node : NULL;
+	size_t end = strlen((const char *) name);
+	if (end && name[end - 1] == '.')
+		--end;
+	while (end) {
+		size_t start = end;
+		while (start && name[start - 1] != '.')
+			--start;
+		if (end - start > 63) // Longer than any valid label
+			return NULL;
+		unsigned int pos;
+		Domain_Trie_Node *child = child_find(atomic_load_explicit(&node->children, memory_order_acquire), name + start,
+		                                     (uint8_t) (end - start), &pos);
+		if (!child) {
+			if (!create)
+				return exact ? NULL : best;
+			child = child_insert(trie, node, name + start, (uint8_t) (end - start), pos);
+			if (!child)
+				return NULL;
+		}
+		node = child;
+		if (atomic_load_explicit(&node->value, memory_order_acquire))
+			best = node;
+		if (!start)
+			break;
+		end = start - 1;
+	}
+	return create || exact ? node : best;
+}
+
+/**
+ * @brief Get the value slot of a domain name, creating the nodes on its path as needed
+ * @param trie The domain trie
+ * @param name The domain name, with or without the trailing dot
+ * @return The value slot of the name, NULL if the name is invalid
+ */
+static void *_Atomic *trie_insert(Domain_Trie *trie, const uint8_t *name) {
+	Domain_Trie_Node *node = trie_walk(trie, name, true, true);
+	if (!node) {
+		log_error("Invalid domain name %s", name)
+		return NULL;
+	}
+	return &node->value;
+}
+
+/**
+ * @brief Look up a domain name in a single pass over its labels from the right
+ * @param trie The domain trie
+ * @param name The domain name, with or without the trailing dot
+ * @param exact Whether only the value of the name itself matches, rather than the value of its longest suffix
+ * @return The value found, NULL if there is none
+ */
+static void *trie_lookup(Domain_Trie *trie, const uint8_t *name, bool exact) {
+	Domain_Trie_Node *node = trie_walk(trie, name, false, exact);
+	return node ? atomic_load_explicit(&node->value, memory_order_acquire) : NULL;
+}
+
+/**
+ * @brief Create a new domain trie
+ * @return The new domain trie
+ */
+Domain_Trie *new_domain_trie() {
+	Domain_Trie *trie = (Domain_Trie *) calloc(1, sizeof(Domain_Trie));
+	if (!trie) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	trie->insert = &trie_insert;
+	trie->lookup = &trie_lookup;
+	return trie;
+}
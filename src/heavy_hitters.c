@@ -0,0 +1,407 @@
+#include "../include/heavy_hitters.h"
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/log.h"
+
+static Heavy_Hitters *_Atomic registry; ///< Summaries of every thread that counted, newest first
+static _Thread_local Heavy_Hitters *local; ///< Summaries of the current thread, allocated by its first count
+
+/**
+ * @brief Hash of a key (FNV-1a)
+ * @param key The key
+ * @param len Length of the key
+ * @return The hash
+ */
+static uint32_t key_hash(const uint8_t *key, uint8_t len) {
+	uint32_t hash = 2166136261u;
+	for (uint8_t i = 0; i < len; ++i)
+		hash = (hash ^ key[i]) * 16777619u;
+	return hash;
+}
+
+/**
+ * @brief Number of the current window
+ * @return The time in milliseconds divided by HEAVY_HITTERS_WINDOW, the same clock on every thread
+ */
+static uint64_t window_number(void) {
+	return uv_hrtime() / 1000000 / HEAVY_HITTERS_WINDOW;
+}
+
+/**
+ * @brief Get the summaries of the calling thread, registering them on first use
+ * @return The summaries, NULL if they could not be allocated
+ */
+static Heavy_Hitters *heavy_hitters_local(void) {
+	if (local)
+		return local;
+	Heavy_Hitters *hh = (Heavy_Hitters *) calloc(1, sizeof(Heavy_Hitters));
+	if (!hh) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	unsigned int slots = 1;
+	while (slots < 2 * (unsigned int) HEAVY_HITTERS)
+		slots <<= 1;
+	for (int kind = 0; kind < HEAVY_HITTERS_KINDS; ++kind)
+		for (int i = 0; i < HEAVY_HITTERS_WINDOWS; ++i) {
+			Heavy_Hitters_Window *window = &hh->windows[kind][i];
+			window->counters = (Heavy_Hitter *) calloc(HEAVY_HITTERS, sizeof(Heavy_Hitter));
+			window->heap = (unsigned int *) calloc(HEAVY_HITTERS, sizeof(unsigned int));
+			window->slots = (unsigned int *) calloc(slots, sizeof(unsigned int));
+			if (!window->counters || !window->heap || !window->slots) {
+				log_fatal("Memory allocation error")
+				return NULL;
+			}
+			window->mask = slots - 1;
+		}
+	if (uv_mutex_init(&hh->lock))
+		log_fatal("Failed to initialize the heavy hitters lock")
+	hh->next = atomic_load(&registry);
+	while (!atomic_compare_exchange_weak(&registry, &hh->next, hh));
+	return local = hh;
+}
+
+/**
+ * @brief Swap two positions of the heap of a summary
+ * @param window The summary
+ * @param a A position
+ * @param b Another position
+ */
+static void heap_swap(Heavy_Hitters_Window *window, unsigned int a, unsigned int b) {
+	unsigned int counter = window->heap[a];
+	window->heap[a] = window->heap[b];
+	window->heap[b] = counter;
+	window->counters[window->heap[a]].heap = a;
+	window->counters[window->heap[b]].heap = b;
+}
+
+/**
+ * @brief Count of the counter at a position of the heap of a summary
+ * @param window The summary
+ * @param pos The position
+ * @return The count
+ */
+static uint64_t heap_count(const Heavy_Hitters_Window *window, unsigned int pos) {
+	return window->counters[window->heap[pos]].count;
+}
+
+/**
+ * @brief Move a counter towards the root of the heap while its count is below its parent's
+ * @param window The summary
+ * @param pos Position of the counter
+ */
+static void heap_up(Heavy_Hitters_Window *window, unsigned int pos) {
+	while (pos) {
+		unsigned int parent = (pos - 1) / 2;
+		if (heap_count(window, parent) <= heap_count(window, pos))
+			return;
+		heap_swap(window, parent, pos);
+		pos = parent;
+	}
+}
+
+/**
+ * @brief Move a counter away from the root of the heap while its count is above a child's
+ * @param window The summary
+ * @param pos Position of the counter
+ */
+static void heap_down(Heavy_Hitters_Window *window, unsigned int pos) {
+	for (;;) {
+		unsigned int smallest = pos, left = 2 * pos + 1, right = left + 1;
+		if (left < window->size && heap_count(window, left) < heap_count(window, smallest))
+			smallest = left;
+		if (right < window->size && heap_count(window, right) < heap_count(window, smallest))
+			smallest = right;
+		if (smallest == pos)
+			return;
+		heap_swap(window, pos, smallest);
+		pos = smallest;
+	}
+}
+
+/**
+ * @brief Find the slot of a key in the hash table of a summary
+ * @param window The summary
+ * @param hash Hash of the key
+ * @param key The key
+ * @param len Length of the key
+ * @return The slot of the counter of the key, or the empty slot where it would go
+ */
+static unsigned int slot_find(const Heavy_Hitters_Window *window, uint32_t hash, const uint8_t *key, uint8_t len) {
+	for (unsigned int slot = hash & window->mask;; slot = (slot + 1) & window->mask) {
+		if (!window->slots[slot])
+			return slot;
+		const Heavy_Hitter *hitter = &window->counters[window->slots[slot] - 1];
+		if (hitter->hash == hash && hitter->len == len && memcmp(hitter->key, key, len) == 0)
+			return slot;
+	}
+}
+
+/**
+ * @brief Empty a slot of the hash table of a summary, moving back the counters probed past it
+ * @param window The summary
+ * @param slot The slot
+ */
+static void slot_remove(Heavy_Hitters_Window *window, unsigned int slot) {
+	unsigned int next = slot;
+	for (;;) {
+		window->slots[slot] = 0;
+		for (;;) {
+			next = (next + 1) & window->mask;
+			if (!window->slots[next])
+				return;
+			unsigned int home = window->counters[window->slots[next] - 1].hash & window->mask;
+			// The counter stays unless its home lies cyclically outside (slot, next]
+			if (slot <= next ? home <= slot || home > next : home <= slot && home > next)
+				break;
+		}
+		window->slots[slot] = window->slots[next];
+		window->counters[window->slots[slot] - 1].slot = slot;
+		slot = next;
+	}
+}
+
+/**
+ * @brief Count a key in a summary
+ * @param window The summary
+ * @param key The key
+ * @param len Length of the key
+ *
+ * A new key takes a free counter, or once every counter is in use the one with the smallest count,
+ * whose count it carries on from as its error.
+ */
+static void window_count(Heavy_Hitters_Window *window, const uint8_t *key, uint8_t len) {
+	uint32_t hash = key_hash(key, len);
+	unsigned int slot = slot_find(window, hash, key, len);
+	if (window->slots[slot]) {
+		Heavy_Hitter *hitter = &window->counters[window->slots[slot] - 1];
+		++hitter->count;
+		heap_down(window, hitter->heap);
+		return;
+	}
+	unsigned int index;
+	uint64_t base = 0;
+	if (window->size < (unsigned int) HEAVY_HITTERS) {
+		index = window->size;
+		window->heap[window->size] = index;
+		window->counters[index].heap = window->size++;
+	} else {
+		index = window->heap[0];
+		base = window->counters[index].count;
+		slot_remove(window, window->counters[index].slot);
+		slot = slot_find(window, hash, key, len);
+	}
+	Heavy_Hitter *hitter = &window->counters[index];
+	hitter->count = base + 1;
+	hitter->error = base;
+	hitter->hash = hash;
+	hitter->len = len;
+	memcpy(hitter->key, key, len);
+	hitter->slot = slot;
+	window->slots[slot] = index + 1;
+	if (base)
+		heap_down(window, hitter->heap);
+	else
+		heap_up(window, hitter->heap);
+}
+
+/**
+ * @brief Get the summary of the current window of a kind, emptied if it belongs to an older window
+ * @param hh The summaries of the calling thread, locked
+ * @param kind The kind
+ * @param number Number of the current window
+ * @return The summary
+ */
+static Heavy_Hitters_Window *window_current(Heavy_Hitters *hh, Heavy_Hitter_Kind kind, uint64_t number) {
+	Heavy_Hitters_Window *window = &hh->windows[kind][number % HEAVY_HITTERS_WINDOWS];
+	if (window->number != number) {
+		window->number = number;
+		window->size = 0;
+		memset(window->slots, 0, (window->mask + 1) * sizeof(unsigned int));
+	}
+	return window;
+}
+
+/**
+ * @brief Copy a name as a key in lower case
+ * @param name The name
+ * @param key Storage for the key
+ * @return Length of the key, cut at HEAVY_HITTERS_KEY_MAX
+ */
+static uint8_t name_key(const uint8_t *name, uint8_t *key) {
+	uint8_t len = 0;
+	while (name[len] && len < HEAVY_HITTERS_KEY_MAX) {
+		key[len] = (uint8_t) tolower(name[len]);
+		++len;
+	}
+	return len;
+}
+
+/**
+ * @brief Count the client of a query received, before it is rate limited or parsed, if HEAVY_HITTERS is set
+ * @param addr The address of the client
+ */
+void heavy_hitters_client(const struct sockaddr *addr) {
+	if (!HEAVY_HITTERS)
+		return;
+	Heavy_Hitters *hh = heavy_hitters_local();
+	if (!hh)
+		return;
+	const uint8_t *client;
+	uint8_t client_len;
+	if (addr->sa_family == AF_INET6) {
+		client = (const uint8_t *) &((const struct sockaddr_in6 *) addr)->sin6_addr;
+		client_len = 16;
+	} else {
+		client = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+		client_len = 4;
+	}
+	uint64_t number = window_number();
+	uv_mutex_lock(&hh->lock);
+	window_count(window_current(hh, HEAVY_HITTERS_CLIENT, number), client, client_len);
+	uv_mutex_unlock(&hh->lock);
+}
+
+/**
+ * @brief Count the name of a query parsed, if HEAVY_HITTERS is set
+ * @param msg The parsed query
+ */
+void heavy_hitters_query(const Dns_Msg *msg) {
+	if (!HEAVY_HITTERS || !msg->que)
+		return;
+	Heavy_Hitters *hh = heavy_hitters_local();
+	if (!hh)
+		return;
+	uint8_t key[HEAVY_HITTERS_KEY_MAX];
+	uint8_t len = name_key(msg->que->qname, key);
+	uint64_t number = window_number();
+	uv_mutex_lock(&hh->lock);
+	window_count(window_current(hh, HEAVY_HITTERS_QNAME, number), key, len);
+	uv_mutex_unlock(&hh->lock);
+}
+
+/**
+ * @brief Count the name of a response sent if it is NXDOMAIN and HEAVY_HITTERS is set
+ * @param msg The response
+ */
+void heavy_hitters_response(const Dns_Msg *msg) {
+	if (!HEAVY_HITTERS || msg->header->rcode != DNS_RCODE_NXDOMAIN || !msg->que)
+		return;
+	Heavy_Hitters *hh = heavy_hitters_local();
+	if (!hh)
+		return;
+	uint8_t key[HEAVY_HITTERS_KEY_MAX];
+	uint8_t len = name_key(msg->que->qname, key);
+	uint64_t number = window_number();
+	uv_mutex_lock(&hh->lock);
+	window_count(window_current(hh, HEAVY_HITTERS_NXDOMAIN, number), key, len);
+	uv_mutex_unlock(&hh->lock);
+}
+
+/**
+ * @brief Order counters by key
+ * @param a A counter
+ * @param b Another counter
+ * @return Negative, zero or positive as the key of a sorts before, equal to or after the key of b
+ */
+static int compare_key(const void *a, const void *b) {
+	const Heavy_Hitter *x = (const Heavy_Hitter *) a, *y = (const Heavy_Hitter *) b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->key, y->key, x->len);
+}
+
+/**
+ * @brief Order counters by count, the largest first
+ * @param a A counter
+ * @param b Another counter
+ * @return Negative, zero or positive as a comes before, with or after b
+ */
+static int compare_count(const void *a, const void *b) {
+	const Heavy_Hitter *x = (const Heavy_Hitter *) a, *y = (const Heavy_Hitter *) b;
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return 0;
+}
+
+/**
+ * @brief Get the keys of a kind counted most often over the windows kept, summed over the threads
+ * @param kind The kind
+ * @param top Storage for the counters, most frequent first
+ * @param n Most counters stored
+ * @return Number of counters stored
+ *
+ * The summaries are copied one thread at a time under the lock of the thread, then the counters of the same key
+ * are added up, their errors too. A key that lost its counter in some window or thread loses the counts it had
+ * there, so the sum is an overestimate by at most its error only for a key that kept its counter everywhere;
+ * otherwise it may be an undercount.
+ */
+unsigned int heavy_hitters_top(Heavy_Hitter_Kind kind, Heavy_Hitter *top, unsigned int n) {
+	if (!HEAVY_HITTERS)
+		return 0;
+	uint64_t number = window_number();
+	Heavy_Hitter *all = NULL;
+	size_t count = 0, capacity = 0;
+	for (Heavy_Hitters *hh = atomic_load(&registry); hh; hh = hh->next) {
+		uv_mutex_lock(&hh->lock);
+		for (int i = 0; i < HEAVY_HITTERS_WINDOWS; ++i) {
+			const Heavy_Hitters_Window *window = &hh->windows[kind][i];
+			if (!window->size || window->number + HEAVY_HITTERS_WINDOWS <= number)
+				continue;
+			if (count + window->size > capacity) {
+				capacity = (count + window->size) * 2;
+				Heavy_Hitter *grown = (Heavy_Hitter *) realloc(all, capacity * sizeof(Heavy_Hitter));
+				if (!grown) {
+					log_fatal("Memory allocation error")
+					uv_mutex_unlock(&hh->lock);
+					free(all);
+					return 0;
+				}
+				all = grown;
+			}
+			memcpy(all + count, window->counters, window->size * sizeof(Heavy_Hitter));
+			count += window->size;
+		}
+		uv_mutex_unlock(&hh->lock);
+	}
+	if (!count)
+		return 0;
+
+	qsort(all, count, sizeof(Heavy_Hitter), compare_key);
+	size_t merged = 0;
+	for (size_t i = 0; i < count; ++i)
+		if (merged && compare_key(&all[merged - 1], &all[i]) == 0) {
+			all[merged - 1].count += all[i].count;
+			all[merged - 1].error += all[i].error;
+		} else
+			all[merged++] = all[i];
+	qsort(all, merged, sizeof(Heavy_Hitter), compare_count);
+	if (n > merged)
+		n = (unsigned int) merged;
+	memcpy(top, all, n * sizeof(Heavy_Hitter));
+	free(all);
+	return n;
+}
+
+/**
+ * @brief Write the key of a counter as text, a name or an address
+ * @param kind The kind of the counter
+ * @param hitter The counter
+ * @param buf Storage for the text, HEAVY_HITTERS_KEY_MAX + 1 bytes
+ * @return buf
+ */
+char *heavy_hitter_key(Heavy_Hitter_Kind kind, const Heavy_Hitter *hitter, char *buf) {
+	if (kind == HEAVY_HITTERS_CLIENT)
+		uv_inet_ntop(hitter->len == 16 ? AF_INET6 : AF_INET, hitter->key, buf, HEAVY_HITTERS_KEY_MAX + 1);
+	else {
+		memcpy(buf, hitter->key, hitter->len);
+		buf[hitter->len] = 0;
+	}
+	return buf;
+}
@@ -1,8 +1,26 @@
 #include "../include/index_pool.h"
 
 #include <stdlib.h>
+#include <uv.h>
 
 #include "../include/log.h"
+#include "../include/metrics.h"
+
+/**
+ * @brief Bucket of a key in the index table
+ * @param ipool The index pool
+ * @param socket The socket
+ * @param id The ID
+ * @param qhash The question hash
+ * @return The first bucket to probe
+ */
+static unsigned int ipool_bucket(const Index_Pool *ipool, uint8_t socket, uint16_t id, uint32_t qhash) {
+	uint64_t key = ((uint64_t) qhash << 32 | (uint32_t) id << 8 | socket) ^ ipool->seed;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (unsigned int) key & (ipool->capacity - 1);
+}
 
 /**
  * @brief Check if the index pool is full
@@ -14,40 +32,125 @@ static bool ipool_full(Index_Pool *ipool) {
 }
 
 /**
- * @brief Insert an index into the pool
+ * @brief Draw a random number from the system random source
+ * @param ipool The index pool
+ * @return The random number
+ * @note The numbers are fetched in batches of INDEX_POOL_RANDOM_BATCH, the loop time stands in if the system fails
+ */
+static uint16_t ipool_random_id(Index_Pool *ipool) {
+	if (!ipool->random_left) {
+		if (uv_random(NULL, NULL, ipool->random, sizeof(ipool->random), 0, NULL)) {
+			log_error("System random source failed")
+			uint64_t seed = uv_hrtime();
+			for (int i = 0; i < INDEX_POOL_RANDOM_BATCH; ++i) {
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				ipool->random[i] = (uint16_t) (seed >> 48);
+			}
+		}
+		ipool->random_left = INDEX_POOL_RANDOM_BATCH;
+	}
+	return ipool->random[--ipool->random_left];
+}
+
+/**
+ * @brief Query an index in the pool
+ * @param ipool The index pool
+ * @param socket The socket the reply came in on
+ * @param id The ID of the reply
+ * @param qhash Hash of the question of the reply
+ * @return The index, NULL if it does not exist, valid until the next insertion or deletion
+ */
+static Index *ipool_query(Index_Pool *ipool, uint8_t socket, uint16_t id, uint32_t qhash) {
+	for (unsigned int i = ipool_bucket(ipool, socket, id, qhash); ipool->table[i].used; i = (i + 1) & (ipool->capacity - 1)) {
+		Index *index = &ipool->table[i];
+		if (index->id == id && index->socket == socket && index->qhash == qhash)
+			return index;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Put an index into a free bucket, the key must not be in the table yet
  * @param ipool The index pool
- * @param req The index to insert
- * @return The ID of the inserted index
+ * @param req The index
  */
-static uint16_t ipool_insert(Index_Pool *ipool, Index *req) {
-	uint16_t id = ipool->queue->pop(ipool->queue);
-	ipool->pool[id] = req;
-	ipool->count++;
-	return id;
+static void ipool_place(Index_Pool *ipool, const Index *req) {
+	unsigned int i = ipool_bucket(ipool, req->socket, req->id, req->qhash);
+	while (ipool->table[i].used)
+		i = (i + 1) & (ipool->capacity - 1);
+	ipool->table[i] = *req;
+	ipool->table[i].used = 1;
 }
 
 /**
- * @brief Query if an index exists in the pool
+ * @brief Double the number of buckets of the index table
  * @param ipool The index pool
- * @param index The index to query
- * @return True if the index exists, false otherwise
+ * @return True if the table grew, false if the allocation failed
  */
-static bool ipool_query(Index_Pool *ipool, uint16_t index) {
-	return ipool->pool[index] != NULL;
+static bool ipool_grow(Index_Pool *ipool) {
+	Index *old = ipool->table;
+	unsigned int old_capacity = ipool->capacity;
+	Index *table = (Index *) calloc(old_capacity * 2, sizeof(Index));
+	if (!table) {
+		log_fatal("Memory allocation error")
+		return false;
+	}
+	ipool->table = table;
+	ipool->capacity = old_capacity * 2;
+	for (unsigned int i = 0; i < old_capacity; ++i)
+		if (old[i].used)
+			ipool_place(ipool, &old[i]);
+	free(old);
+	log_debug("Growing index pool to %u buckets", ipool->capacity)
+	return true;
+}
+
+/**
+ * @brief Insert an index into the pool under a random ID
+ * @param ipool The index pool
+ * @param req The index to insert, with its socket, question hash and query ID set, its ID is filled in
+ * @return True if the index was inserted, false if no free ID was found
+ */
+static bool ipool_insert(Index_Pool *ipool, Index *req) {
+	if ((ipool->count + 1) * 4 > ipool->capacity * 3 && !ipool_grow(ipool))
+		return false;
+	for (int i = 0; i < INDEX_POOL_ID_TRIES; ++i) {
+		req->id = ipool_random_id(ipool);
+		if (!ipool_query(ipool, req->socket, req->id, req->qhash)) {
+			ipool_place(ipool, req);
+			ipool->count++;
+			metrics_set(indices_in_flight, ipool->count);
+			return true;
+		}
+	}
+	return false;
 }
 
 /**
  * @brief Delete an index from the pool
  * @param ipool The index pool
- * @param index The index to delete
- * @return The deleted index
+ * @param socket The socket of the index
+ * @param id The ID of the index
+ * @param qhash The question hash of the index
+ *
+ * The indices after the bucket are shifted back, so that probing never needs tombstones.
  */
-static Index *ipool_delete(Index_Pool *ipool, uint16_t index) {
-	Index *req = ipool->pool[index];
-	ipool->queue->push(ipool->queue, index);
-	ipool->pool[index] = NULL;
+static void ipool_delete(Index_Pool *ipool, uint8_t socket, uint16_t id, uint32_t qhash) {
+	Index *index = ipool_query(ipool, socket, id, qhash);
+	if (!index)
+		return;
+	unsigned int mask = ipool->capacity - 1;
+	unsigned int hole = (unsigned int) (index - ipool->table);
+	for (unsigned int i = (hole + 1) & mask; ipool->table[i].used; i = (i + 1) & mask) {
+		unsigned int home = ipool_bucket(ipool, ipool->table[i].socket, ipool->table[i].id, ipool->table[i].qhash);
+		if (((i - home) & mask) >= ((i - hole) & mask)) { // The index may move back into the hole
+			ipool->table[hole] = ipool->table[i];
+			hole = i;
+		}
+	}
+	ipool->table[hole].used = 0;
 	ipool->count--;
-	return req;
+	metrics_set(indices_in_flight, ipool->count);
 }
 
 /**
@@ -55,7 +158,7 @@ static Index *ipool_delete(Index_Pool *ipool, uint16_t index) {
  * @param ipool The index pool to destroy
  */
 static void ipool_destroy(Index_Pool *ipool) {
-	ipool->queue->destroy(ipool->queue);
+	free(ipool->table);
 	free(ipool);
 }
 
@@ -70,14 +173,19 @@ Index_Pool *new_ipool() {
 		return NULL;
 	}
 	ipool->count = 0;
-	ipool->queue = new_queue();
-	for (uint16_t i = 0; i < INDEX_POOL_MAX_SIZE; ++i)
-		ipool->queue->push(ipool->queue, i);
+	ipool->capacity = INDEX_POOL_INIT_SIZE;
+	ipool->table = (Index *) calloc(ipool->capacity, sizeof(Index));
+	if (!ipool->table) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	ipool->seed = (uint32_t) ipool_random_id(ipool) << 16 | ipool_random_id(ipool);
 
 	ipool->full = &ipool_full;
+	ipool->random_id = &ipool_random_id;
 	ipool->insert = &ipool_insert;
 	ipool->query = &ipool_query;
 	ipool->delete = &ipool_delete;
 	ipool->destroy = &ipool_destroy;
 	return ipool;
-}
\ No newline at end of file
+}
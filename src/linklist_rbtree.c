@@ -412,7 +412,7 @@ static void rbtree_delete(Rbtree *tree, Rbtree_Node *node) {
  */
 Dns_RR_LinkList *rbtree_query(Rbtree *tree, unsigned int key) {
 	log_debug("Query in Red-Black Tree")
-	Rbtree_Node *node = rbtree_find(tree->root, key);
+	Rbtree_Node *node = tree->root ? rbtree_find(tree->root, key) : NULL; // The tree is empty until the first answer is cached
 	if (node == NULL)return NULL;
 	time_t now_time = time(NULL);
 	Dns_RR_LinkList *list = node->rr_list;
@@ -0,0 +1,184 @@
+#include "../include/log.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <uv.h>
+
+static Log_Ring *_Atomic rings; ///< Rings of every thread that logged
+static _Thread_local Log_Ring *ring; ///< Ring of the current thread
+static bool started; ///< Whether the writer thread runs
+static uv_mutex_t writer_lock; ///< Held while the rings are drained, by the writer thread or log_flush
+static uv_thread_t writer_thread; ///< The writer thread
+
+static const char *const level_names[] = {"[DEBUG]", "[INFO ]", "[ERROR]", "[FATAL]"};
+static const char *const level_colors[] = {"\x1b[37m", "\x1b[34m", "\x1b[33m", "\x1b[31m"};
+
+/**
+ * @brief Get the log ring of the calling thread, registering it on first use
+ * @return The ring, NULL if it could not be allocated
+ */
+static Log_Ring *log_ring() {
+	if (ring)
+		return ring;
+	Log_Ring *new_ring = (Log_Ring *) calloc(1, sizeof(Log_Ring));
+	if (!new_ring)
+		return NULL;
+	new_ring->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &new_ring->next, new_ring));
+	return ring = new_ring;
+}
+
+/**
+ * @brief Put preformatted text into the log ring of the calling thread as it is
+ * @param text The text, lines ended with a newline
+ * @param len Length of the text
+ *
+ * The text is dropped and counted if the ring has no room for all of it, the thread never waits for the writer.
+ */
+void log_raw(const char *text, size_t len) {
+	if (!started) {
+		fwrite(text, 1, len, log_file ? log_file : stderr);
+		return;
+	}
+	Log_Ring *r = log_ring();
+	if (!r)
+		return;
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (len > LOG_RING_SIZE - (tail - head)) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	size_t pos = tail & (LOG_RING_SIZE - 1);
+	size_t first = len < LOG_RING_SIZE - pos ? len : LOG_RING_SIZE - pos;
+	memcpy(r->data + pos, text, first);
+	memcpy(r->data, text + first, len - first);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+/**
+ * @brief Format a message into the log ring of the calling thread, written out by the writer thread
+ * @param level Level of the message
+ * @param file Source file of the call
+ * @param line Source line of the call
+ * @param format Format of the message, as printf
+ * @note Before init_log the message is written right away
+ */
+void log_write(int level, const char *file, int line, const char *format, ...) {
+	char text[LOG_LINE_MAX];
+	int len;
+	if (log_file && log_file != stderr)
+		len = snprintf(text, LOG_LINE_MAX, "%s %s:%d ", level_names[level], file, line);
+	else
+		len = snprintf(text, LOG_LINE_MAX, "%s%s\x1b[36m %s:%d \x1b[0m", level_colors[level], level_names[level], file, line);
+	if (len < 0 || len >= LOG_LINE_MAX - 1)
+		len = 0;
+	va_list args;
+	va_start(args, format);
+	int msg_len = vsnprintf(text + len, LOG_LINE_MAX - 1 - len, format, args);
+	va_end(args);
+	if (msg_len > 0)
+		len += msg_len < LOG_LINE_MAX - 1 - len ? msg_len : LOG_LINE_MAX - 2 - len; // Cut at the end of the buffer
+	text[len++] = '\n';
+	log_raw(text, len);
+}
+
+/**
+ * @brief Check if an error call site may log again, noting the messages it suppressed before
+ * @param limit The rate limit of the call site
+ * @param file Source file of the call
+ * @param line Source line of the call
+ * @return True if the message is written, false if it is suppressed
+ */
+bool log_allow(Log_Limit *limit, const char *file, int line) {
+	uint64_t second = uv_hrtime() / 1000000000;
+	if (second != limit->second) {
+		limit->second = second;
+		limit->count = 0;
+	}
+	if (limit->count == LOG_ERROR_BURST) {
+		++limit->suppressed;
+		return false;
+	}
+	++limit->count;
+	if (limit->suppressed) {
+		log_write(LOG_LEVEL_ERROR, file, line, "%u similar messages suppressed", limit->suppressed);
+		limit->suppressed = 0;
+	}
+	return true;
+}
+
+/**
+ * @brief Write the waiting messages of every ring to the log file, with the writer lock held
+ * @return True if anything was written, false otherwise
+ */
+static bool drain_rings() {
+	bool wrote = false;
+	for (Log_Ring *r = atomic_load(&rings); r; r = r->next) {
+		size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head != tail) {
+			size_t pos = head & (LOG_RING_SIZE - 1);
+			size_t len = tail - head;
+			size_t first = len < LOG_RING_SIZE - pos ? len : LOG_RING_SIZE - pos;
+			fwrite(r->data + pos, 1, first, log_file);
+			fwrite(r->data, 1, len - first, log_file);
+			atomic_store_explicit(&r->head, tail, memory_order_release);
+			wrote = true;
+		}
+		size_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+		if (dropped != r->dropped_reported) {
+			fprintf(log_file, "%s %zu log messages dropped, the writer fell behind\n", level_names[LOG_LEVEL_ERROR],
+			        dropped - r->dropped_reported);
+			r->dropped_reported = dropped;
+			wrote = true;
+		}
+	}
+	if (wrote)
+		fflush(log_file);
+	return wrote;
+}
+
+/**
+ * @brief Write every waiting message to the log file right away
+ */
+void log_flush() {
+	if (!started) {
+		fflush(log_file ? log_file : stderr);
+		return;
+	}
+	uv_mutex_lock(&writer_lock);
+	drain_rings();
+	uv_mutex_unlock(&writer_lock);
+}
+
+/**
+ * @brief Entry of the writer thread, it drains the rings and sleeps while they are empty
+ * @param arg Unused
+ */
+static void writer_main(void *arg) {
+	for (;;) {
+		uv_mutex_lock(&writer_lock);
+		bool wrote = drain_rings();
+		uv_mutex_unlock(&writer_lock);
+		if (!wrote)
+			uv_sleep(LOG_FLUSH_INTERVAL);
+	}
+}
+
+/**
+ * @brief Start the writer thread, from then on the calls only format into their ring
+ */
+void init_log() {
+	if (uv_mutex_init(&writer_lock)) {
+		log_error("Failed to initialize the log writer lock, logging synchronously")
+		return;
+	}
+	started = true;
+	if (uv_thread_create(&writer_thread, writer_main, NULL)) {
+		started = false;
+		log_error("Failed to start the log writer, logging synchronously")
+		return;
+	}
+	atexit(log_flush);
+}
@@ -3,13 +3,11 @@
 #include <uv.h>
 
 #include "../include/log.h"
-#include "../include/dns_client.h"
-#include "../include/dns_server.h"
-#include "../include/query_pool.h"
+#include "../include/query_log.h"
+#include "../include/upstream.h"
+#include "../include/worker.h"
 
-uv_loop_t *loop;
 Cache *cache;
-Query_Pool *qpool;
 FILE *log_file;
 
 int main(int argc, char *argv[]) {
@@ -24,6 +22,8 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
     }
+    init_log();
+    init_query_log();
 
     FILE *hosts_file = fopen(HOSTS_PATH, "r");
     if (!hosts_file) {
@@ -31,11 +31,8 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    log_info("Starting DNS relay server")
-    loop = uv_default_loop();
+    log_info("Starting DNS relay server with %d worker threads", THREAD_COUNT)
     cache = new_cache(hosts_file);
-    qpool = new_qpool(loop, cache);
-	init_client(loop);
-    init_server(loop);
-    return uv_run(loop, UV_RUN_DEFAULT);
-}
\ No newline at end of file
+    init_routes();
+    return run_workers(cache);
+}
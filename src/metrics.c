@@ -0,0 +1,171 @@
+#include "../include/metrics.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/log.h"
+
+/// Counters of a registered thread
+typedef struct metrics_node {
+	Metrics *metrics; ///< The thread-local counters of the thread
+	struct metrics_node *next; ///< Next registered thread
+} Metrics_Node;
+
+_Thread_local Metrics metrics; ///< Counters of the current thread
+const uint64_t metrics_latency_bounds[METRICS_LATENCY_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+static Metrics_Node *_Atomic registry; ///< Counters of every registered thread, newest first
+static uv_timer_t report_timer; ///< Timer of the periodic metrics report
+
+/**
+ * @brief Record the size of a batch in a batch size histogram
+ * @param hist The histogram with METRICS_BATCH_BUCKETS buckets
+ * @param size The number of datagrams in the batch
+ */
+void metrics_record_batch(uint64_t *hist, unsigned size) {
+	unsigned bucket = 0;
+	while (size > 1 && bucket < METRICS_BATCH_BUCKETS - 1) {
+		size >>= 1;
+		++bucket;
+	}
+	__atomic_store_n(&hist[bucket], hist[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record a latency in a latency histogram
+ * @param hist The histogram
+ * @param ns The latency in nanoseconds
+ */
+void metrics_record_latency(Metrics_Histogram *hist, uint64_t ns) {
+	unsigned bucket = 0;
+	while (bucket < METRICS_LATENCY_BUCKETS - 1 && ns > metrics_latency_bounds[bucket] * 1000)
+		++bucket;
+	__atomic_store_n(&hist->buckets[bucket], hist->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Register the counters of the current thread, so that they are summed up with the others
+ * @note Once per thread, init_metrics does it for the workers
+ */
+void metrics_register(void) {
+	Metrics_Node *node = (Metrics_Node *) malloc(sizeof(Metrics_Node));
+	if (!node) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	node->metrics = &metrics;
+	node->next = atomic_load(&registry);
+	while (!atomic_compare_exchange_weak(&registry, &node->next, node));
+}
+
+/**
+ * @brief Average number of datagrams per system call
+ * @param packets Number of datagrams
+ * @param syscalls Number of system calls
+ * @return The average, or 0 if no system call was made
+ */
+static double per_syscall(uint64_t packets, uint64_t syscalls) {
+	return syscalls ? (double) packets / (double) syscalls : 0;
+}
+
+/**
+ * @brief Whether a field of the counters is a high-water mark, aggregated with the maximum rather than the sum
+ * @param field Index of the field, counted in uint64_t
+ * @return true for a high-water mark
+ */
+static bool high_water(size_t field) {
+	static const size_t fields[] = {
+		offsetof(Metrics, buffer_high_water) / sizeof(uint64_t),
+		offsetof(Metrics, send_slot_high_water) / sizeof(uint64_t),
+		offsetof(Metrics, query_high_water) / sizeof(uint64_t)
+	};
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+		if (fields[i] == field)
+			return true;
+	return false;
+}
+
+/**
+ * @brief Sum up the counters of every registered thread, the high-water marks are the highest of the threads
+ * @param total The sum
+ * @note The counters are read while the threads update them, so the sum is a close snapshot rather than an exact one
+ */
+void metrics_aggregate(Metrics *total) {
+	memset(total, 0, sizeof(Metrics));
+	uint64_t *dst = (uint64_t *) total;
+	for (const Metrics_Node *node = atomic_load(&registry); node; node = node->next) {
+		const uint64_t *src = (const uint64_t *) node->metrics;
+		for (size_t j = 0; j < sizeof(Metrics) / sizeof(uint64_t); ++j) {
+			uint64_t value = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+			if (!high_water(j))
+				dst[j] += value;
+			else if (value > dst[j])
+				dst[j] = value;
+		}
+	}
+}
+
+/**
+ * @brief Callback function of the periodic metrics report
+ * @param timer The report timer
+ */
+static void report_cb(uv_timer_t *timer) {
+	Metrics total;
+	metrics_aggregate(&total);
+	log_info("UDP rx: %llu packets, %llu syscalls, %.2f packets/syscall, batches [%llu %llu %llu %llu %llu %llu]",
+	         (unsigned long long) total.rx_packets, (unsigned long long) total.rx_syscalls,
+	         per_syscall(total.rx_packets, total.rx_syscalls),
+	         (unsigned long long) total.rx_batches[0], (unsigned long long) total.rx_batches[1],
+	         (unsigned long long) total.rx_batches[2], (unsigned long long) total.rx_batches[3],
+	         (unsigned long long) total.rx_batches[4], (unsigned long long) total.rx_batches[5])
+	log_info("UDP tx: %llu packets, %llu syscalls, %.2f packets/syscall, %llu queued, batches [%llu %llu %llu %llu %llu %llu]",
+	         (unsigned long long) total.tx_packets, (unsigned long long) total.tx_syscalls,
+	         per_syscall(total.tx_packets, total.tx_syscalls), (unsigned long long) total.tx_queued,
+	         (unsigned long long) total.tx_batches[0], (unsigned long long) total.tx_batches[1],
+	         (unsigned long long) total.tx_batches[2], (unsigned long long) total.tx_batches[3],
+	         (unsigned long long) total.tx_batches[4], (unsigned long long) total.tx_batches[5])
+	log_info("Receive buffers: %llu high water, %llu fallbacks",
+	         (unsigned long long) total.buffer_high_water, (unsigned long long) total.buffer_fallbacks)
+	log_info("Send slots: %llu high water, %llu fallbacks",
+	         (unsigned long long) total.send_slot_high_water, (unsigned long long) total.send_slot_fallbacks)
+	log_info("TCP: %llu connections accepted, %llu rejected, %llu closed idle, %llu queries",
+	         (unsigned long long) total.tcp_accepted, (unsigned long long) total.tcp_rejected,
+	         (unsigned long long) total.tcp_idle_closed, (unsigned long long) total.tcp_queries)
+	log_info("Upstream TCP: %llu connections established, %llu failed",
+	         (unsigned long long) total.upstream_tcp_connects, (unsigned long long) total.upstream_tcp_failures)
+	log_info("Hedging: %llu requests sent, %llu answered first",
+	         (unsigned long long) total.upstream_hedges, (unsigned long long) total.upstream_hedge_wins)
+	log_info("Retransmission: %llu queries sent again, %llu answered with SERVFAIL",
+	         (unsigned long long) total.upstream_retransmits, (unsigned long long) total.upstream_servfails)
+	log_info("Answers: %llu from the cache, %llu from the hosts file, %llu blocked, %llu misses",
+	         (unsigned long long) total.cache_hits, (unsigned long long) total.hosts_hits,
+	         (unsigned long long) total.blocked_hits, (unsigned long long) total.cache_misses)
+	log_info("Coalescing: %llu queries joined a question in flight", (unsigned long long) total.queries_coalesced)
+	log_info("Rate limiting: %llu queries dropped, %llu answered truncated",
+	         (unsigned long long) total.rrl_dropped, (unsigned long long) total.rrl_truncated)
+	log_info("Pipeline: %llu queries handed to the parse workers, %llu answered from the cache, %llu dropped",
+	         (unsigned long long) total.pipeline_jobs, (unsigned long long) total.pipeline_answered,
+	         (unsigned long long) total.pipeline_dropped)
+	log_info("Query pool: %llu high water in a worker", (unsigned long long) total.query_high_water)
+	log_info("Load shedding: %llu queries shed with the pool full, %llu by the admission control",
+	         (unsigned long long) total.queries_shed_full, (unsigned long long) total.queries_shed_codel)
+}
+
+/**
+ * @brief Register the counters of the current worker, the first worker also reports the metrics periodically in the log
+ * @param loop The libuv event loop of the worker
+ * @param worker_id Index of the worker
+ */
+void init_metrics(uv_loop_t *loop, unsigned int worker_id) {
+	metrics_register();
+	if (worker_id != 0)
+		return;
+	uv_timer_init(loop, &report_timer);
+	uv_unref((uv_handle_t *) &report_timer); // The report alone must not keep the loop alive
+	uv_timer_start(&report_timer, report_cb, METRICS_REPORT_INTERVAL, METRICS_REPORT_INTERVAL);
+}
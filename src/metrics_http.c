@@ -0,0 +1,394 @@
+#include "../include/metrics_http.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "../include/config.h"
+#include "../include/heavy_hitters.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+
+/// Exposition text, grown as it is written
+typedef struct metrics_text {
+	char *data; ///< The text
+	size_t len; ///< Length of the text
+	size_t cap; ///< Size of data
+} Metrics_Text;
+
+static union {
+	uv_tcp_t tcp;
+	uv_pipe_t pipe;
+} listener; ///< Listening socket of the scrapers
+static bool over_pipe; ///< Whether the listener is a Unix socket
+static Cache *metrics_cache; ///< The cache, measured on each scrape
+
+/**
+ * @brief Append formatted text to the exposition
+ * @param text The exposition
+ * @param format Format of the text, as printf
+ */
+static void text_printf(Metrics_Text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(Metrics_Text *text, const char *format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(text->data + text->len, text->cap - text->len, format, args);
+		va_end(args);
+		if (len < 0)
+			return;
+		if ((size_t) len < text->cap - text->len) {
+			text->len += len;
+			return;
+		}
+		char *data = (char *) realloc(text->data, text->cap * 2);
+		if (!data) {
+			log_fatal("Memory allocation error")
+			return;
+		}
+		text->data = data;
+		text->cap *= 2;
+	}
+}
+
+/**
+ * @brief Write the help and type lines of a metric family
+ * @param text The exposition
+ * @param name Name of the family
+ * @param type counter, gauge or histogram
+ * @param help Description of the family
+ */
+static void family(Metrics_Text *text, const char *name, const char *type, const char *help) {
+	text_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Write a sample of a counter or a gauge
+ * @param text The exposition
+ * @param name Name of the family
+ * @param labels Labels of the sample, NULL for none
+ * @param value The value
+ */
+static void sample(Metrics_Text *text, const char *name, const char *labels, uint64_t value) {
+	if (labels)
+		text_printf(text, "%s{%s} %llu\n", name, labels, (unsigned long long) value);
+	else
+		text_printf(text, "%s %llu\n", name, (unsigned long long) value);
+}
+
+/**
+ * @brief Write a counter family with a single sample
+ * @param text The exposition
+ * @param name Name of the family
+ * @param help Description of the family
+ * @param value The value
+ */
+static void counter(Metrics_Text *text, const char *name, const char *help, uint64_t value) {
+	family(text, name, "counter", help);
+	sample(text, name, NULL, value);
+}
+
+/**
+ * @brief Write the samples of a latency histogram, with cumulative buckets in seconds
+ * @param text The exposition
+ * @param name Name of the family
+ * @param labels Labels of the histogram, without le
+ * @param hist The histogram
+ */
+static void histogram(Metrics_Text *text, const char *name, const char *labels, const Metrics_Histogram *hist) {
+	uint64_t count = 0;
+	for (int i = 0; i < METRICS_LATENCY_BUCKETS; ++i) {
+		count += hist->buckets[i];
+		if (i < METRICS_LATENCY_BUCKETS - 1)
+			text_printf(text, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+			            (double) metrics_latency_bounds[i] / 1e6, (unsigned long long) count);
+		else
+			text_printf(text, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long) count);
+	}
+	text_printf(text, "%s_sum{%s} %.9f\n", name, labels, (double) hist->sum / 1e9);
+	text_printf(text, "%s_count{%s} %llu\n", name, labels, (unsigned long long) count);
+}
+
+/**
+ * @brief Write a gauge family of the keys of a kind counted most often, one sample per key
+ * @param text The exposition
+ * @param name Name of the family
+ * @param help Description of the family
+ * @param kind The kind
+ * @param label Name of the label holding the key
+ *
+ * Backslashes, quotes and newlines of the keys are escaped, other bytes outside printable ASCII become '?'.
+ */
+static void heavy_hitters(Metrics_Text *text, const char *name, const char *help, Heavy_Hitter_Kind kind,
+                          const char *label) {
+	Heavy_Hitter top[HEAVY_HITTERS_METRICS];
+	unsigned int count = heavy_hitters_top(kind, top, HEAVY_HITTERS_METRICS);
+	family(text, name, "gauge", help);
+	for (unsigned int i = 0; i < count; ++i) {
+		char key[HEAVY_HITTERS_KEY_MAX + 1], labels[2 * HEAVY_HITTERS_KEY_MAX + 32];
+		heavy_hitter_key(kind, &top[i], key);
+		size_t len = (size_t) snprintf(labels, sizeof(labels), "%s=\"", label);
+		for (const char *c = key; *c; ++c) {
+			if (*c == '\\' || *c == '"')
+				labels[len++] = '\\';
+			if (*c == '\n') {
+				labels[len++] = '\\';
+				labels[len++] = 'n';
+			} else
+				labels[len++] = *c >= 0x20 && *c <= 0x7e ? *c : '?';
+		}
+		labels[len++] = '"';
+		labels[len] = 0;
+		sample(text, name, labels, top[i].count);
+	}
+}
+
+/**
+ * @brief Write the metrics of every thread and of the cache in the Prometheus text format
+ * @param text The exposition
+ */
+static void expose(Metrics_Text *text) {
+	Metrics total;
+	metrics_aggregate(&total);
+	size_t entries, bytes;
+	metrics_cache->usage(metrics_cache, &entries, &bytes);
+
+	family(text, "dnsr_queries_total", "counter", "Queries received from clients");
+	sample(text, "dnsr_queries_total", "transport=\"udp\"", total.rx_packets);
+	sample(text, "dnsr_queries_total", "transport=\"tcp\"", total.tcp_queries);
+	counter(text, "dnsr_udp_responses_total", "Datagrams sent to clients", total.tx_packets);
+	family(text, "dnsr_udp_syscalls_total", "counter", "System calls that received or sent datagrams of clients");
+	sample(text, "dnsr_udp_syscalls_total", "direction=\"rx\"", total.rx_syscalls);
+	sample(text, "dnsr_udp_syscalls_total", "direction=\"tx\"", total.tx_syscalls);
+	family(text, "dnsr_answers_total", "counter", "Questions answered without a remote server");
+	sample(text, "dnsr_answers_total", "source=\"cache\"", total.cache_hits);
+	sample(text, "dnsr_answers_total", "source=\"hosts\"", total.hosts_hits);
+	sample(text, "dnsr_answers_total", "source=\"blocked\"", total.blocked_hits);
+	counter(text, "dnsr_cache_misses_total", "Questions neither the cache nor the hosts file had an answer for",
+	        total.cache_misses);
+	counter(text, "dnsr_queries_coalesced_total", "Queries that joined the same question in flight",
+	        total.queries_coalesced);
+	family(text, "dnsr_queries_shed_total", "counter", "Queries answered right away with the shed response code");
+	sample(text, "dnsr_queries_shed_total", "reason=\"pool_full\"", total.queries_shed_full);
+	sample(text, "dnsr_queries_shed_total", "reason=\"admission\"", total.queries_shed_codel);
+	family(text, "dnsr_queries_dropped_total", "counter", "Queries dropped without a response");
+	sample(text, "dnsr_queries_dropped_total", "reason=\"rate_limit\"", total.rrl_dropped);
+	sample(text, "dnsr_queries_dropped_total", "reason=\"pipeline_full\"", total.pipeline_dropped);
+	counter(text, "dnsr_rrl_truncated_total", "Queries over the rate limit answered with a truncated response",
+	        total.rrl_truncated);
+	counter(text, "dnsr_pipeline_jobs_total", "Queries handed to the parse workers", total.pipeline_jobs);
+	counter(text, "dnsr_upstream_timeouts_total", "Queries answered with SERVFAIL because no remote server replied in time",
+	        total.upstream_servfails);
+	counter(text, "dnsr_upstream_retransmits_total", "Queries sent again after their retransmission timeout",
+	        total.upstream_retransmits);
+	counter(text, "dnsr_upstream_hedges_total", "Hedged requests sent to a second remote server", total.upstream_hedges);
+	counter(text, "dnsr_upstream_hedge_wins_total", "Hedged requests answered before the first request",
+	        total.upstream_hedge_wins);
+	counter(text, "dnsr_upstream_replies_unmatched_total", "Replies of remote servers that matched no query in flight",
+	        total.replies_unmatched);
+	family(text, "dnsr_upstream_tcp_connections_total", "counter", "TCP connections to remote servers");
+	sample(text, "dnsr_upstream_tcp_connections_total", "outcome=\"established\"", total.upstream_tcp_connects);
+	sample(text, "dnsr_upstream_tcp_connections_total", "outcome=\"failed\"", total.upstream_tcp_failures);
+	family(text, "dnsr_tcp_connections_total", "counter", "TCP connections of clients");
+	sample(text, "dnsr_tcp_connections_total", "outcome=\"accepted\"", total.tcp_accepted);
+	sample(text, "dnsr_tcp_connections_total", "outcome=\"rejected\"", total.tcp_rejected);
+	sample(text, "dnsr_tcp_connections_total", "outcome=\"idle_closed\"", total.tcp_idle_closed);
+
+	family(text, "dnsr_queries_in_flight", "gauge", "Queries in the query pools waiting for a remote server");
+	sample(text, "dnsr_queries_in_flight", NULL, total.queries_in_flight);
+	family(text, "dnsr_indices_in_flight", "gauge", "Requests in the index pools waiting for a reply");
+	sample(text, "dnsr_indices_in_flight", NULL, total.indices_in_flight);
+	family(text, "dnsr_cache_entries", "gauge", "Answers in the cache");
+	sample(text, "dnsr_cache_entries", NULL, entries);
+	family(text, "dnsr_cache_bytes", "gauge", "Memory allocated for the answers in the cache");
+	sample(text, "dnsr_cache_bytes", NULL, bytes);
+
+	family(text, "dnsr_response_latency_seconds", "histogram", "Time from a query to its response");
+	histogram(text, "dnsr_response_latency_seconds", "source=\"local\"", &total.local_latency);
+	histogram(text, "dnsr_response_latency_seconds", "source=\"remote\"", &total.remote_latency);
+	family(text, "dnsr_upstream_rtt_seconds", "histogram", "Round-trip time of the requests to each remote server");
+	for (int i = 0; i < REMOTE_COUNT; ++i) {
+		char labels[128];
+		snprintf(labels, sizeof(labels), "server=\"%s\"", REMOTE_HOSTS[i]);
+		histogram(text, "dnsr_upstream_rtt_seconds", labels, &total.upstream_rtt[i]);
+	}
+
+	if (HEAVY_HITTERS) {
+		heavy_hitters(text, "dnsr_top_qname_queries", "Queries of the most frequent names over the last minutes",
+		              HEAVY_HITTERS_QNAME, "qname");
+		heavy_hitters(text, "dnsr_top_client_queries", "Queries of the busiest clients over the last minutes",
+		              HEAVY_HITTERS_CLIENT, "client");
+		heavy_hitters(text, "dnsr_top_nxdomain_responses", "NXDOMAIN responses of the most frequent names "
+		              "over the last minutes", HEAVY_HITTERS_NXDOMAIN, "qname");
+	}
+}
+
+/**
+ * @brief Callback function of a closed scraper connection
+ * @param handle The connection
+ */
+static void on_close(uv_handle_t *handle) {
+	Metrics_Conn *conn = (Metrics_Conn *) handle->data;
+	free(conn->response);
+	free(conn);
+}
+
+/**
+ * @brief Callback function of a written response, the connection is closed
+ * @param req The write request
+ * @param status Write status
+ */
+static void on_write(uv_write_t *req, int status) {
+	if (status)
+		log_error("Metrics write status error %d", status)
+	uv_close((uv_handle_t *) req->handle, on_close);
+}
+
+/**
+ * @brief Answer the request of a scraper, the metrics for GET / and GET /metrics
+ * @param conn The connection
+ * @param status Status line, NULL to look at the request
+ */
+static void respond(Metrics_Conn *conn, const char *status) {
+	Metrics_Text text = {.data = (char *) malloc(METRICS_HTTP_TEXT_INIT), .cap = METRICS_HTTP_TEXT_INIT};
+	if (!text.data) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	text.data[0] = 0;
+	const char *type = "text/plain; charset=utf-8";
+	if (!status) {
+		char *path = conn->request + 4;
+		if (strncmp(conn->request, "GET ", 4) != 0)
+			status = "405 Method Not Allowed";
+		else if (strncmp(path, "/ ", 2) == 0 || strncmp(path, "/metrics ", 9) == 0 ||
+		         strncmp(path, "/metrics?", 9) == 0) {
+			status = "200 OK";
+			type = "text/plain; version=0.0.4; charset=utf-8";
+			expose(&text);
+		} else
+			status = "404 Not Found";
+	}
+	if (text.len == 0)
+		text_printf(&text, "%s\n", status);
+
+	char head[256];
+	int head_len = snprintf(head, sizeof(head),
+	                        "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+	                        status, type, text.len);
+	conn->response = (char *) malloc(head_len + text.len);
+	if (!conn->response) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	memcpy(conn->response, head, head_len);
+	memcpy(conn->response + head_len, text.data, text.len);
+	uv_buf_t buf = uv_buf_init(conn->response, (unsigned int) (head_len + text.len));
+	free(text.data);
+	uv_read_stop((uv_stream_t *) &conn->handle);
+	if (uv_write(&conn->write, (uv_stream_t *) &conn->handle, &buf, 1, on_write))
+		uv_close((uv_handle_t *) &conn->handle, on_close);
+}
+
+/**
+ * @brief Give the rest of the request buffer of a connection to libuv
+ * @param handle The connection
+ * @param suggested_size Suggested buffer size
+ * @param buf Buffer to be allocated
+ */
+static void alloc_request(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+	(void) suggested_size;
+	Metrics_Conn *conn = (Metrics_Conn *) handle->data;
+	*buf = uv_buf_init(conn->request + conn->len, (unsigned int) (METRICS_HTTP_REQUEST_MAX - 1 - conn->len));
+}
+
+/**
+ * @brief Callback function of a read on a scraper connection, the request is answered once its head is complete
+ * @param stream The connection
+ * @param nread Number of bytes read, negative on error or end of file
+ * @param buf The request buffer
+ */
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+	(void) buf;
+	Metrics_Conn *conn = (Metrics_Conn *) stream->data;
+	if (nread < 0) {
+		uv_close((uv_handle_t *) stream, on_close);
+		return;
+	}
+	conn->len += nread;
+	conn->request[conn->len] = 0;
+	if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n"))
+		respond(conn, NULL);
+	else if (conn->len == METRICS_HTTP_REQUEST_MAX - 1)
+		respond(conn, "431 Request Header Fields Too Large");
+}
+
+/**
+ * @brief Callback function for new scraper connections
+ * @param server The listening socket
+ * @param status Connection status
+ */
+static void on_connection(uv_stream_t *server, int status) {
+	if (status < 0) {
+		log_error("Metrics connection error %d", status)
+		return;
+	}
+	Metrics_Conn *conn = (Metrics_Conn *) calloc(1, sizeof(Metrics_Conn));
+	if (!conn) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	if (over_pipe)
+		uv_pipe_init(server->loop, &conn->handle.pipe, 0);
+	else
+		uv_tcp_init(server->loop, &conn->handle.tcp);
+	conn->handle.tcp.data = conn; // The handle fields come first in both members
+	if (uv_accept(server, (uv_stream_t *) &conn->handle)) {
+		uv_close((uv_handle_t *) &conn->handle, on_close);
+		return;
+	}
+	uv_read_start((uv_stream_t *) &conn->handle, alloc_request, on_read);
+}
+
+/**
+ * @brief Serve the metrics of every thread in the Prometheus text format on METRICS_LISTEN
+ * Each scrape sums up the thread-local counters, the threads themselves never synchronize for it.
+ * @param loop The libuv event loop serving the scrapers
+ * @param cache The cache, measured on each scrape
+ * @note A socket file left behind at the Unix socket path by an earlier run is replaced, any other file is not.
+ */
+void init_metrics_http(uv_loop_t *loop, Cache *cache) {
+	metrics_cache = cache;
+	int ret;
+	if (METRICS_LISTEN[0] == '/') {
+		over_pipe = true;
+#ifndef _WIN32
+		uv_fs_t req;
+		if (uv_fs_stat(NULL, &req, METRICS_LISTEN, NULL) == 0 && S_ISSOCK(req.statbuf.st_mode)) {
+			uv_fs_req_cleanup(&req);
+			uv_fs_unlink(NULL, &req, METRICS_LISTEN, NULL);
+		}
+		uv_fs_req_cleanup(&req);
+#endif
+		ret = uv_pipe_init(loop, &listener.pipe, 0);
+		if (!ret)
+			ret = uv_pipe_bind(&listener.pipe, METRICS_LISTEN);
+	} else {
+		struct sockaddr_storage addr;
+		parse_endpoint(METRICS_LISTEN, &addr);
+		ret = uv_tcp_init(loop, &listener.tcp);
+		if (!ret)
+			ret = uv_tcp_bind(&listener.tcp, (const struct sockaddr *) &addr, 0);
+	}
+	if (!ret)
+		ret = uv_listen((uv_stream_t *) &listener, SOMAXCONN, on_connection);
+	if (ret)
+		log_fatal("Failed to serve metrics on %s: %s", METRICS_LISTEN, uv_strerror(ret))
+	log_info("Serving metrics on %s", METRICS_LISTEN)
+}
@@ -0,0 +1,227 @@
+#include "../include/pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/log.h"
+#include "../include/dns_parse.h"
+#include "../include/dns_print.h"
+#include "../include/dns_server.h"
+#include "../include/heavy_hitters.h"
+#include "../include/metrics.h"
+#include "../include/query_log.h"
+#include "../include/query_pool.h"
+
+extern _Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+
+/**
+ * @brief Parse a query and answer it from the cache if possible, run by a parse worker
+ * @param pipeline The pipeline
+ * @param job The job, it may be moved by the call
+ * @return The job with either the response or the parsed query, or neither for a malformed query
+ */
+static Pipeline_Job *pipeline_process(Pipeline *pipeline, Pipeline_Job *job) {
+	print_dns_string(job->data, job->len);
+	Dns_Msg *msg = (Dns_Msg *) calloc(1, sizeof(Dns_Msg));
+	if (!msg) {
+		log_fatal("Memory allocation error")
+		return job;
+	}
+	trace_current = job->trace.at[TRACE_RECEIVED] ? &job->trace : NULL;
+	if (!string_to_dnsmsg_limit(msg, job->data, job->len)) { // Convert byte sequence to structure
+		log_debug("Malformed DNS query dropped")
+		destroy_dnsmsg(msg);
+		job->len = 0;
+		return job;
+	}
+	trace_mark(TRACE_PARSED)
+	trace_question(msg);
+	print_dns_message(msg);
+	query_log_query((const struct sockaddr *) &job->addr, false, msg);
+	heavy_hitters_query(msg);
+
+	Dns_Header header;
+	Dns_Msg reply = {.header = &header};
+	Cache_Source source;
+	Rbtree_Value *value = cache_answer(pipeline->cache, msg, &reply, &source);
+	if (value == NULL) { // The I/O thread sends it to a remote server
+		job->msg = msg;
+		return job;
+	}
+	uint16_t udp_size = client_udp_size(msg);
+	if (job->capacity < udp_size) {
+		Pipeline_Job *grown = (Pipeline_Job *) realloc(job, sizeof(Pipeline_Job) + udp_size);
+		if (!grown) {
+			log_fatal("Memory allocation error")
+			return job;
+		}
+		job = grown;
+		job->capacity = udp_size;
+		if (trace_current)
+			trace_current = &job->trace;
+	}
+	job->len = dnsmsg_to_string_limit(&reply, job->data, udp_size); // Convert DNS structure to byte stream
+	trace_mark(TRACE_SERIALIZED)
+	// Recorded before the I/O thread sends the response, the hand-off back is left out of the latency
+	query_log_response((const struct sockaddr *) &job->addr, false, &reply, (Query_Log_Outcome) source,
+	                   uv_hrtime() - job->received_at);
+	heavy_hitters_response(&reply);
+	destroy_dnsrr(value->rr);
+	free(value);
+	destroy_dnsmsg(msg);
+	return job;
+}
+
+/**
+ * @brief Callback function of a parse worker, it works through the jobs queued by the I/O thread
+ * @param handle The wakeup handle of the parse worker
+ *
+ * A job that finds the ring back to the I/O thread full waits for the I/O thread to drain it, so no answer is lost.
+ */
+static void on_jobs(uv_async_t *handle) {
+	Parse_Worker *worker = (Parse_Worker *) handle->data;
+	Pipeline *pipeline = worker->pipeline;
+	Pipeline_Job *job;
+	unsigned int done = 0;
+	while ((job = (Pipeline_Job *) worker->jobs->pop(worker->jobs))) {
+		job = pipeline_process(pipeline, job);
+		trace_current = NULL;
+		while (!pipeline->done->push(pipeline->done, job)) {
+			uv_async_send(&pipeline->done_async);
+			uv_sleep(1);
+		}
+		++done;
+	}
+	if (done)
+		uv_async_send(&pipeline->done_async);
+}
+
+/**
+ * @brief Entry of a parse worker thread
+ * @param arg The parse worker
+ */
+static void parse_worker_main(void *arg) {
+	Parse_Worker *worker = (Parse_Worker *) arg;
+	metrics_register();
+	uv_run(&worker->loop, UV_RUN_DEFAULT);
+}
+
+/**
+ * @brief Callback function of the I/O thread, it sends the answers of the parse workers
+ * and passes the queries the cache has no answer for to the query pool
+ * @param handle The done handle of the pipeline
+ */
+static void on_done(uv_async_t *handle) {
+	Pipeline *pipeline = (Pipeline *) handle->data;
+	Pipeline_Job *job;
+	while ((job = (Pipeline_Job *) pipeline->done->pop(pipeline->done))) {
+		trace_current = job->trace.at[TRACE_RECEIVED] ? &job->trace : NULL;
+		if (job->msg) {
+			qpool->forward(qpool, (const struct sockaddr *) &job->addr, job->socket, NULL, job->msg,
+			               job->received_at);
+			destroy_dnsmsg(job->msg);
+		} else if (job->len) {
+			metrics_add(pipeline_answered, 1);
+			send_raw_to_local(job->socket, (const struct sockaddr *) &job->addr, job->data, job->len);
+			metrics_record_latency(&metrics.local_latency, uv_hrtime() - job->received_at);
+		}
+		trace_current = NULL;
+		free(job);
+	}
+}
+
+/**
+ * @brief Hand a query received by the I/O thread to a parse worker
+ * @param pipeline The pipeline
+ * @param socket The listening socket the query came in on
+ * @param addr The address of the client
+ * @param data The query message
+ * @param len Length of the query message
+ * @return True if the query was queued, false if every parse worker is backlogged
+ *
+ * The parse workers take the jobs in turn, a backlogged worker is skipped.
+ */
+static bool pipeline_submit(Pipeline *pipeline, uv_udp_t *socket, const struct sockaddr *addr, const char *data,
+                            size_t len) {
+	unsigned int capacity = len > DNS_UDP_MIN_SIZE ? (unsigned int) len : DNS_UDP_MIN_SIZE;
+	Pipeline_Job *job = (Pipeline_Job *) malloc(sizeof(Pipeline_Job) + capacity);
+	if (!job) {
+		log_fatal("Memory allocation error")
+		return false;
+	}
+	job->socket = socket;
+	memcpy(&job->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	job->msg = NULL;
+	job->received_at = uv_hrtime();
+	trace_begin(&job->trace);
+	trace_current = NULL; // The job goes on on a parse worker
+	job->len = (unsigned int) len;
+	job->capacity = capacity;
+	memcpy(job->data, data, len);
+	for (unsigned int i = 0; i < pipeline->count; ++i) {
+		Parse_Worker *worker = &pipeline->workers[pipeline->next];
+		pipeline->next = (pipeline->next + 1) % pipeline->count;
+		if (worker->jobs->push(worker->jobs, job)) {
+			worker->signal = true;
+			metrics_add(pipeline_jobs, 1);
+			return true;
+		}
+	}
+	free(job);
+	return false;
+}
+
+/**
+ * @brief Wake the parse workers that got jobs since the last flush, once per loop iteration of the I/O thread
+ * @param pipeline The pipeline
+ */
+static void pipeline_flush(Pipeline *pipeline) {
+	for (unsigned int i = 0; i < pipeline->count; ++i)
+		if (pipeline->workers[i].signal) {
+			pipeline->workers[i].signal = false;
+			uv_async_send(&pipeline->workers[i].wakeup);
+		}
+}
+
+/**
+ * @brief Create a new pipeline and start PIPELINE_WORKERS parse workers
+ * @param loop The event loop of the I/O thread
+ * @param cache The cache
+ * @return The new pipeline
+ */
+Pipeline *new_pipeline(uv_loop_t *loop, Cache *cache) {
+	Pipeline *pipeline = (Pipeline *) calloc(1, sizeof(Pipeline));
+	if (!pipeline) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	pipeline->count = PIPELINE_WORKERS;
+	pipeline->cache = cache;
+	size_t done_size = PIPELINE_RING_SIZE;
+	while (done_size < (size_t) PIPELINE_RING_SIZE * pipeline->count)
+		done_size <<= 1;
+	pipeline->done = new_mpsc_ring(done_size);
+	uv_async_init(loop, &pipeline->done_async, on_done);
+	pipeline->done_async.data = pipeline;
+	pipeline->workers = (Parse_Worker *) calloc(pipeline->count, sizeof(Parse_Worker));
+	if (!pipeline->workers) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	pipeline->submit = &pipeline_submit;
+	pipeline->flush = &pipeline_flush;
+
+	for (unsigned int i = 0; i < pipeline->count; ++i) {
+		Parse_Worker *worker = &pipeline->workers[i];
+		worker->pipeline = pipeline;
+		worker->jobs = new_spsc_ring(PIPELINE_RING_SIZE);
+		if (uv_loop_init(&worker->loop))
+			log_fatal("Failed to initialize the event loop of parse worker %u", i)
+		uv_async_init(&worker->loop, &worker->wakeup, on_jobs);
+		worker->wakeup.data = worker;
+		if (uv_thread_create(&worker->thread, parse_worker_main, worker))
+			log_fatal("Failed to start parse worker %u", i)
+	}
+	return pipeline;
+}
@@ -0,0 +1,401 @@
+#include "../include/query_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "../include/cache.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+_Static_assert(QUERY_LOG_CACHE == (int) CACHE_HIT && QUERY_LOG_HOSTS == (int) CACHE_HOSTS &&
+               QUERY_LOG_BLOCKED == (int) CACHE_BLOCKED, "Cache_Source must number the local outcomes like the query log");
+
+static Query_Log_Ring *_Atomic rings; ///< Rings of every thread that recorded
+static _Thread_local Query_Log_Ring *ring; ///< Ring of the current thread
+static bool started; ///< Whether the writer thread runs
+static uv_mutex_t writer_lock; ///< Held while the rings are drained, by the writer thread or query_log_flush
+static uv_thread_t writer_thread; ///< The writer thread
+static const char *collector; ///< Path of the Unix socket of the collector, NULL when writing to a file
+static FILE *out_file; ///< The log file
+static int out_socket = -1; ///< Connection to the collector, -1 while it is down
+static uint64_t out_bytes; ///< Bytes written to the log file since it was opened
+static uint64_t retry_at; ///< High-resolution time of the next attempt to reach the collector
+
+/**
+ * @brief Write a big-endian 16-bit number
+ * @param p Where to write it
+ * @param value The number
+ */
+static void put16(uint8_t *p, uint16_t value) {
+	p[0] = (uint8_t) (value >> 8);
+	p[1] = (uint8_t) value;
+}
+
+/**
+ * @brief Write a big-endian 32-bit number
+ * @param p Where to write it
+ * @param value The number
+ */
+static void put32(uint8_t *p, uint32_t value) {
+	put16(p, (uint16_t) (value >> 16));
+	put16(p + 2, (uint16_t) value);
+}
+
+/**
+ * @brief Write a big-endian 64-bit number
+ * @param p Where to write it
+ * @param value The number
+ */
+static void put64(uint8_t *p, uint64_t value) {
+	put32(p, (uint32_t) (value >> 32));
+	put32(p + 4, (uint32_t) value);
+}
+
+/**
+ * @brief Get the record ring of the calling thread, registering it on first use
+ * @return The ring, NULL if it could not be allocated
+ */
+static Query_Log_Ring *query_log_ring() {
+	if (ring)
+		return ring;
+	Query_Log_Ring *new_ring = (Query_Log_Ring *) calloc(1, sizeof(Query_Log_Ring));
+	if (!new_ring) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	new_ring->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &new_ring->next, new_ring));
+	return ring = new_ring;
+}
+
+/**
+ * @brief Frame a record into the ring of the calling thread
+ * @param type Kind of the record
+ * @param addr The address of the client
+ * @param tcp Whether the client came over TCP
+ * @param msg The query or the response
+ * @param outcome Where the answer came from, 0 for a query
+ * @param latency Time from receiving the query to sending the response in nanoseconds, 0 for a query
+ *
+ * The record is dropped and counted if the ring has no room for it, the thread never waits for the writer.
+ */
+static void query_log_record(Query_Log_Type type, const struct sockaddr *addr, bool tcp, const Dns_Msg *msg,
+                             uint8_t outcome, uint64_t latency) {
+	Query_Log_Ring *r = query_log_ring();
+	if (!r)
+		return;
+	uint8_t frame[2 + QUERY_LOG_RECORD_MAX];
+	uint8_t *record = frame + 2;
+	uv_timeval64_t now;
+	uv_gettimeofday(&now);
+	record[0] = (uint8_t) type;
+	record[1] = tcp ? QUERY_LOG_FLAG_TCP : 0;
+	put64(record + 2, (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_usec);
+	put16(record + 10, msg->header->id);
+	put16(record + 12, msg->que ? msg->que->qtype : 0);
+	record[14] = type == QUERY_LOG_RESPONSE ? msg->header->rcode : 0;
+	record[15] = outcome;
+	latency /= 1000;
+	put32(record + 16, latency < UINT32_MAX ? (uint32_t) latency : UINT32_MAX);
+	size_t len = QUERY_LOG_RECORD_FIXED;
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *) addr;
+		record[1] |= QUERY_LOG_FLAG_IPV6;
+		put16(record + 20, ntohs(addr6->sin6_port));
+		memcpy(record + len, &addr6->sin6_addr, 16);
+		len += 16;
+	} else {
+		const struct sockaddr_in *addr4 = (const struct sockaddr_in *) addr;
+		put16(record + 20, ntohs(addr4->sin_port));
+		memcpy(record + len, &addr4->sin_addr, 4);
+		len += 4;
+	}
+	size_t name_len = msg->que ? strlen((const char *) msg->que->qname) : 0;
+	if (name_len > 255)
+		name_len = 255;
+	record[len++] = (uint8_t) name_len;
+	if (name_len)
+		memcpy(record + len, msg->que->qname, name_len);
+	len += name_len;
+	put16(frame, (uint16_t) len);
+	len += 2;
+
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (len > QUERY_LOG_RING_SIZE - (tail - head)) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	size_t pos = tail & (QUERY_LOG_RING_SIZE - 1);
+	size_t first = len < QUERY_LOG_RING_SIZE - pos ? len : QUERY_LOG_RING_SIZE - pos;
+	memcpy(r->data + pos, frame, first);
+	memcpy(r->data, frame + first, len - first);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+/**
+ * @brief Record a query received from a client, if QUERY_LOG is set
+ * @param addr The address of the client
+ * @param tcp Whether the query came over TCP
+ * @param msg The parsed query
+ */
+void query_log_query(const struct sockaddr *addr, bool tcp, const Dns_Msg *msg) {
+	if (started)
+		query_log_record(QUERY_LOG_QUERY, addr, tcp, msg, 0, 0);
+}
+
+/**
+ * @brief Record a response sent to a client, if QUERY_LOG is set
+ * @param addr The address of the client
+ * @param tcp Whether the response goes over TCP
+ * @param msg The response
+ * @param outcome Where the answer came from
+ * @param latency Time from receiving the query to sending the response in nanoseconds
+ */
+void query_log_response(const struct sockaddr *addr, bool tcp, const Dns_Msg *msg, Query_Log_Outcome outcome,
+                        uint64_t latency) {
+	if (started)
+		query_log_record(QUERY_LOG_RESPONSE, addr, tcp, msg, (uint8_t) outcome, latency);
+}
+
+/**
+ * @brief Record a query that is not parsed, with the fields read from the wire, if QUERY_LOG is set
+ * @param type QUERY_LOG_RESPONSE for a truncated response sent, QUERY_LOG_DROP for a query dropped
+ * @param addr The address of the client
+ * @param data The query message
+ * @param len Length of the query message
+ * @param outcome Why the query was not parsed
+ *
+ * Only the ID and the first question are read, a name that is compressed or runs past the message is left empty.
+ */
+void query_log_unparsed(Query_Log_Type type, const struct sockaddr *addr, const uint8_t *data, size_t len,
+                        Query_Log_Outcome outcome) {
+	if (!started || len < 12)
+		return;
+	uint8_t name[DNS_RR_NAME_MAX_SIZE];
+	size_t pos = 12, name_len = 0;
+	while (pos < len && data[pos] && !(data[pos] & 0xc0) && pos + 1 + data[pos] <= len &&
+	       name_len + data[pos] + 2 <= DNS_RR_NAME_MAX_SIZE) {
+		memcpy(name + name_len, data + pos + 1, data[pos]);
+		name_len += data[pos];
+		name[name_len++] = '.';
+		pos += 1 + data[pos];
+	}
+	bool named = (data[4] | data[5]) && pos + 5 <= len && !data[pos];
+	name[named ? name_len : 0] = 0;
+	Dns_Header header = {.id = (uint16_t) (data[0] << 8 | data[1])};
+	Dns_Que que = {.qname = name, .qtype = named ? (uint16_t) (data[pos + 1] << 8 | data[pos + 2]) : 0};
+	Dns_Msg msg = {.header = &header, .que = &que};
+	query_log_record(type, addr, false, &msg, (uint8_t) outcome, 0);
+}
+
+/**
+ * @brief Write to the log file or the collector
+ * @param data The bytes
+ * @param len Number of bytes
+ * @return False if the collector went away, the bytes are then to be written again once it is back
+ */
+static bool out_write(const void *data, size_t len) {
+#ifndef _WIN32
+	if (collector) {
+		for (size_t sent = 0; sent < len;) {
+#ifdef MSG_NOSIGNAL
+			ssize_t n = send(out_socket, (const char *) data + sent, len - sent, MSG_NOSIGNAL);
+#else
+			ssize_t n = send(out_socket, (const char *) data + sent, len - sent, 0);
+#endif
+			if (n <= 0) {
+				log_error("Lost the query log collector on %s", collector)
+				close(out_socket);
+				out_socket = -1;
+				retry_at = uv_hrtime() + (uint64_t) QUERY_LOG_RETRY_INTERVAL * 1000000;
+				return false;
+			}
+			sent += (size_t) n;
+		}
+		return true;
+	}
+#endif
+	if (fwrite(data, 1, len, out_file) != len)
+		log_error("Failed to write the query log")
+	out_bytes += len;
+	return true;
+}
+
+/**
+ * @brief Write the magic and the version that start every file and every connection
+ * @return False if the collector went away
+ */
+static bool out_head() {
+	uint8_t head[QUERY_LOG_HEAD_SIZE];
+	memcpy(head, QUERY_LOG_MAGIC, QUERY_LOG_HEAD_SIZE - 2);
+	put16(head + QUERY_LOG_HEAD_SIZE - 2, QUERY_LOG_VERSION);
+	return out_write(head, QUERY_LOG_HEAD_SIZE);
+}
+
+/**
+ * @brief Check that the collector is connected, trying to reconnect once QUERY_LOG_RETRY_INTERVAL has passed
+ * @return True if records can be written
+ */
+static bool out_ready() {
+#ifndef _WIN32
+	if (!collector || out_socket >= 0)
+		return true;
+	if (uv_hrtime() < retry_at)
+		return false;
+	retry_at = uv_hrtime() + (uint64_t) QUERY_LOG_RETRY_INTERVAL * 1000000;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, collector, sizeof(addr.sun_path) - 1);
+	out_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (out_socket < 0)
+		return false;
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(out_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	if (connect(out_socket, (const struct sockaddr *) &addr, sizeof(addr))) {
+		close(out_socket);
+		out_socket = -1;
+		return false;
+	}
+	log_info("Writing the query log to the collector on %s", collector)
+	return out_head();
+#else
+	return true;
+#endif
+}
+
+/**
+ * @brief Start a new log file once the current one has reached QUERY_LOG_SIZE megabytes
+ * QUERY_LOG becomes QUERY_LOG.1 and the older files move up by one, the oldest beyond QUERY_LOG_ROTATIONS is removed.
+ */
+static void out_rotate() {
+	if (collector || !QUERY_LOG_SIZE || out_bytes < (uint64_t) QUERY_LOG_SIZE << 20)
+		return;
+	size_t len = strlen(QUERY_LOG) + 4;
+	char *from = (char *) malloc(len), *to = (char *) malloc(len);
+	if (!from || !to) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	fclose(out_file);
+	snprintf(to, len, "%s.%d", QUERY_LOG, QUERY_LOG_ROTATIONS);
+	remove(to);
+	for (int i = QUERY_LOG_ROTATIONS - 1; i > 0; --i) {
+		snprintf(from, len, "%s.%d", QUERY_LOG, i);
+		snprintf(to, len, "%s.%d", QUERY_LOG, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, len, "%s.1", QUERY_LOG);
+	if (rename(QUERY_LOG, to))
+		log_error("Failed to rotate the query log %s", QUERY_LOG)
+	free(from);
+	free(to);
+	out_file = fopen(QUERY_LOG, "wb");
+	if (!out_file)
+		log_fatal("Failed to open the query log %s", QUERY_LOG)
+	out_bytes = 0;
+	out_head();
+}
+
+/**
+ * @brief Write the waiting records of every ring out, with the writer lock held
+ * @return True if anything was written, false otherwise
+ *
+ * While the collector is down the records stay in the rings, and the threads drop new ones once their ring is full.
+ */
+static bool drain_rings() {
+	if (!out_ready())
+		return false;
+	bool wrote = false;
+	for (Query_Log_Ring *r = atomic_load(&rings); r; r = r->next) {
+		size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head != tail) {
+			size_t pos = head & (QUERY_LOG_RING_SIZE - 1);
+			size_t len = tail - head;
+			size_t first = len < QUERY_LOG_RING_SIZE - pos ? len : QUERY_LOG_RING_SIZE - pos;
+			if (!out_write(r->data + pos, first) || !out_write(r->data, len - first))
+				return wrote;
+			atomic_store_explicit(&r->head, tail, memory_order_release);
+			wrote = true;
+		}
+		size_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+		if (dropped != r->dropped_reported) {
+			log_error("%zu query log records dropped, the writer fell behind", dropped - r->dropped_reported)
+			r->dropped_reported = dropped;
+		}
+	}
+	if (wrote && out_file)
+		fflush(out_file);
+	out_rotate();
+	return wrote;
+}
+
+/**
+ * @brief Write every waiting record out right away, at exit
+ */
+static void query_log_flush() {
+	uv_mutex_lock(&writer_lock);
+	drain_rings();
+	uv_mutex_unlock(&writer_lock);
+}
+
+/**
+ * @brief Entry of the writer thread, it drains the rings and sleeps while they are empty
+ * @param arg Unused
+ */
+static void writer_main(void *arg) {
+	for (;;) {
+		uv_mutex_lock(&writer_lock);
+		bool wrote = drain_rings();
+		uv_mutex_unlock(&writer_lock);
+		if (!wrote)
+			uv_sleep(QUERY_LOG_FLUSH_INTERVAL);
+	}
+}
+
+/**
+ * @brief Open QUERY_LOG and start the writer thread, from then on records are only copied into the ring of their thread
+ *
+ * A path starting with unix: names the socket of a collector, which gets the same stream as a file would.
+ */
+void init_query_log(void) {
+	if (!QUERY_LOG)
+		return;
+	if (strncmp(QUERY_LOG, "unix:", 5) == 0) {
+#ifdef _WIN32
+		log_fatal("Writing the query log to a Unix socket is not supported on this platform")
+#else
+		collector = QUERY_LOG + 5;
+		if (strlen(collector) >= sizeof(((struct sockaddr_un *) NULL)->sun_path))
+			log_fatal("Query log socket path %s is too long", collector)
+		if (!out_ready())
+			log_error("Query log collector on %s is down, records are kept until it is up", collector)
+#endif
+	} else {
+		out_file = fopen(QUERY_LOG, "ab");
+		if (!out_file)
+			log_fatal("Failed to open the query log %s", QUERY_LOG)
+		fseek(out_file, 0, SEEK_END);
+		out_bytes = (uint64_t) ftell(out_file);
+		if (!out_bytes)
+			out_head();
+	}
+	if (uv_mutex_init(&writer_lock))
+		log_fatal("Failed to initialize the query log writer lock")
+	if (uv_thread_create(&writer_thread, writer_main, NULL))
+		log_fatal("Failed to start the query log writer")
+	started = true;
+	atexit(query_log_flush);
+	log_info("Recording every query and response to %s", QUERY_LOG)
+}
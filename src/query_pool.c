@@ -1,23 +1,395 @@
 #include "../include/query_pool.h"
 
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "../include/config.h"
 #include "../include/log.h"
+#include "../include/metrics.h"
 #include "../include/dns_parse.h"
 #include "../include/dns_client.h"
 #include "../include/dns_server.h"
+#include "../include/heavy_hitters.h"
+#include "../include/query_log.h"
+#include "../include/tcp_server.h"
+#include "../include/upstream_tcp.h"
+
+/**
+ * @brief Send the response of a query to its client and to every waiter, over the transport each came in on
+ * @param query The query, whose message holds the response
+ * @param outcome QUERY_LOG_UPSTREAM for the reply of a remote server, otherwise why the response is SERVFAIL
+ */
+static void respond(Dns_Query *query, Query_Log_Outcome outcome) {
+	uint64_t now = uv_hrtime();
+	metrics_record_latency(&metrics.remote_latency, now - query->started_at);
+	Dns_Msg *msg = query->msg;
+	query_log_response((const struct sockaddr *) &query->addr, query->conn, msg, outcome, now - query->started_at);
+	heavy_hitters_response(msg);
+	Trace *outer = trace_current;
+	trace_current = query->trace.at[TRACE_RECEIVED] ? &query->trace : NULL;
+	if (query->conn)
+		send_to_tcp(query->conn, msg);
+	else
+		send_to_local(query->socket, (const struct sockaddr *) &query->addr, msg, query->udp_size);
+	trace_current = outer; // The waiters are not traced
+	for (const Query_Waiter *waiter = query->waiters; waiter; waiter = waiter->next) {
+		msg->header->id = waiter->prev_id;
+		query_log_response((const struct sockaddr *) &waiter->addr, waiter->conn, msg, outcome, now - waiter->started_at);
+		heavy_hitters_response(msg);
+		if (waiter->conn)
+			send_to_tcp(waiter->conn, msg);
+		else
+			send_to_local(waiter->socket, (const struct sockaddr *) &waiter->addr, msg, waiter->udp_size);
+	}
+}
+
+/**
+ * @brief Answer a client right away, without a query in the pool
+ * @param addr The address of the client
+ * @param socket The listening socket the query came in on, NULL if the query came over TCP
+ * @param conn The TCP connection of the client, NULL if the query came over UDP
+ * @param msg The response
+ * @param udp_size Largest UDP payload the client accepts
+ */
+static void reply_now(const struct sockaddr *addr, uv_udp_t *socket, Tcp_Conn *conn, const Dns_Msg *msg,
+                      uint16_t udp_size) {
+	if (conn)
+		send_to_tcp(conn, msg);
+	else
+		send_to_local(socket, addr, msg, udp_size);
+}
+
+/**
+ * @brief Feed the time a query waited in the worker before it could be sent on into the admission control
+ * @param qpool The query pool
+ * @param received_at High-resolution time the query was received in nanoseconds
+ *
+ * Shedding starts once queries have waited longer than SHED_TARGET for QUERY_SHED_INTERVAL,
+ * and stops with the first query that waits less. The time in flight is left out, it is the round trip
+ * of the remote server and says nothing of the load of the worker.
+ */
+static void codel_sample(Query_Pool *qpool, uint64_t received_at) {
+	if (!SHED_TARGET)
+		return;
+	Query_Codel *codel = &qpool->codel;
+	uint64_t now = uv_now(qpool->loop), hrnow = uv_hrtime();
+	uint64_t waited = hrnow > received_at ? (hrnow - received_at) / 1000000 : 0;
+	if (waited < (uint64_t) SHED_TARGET) {
+		codel->first_above = 0;
+		codel->shedding = false;
+		return;
+	}
+	if (!codel->first_above) {
+		codel->first_above = now + QUERY_SHED_INTERVAL;
+		return;
+	}
+	if (codel->shedding || now < codel->first_above)
+		return;
+	log_error("Queries wait longer than %d ms before they are sent on, shedding load", SHED_TARGET)
+	codel->shedding = true;
+	// Pick up near the last rate if the previous period ended recently (RFC 8289 5.4)
+	codel->count = codel->count > 2 && now - codel->shed_next < 8 * QUERY_SHED_INTERVAL ? codel->count - 2 : 1;
+	codel->shed_next = now;
+}
+
+/**
+ * @brief Decide whether a new query that needs a remote server is shed
+ * @param qpool The query pool
+ * @return true if the query is shed
+ * @note While shedding, the gap between shed queries shrinks with the square root of their number (RFC 8289).
+ */
+static bool codel_shed(Query_Pool *qpool) {
+	Query_Codel *codel = &qpool->codel;
+	if (!codel->shedding)
+		return false;
+	uint64_t now = uv_now(qpool->loop);
+	if (now < codel->shed_next)
+		return false;
+	++codel->count;
+	codel->shed_next = now + (uint64_t) (QUERY_SHED_INTERVAL / sqrt(codel->count));
+	return true;
+}
+
+/**
+ * @brief Hash a question
+ * @param que The question
+ * @return BKDR hash of the name, type and class
+ */
+static unsigned int question_hash(const Dns_Que *que) {
+	unsigned int hash = 0;
+	for (const uint8_t *str = que->qname; *str; ++str)
+		hash = hash * 131 + *str;
+	return (hash * 131 + que->qtype) * 131 + que->qclass;
+}
+
+/**
+ * @brief Flags of a query the answer of a remote server depends on, a query only joins another with the same flags
+ * @param msg The query
+ * @return RD, CD, whether the query carries an OPT record, its DO bit and its EDNS version, as a bit mask
+ */
+static uint16_t query_flags(const Dns_Msg *msg) {
+	uint16_t flags = msg->header->rd | (msg->header->z & 1) << 1; // CD is the lowest bit of z
+	for (const Dns_RR *prr = msg->rr; prr; prr = prr->next)
+		if (prr->type == DNS_TYPE_OPT) { // The TTL holds the version and DO (RFC 6891 6.1.3)
+			flags |= 1 << 2 | (prr->ttl & 0x8000 ? 1 << 3 : 0) | (prr->ttl >> 16 & 0xff) << 8;
+			break;
+		}
+	return flags;
+}
+
+/**
+ * @brief Find the query in flight with the same question and flags that still takes waiters
+ * @param qpool The query pool
+ * @param que The question
+ * @param hash Hash of the question
+ * @param flags Flags of the query, see query_flags
+ * @return The query, NULL if there is none
+ * @note Names are compared byte for byte, so that every waiter gets back the name as it asked it
+ */
+static Dns_Query *pending_find(Query_Pool *qpool, const Dns_Que *que, unsigned int hash, uint16_t flags) {
+	for (Dns_Query *query = qpool->pending[hash % QUERY_PENDING_BUCKETS]; query; query = query->pending_next) {
+		const Dns_Que *other = query->msg->que;
+		if (query->hash == hash && query->flags == flags && query->waiter_count < QUERY_MAX_WAITERS &&
+		    other->qtype == que->qtype && other->qclass == que->qclass &&
+		    strcmp((const char *) other->qname, (const char *) que->qname) == 0)
+			return query;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Remove a query from the table of questions in flight
+ * @param qpool The query pool
+ * @param query The query
+ */
+static void pending_remove(Query_Pool *qpool, Dns_Query *query) {
+	Dns_Query **link = &qpool->pending[query->hash % QUERY_PENDING_BUCKETS];
+	while (*link != query)
+		link = &(*link)->pending_next;
+	*link = query->pending_next;
+	query->pending = false;
+}
+
+/**
+ * @brief Get the largest UDP payload a client accepts
+ * @param msg The DNS message containing the query
+ * @return The payload size of the EDNS OPT record, or 512 without one (RFC 6891 6.2.3)
+ */
+uint16_t client_udp_size(const Dns_Msg *msg) {
+	for (const Dns_RR *prr = msg->rr; prr; prr = prr->next)
+		if (prr->type == DNS_TYPE_OPT) {
+			if (prr->class < DNS_UDP_MIN_SIZE)
+				return DNS_UDP_MIN_SIZE;
+			return prr->class < DNS_STRING_MAX_SIZE ? prr->class : DNS_STRING_MAX_SIZE;
+		}
+	return DNS_UDP_MIN_SIZE;
+}
+
+/**
+ * @brief Answer a query with SERVFAIL and delete it from the query pool
+ * @param query The query
+ * @param outcome QUERY_LOG_TIMEOUT after the timeout, QUERY_LOG_UNSENT if the query could not be sent
+ */
+static void servfail(Dns_Query *query, Query_Log_Outcome outcome) {
+	metrics_add(upstream_servfails, 1);
+	query->msg->header->id = query->prev_id;
+	query->msg->header->qr = DNS_QR_ANSWER;
+	query->msg->header->ra = query->msg->header->rd;
+	query->msg->header->rcode = DNS_RCODE_SERVFAIL;
+	respond(query, outcome);
+	query->qpool->delete(query->qpool, query->id);
+}
 
 /**
  * @brief Timeout callback function
  * This function is called when a query times out.
- * It stops the timer and deletes the query from the query pool.
+ * It records the timeout against the remote servers, answers the client with SERVFAIL
+ * and deletes the query from the query pool.
  * @param timer The timer that timed out
  */
 static void timeout_cb(uv_timer_t *timer) {
-	log_info("Timeout")
+	log_debug("Timeout")
 	uv_timer_stop(timer);
-	Query_Pool *qpool = *(Query_Pool **) (timer->data + sizeof(uint16_t));
-	qpool->delete(qpool, *(uint16_t *) timer->data);
+	Dns_Query *query = (Dns_Query *) timer->data;
+	for (unsigned int i = 0; i < query->attempt_count; ++i)
+		upstream_timeout(query->attempts[i].upstream);
+	servfail(query, QUERY_LOG_TIMEOUT);
+}
+
+/**
+ * @brief Unlink a slab chunk from the list of chunks with free queries
+ * @param qpool The query pool
+ * @param chunk The chunk
+ */
+static void chunk_unlink(Query_Pool *qpool, Query_Chunk *chunk) {
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		qpool->partial = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	chunk->prev = chunk->next = NULL;
+}
+
+/**
+ * @brief Take a zeroed query from the slab, a new chunk is allocated when no chunk has a free query
+ * @param qpool The query pool
+ * @return The query, NULL if the allocation failed
+ */
+static Dns_Query *query_alloc(Query_Pool *qpool) {
+	Query_Chunk *chunk = qpool->partial;
+	if (!chunk) {
+		chunk = (Query_Chunk *) malloc(sizeof(Query_Chunk));
+		if (!chunk) {
+			log_fatal("Memory allocation error")
+			return NULL;
+		}
+		chunk->prev = chunk->next = NULL;
+		chunk->free = NULL;
+		chunk->used = 0;
+		for (int i = QUERY_CHUNK_SIZE - 1; i >= 0; --i) {
+			chunk->queries[i].free_next = chunk->free;
+			chunk->free = &chunk->queries[i];
+		}
+		qpool->partial = chunk;
+		++qpool->empty_chunks;
+	}
+	Dns_Query *query = chunk->free;
+	chunk->free = query->free_next;
+	if (chunk->used++ == 0)
+		--qpool->empty_chunks;
+	if (!chunk->free)
+		chunk_unlink(qpool, chunk);
+	memset(query, 0, sizeof(Dns_Query));
+	query->chunk = chunk;
+	return query;
+}
+
+/**
+ * @brief Give a query back to the slab
+ * @param qpool The query pool
+ * @param query The query
+ * @note A chunk that has no query in use any more is freed, except for one spare chunk kept against churn
+ */
+static void query_free(Query_Pool *qpool, Dns_Query *query) {
+	Query_Chunk *chunk = query->chunk;
+	if (!chunk->free) {
+		chunk->next = qpool->partial;
+		if (qpool->partial)
+			qpool->partial->prev = chunk;
+		qpool->partial = chunk;
+	}
+	query->free_next = chunk->free;
+	chunk->free = query;
+	if (--chunk->used == 0 && ++qpool->empty_chunks > 1) {
+		chunk_unlink(qpool, chunk);
+		free(chunk);
+		--qpool->empty_chunks;
+	}
+}
+
+/**
+ * @brief Callback function of a closed query timer, the query is freed once all of its timers are closed
+ * @param handle The timer
+ */
+static void on_timer_close(uv_handle_t *handle) {
+	Dns_Query *query = (Dns_Query *) handle->data;
+	if (--query->handles == 0)
+		query_free(query->qpool, query);
+}
+
+/**
+ * @brief Register a new index of a query on a socket under a random ID
+ * @param qpool The query pool
+ * @param query The query
+ * @param socket The upstream socket, INDEX_SOCKET_TCP over TCP
+ * @param id The ID of the new index
+ * @return false if the index pool is full or no free ID was found
+ */
+static bool index_register(Query_Pool *qpool, const Dns_Query *query, uint8_t socket, uint16_t *id) {
+	if (qpool->ipool->full(qpool->ipool)) {
+		log_error("Index pool full")
+		return false;
+	}
+	Index index = {.qhash = query->hash, .prev_id = query->id, .socket = socket};
+	if (!qpool->ipool->insert(qpool->ipool, &index)) {
+		log_error("No free ID for the question")
+		return false;
+	}
+	*id = index.id;
+	return true;
+}
+
+/**
+ * @brief Send a query to a remote server under a new index
+ * The request leaves from a random upstream socket under a random ID.
+ * @param qpool The query pool
+ * @param query The query
+ * @param up The remote server
+ * @return false if no index could be registered or the request could not be sent, no attempt is then recorded
+ */
+static bool send_attempt(Query_Pool *qpool, Dns_Query *query, Upstream *up) {
+	uint8_t socket = UPSTREAM_TCP ? INDEX_SOCKET_TCP : qpool->ipool->random_id(qpool->ipool) % UPSTREAM_SOCKETS;
+	uint16_t id;
+	if (!index_register(qpool, query, socket, &id))
+		return false;
+	Query_Attempt *attempt = &query->attempts[query->attempt_count++];
+	attempt->id = id;
+	attempt->socket = socket;
+	attempt->upstream = up;
+	attempt->sent_at = uv_hrtime();
+	query->msg->header->id = id;
+	if (!send_to_remote(up, socket, query->msg)) {
+		qpool->ipool->delete(qpool->ipool, socket, id, query->hash);
+		--query->attempt_count;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Retransmission timer callback function
+ * This function is called when the first request has not been answered within the RTO of its server.
+ * The loss is recorded against the server and, up to RETRIES times, the request is sent again under the same
+ * ID with the timeout doubled each time. The retransmission goes to another server if the first one is now down.
+ * @param timer The retransmission timer
+ */
+static void retransmit_cb(uv_timer_t *timer) {
+	Dns_Query *query = (Dns_Query *) timer->data;
+	Query_Attempt *attempt = &query->attempts[0];
+	upstream_loss(attempt->upstream);
+	if (query->tcp_retry || attempt->retransmits == (unsigned int) RETRIES)
+		return;
+	if (upstream_is_down(attempt->upstream))
+		attempt->upstream = upstream_select(query->group);
+	++attempt->retransmits;
+	metrics_add(upstream_retransmits, 1);
+	log_debug("Retransmitting query ID: 0x%08x", query->id)
+	query->msg->header->id = attempt->id;
+	send_to_remote(attempt->upstream, attempt->socket, query->msg); // Tried again at the next timeout if not sent
+	uv_timer_start(timer, retransmit_cb, upstream_rto(attempt->upstream) << attempt->retransmits, 0);
+}
+
+/**
+ * @brief Hedge timer callback function
+ * This function is called when the first server has not answered within its p95 RTT.
+ * If the budget allows it, the query is also sent to another server.
+ * @param timer The hedge timer
+ */
+static void hedge_cb(uv_timer_t *timer) {
+	Dns_Query *query = (Dns_Query *) timer->data;
+	Query_Pool *qpool = query->qpool;
+	if (query->tcp_retry || query->attempt_count == QUERY_MAX_ATTEMPTS || qpool->hedge_tokens < 1)
+		return;
+	Upstream *up = upstream_select_other(query->attempts[0].upstream, query->group);
+	if (!up)
+		return;
+	log_debug("Hedging query ID: 0x%08x", query->id)
+	if (send_attempt(qpool, query, up)) {
+		qpool->hedge_tokens -= 1;
+		metrics_add(upstream_hedges, 1);
+	}
 }
 
 /**
@@ -26,78 +398,208 @@ static void timeout_cb(uv_timer_t *timer) {
  * @return true if the query pool is full, false otherwise
  */
 static bool qpool_full(Query_Pool *this) {
-	return this->count == QUERY_POOL_MAX_SIZE;
+	return this->count >= (unsigned int) MAX_QUERIES;
 }
 
 /**
- * @brief Insert a new query into the query pool
- * This function creates a new query and inserts it into the query pool.
- * If the query is found in the cache, it is immediately processed and sent to the local client.
- * Otherwise, it is sent to the remote DNS server and a timeout timer is started.
+ * @brief Double the number of slots of the query pool, up to MAX_QUERIES
+ * @param qpool The query pool
+ * @return true if new slots were added, false otherwise
+ * @note The slot map never shrinks, the queries themselves are returned to the system by query_free
+ */
+static bool qpool_grow(Query_Pool *qpool) {
+	unsigned int capacity = qpool->capacity * 2;
+	if (capacity > (unsigned int) MAX_QUERIES)
+		capacity = MAX_QUERIES;
+	if (capacity <= qpool->capacity)
+		return false;
+	Query_Slot *slots = (Query_Slot *) realloc(qpool->slots, capacity * sizeof(Query_Slot));
+	if (!slots) {
+		log_fatal("Memory allocation error")
+		return false;
+	}
+	memset(slots + qpool->capacity, 0, (capacity - qpool->capacity) * sizeof(Query_Slot));
+	for (unsigned int i = qpool->capacity; i < capacity; ++i)
+		qpool->queue->push(qpool->queue, i);
+	log_debug("Growing query pool to %u slots", capacity)
+	qpool->slots = slots;
+	qpool->capacity = capacity;
+	return true;
+}
+
+/**
+ * @brief Look up the answer to a query in the cache and the hosts file
+ * @param cache The cache
+ * @param msg The query
+ * @param reply The reply to fill in, its header must point to storage for the header
+ * @param source Set to where the answer was found
+ * @return The cache value holding the records of the reply, to be freed with destroy_dnsrr and free once the reply is sent,
+ * NULL if there is no answer
+ */
+Rbtree_Value *cache_answer(Cache *cache, const Dns_Msg *msg, Dns_Msg *reply, Cache_Source *source) {
+	Rbtree_Value *value = cache->query(cache, msg->que, source);
+	trace_mark(TRACE_LOOKED_UP)
+	if (value == NULL)
+		return NULL;
+	Dns_Header *header = reply->header;
+	*header = *msg->header;
+	reply->que = msg->que;
+	reply->rr = value->rr;
+	header->qr = DNS_QR_ANSWER;
+	if (header->rd == 1) header->ra = 1;
+	header->ancount = value->ancount;
+	header->nscount = value->nscount;
+	header->arcount = value->arcount;
+
+	// Poisoning
+	if (value->rr->type == 255 && (*(int *) value->rr->rdata) == 0) {
+		header->rcode = DNS_RCODE_NXDOMAIN;
+		reply->rr = NULL;
+		header->ancount = 0;
+	}
+	return value;
+}
+
+/**
+ * @brief Insert a query the cache has no answer for into the query pool
+ * It joins the same question already in flight, or is sent to a remote DNS server with a timeout timer started,
+ * unless the pool is full or the admission control sheds it, then it is answered right away with SHED_RCODE.
  * @param qpool The query pool
  * @param addr The address of the client
+ * @param socket The listening socket the query came in on, NULL if the query came over TCP
+ * @param conn The TCP connection of the client, NULL if the query came over UDP
  * @param msg The DNS message containing the query
+ * @param received_at High-resolution time the query was received in nanoseconds, for the admission control
  */
-static void qpool_insert(Query_Pool *qpool, const struct sockaddr *addr, const Dns_Msg *msg) {
-	log_debug("Adding new query request")
-	Dns_Query *query = (Dns_Query *) calloc(1, sizeof(Dns_Query));
-	if (!query) {
-		log_fatal("Memory allocation error")
+static void qpool_forward(Query_Pool *qpool, const struct sockaddr *addr, uv_udp_t *socket, Tcp_Conn *conn,
+                          const Dns_Msg *msg, uint64_t received_at) {
+	codel_sample(qpool, received_at);
+	unsigned int hash = question_hash(msg->que);
+	uint16_t flags = query_flags(msg);
+	Dns_Query *leader = pending_find(qpool, msg->que, hash, flags);
+	if (leader) {
+		log_debug("Joining query ID: 0x%08x in flight", leader->id)
+		Query_Waiter *waiter = (Query_Waiter *) calloc(1, sizeof(Query_Waiter));
+		if (!waiter) {
+			log_fatal("Memory allocation error")
+			return;
+		}
+		waiter->prev_id = msg->header->id;
+		memcpy(&waiter->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+		waiter->socket = socket;
+		waiter->conn = conn;
+		if (conn)
+			++conn->pending;
+		waiter->udp_size = client_udp_size(msg);
+		waiter->started_at = uv_hrtime();
+		waiter->next = leader->waiters;
+		leader->waiters = waiter;
+		++leader->waiter_count;
+		metrics_add(queries_coalesced, 1);
 		return;
 	}
-	uint16_t id = qpool->queue->pop(qpool->queue);
-	qpool->pool[id % QUERY_POOL_MAX_SIZE] = query;
+	bool full = qpool_full(qpool) || (qpool->count == qpool->capacity && !qpool_grow(qpool));
+	if (full || codel_shed(qpool)) {
+		if (full)
+			metrics_add(queries_shed_full, 1);
+		else
+			metrics_add(queries_shed_codel, 1);
+		log_debug("Shedding query for %s", msg->que->qname)
+		Dns_Header header = *msg->header;
+		Dns_Msg reply = {.header = &header, .que = msg->que, .rr = NULL};
+		header.qr = DNS_QR_ANSWER;
+		header.ra = header.rd;
+		header.rcode = SHED_RCODE;
+		header.ancount = header.nscount = header.arcount = 0;
+		reply_now(addr, socket, conn, &reply, client_udp_size(msg));
+		query_log_response(addr, conn, &reply, QUERY_LOG_SHED, 0);
+		return;
+	}
+	Dns_Query *query = query_alloc(qpool);
+	if (!query)
+		return;
+	uint16_t slot = qpool->queue->pop(qpool->queue);
+	uint32_t id = (uint32_t) qpool->slots[slot].generation << 16 | slot;
+	qpool->slots[slot].query = query;
 	qpool->count++;
+	metrics_set(queries_in_flight, qpool->count);
+	if (qpool->count > metrics.query_high_water)
+		metrics_set(query_high_water, qpool->count);
 
 	query->id = id;
+	query->qpool = qpool;
+	query->hash = hash;
+	query->flags = flags;
 	query->prev_id = msg->header->id;
-	query->addr = *addr;
+	memcpy(&query->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	query->socket = socket;
+	query->conn = conn;
+	if (conn)
+		++conn->pending;
+	query->udp_size = client_udp_size(msg);
+	query->started_at = uv_hrtime();
 	query->msg = copy_dnsmsg(msg);
 
-	Rbtree_Value *value = qpool->cache->query(qpool->cache, query->msg->que);
-	if (value != NULL) {
-		query->msg->header->qr = DNS_QR_ANSWER;
-		if (query->msg->header->rd == 1) query->msg->header->ra = 1;
-		query->msg->header->ancount = value->ancount;
-		query->msg->header->nscount = value->nscount;
-		query->msg->header->arcount = value->arcount;
-		query->msg->rr = value->rr;
-
-		// Poisoning
-		if (value->rr->type == 255 && (*(int *) value->rr->rdata) == 0) {
-			query->msg->header->rcode = DNS_RCODE_NXDOMAIN;
-			destroy_dnsrr(query->msg->rr);
-			query->msg->rr = NULL;
-			query->msg->header->ancount = 0;
-		}
+	query->group = upstream_route(query->msg->que->qname);
+	Upstream *up = upstream_select(query->group);
+	if (!send_attempt(qpool, query, up)) {
+		servfail(query, QUERY_LOG_UNSENT);
+		return;
+	}
+	trace_mark(TRACE_UPSTREAM_SENT)
+	trace_attach(&query->trace);
+	uv_timer_init(qpool->loop, &query->timer);
+	uv_timer_init(qpool->loop, &query->hedge_timer);
+	uv_timer_init(qpool->loop, &query->retransmit_timer);
+	query->timer.data = query->hedge_timer.data = query->retransmit_timer.data = query;
+	query->pending_next = qpool->pending[hash % QUERY_PENDING_BUCKETS];
+	qpool->pending[hash % QUERY_PENDING_BUCKETS] = query;
+	query->pending = true;
+	query->handles = 3;
+	uv_timer_start(&query->timer, timeout_cb, QUERY_TIMEOUT, 0);
+	// Over TCP too, a request in flight on a connection that breaks is only sent again by this timer
+	uv_timer_start(&query->retransmit_timer, retransmit_cb, upstream_rto(up), 0);
+	if (HEDGE_BUDGET) {
+		qpool->hedge_tokens += HEDGE_BUDGET / 100.0;
+		if (qpool->hedge_tokens > QUERY_HEDGE_BURST)
+			qpool->hedge_tokens = QUERY_HEDGE_BURST;
+		uv_timer_start(&query->hedge_timer, hedge_cb, upstream_hedge_delay(up), 0);
+	}
+}
 
-		send_to_local(addr, query->msg);
+/**
+ * @brief Insert a new query into the query pool
+ * This function creates a new query and inserts it into the query pool.
+ * If the query is found in the cache, it is immediately processed and sent to the local client.
+ * Otherwise, it is forwarded, see qpool_forward.
+ * @param qpool The query pool
+ * @param addr The address of the client
+ * @param socket The listening socket the query came in on, NULL if the query came over TCP
+ * @param conn The TCP connection of the client, NULL if the query came over UDP
+ * @param msg The DNS message containing the query
+ */
+static void qpool_insert(Query_Pool *qpool, const struct sockaddr *addr, uv_udp_t *socket, Tcp_Conn *conn,
+                         const Dns_Msg *msg) {
+	log_debug("Adding new query request")
+	uint64_t start = uv_hrtime();
+	query_log_query(addr, conn, msg);
+	heavy_hitters_query(msg);
+	Dns_Header header;
+	Dns_Msg reply = {.header = &header};
+	Cache_Source source;
+	Rbtree_Value *value = cache_answer(qpool->cache, msg, &reply, &source);
+	if (value != NULL) { // Always answered, a hit needs neither a slot nor a remote server
+		reply_now(addr, socket, conn, &reply, client_udp_size(msg));
+		uint64_t latency = uv_hrtime() - start;
+		query_log_response(addr, conn, &reply, (Query_Log_Outcome) source, latency);
+		heavy_hitters_response(&reply);
+		destroy_dnsrr(value->rr);
 		free(value);
-		qpool->delete(qpool, query->id);
-	} else {
-		if (qpool->ipool->full(qpool->ipool)) {
-			log_error("Index pool full")
-			qpool->delete(qpool, id);
-			return;
-		}
-		Index *index = (Index *) calloc(1, sizeof(Index));
-		if (!index) {
-			log_fatal("Memory allocation error")
-			return;
-		}
-		index->id = qpool->ipool->insert(qpool->ipool, index);
-		index->prev_id = id;
-		query->msg->header->id = index->id;
-
-		uv_timer_init(qpool->loop, &query->timer);
-		query->timer.data = malloc(sizeof(uint16_t) + sizeof(Query_Pool *));
-		if (!query->timer.data)
-			log_fatal("Memory allocation error")
-		*(uint16_t *) query->timer.data = query->id;
-		*(Query_Pool **) (query->timer.data + sizeof(uint16_t)) = qpool;
-		uv_timer_start(&query->timer, timeout_cb, 5000, 5000);
-		send_to_remote(query->msg);
+		metrics_record_latency(&metrics.local_latency, latency);
+		return;
 	}
+	// Received when the poll returned it, so it waited for the queries handled before it in the same iteration
+	qpool_forward(qpool, addr, socket, conn, msg, uv_now(qpool->loop) * 1000000);
 }
 
 /**
@@ -106,41 +608,116 @@ static void qpool_insert(Query_Pool *qpool, const struct sockaddr *addr, const D
  * @param id The ID of the query
  * @return true if the query exists in the query pool, false otherwise
  */
-static bool qpool_query(Query_Pool *qpool, uint16_t id) {
-	return qpool->pool[id % QUERY_POOL_MAX_SIZE] != NULL && qpool->pool[id % QUERY_POOL_MAX_SIZE]->id == id;
+static bool qpool_query(Query_Pool *qpool, uint32_t id) {
+	uint16_t slot = id & 0xFFFF;
+	return slot < qpool->capacity && qpool->slots[slot].query != NULL && qpool->slots[slot].query->id == id;
+}
+
+/**
+ * @brief Check if a reply came from the address and port of a server
+ * @param addr Address the reply came from
+ * @param server Address of the server
+ * @return true if both the address and the port are the same
+ */
+static bool same_address(const struct sockaddr *addr, const struct sockaddr_storage *server) {
+	if (addr->sa_family != server->ss_family)
+		return false;
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *a = (const struct sockaddr_in6 *) addr, *b = (const struct sockaddr_in6 *) server;
+		return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+	}
+	const struct sockaddr_in *a = (const struct sockaddr_in *) addr, *b = (const struct sockaddr_in *) server;
+	return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
 }
 
 /**
  * @brief Finish processing a query
  * This function is called when a response is received for a query.
  * It processes the response, updates the cache if necessary, and sends the response to the local client.
+ * A response only matches if it carries the ID and the question of a request sent on the same socket,
+ * and comes from the address and port that request was sent to.
  * @param qpool The query pool
  * @param msg The DNS message containing the response
+ * @param socket The upstream socket the response came in on, INDEX_SOCKET_TCP over TCP
+ * @param addr Address the response came from, the server of the connection over TCP
  */
-static void qpool_finish(Query_Pool *qpool, const Dns_Msg *msg) {
+static void qpool_finish(Query_Pool *qpool, const Dns_Msg *msg, uint8_t socket, const struct sockaddr *addr) {
+	if (!msg->que) {
+		log_error("Response without a question dropped")
+		metrics_add(replies_unmatched, 1);
+		return;
+	}
 	uint16_t uid = msg->header->id;
-	if (!qpool->ipool->query(qpool->ipool, uid)) {
+	uint32_t qhash = question_hash(msg->que);
+	Index *index = qpool->ipool->query(qpool->ipool, socket, uid, qhash);
+	if (!index) {
 		log_error("Index not found in the index pool")
+		metrics_add(replies_unmatched, 1);
+		return;
+	}
+	if (!qpool_query(qpool, index->prev_id)) {
+		qpool->ipool->delete(qpool->ipool, socket, uid, qhash);
+		metrics_add(replies_unmatched, 1);
+		return;
+	}
+	Dns_Query *query = qpool->slots[index->prev_id & 0xFFFF].query;
+	const Dns_Que *que = query->msg->que;
+	if (msg->que->qtype != que->qtype || msg->que->qclass != que->qclass ||
+	    strcmp((const char *) msg->que->qname, (const char *) que->qname) != 0) {
+		// Spoofed or a hash collision, the query keeps waiting for the reply to its own question
+		log_error("Reply with another question dropped")
+		metrics_add(replies_unmatched, 1);
+		return;
+	}
+	Query_Attempt *attempt = NULL;
+	for (unsigned int i = 0; i < query->attempt_count && !attempt; ++i)
+		if (query->attempts[i].id == uid && query->attempts[i].socket == socket)
+			attempt = &query->attempts[i];
+	if (!attempt) { // The index and the attempts disagree, never expected
+		log_error("Reply to no attempt of query ID: 0x%08x dropped", query->id)
+		qpool->ipool->delete(qpool->ipool, socket, uid, qhash);
+		metrics_add(replies_unmatched, 1);
+		return;
+	}
+	if (!same_address(addr, &attempt->upstream->addr)) { // Spoofed, the query keeps waiting for the server
+		log_error("Reply from another address than the server dropped")
+		metrics_add(replies_unmatched, 1);
 		return;
 	}
-	Index *index = qpool->ipool->delete(qpool->ipool, uid);
-	if (qpool_query(qpool, index->prev_id)) {
-		Dns_Query *query = qpool->pool[index->prev_id % QUERY_POOL_MAX_SIZE];
-		log_debug("Finishing query ID: 0x%04x", query->id)
-
-		if (strcmp((char *)msg->que->qname, (char *)query->msg->que->qname) == 0) {
-			destroy_dnsmsg(query->msg);
-			query->msg = copy_dnsmsg(msg);
-			query->msg->header->id = query->prev_id;
-			if (msg->header->rcode == DNS_RCODE_OK &&
-			    (msg->que->qtype == DNS_TYPE_A || msg->que->qtype == DNS_TYPE_CNAME ||
-			     msg->que->qtype == DNS_TYPE_AAAA))
-				qpool->cache->insert(qpool->cache, msg);
-			send_to_local(&query->addr, query->msg);
+	if (query->trace.at[TRACE_RECEIVED])
+		query->trace.at[TRACE_UPSTREAM_REPLIED] = uv_hrtime();
+	if (!query->tcp_retry) { // The retry over TCP includes the connection setup, it is no RTT sample
+		uint64_t rtt = uv_hrtime() - attempt->sent_at;
+		upstream_success(attempt->upstream, (double) rtt / 1e6, !attempt->retransmits);
+		if (!attempt->retransmits)
+			metrics_record_latency(&metrics.upstream_rtt[attempt->upstream->index], rtt);
+		if (attempt != query->attempts)
+			metrics_add(upstream_hedge_wins, 1);
+	}
+	uint16_t tcp_id;
+	if (msg->header->tc && !query->tcp_retry && index_register(qpool, query, INDEX_SOCKET_TCP, &tcp_id)) {
+		query->msg->header->id = tcp_id;
+		if (send_to_remote_tcp(attempt->upstream, query->msg)) {
+			log_debug("Truncated reply, retrying query ID: 0x%08x over TCP", query->id)
+			qpool->ipool->delete(qpool->ipool, socket, uid, qhash);
+			attempt->id = tcp_id;
+			attempt->socket = INDEX_SOCKET_TCP;
+			query->tcp_retry = true;
+			uv_timer_stop(&query->retransmit_timer); // The deadline of the query keeps running
+			return;
 		}
-		qpool->delete(qpool, query->id);
+		qpool->ipool->delete(qpool->ipool, INDEX_SOCKET_TCP, tcp_id, query->hash); // The truncated reply is sent on
 	}
-	free(index);
+	log_debug("Finishing query ID: 0x%08x", query->id)
+
+	destroy_dnsmsg(query->msg);
+	query->msg = copy_dnsmsg(msg);
+	query->msg->header->id = query->prev_id;
+	if (msg->header->rcode == DNS_RCODE_OK && !msg->header->tc &&
+	    (msg->que->qtype == DNS_TYPE_A || msg->que->qtype == DNS_TYPE_CNAME || msg->que->qtype == DNS_TYPE_AAAA))
+		qpool->cache->insert(qpool->cache, msg);
+	respond(query, QUERY_LOG_UPSTREAM);
+	qpool->delete(qpool, query->id);
 }
 
 /**
@@ -149,30 +726,44 @@ static void qpool_finish(Query_Pool *qpool, const Dns_Msg *msg) {
  * @param qpool The query pool
  * @param id The ID of the query to be deleted
  */
-static void qpool_delete(Query_Pool *qpool, uint16_t id) {
+static void qpool_delete(Query_Pool *qpool, uint32_t id) {
 	if (!qpool_query(qpool, id)) {
 		log_error("Query ID not found in the query pool")
 		return;
 	}
-	log_debug("Deleting query ID: 0x%04x", id)
-	Dns_Query *query = qpool->pool[id % QUERY_POOL_MAX_SIZE];
+	log_debug("Deleting query ID: 0x%08x", id)
+	Query_Slot *slot = &qpool->slots[id & 0xFFFF];
+	Dns_Query *query = slot->query;
 	if (!query) {
 		log_error("Query is NULL");
 		return;
 	}
-	qpool->queue->push(qpool->queue, id + QUERY_POOL_MAX_SIZE);
-	qpool->pool[id % QUERY_POOL_MAX_SIZE] = NULL;
+	slot->query = NULL;
+	++slot->generation;
+	qpool->queue->push(qpool->queue, id & 0xFFFF);
 	qpool->count--;
-	log_debug("Deleting query timer: %p", &query->timer);
-	if (query->timer.data) {
-		log_debug("Deleting query timer: %p", &query->timer);
-		uv_timer_stop(&query->timer);
-		free(query->timer.data);
-	} else {
-		log_debug("Query timer data is NULL, skipping uv_timer_stop");
+	metrics_set(queries_in_flight, qpool->count);
+	for (unsigned int i = 0; i < query->attempt_count; ++i) // Late replies find no index and are dropped
+		qpool->ipool->delete(qpool->ipool, query->attempts[i].socket, query->attempts[i].id, query->hash);
+	if (query->pending)
+		pending_remove(qpool, query);
+	if (query->conn)
+		tcp_conn_release(query->conn);
+	while (query->waiters) {
+		Query_Waiter *waiter = query->waiters;
+		query->waiters = waiter->next;
+		if (waiter->conn)
+			tcp_conn_release(waiter->conn);
+		free(waiter);
 	}
 	destroy_dnsmsg(query->msg);
-	free(query);
+	if (query->handles) {
+		log_debug("Deleting query timer: %p", &query->timer);
+		uv_close((uv_handle_t *) &query->timer, on_timer_close);
+		uv_close((uv_handle_t *) &query->hedge_timer, on_timer_close);
+		uv_close((uv_handle_t *) &query->retransmit_timer, on_timer_close);
+	} else
+		query_free(qpool, query);
 }
 
 /**
@@ -190,8 +781,14 @@ Query_Pool *new_qpool(uv_loop_t *loop, Cache *cache) {
 		return NULL;
 	}
 	qpool->count = 0;
+	qpool->capacity = QUERY_POOL_INIT_SIZE < MAX_QUERIES ? QUERY_POOL_INIT_SIZE : MAX_QUERIES;
+	qpool->slots = (Query_Slot *) calloc(qpool->capacity, sizeof(Query_Slot));
+	if (!qpool->slots) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
 	qpool->queue = new_queue();
-	for (uint16_t i = 0; i < QUERY_POOL_MAX_SIZE; ++i)
+	for (unsigned int i = 0; i < qpool->capacity; ++i)
 		qpool->queue->push(qpool->queue, i);
 	qpool->ipool = new_ipool();
 	qpool->loop = loop;
@@ -199,6 +796,7 @@ Query_Pool *new_qpool(uv_loop_t *loop, Cache *cache) {
 
 	qpool->full = &qpool_full;
 	qpool->insert = &qpool_insert;
+	qpool->forward = &qpool_forward;
 	qpool->delete = &qpool_delete;
 	qpool->finish = &qpool_finish;
 	return qpool;
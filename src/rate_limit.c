@@ -0,0 +1,189 @@
+#include "../include/rate_limit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/log.h"
+
+/**
+ * @brief Parse a prefix of the form address[/length]
+ * @param str The prefix string
+ * @param prefix The parsed prefix, a host prefix if the length is missing
+ * @return 0 on success, -1 if the address or the length is invalid
+ */
+int parse_prefix(const char *str, Rrl_Prefix *prefix) {
+	char host[64];
+	const char *slash = strchr(str, '/');
+	size_t host_len = slash ? (size_t) (slash - str) : strlen(str);
+	if (host_len >= sizeof(host))
+		return -1;
+	memcpy(host, str, host_len);
+	host[host_len] = '\0';
+	struct sockaddr_storage addr;
+	if (parse_address(host, 0, &addr))
+		return -1;
+	memset(prefix, 0, sizeof(Rrl_Prefix));
+	prefix->family = addr.ss_family;
+	int max_len;
+	if (addr.ss_family == AF_INET6) {
+		memcpy(prefix->addr, &((struct sockaddr_in6 *) &addr)->sin6_addr, 16);
+		max_len = 128;
+	} else {
+		memcpy(prefix->addr, &((struct sockaddr_in *) &addr)->sin_addr, 4);
+		max_len = 32;
+	}
+	prefix->len = max_len;
+	if (slash) {
+		char *end;
+		long len = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end || len < 0 || len > max_len)
+			return -1;
+		prefix->len = (int) len;
+	}
+	return 0;
+}
+
+/**
+ * @brief Check if an address lies in a prefix
+ * @param prefix The prefix
+ * @param family The address family of the address
+ * @param addr The address in network byte order
+ * @return True if the address lies in the prefix, false otherwise
+ */
+static bool prefix_match(const Rrl_Prefix *prefix, int family, const uint8_t *addr) {
+	if (prefix->family != family)
+		return false;
+	int bytes = prefix->len / 8, bits = prefix->len % 8;
+	if (memcmp(prefix->addr, addr, bytes))
+		return false;
+	return !bits || ((prefix->addr[bytes] ^ addr[bytes]) & (0xff00 >> bits) & 0xff) == 0;
+}
+
+/**
+ * @brief Key of the token bucket of a client
+ * @param addr The address of the client
+ * @param raw Set to the address in network byte order
+ * @return The address family in the top byte above the prefix of the client
+ */
+static uint64_t rrl_key(const struct sockaddr *addr, const uint8_t **raw) {
+	uint64_t key = 0;
+	if (addr->sa_family == AF_INET6) {
+		*raw = (const uint8_t *) &((const struct sockaddr_in6 *) addr)->sin6_addr;
+		for (int i = 0; i < RRL_V6_PREFIX / 8; ++i)
+			key = key << 8 | (*raw)[i];
+		return (uint64_t) AF_INET6 << 56 | key;
+	}
+	*raw = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+	for (int i = 0; i < RRL_V4_PREFIX / 8; ++i)
+		key = key << 8 | (*raw)[i];
+	return (uint64_t) AF_INET << 56 | key;
+}
+
+/**
+ * @brief First bucket of the set of a key
+ * @param rrl The rate limiter
+ * @param key The key
+ * @return Index of the first of the RRL_WAYS buckets of the set
+ */
+static unsigned int rrl_set(const Rate_Limiter *rrl, uint64_t key) {
+	key ^= rrl->seed;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (unsigned int) key & (RRL_TABLE_SIZE - RRL_WAYS);
+}
+
+/**
+ * @brief Find the bucket of a key, taking over the least recently seen bucket of its set if the key has none
+ * @param rrl The rate limiter
+ * @param key The key
+ * @param now The loop time in milliseconds
+ * @return The bucket
+ */
+static Rrl_Bucket *rrl_bucket(Rate_Limiter *rrl, uint64_t key, uint32_t now) {
+	Rrl_Bucket *set = rrl->table + rrl_set(rrl, key);
+	Rrl_Bucket *victim = set;
+	for (int i = 0; i < RRL_WAYS; ++i) {
+		if (set[i].key == key)
+			return &set[i];
+		if (!set[i].key || now - set[i].stamp > now - victim->stamp)
+			victim = &set[i];
+		if (!set[i].key)
+			break;
+	}
+	victim->key = key;
+	victim->tokens = (uint32_t) RRL_RATE * 1000; // A new prefix starts with a full second of responses
+	victim->stamp = now;
+	victim->limited = 0;
+	return victim;
+}
+
+/**
+ * @brief Take a token from the bucket of the prefix of a client
+ * @param rrl The rate limiter
+ * @param addr The address of the client
+ * @return RRL_PASS if the client is within its rate or exempt, RRL_TRUNCATE for every RRL_SLIP-th query limited, RRL_DROP otherwise
+ *
+ * The bucket holds at most one second of responses and refills continuously at RRL_RATE responses per second.
+ */
+static Rrl_Verdict rrl_check(Rate_Limiter *rrl, const struct sockaddr *addr) {
+	const uint8_t *raw;
+	uint64_t key = rrl_key(addr, &raw);
+	uint32_t now = (uint32_t) uv_now(rrl->loop);
+	Rrl_Bucket *bucket = rrl_bucket(rrl, key, now);
+	uint64_t tokens = bucket->tokens + (uint64_t) (now - bucket->stamp) * RRL_RATE;
+	uint64_t burst = (uint64_t) RRL_RATE * 1000;
+	bucket->tokens = (uint32_t) (tokens < burst ? tokens : burst);
+	bucket->stamp = now;
+	if (bucket->tokens >= 1000) {
+		bucket->tokens -= 1000;
+		bucket->limited = 0;
+		return RRL_PASS;
+	}
+	for (int i = 0; i < rrl->exempt_count; ++i) // Only limited clients pay for the exempt list
+		if (prefix_match(&rrl->exempt[i], addr->sa_family, raw))
+			return RRL_PASS;
+	++bucket->limited;
+	if (RRL_SLIP && bucket->limited % RRL_SLIP == 0)
+		return RRL_TRUNCATE;
+	return RRL_DROP;
+}
+
+/**
+ * @brief Destroy the rate limiter
+ * @param rrl The rate limiter to destroy
+ */
+static void rrl_destroy(Rate_Limiter *rrl) {
+	free(rrl->table);
+	free(rrl);
+}
+
+/**
+ * @brief Create a new rate limiter allowing RRL_RATE responses per second to each prefix
+ * @param loop The event loop of the worker
+ * @return The new rate limiter
+ */
+Rate_Limiter *new_rate_limiter(uv_loop_t *loop) {
+	Rate_Limiter *rrl = (Rate_Limiter *) calloc(1, sizeof(Rate_Limiter));
+	if (!rrl) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	rrl->table = (Rrl_Bucket *) calloc(RRL_TABLE_SIZE, sizeof(Rrl_Bucket));
+	if (!rrl->table) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	if (uv_random(NULL, NULL, &rrl->seed, sizeof(rrl->seed), 0, NULL)) {
+		log_error("System random source failed")
+		rrl->seed = uv_hrtime();
+	}
+	for (int i = 0; i < RRL_EXEMPT_COUNT; ++i)
+		parse_prefix(RRL_EXEMPT[i], &rrl->exempt[rrl->exempt_count++]); // Checked when the options were parsed
+	rrl->loop = loop;
+
+	rrl->check = &rrl_check;
+	rrl->destroy = &rrl_destroy;
+	return rrl;
+}
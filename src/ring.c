@@ -0,0 +1,135 @@
+#include "../include/ring.h"
+
+#include <stdlib.h>
+
+#include "../include/log.h"
+
+/**
+ * @brief Push a pointer, called by the producer only
+ * @param ring The ring
+ * @param item The pointer, not NULL
+ * @return True if the pointer was pushed, false if the ring is full
+ */
+static bool spsc_push(Spsc_Ring *ring, void *item) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - ring->head_cache > ring->mask) { // Looks full, check where the consumer really is
+		ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (tail - ring->head_cache > ring->mask)
+			return false;
+	}
+	ring->slots[tail & ring->mask] = item;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * @brief Pop a pointer, called by the consumer only
+ * @param ring The ring
+ * @return The oldest pointer, NULL if the ring is empty
+ */
+static void *spsc_pop(Spsc_Ring *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head == ring->tail_cache) { // Looks empty, check where the producer really is
+		ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head == ring->tail_cache)
+			return NULL;
+	}
+	void *item = ring->slots[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return item;
+}
+
+/**
+ * @brief Push a pointer, called by any producer
+ * @param ring The ring
+ * @param item The pointer, not NULL
+ * @return True if the pointer was pushed, false if the ring is full
+ *
+ * A producer claims a position by advancing the tail, then publishes the pointer through the sequence of its cell.
+ */
+static bool mpsc_push(Mpsc_Ring *ring, void *item) {
+	size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	for (;;) {
+		Mpsc_Cell *cell = &ring->cells[pos & ring->mask];
+		ptrdiff_t diff = (ptrdiff_t) (atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) {
+				cell->item = item;
+				atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) // The cell still holds the pointer pushed one lap earlier
+			return false;
+		else
+			pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Pop a pointer, called by the consumer only
+ * @param ring The ring
+ * @return The oldest pointer, NULL if the ring is empty
+ */
+static void *mpsc_pop(Mpsc_Ring *ring) {
+	Mpsc_Cell *cell = &ring->cells[ring->head & ring->mask];
+	if (atomic_load_explicit(&cell->seq, memory_order_acquire) != ring->head + 1)
+		return NULL;
+	void *item = cell->item;
+	atomic_store_explicit(&cell->seq, ring->head + ring->mask + 1, memory_order_release); // Free for the next lap
+	++ring->head;
+	return item;
+}
+
+/**
+ * @brief Create a new single-producer single-consumer ring
+ * @param capacity Number of slots, a power of two
+ * @return The new ring
+ */
+Spsc_Ring *new_spsc_ring(size_t capacity) {
+	Spsc_Ring *ring = (Spsc_Ring *) calloc(1, sizeof(Spsc_Ring));
+	if (!ring) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	ring->slots = (void **) calloc(capacity, sizeof(void *));
+	if (!ring->slots) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	ring->mask = capacity - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->head_cache = ring->tail_cache = 0;
+
+	ring->push = &spsc_push;
+	ring->pop = &spsc_pop;
+	return ring;
+}
+
+/**
+ * @brief Create a new multi-producer single-consumer ring
+ * @param capacity Number of slots, a power of two
+ * @return The new ring
+ */
+Mpsc_Ring *new_mpsc_ring(size_t capacity) {
+	Mpsc_Ring *ring = (Mpsc_Ring *) calloc(1, sizeof(Mpsc_Ring));
+	if (!ring) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	ring->cells = (Mpsc_Cell *) calloc(capacity, sizeof(Mpsc_Cell));
+	if (!ring->cells) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	ring->mask = capacity - 1;
+	for (size_t i = 0; i < capacity; ++i)
+		atomic_init(&ring->cells[i].seq, i);
+	atomic_init(&ring->tail, 0);
+	ring->head = 0;
+
+	ring->push = &mpsc_push;
+	ring->pop = &mpsc_pop;
+	return ring;
+}
@@ -0,0 +1,76 @@
+#include "../include/send_pool.h"
+
+#include <stdlib.h>
+
+#include "../include/log.h"
+#include "../include/metrics.h"
+
+/**
+ * @brief Take a send slot from the pool
+ * Falls back to malloc when every preallocated slot is in use.
+ * @param pool The send pool
+ * @return A send slot whose request data points back to the pool
+ */
+static Send_Slot *spool_alloc(Send_Pool *pool) {
+	Send_Slot *slot = pool->free;
+	if (slot)
+		pool->free = slot->next;
+	else {
+		slot = (Send_Slot *) malloc(sizeof(Send_Slot));
+		if (!slot) {
+			log_fatal("Memory allocation error")
+			return NULL;
+		}
+		metrics_add(send_slot_fallbacks, 1);
+	}
+	slot->req.udp.data = pool; // Shared with req.tcp.data, both requests start with the same fields
+	slot->next = NULL;
+	slot->trace.at[TRACE_RECEIVED] = 0;
+	if (++pool->in_use > metrics.send_slot_high_water)
+		metrics_set(send_slot_high_water, pool->in_use);
+	return slot;
+}
+
+/**
+ * @brief Return a send slot to the pool
+ * @param pool The send pool
+ * @param slot The slot taken by alloc
+ */
+static void spool_release(Send_Pool *pool, Send_Slot *slot) {
+	if (slot->trace.at[TRACE_RECEIVED])
+		trace_finish(&slot->trace);
+	--pool->in_use;
+	if (slot >= pool->slab && slot < pool->slab + pool->capacity) {
+		slot->next = pool->free;
+		pool->free = slot;
+	} else
+		free(slot);
+}
+
+/**
+ * @brief Create a new send pool
+ * @param capacity Number of slots to preallocate
+ * @return The new send pool
+ */
+Send_Pool *new_send_pool(unsigned int capacity) {
+	log_debug("Initializing send pool")
+	Send_Pool *pool = (Send_Pool *) calloc(1, sizeof(Send_Pool));
+	if (!pool) {
+		log_fatal("Memory allocation error")
+		return NULL;
+	}
+	pool->slab = (Send_Slot *) malloc(capacity * sizeof(Send_Slot));
+	if (!pool->slab)
+		log_fatal("Memory allocation error")
+	pool->capacity = capacity;
+	pool->free = NULL;
+	for (unsigned int i = capacity; i > 0; --i) {
+		pool->slab[i - 1].next = pool->free;
+		pool->free = &pool->slab[i - 1];
+	}
+	pool->in_use = 0;
+
+	pool->alloc = &spool_alloc;
+	pool->release = &spool_release;
+	return pool;
+}
@@ -0,0 +1,293 @@
+#include "../include/tcp_server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/log.h"
+#include "../include/dns_parse.h"
+#include "../include/dns_print.h"
+#include "../include/dns_server.h"
+#include "../include/heavy_hitters.h"
+#include "../include/metrics.h"
+#include "../include/query_pool.h"
+#include "../include/send_pool.h"
+#include "../include/trace.h"
+
+static _Thread_local uv_tcp_t tcp_servers[LISTEN_MAX_ADDRESSES]; ///< Listening sockets for DNS-over-TCP clients
+static _Thread_local unsigned int conn_count; ///< Number of open connections
+extern _Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+extern _Thread_local Send_Pool *spool; ///< Send slot pool of the current worker
+
+/**
+ * @brief Callback function of the closed handles of a connection
+ * @param handle The closed handle
+ */
+static void on_close(uv_handle_t *handle) {
+	Tcp_Conn *conn = (Tcp_Conn *) handle->data;
+	if (--conn->handles == 0 && conn->pending == 0) {
+		free(conn->buf);
+		free(conn);
+	}
+}
+
+/**
+ * @brief Close a connection, the memory is freed once every query of it has been released
+ * @param conn The connection
+ */
+static void close_conn(Tcp_Conn *conn) {
+	if (conn->closing)
+		return;
+	conn->closing = true;
+	--conn_count;
+	uv_close((uv_handle_t *) &conn->handle, on_close);
+	uv_close((uv_handle_t *) &conn->idle_timer, on_close);
+}
+
+/**
+ * @brief Release a query of a connection once it has been answered or dropped
+ * @param conn The connection of the query
+ */
+void tcp_conn_release(Tcp_Conn *conn) {
+	--conn->pending;
+	if (conn->closing) {
+		if (conn->handles == 0 && conn->pending == 0) {
+			free(conn->buf);
+			free(conn);
+		}
+	} else if (conn->eof && conn->pending == 0)
+		close_conn(conn);
+}
+
+/**
+ * @brief Callback function of the idle timer of a connection
+ * @param timer The idle timer
+ */
+static void on_idle_timeout(uv_timer_t *timer) {
+	Tcp_Conn *conn = (Tcp_Conn *) timer->data;
+	if (conn->pending) { // Still waiting for answers, so not idle
+		uv_timer_start(&conn->idle_timer, on_idle_timeout, TCP_IDLE_TIMEOUT, 0);
+		return;
+	}
+	log_debug("Closing idle TCP connection")
+	metrics_add(tcp_idle_closed, 1);
+	close_conn(conn);
+}
+
+/**
+ * @brief Allocate space for the buffer
+ * @param handle Allocation handle
+ * @param suggested_size Suggested buffer size
+ * @param buf Buffer to be allocated
+ *
+ * Reads straight into the free tail of the connection buffer, grown to hold the whole message being received.
+ */
+static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+	Tcp_Conn *conn = (Tcp_Conn *) handle->data;
+	unsigned int need = conn->len + 1;
+	if (conn->len >= 2)
+		need = 2 + ((uint8_t) conn->buf[0] << 8 | (uint8_t) conn->buf[1]);
+	if (need > conn->cap) {
+		unsigned int cap = conn->cap * 2 > need ? conn->cap * 2 : need;
+		if (cap > TCP_BUFFER_MAX_SIZE)
+			cap = TCP_BUFFER_MAX_SIZE;
+		char *grown = (char *) realloc(conn->buf, cap);
+		if (!grown)
+			log_fatal("Memory allocation error")
+		conn->buf = grown;
+		conn->cap = cap;
+	}
+	buf->base = conn->buf + conn->len;
+	buf->len = conn->cap - conn->len;
+}
+
+/**
+ * @brief Callback function for receiving query messages on a connection
+ * @param stream The connection handle
+ * @param nread Number of bytes received
+ * @param buf Buffer containing the received bytes
+ *
+ * Every complete length-prefixed message is handed to the query pool, so pipelined queries are
+ * resolved concurrently and answered in the order they complete.
+ */
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+	Tcp_Conn *conn = (Tcp_Conn *) stream->data;
+	if (nread < 0) {
+		if (nread != UV_EOF) {
+			log_debug("TCP transmission error")
+			close_conn(conn);
+			return;
+		}
+		uv_read_stop(stream);
+		conn->eof = true;
+		if (conn->pending == 0)
+			close_conn(conn);
+		return;
+	}
+	conn->len += nread;
+	uv_timer_start(&conn->idle_timer, on_idle_timeout, TCP_IDLE_TIMEOUT, 0);
+
+	unsigned int offset = 0;
+	while (conn->len - offset >= 2) {
+		unsigned int msg_len = (uint8_t) conn->buf[offset] << 8 | (uint8_t) conn->buf[offset + 1];
+		if (msg_len < 12) { // Shorter than a DNS header
+			log_error("Malformed DNS-over-TCP message")
+			close_conn(conn);
+			return;
+		}
+		if (conn->len - offset - 2 < msg_len)
+			break;
+		log_debug("Received DNS query message from TCP client")
+		metrics_add(tcp_queries, 1);
+		heavy_hitters_client((const struct sockaddr *) &conn->addr);
+		print_dns_string(conn->buf + offset + 2, msg_len);
+		Dns_Msg *msg = (Dns_Msg *) calloc(1, sizeof(Dns_Msg));
+		if (!msg)
+			log_fatal("Memory allocation error")
+		Trace trace;
+		trace_begin(&trace);
+		if (!string_to_dnsmsg_limit(msg, conn->buf + offset + 2, msg_len)) {
+			log_error("Malformed DNS-over-TCP message")
+			trace_current = NULL;
+			destroy_dnsmsg(msg);
+			close_conn(conn);
+			return;
+		}
+		trace_mark(TRACE_PARSED)
+		trace_question(msg);
+		print_dns_message(msg);
+		qpool->insert(qpool, (const struct sockaddr *) &conn->addr, NULL, conn, msg);
+		trace_current = NULL;
+		destroy_dnsmsg(msg);
+		offset += 2 + msg_len;
+		if (conn->closing)
+			return;
+	}
+	if (offset) {
+		memmove(conn->buf, conn->buf + offset, conn->len - offset);
+		conn->len -= offset;
+	}
+}
+
+/**
+ * @brief Callback function for new connections
+ * @param server The listening socket
+ * @param status Connection status
+ */
+static void on_connection(uv_stream_t *server, int status) {
+	if (status < 0) {
+		log_error("TCP connection error %d", status)
+		return;
+	}
+	Tcp_Conn *conn = (Tcp_Conn *) calloc(1, sizeof(Tcp_Conn));
+	if (!conn) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	uv_tcp_init(server->loop, &conn->handle);
+	uv_timer_init(server->loop, &conn->idle_timer);
+	conn->handle.data = conn->idle_timer.data = conn;
+	conn->handles = 2;
+	++conn_count;
+	if (uv_accept(server, (uv_stream_t *) &conn->handle)) {
+		close_conn(conn);
+		return;
+	}
+	if (conn_count > (unsigned int) TCP_MAX_CONNECTIONS) {
+		log_error("Too many TCP connections")
+		metrics_add(tcp_rejected, 1);
+		close_conn(conn);
+		return;
+	}
+	metrics_add(tcp_accepted, 1);
+	int addr_len = sizeof(conn->addr);
+	uv_tcp_getpeername(&conn->handle, (struct sockaddr *) &conn->addr, &addr_len);
+	uv_tcp_nodelay(&conn->handle, 1);
+	conn->buf = (char *) malloc(TCP_BUFFER_INIT_SIZE);
+	if (!conn->buf)
+		log_fatal("Memory allocation error")
+	conn->cap = TCP_BUFFER_INIT_SIZE;
+	uv_timer_start(&conn->idle_timer, on_idle_timeout, TCP_IDLE_TIMEOUT, 0);
+	uv_read_start((uv_stream_t *) &conn->handle, alloc_buffer, on_read);
+}
+
+/**
+ * @brief Initialize the DNS-over-TCP server
+ * Listens on each address in LISTEN_ADDRESSES, addresses that cannot be bound are skipped.
+ * @param loop The libuv event loop
+ */
+void init_tcp_server(uv_loop_t *loop) {
+	log_info("Starting TCP server")
+	int bound = 0;
+	for (int i = 0; i < LISTEN_COUNT; ++i) {
+		struct sockaddr_storage addr;
+		parse_address(LISTEN_ADDRESSES[i], 53, &addr);
+		uv_tcp_t *server = &tcp_servers[i];
+		if (uv_tcp_init_ex(loop, server, addr.ss_family)) {
+			log_error("Failed to create the TCP server socket for %s", LISTEN_ADDRESSES[i])
+			continue;
+		}
+		set_reuseport((uv_handle_t *) server);
+		if (uv_tcp_bind(server, (const struct sockaddr *) &addr, addr.ss_family == AF_INET6 ? UV_TCP_IPV6ONLY : 0) ||
+		    uv_listen((uv_stream_t *) server, SOMAXCONN, on_connection)) {
+			log_error("Failed to listen on %s over TCP", LISTEN_ADDRESSES[i])
+			uv_close((uv_handle_t *) server, NULL);
+			continue;
+		}
+		++bound;
+	}
+	if (!bound)
+		log_fatal("Failed to bind the TCP server socket")
+}
+
+/**
+ * @brief Callback function for writing response messages on a connection
+ * @param req Write handle
+ * @param status Write status, indicating whether the write was successful
+ */
+static void on_write(uv_write_t *req, int status) {
+	((Send_Pool *) req->data)->release((Send_Pool *) req->data, (Send_Slot *) req);
+	if (status)
+		log_error("TCP write status error %d", status)
+}
+
+/**
+ * @brief Send a DNS response message on a TCP connection
+ * @param conn The connection of the local client
+ * @param msg The DNS message to be sent
+ *
+ * The length-prefixed response is written right away with uv_try_write,
+ * whatever the socket does not take is queued with uv_write.
+ */
+void send_to_tcp(Tcp_Conn *conn, const Dns_Msg *msg) {
+	if (conn->closing)
+		return;
+	log_debug("Sending DNS response message to TCP client")
+	print_dns_message(msg);
+	Send_Slot *slot = spool->alloc(spool);
+	unsigned int len = dnsmsg_to_string_limit(msg, slot->data + 2, DNS_STRING_MAX_SIZE - 2);
+	slot->data[0] = (char) (len >> 8);
+	slot->data[1] = (char) len;
+	slot->len = len + 2;
+	trace_mark(TRACE_SERIALIZED)
+	trace_attach(&slot->trace);
+	print_dns_string(slot->data + 2, len);
+
+	uv_buf_t send_buf = uv_buf_init(slot->data, slot->len);
+	int ret = uv_try_write((uv_stream_t *) &conn->handle, &send_buf, 1);
+	if (ret == (int) slot->len) {
+		spool->release(spool, slot);
+		return;
+	}
+	if (ret < 0 && ret != UV_EAGAIN) {
+		log_error("TCP write status error %d", ret)
+		spool->release(spool, slot);
+		close_conn(conn);
+		return;
+	}
+	if (ret > 0) { // Partially written
+		send_buf.base += ret;
+		send_buf.len -= ret;
+	}
+	uv_write(&slot->req.tcp, (uv_stream_t *) &conn->handle, &send_buf, 1, on_write);
+}
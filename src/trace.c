@@ -0,0 +1,222 @@
+#include "../include/trace.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/log.h"
+
+_Thread_local Trace *trace_current; ///< Trace of the query the current thread works on, NULL if it is not traced
+static _Thread_local Trace_Stats *stats; ///< Stage histograms of the current thread, allocated by its first trace
+static _Thread_local unsigned int sample_countdown; ///< Queries of the current thread left until the next sampled one
+static Trace_Stats *_Atomic registry; ///< Stage histograms of every thread that traced, newest first
+static atomic_uint sample_next; ///< Number of the last sampled trace
+static uv_signal_t dump_signal; ///< SIGUSR1 handler
+
+static const char *const stage_names[TRACE_STAGE_COUNT] = {
+	"total", "parse", "cache", "upstream send", "upstream wait", "serialize", "send"
+};
+
+/**
+ * @brief Bucket of a duration
+ * @param value The duration in nanoseconds
+ * @return Index of the bucket, the power of two of the value picks the group and the bits below its leading one the sub-bucket
+ */
+static unsigned int hdr_index(uint64_t value) {
+	if (value >= (uint64_t) 1 << TRACE_HDR_MAX_BITS)
+		value = ((uint64_t) 1 << TRACE_HDR_MAX_BITS) - 1;
+	if (value < TRACE_HDR_SUB_BUCKETS)
+		return (unsigned int) value;
+	unsigned int shift = 63 - __builtin_clzll(value) - TRACE_HDR_SUB_BITS;
+	return (shift + 1) * TRACE_HDR_SUB_BUCKETS + (unsigned int) ((value >> shift) - TRACE_HDR_SUB_BUCKETS);
+}
+
+/**
+ * @brief Largest duration of a bucket
+ * @param index Index of the bucket
+ * @return The duration in nanoseconds
+ */
+static uint64_t hdr_value(unsigned int index) {
+	unsigned int group = index / TRACE_HDR_SUB_BUCKETS, sub = index % TRACE_HDR_SUB_BUCKETS;
+	if (group == 0)
+		return sub;
+	return (((uint64_t) TRACE_HDR_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+/**
+ * @brief Duration at a percentile of a histogram
+ * @param hist The histogram
+ * @param total Number of durations in the histogram
+ * @param percentile The percentile, from 0 to 100
+ * @return The duration in nanoseconds, no more than the longest one recorded
+ */
+static uint64_t hdr_percentile(const Trace_Histogram *hist, uint64_t total, double percentile) {
+	uint64_t rank = (uint64_t) (percentile / 100 * (double) total + 0.5), seen = 0;
+	if (rank == 0)
+		rank = 1;
+	for (unsigned int i = 0; i < TRACE_HDR_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t value = hdr_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/**
+ * @brief Start the trace of a query just received, if TRACE_STAGES is set or the query is sampled
+ * @param trace The trace, it becomes trace_current if the query is traced
+ */
+void trace_begin(Trace *trace) {
+	trace_current = NULL;
+	trace->at[TRACE_RECEIVED] = 0; // Marks the trace as not traced where it is carried on, as in a pipeline job
+	trace->sample = 0;
+	if (!TRACE_STAGES && !TRACE_SAMPLE)
+		return;
+	if (TRACE_SAMPLE && sample_countdown-- == 0) {
+		sample_countdown = TRACE_SAMPLE - 1;
+		trace->sample = atomic_fetch_add(&sample_next, 1) + 1;
+	} else if (!TRACE_STAGES)
+		return;
+	memset(trace->at, 0, sizeof(trace->at));
+	trace->at[TRACE_RECEIVED] = uv_hrtime();
+	trace_current = trace;
+}
+
+/**
+ * @brief Log the question of a sampled query
+ * @param msg The parsed query
+ */
+void trace_question(const Dns_Msg *msg) {
+	if (trace_current && trace_current->sample && msg->que)
+		log_info("Trace %u: %s type %u", trace_current->sample, (const char *) msg->que->qname, msg->que->qtype)
+}
+
+/**
+ * @brief Copy the trace of the current query where the query goes on, a send slot or a query in flight
+ * @param trace The copy, marked as not traced if there is no current trace
+ */
+void trace_attach(Trace *trace) {
+	if (trace_current)
+		*trace = *trace_current;
+	else
+		trace->at[TRACE_RECEIVED] = 0;
+}
+
+/**
+ * @brief Finish a trace once its response was sent, its stages are recorded and a sampled trace is logged
+ * @param trace The trace
+ *
+ * Each stage runs from the last point the query passed before the point of the stage,
+ * so a cache hit has no upstream stages and its serialization starts at the lookup.
+ */
+void trace_finish(Trace *trace) {
+	trace->at[TRACE_SENT] = uv_hrtime();
+	uint64_t durations[TRACE_STAGE_COUNT] = {0};
+	bool passed[TRACE_STAGE_COUNT] = {true};
+	durations[0] = trace->at[TRACE_SENT] - trace->at[TRACE_RECEIVED];
+	unsigned int last = TRACE_RECEIVED;
+	for (unsigned int point = TRACE_RECEIVED + 1; point < TRACE_POINTS; ++point)
+		if (trace->at[point]) {
+			durations[point] = trace->at[point] - trace->at[last];
+			passed[point] = true;
+			last = point;
+		}
+
+	if (TRACE_STAGES) {
+		if (!stats) {
+			stats = (Trace_Stats *) calloc(1, sizeof(Trace_Stats));
+			if (!stats) {
+				log_fatal("Memory allocation error")
+				return;
+			}
+			stats->next = atomic_load(&registry);
+			while (!atomic_compare_exchange_weak(&registry, &stats->next, stats));
+		}
+		for (unsigned int stage = 0; stage < TRACE_STAGE_COUNT; ++stage)
+			if (passed[stage]) {
+				Trace_Histogram *hist = &stats->stages[stage];
+				unsigned int bucket = hdr_index(durations[stage]);
+				// Stored atomically as in metrics_add, trace_dump reads them from another thread
+				__atomic_store_n(&hist->counts[bucket], hist->counts[bucket] + 1, __ATOMIC_RELAXED);
+				if (durations[stage] > hist->max)
+					__atomic_store_n(&hist->max, durations[stage], __ATOMIC_RELAXED);
+			}
+	}
+
+	if (trace->sample) {
+		char line[LOG_LINE_MAX] = "";
+		int len = 0;
+		for (unsigned int stage = 1; stage < TRACE_STAGE_COUNT && len < (int) sizeof(line); ++stage)
+			if (passed[stage])
+				len += snprintf(line + len, sizeof(line) - len, "%s %.1f us, ", stage_names[stage],
+				                (double) durations[stage] / 1e3);
+		log_info("Trace %u: %stotal %.1f us", trace->sample, line, (double) durations[0] / 1e3)
+	}
+}
+
+/**
+ * @brief Write the percentiles of every stage, summed over the threads, to the log
+ * @note The histograms are read while the threads update them, so the sum is a close snapshot rather than an exact one
+ */
+void trace_dump(void) {
+	if (!TRACE_STAGES) {
+		log_info("Stage tracing is off, enable it with --trace-stages 1")
+		return;
+	}
+	Trace_Stats *total = (Trace_Stats *) calloc(1, sizeof(Trace_Stats));
+	if (!total) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	for (const Trace_Stats *node = atomic_load(&registry); node; node = node->next)
+		for (unsigned int stage = 0; stage < TRACE_STAGE_COUNT; ++stage) {
+			const Trace_Histogram *src = &node->stages[stage];
+			Trace_Histogram *dst = &total->stages[stage];
+			for (unsigned int i = 0; i < TRACE_HDR_BUCKETS; ++i)
+				dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+			uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+			if (max > dst->max)
+				dst->max = max;
+		}
+	for (unsigned int stage = 0; stage < TRACE_STAGE_COUNT; ++stage) {
+		const Trace_Histogram *hist = &total->stages[stage];
+		uint64_t count = 0;
+		for (unsigned int i = 0; i < TRACE_HDR_BUCKETS; ++i)
+			count += hist->counts[i];
+		if (!count)
+			continue;
+		log_info("Stage %s: %llu queries, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+		         stage_names[stage], (unsigned long long) count,
+		         (double) hdr_percentile(hist, count, 50) / 1e3, (double) hdr_percentile(hist, count, 90) / 1e3,
+		         (double) hdr_percentile(hist, count, 99) / 1e3, (double) hdr_percentile(hist, count, 99.9) / 1e3,
+		         (double) hist->max / 1e3)
+	}
+	free(total);
+}
+
+/**
+ * @brief Callback function of SIGUSR1
+ * @param handle The signal handle
+ * @param signum The signal
+ */
+static void on_dump_signal(uv_signal_t *handle, int signum) {
+	trace_dump();
+}
+
+/**
+ * @brief Dump the stage histograms whenever the process gets SIGUSR1
+ * @param loop The event loop handling the signal
+ */
+void init_trace(uv_loop_t *loop) {
+#ifdef SIGUSR1
+	uv_signal_init(loop, &dump_signal);
+	uv_signal_start(&dump_signal, on_dump_signal, SIGUSR1);
+	uv_unref((uv_handle_t *) &dump_signal); // The handler alone must not keep the loop alive
+#else
+	log_error("Dumping the stage histograms on a signal is not supported on this platform")
+#endif
+}
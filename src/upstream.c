@@ -0,0 +1,326 @@
+#include "../include/upstream.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/log.h"
+#include "../include/domain_trie.h"
+#include "../include/query_pool.h"
+
+static _Thread_local Upstream upstreams[REMOTE_MAX_HOSTS]; ///< Remote servers as seen by the current worker
+static _Thread_local unsigned int upstream_count; ///< Servers of REMOTE_HOSTS the current worker has set up
+static _Thread_local uv_loop_t *upstream_loop; ///< Event loop of the worker
+static _Thread_local unsigned int select_count; ///< Number of selections, spaces out the probes
+static _Thread_local unsigned int probe_next; ///< Round-robin position of the probes
+static Domain_Trie *routes; ///< Group of each forwarded zone, shared by the workers
+static atomic_uint default_group; ///< Group of the names outside every forwarded zone, changed by control commands
+static atomic_uint remote_count; ///< REMOTE_COUNT as published to the workers, servers added at run time included
+
+/**
+ * @brief Add a remote server to REMOTE_HOSTS unless it is there already
+ * @param host The address of the server
+ * @return Position of the server in REMOTE_HOSTS
+ */
+static int remote_add(const char *host) {
+	for (int i = 0; i < REMOTE_COUNT; ++i)
+		if (strcmp(REMOTE_HOSTS[i], host) == 0)
+			return i;
+	struct sockaddr_storage addr;
+	if (parse_address(host, 53, &addr))
+		log_fatal("Command line parameter is wrong, entered illegitimate IP address")
+	if (REMOTE_COUNT == REMOTE_MAX_HOSTS)
+		log_fatal("Command line parameter is wrong, too many name servers")
+	REMOTE_HOSTS[REMOTE_COUNT] = strdup(host);
+	return REMOTE_COUNT++;
+}
+
+/**
+ * @brief Build the routing table of the forwarded zones from FORWARD_RULES
+ * The servers of the rules are added to REMOTE_HOSTS, so that each one is tracked once however many zones use it.
+ * @note Must run before the workers start
+ */
+void init_routes(void) {
+	atomic_init(&default_group, (1u << REMOTE_COUNT) - 1);
+	routes = new_domain_trie();
+	for (int i = 0; i < FORWARD_COUNT; ++i) {
+		char *rule = strdup(FORWARD_RULES[i]);
+		if (!rule) {
+			log_fatal("Memory allocation error")
+			return;
+		}
+		char *servers = strchr(rule, '=');
+		*servers++ = 0;
+		unsigned int group = 0;
+		for (char *host = strtok(servers, ","); host; host = strtok(NULL, ","))
+			group |= 1u << remote_add(host);
+		if (!group)
+			log_fatal("Command line parameter is wrong, forwarded zone %s has no name server", rule)
+		void *_Atomic *slot = routes->insert(routes, (const uint8_t *) rule);
+		if (!slot)
+			log_fatal("Command line parameter is wrong, illegitimate forwarded zone %s", rule)
+		*slot = (void *) (uintptr_t) group;
+		log_info("Forwarding zone %s to %s", rule, servers)
+		free(rule);
+	}
+	atomic_init(&remote_count, REMOTE_COUNT);
+}
+
+/**
+ * @brief Add a remote server to the group of the names outside every forwarded zone
+ * @param host The address of the server
+ * @return NULL on success, otherwise why the server cannot be added
+ *
+ * A server new to REMOTE_HOSTS takes the next position and is published to the workers by remote_count,
+ * each worker sets it up on its next selection. The positions of the servers never change.
+ * @note Must run on a single thread at a time, after the workers started
+ */
+const char *upstream_add(const char *host) {
+	struct sockaddr_storage addr, other;
+	if (parse_address(host, 53, &addr))
+		return "illegitimate IP address";
+	int index = 0;
+	bool family = false;
+	while (index < REMOTE_COUNT && strcmp(REMOTE_HOSTS[index], host) != 0) {
+		parse_address(REMOTE_HOSTS[index], 53, &other);
+		family |= other.ss_family == addr.ss_family;
+		++index;
+	}
+	if (index == REMOTE_COUNT) {
+		if (!family) // The workers opened sockets only for the families of the servers they started with
+			return "no name server of the same address family was given at startup";
+		if (REMOTE_COUNT == REMOTE_MAX_HOSTS)
+			return "too many name servers";
+		REMOTE_HOSTS[REMOTE_COUNT] = strdup(host);
+		if (!REMOTE_HOSTS[REMOTE_COUNT]) {
+			log_fatal("Memory allocation error")
+			return "memory allocation error";
+		}
+		atomic_store_explicit(&remote_count, ++REMOTE_COUNT, memory_order_release);
+	}
+	atomic_fetch_or(&default_group, 1u << index);
+	log_info("Added name server %s", host)
+	return NULL;
+}
+
+/**
+ * @brief Remove a remote server from the group of the names outside every forwarded zone
+ * @param host The address of the server
+ * @return NULL on success, otherwise why the server cannot be removed
+ * @note The server keeps its position in REMOTE_HOSTS and its forwarded zones, queries in flight may still use it
+ */
+const char *upstream_remove(const char *host) {
+	for (int i = 0; i < REMOTE_COUNT; ++i)
+		if (strcmp(REMOTE_HOSTS[i], host) == 0) {
+			unsigned int group = atomic_load(&default_group);
+			if (!(group & 1u << i))
+				break;
+			if (group == 1u << i)
+				return "the last name server cannot be removed";
+			atomic_fetch_and(&default_group, ~(1u << i));
+			log_info("Removed name server %s", host)
+			return NULL;
+		}
+	return "no such name server";
+}
+
+/**
+ * @brief Get the group of the names outside every forwarded zone
+ * @return Bit mask over REMOTE_HOSTS of the servers given with -a or added since
+ */
+unsigned int upstream_default_group(void) {
+	return atomic_load(&default_group);
+}
+
+/**
+ * @brief Find the group of remote servers of a domain name
+ * @param qname The domain name
+ * @return Bit mask over REMOTE_HOSTS of the servers of the longest forwarded zone containing the name,
+ * or of the servers given with -a if there is none
+ */
+unsigned int upstream_route(const uint8_t *qname) {
+	if (!FORWARD_COUNT)
+		return atomic_load_explicit(&default_group, memory_order_relaxed);
+	unsigned int group = (unsigned int) (uintptr_t) routes->lookup(routes, qname, false);
+	return group ? group : atomic_load_explicit(&default_group, memory_order_relaxed);
+}
+
+/**
+ * @brief Check if a remote server is down
+ * @param up The server
+ * @return true if the server is marked down and the period has not passed yet
+ */
+bool upstream_is_down(const Upstream *up) {
+	return up->down_period && uv_now(upstream_loop) < up->down_until;
+}
+
+/**
+ * @brief Expected latency of a query to a remote server
+ * @param up The server
+ * @return The smoothed RTT, plus what a lost request costs weighted by the loss rate:
+ * the retransmission timeout, or the query timeout when retransmission is disabled
+ */
+static double upstream_score(const Upstream *up) {
+	return up->srtt + up->loss * (double) (RETRIES ? upstream_rto(up) : (uint64_t) QUERY_TIMEOUT);
+}
+
+/**
+ * @brief Set up the servers added to REMOTE_HOSTS since the last call on the current worker
+ * @return Number of servers the worker knows
+ */
+static unsigned int upstream_sync(void) {
+	unsigned int count = atomic_load_explicit(&remote_count, memory_order_acquire);
+	for (; upstream_count < count; ++upstream_count) {
+		Upstream *up = &upstreams[upstream_count];
+		parse_address(REMOTE_HOSTS[upstream_count], 53, &up->addr);
+		up->srtt = up->rtt_p95 = UPSTREAM_RTT_INIT;
+		up->rttvar = UPSTREAM_RTT_INIT / 2;
+	}
+	return count;
+}
+
+/**
+ * @brief Initialize the remote servers of the current worker from REMOTE_HOSTS
+ * @param loop The libuv event loop
+ * @return Number of servers set up
+ */
+unsigned int init_upstreams(uv_loop_t *loop) {
+	upstream_loop = loop;
+	for (int i = 0; i < REMOTE_MAX_HOSTS; ++i)
+		upstreams[i].index = i;
+	return upstream_sync();
+}
+
+/**
+ * @brief Get a remote server
+ * @param index Position of the server in REMOTE_HOSTS
+ * @return The server
+ */
+Upstream *upstream_get(unsigned int index) {
+	return &upstreams[index];
+}
+
+/**
+ * @brief Pick the remote server of a new query
+ * @param group Bit mask over REMOTE_HOSTS of the servers to pick from
+ * @return The healthy server with the lowest expected latency, or now and then another server to probe it
+ *
+ * Probes go round-robin to the other servers of the group that are not down, so a server whose down period
+ * has passed gets a chance to recover. If every server is down, the one that comes back first is used.
+ */
+Upstream *upstream_select(unsigned int group) {
+	unsigned int count = upstream_sync();
+	Upstream *best = NULL;
+	for (unsigned int i = 0; i < count; ++i)
+		if (group & 1u << i && !upstream_is_down(&upstreams[i]) &&
+		    (!best || upstream_score(&upstreams[i]) < upstream_score(best)))
+			best = &upstreams[i];
+	if (!best) {
+		for (unsigned int i = 0; i < count; ++i)
+			if (group & 1u << i && (!best || upstreams[i].down_until < best->down_until))
+				best = &upstreams[i];
+		return best;
+	}
+	if (group & (group - 1) && ++select_count % UPSTREAM_PROBE_INTERVAL == 0) {
+		for (unsigned int i = 0; i < count; ++i) {
+			Upstream *up = &upstreams[probe_next++ % count];
+			if (group & 1u << up->index && up != best && !upstream_is_down(up)) {
+				log_debug("Probing server %s", REMOTE_HOSTS[up->index])
+				return up;
+			}
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Pick a remote server for a hedged request
+ * @param exclude The server the query was already sent to
+ * @param group Bit mask over REMOTE_HOSTS of the servers to pick from
+ * @return The healthy server of the group with the lowest expected latency other than exclude, NULL if there is none
+ */
+Upstream *upstream_select_other(const Upstream *exclude, unsigned int group) {
+	unsigned int count = upstream_sync();
+	Upstream *best = NULL;
+	for (unsigned int i = 0; i < count; ++i)
+		if (group & 1u << i && &upstreams[i] != exclude && !upstream_is_down(&upstreams[i]) &&
+		    (!best || upstream_score(&upstreams[i]) < upstream_score(best)))
+			best = &upstreams[i];
+	return best;
+}
+
+/**
+ * @brief Delay before a query to a remote server is hedged
+ * @param up The server
+ * @return The p95 RTT of the server in whole milliseconds, at least UPSTREAM_HEDGE_MIN
+ */
+uint64_t upstream_hedge_delay(const Upstream *up) {
+	uint64_t delay = (uint64_t) up->rtt_p95 + 1;
+	return delay < UPSTREAM_HEDGE_MIN ? UPSTREAM_HEDGE_MIN : delay;
+}
+
+/**
+ * @brief Retransmission timeout of a remote server (RFC 6298)
+ * @param up The server
+ * @return SRTT + 4 * RTTVAR in whole milliseconds, clamped to UPSTREAM_RTO_MIN and UPSTREAM_RTO_MAX
+ */
+uint64_t upstream_rto(const Upstream *up) {
+	uint64_t rto = (uint64_t) (up->srtt + 4 * up->rttvar) + 1;
+	if (rto < UPSTREAM_RTO_MIN)
+		return UPSTREAM_RTO_MIN;
+	return rto > UPSTREAM_RTO_MAX ? UPSTREAM_RTO_MAX : rto;
+}
+
+/**
+ * @brief Record a reply of a remote server
+ * @param up The server
+ * @param rtt Time between the query and the reply in milliseconds
+ * @param sample Whether rtt is a valid RTT sample, false for replies to retransmitted queries
+ *
+ * The p95 estimate moves up by 19 steps for each sample above it and down by one step for each sample below it,
+ * so it settles where 5% of the samples lie above it.
+ */
+void upstream_success(Upstream *up, double rtt, bool sample) {
+	if (sample) {
+		double step = UPSTREAM_QUANTILE_STEP * up->srtt / 20;
+		up->rtt_p95 += rtt > up->rtt_p95 ? 19 * step : -step;
+		if (up->rtt_p95 < rtt / 2) // Keep up with a server much slower than the estimate
+			up->rtt_p95 = rtt / 2;
+		up->rttvar += UPSTREAM_RTTVAR_WEIGHT * ((rtt > up->srtt ? rtt - up->srtt : up->srtt - rtt) - up->rttvar);
+		up->srtt += UPSTREAM_EWMA_WEIGHT * (rtt - up->srtt);
+	}
+	up->loss -= UPSTREAM_EWMA_WEIGHT * up->loss;
+	up->failures = 0;
+	if (up->down_period) {
+		log_info("Server %s is back up", REMOTE_HOSTS[up->index])
+		up->down_period = 0;
+	}
+}
+
+/**
+ * @brief Record a request to a remote server whose retransmission timeout expired
+ * @param up The server
+ * @note Only the loss rate is updated, a lossy server is not marked down as long as its queries get through
+ */
+void upstream_loss(Upstream *up) {
+	up->loss += UPSTREAM_EWMA_WEIGHT * (1 - up->loss);
+}
+
+/**
+ * @brief Record a query of a remote server that timed out
+ * @param up The server
+ *
+ * After UPSTREAM_DOWN_FAILURES consecutive timeouts the server is marked down.
+ * Each time it fails again once the period has passed, the period doubles up to UPSTREAM_DOWN_MAX.
+ */
+void upstream_timeout(Upstream *up) {
+	if (!RETRIES || UPSTREAM_TCP) // Otherwise the retransmission timeouts have counted the loss already
+		upstream_loss(up);
+	if (++up->failures < UPSTREAM_DOWN_FAILURES || upstream_is_down(up))
+		return;
+	up->down_period = up->down_period ? up->down_period * 2 : UPSTREAM_DOWN_MIN;
+	if (up->down_period > UPSTREAM_DOWN_MAX)
+		up->down_period = UPSTREAM_DOWN_MAX;
+	up->down_until = uv_now(upstream_loop) + up->down_period;
+	log_error("Server %s is down for %u ms", REMOTE_HOSTS[up->index], up->down_period)
+}
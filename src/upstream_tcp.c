@@ -0,0 +1,328 @@
+#include "../include/upstream_tcp.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/dns_parse.h"
+#include "../include/dns_print.h"
+#include "../include/query_pool.h"
+#include "../include/send_pool.h"
+#include "../include/tcp_server.h"
+
+/// TCP connection to the remote server
+typedef struct upstream_conn {
+	uv_tcp_t handle; ///< Connection handle
+	uv_connect_t connect_req; ///< Connect request
+	char * buf; ///< Received bytes not yet split into messages
+	unsigned int len; ///< Number of bytes in buf
+	unsigned int cap; ///< Size of buf
+	struct upstream_link * link; ///< Link the connection belongs to
+	bool connected; ///< Whether the connection is established
+} Upstream_Conn;
+
+/// Slot of the connection pool, outlives the connections opened on it
+typedef struct upstream_link {
+	Upstream * up; ///< Remote server of the link
+	Upstream_Conn * conn; ///< Current connection, NULL when closed
+	uv_timer_t reconnect_timer; ///< Reopens the connection once the backoff expires
+	unsigned int backoff; ///< Current reconnect backoff in milliseconds, 0 after a successful connect
+	Send_Slot * backlog; ///< Queries waiting for the connection to be established
+	Send_Slot * backlog_tail; ///< Last query in backlog
+	unsigned int backlog_len; ///< Number of queries in backlog
+} Upstream_Link;
+
+static _Thread_local uv_loop_t *upstream_loop; ///< Event loop of the worker
+static _Thread_local Upstream_Link upstream_links[REMOTE_MAX_HOSTS][UPSTREAM_TCP_MAX_CONNS]; ///< Connection pool of each server
+static _Thread_local unsigned int link_count; ///< Number of links in use per server
+static _Thread_local unsigned int next_link[REMOTE_MAX_HOSTS]; ///< Round-robin position in the pool of each server
+extern _Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+extern _Thread_local Send_Pool *spool; ///< Send slot pool of the current worker
+
+static void open_conn(Upstream_Link *link);
+
+/**
+ * @brief Callback function of a closed connection
+ * @param handle The connection handle
+ */
+static void on_close(uv_handle_t *handle) {
+	Upstream_Conn *conn = (Upstream_Conn *) handle->data;
+	free(conn->buf);
+	free(conn);
+}
+
+/**
+ * @brief Callback function of the reconnect timer
+ * @param timer The reconnect timer of a link
+ */
+static void reconnect_cb(uv_timer_t *timer) {
+	Upstream_Link *link = (Upstream_Link *) timer->data;
+	if (!link->conn)
+		open_conn(link);
+}
+
+/**
+ * @brief Close a connection
+ * @param conn The connection
+ * @param failed Whether the connection failed, the link then reconnects after a growing backoff
+ *
+ * The queries in flight are lost with the connection, the retransmission timers of the query pool send them again
+ * on another connection. Queries waiting in the backlog stay there for the next connection of the link.
+ */
+static void close_conn(Upstream_Conn *conn, bool failed) {
+	Upstream_Link *link = conn->link;
+	if (link->conn == conn) {
+		link->conn = NULL;
+		if (failed) {
+			metrics_add(upstream_tcp_failures, 1);
+			link->backoff = link->backoff ? link->backoff * 2 : UPSTREAM_TCP_BACKOFF_MIN;
+			if (link->backoff > UPSTREAM_TCP_BACKOFF_MAX)
+				link->backoff = UPSTREAM_TCP_BACKOFF_MAX;
+			log_debug("Reconnecting to the server over TCP in %u ms", link->backoff)
+			uv_timer_start(&link->reconnect_timer, reconnect_cb, link->backoff, 0);
+		} else if (link->backlog)
+			open_conn(link);
+	}
+	if (!uv_is_closing((uv_handle_t *) &conn->handle))
+		uv_close((uv_handle_t *) &conn->handle, on_close);
+}
+
+/**
+ * @brief Callback function for writing query messages to the remote server
+ * @param req Write handle
+ * @param status Write status, indicating whether the write was successful
+ */
+static void on_write(uv_write_t *req, int status) {
+	((Send_Pool *) req->data)->release((Send_Pool *) req->data, (Send_Slot *) req);
+	if (status)
+		log_error("Upstream TCP write status error %d", status)
+}
+
+/**
+ * @brief Write a length-prefixed query on an established connection
+ * @param conn The connection
+ * @param slot The send slot of the query, released once written
+ */
+static void write_slot(Upstream_Conn *conn, Send_Slot *slot) {
+	uv_buf_t send_buf = uv_buf_init(slot->data, slot->len);
+	int ret = uv_try_write((uv_stream_t *) &conn->handle, &send_buf, 1);
+	if (ret == (int) slot->len) {
+		spool->release(spool, slot);
+		return;
+	}
+	if (ret < 0 && ret != UV_EAGAIN) {
+		log_error("Upstream TCP write status error %d", ret)
+		spool->release(spool, slot);
+		close_conn(conn, true);
+		return;
+	}
+	if (ret > 0) { // Partially written
+		send_buf.base += ret;
+		send_buf.len -= ret;
+	}
+	uv_write(&slot->req.tcp, (uv_stream_t *) &conn->handle, &send_buf, 1, on_write);
+}
+
+/**
+ * @brief Allocate space for the buffer
+ * @param handle Allocation handle
+ * @param suggested_size Suggested buffer size
+ * @param buf Buffer to be allocated
+ */
+static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+	Upstream_Conn *conn = (Upstream_Conn *) handle->data;
+	unsigned int need = conn->len + 1;
+	if (conn->len >= 2)
+		need = 2 + ((uint8_t) conn->buf[0] << 8 | (uint8_t) conn->buf[1]);
+	if (need > conn->cap) {
+		unsigned int cap = conn->cap * 2 > need ? conn->cap * 2 : need;
+		if (cap > TCP_BUFFER_MAX_SIZE)
+			cap = TCP_BUFFER_MAX_SIZE;
+		char *grown = (char *) realloc(conn->buf, cap);
+		if (!grown)
+			log_fatal("Memory allocation error")
+		conn->buf = grown;
+		conn->cap = cap;
+	}
+	buf->base = conn->buf + conn->len;
+	buf->len = conn->cap - conn->len;
+}
+
+/**
+ * @brief Callback function for receiving response messages from the remote server
+ * @param stream The connection handle
+ * @param nread Number of bytes received
+ * @param buf Buffer containing the received bytes
+ */
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+	Upstream_Conn *conn = (Upstream_Conn *) stream->data;
+	if (nread < 0) {
+		log_debug("Upstream TCP connection closed")
+		close_conn(conn, nread != UV_EOF);
+		return;
+	}
+	conn->len += nread;
+	unsigned int offset = 0;
+	while (conn->len - offset >= 2) {
+		unsigned int msg_len = (uint8_t) conn->buf[offset] << 8 | (uint8_t) conn->buf[offset + 1];
+		if (msg_len < 12) {
+			log_error("Malformed DNS-over-TCP message from server")
+			close_conn(conn, true);
+			return;
+		}
+		if (conn->len - offset - 2 < msg_len)
+			break;
+		log_debug("Received message from server over TCP")
+		print_dns_string(conn->buf + offset + 2, msg_len);
+		Dns_Msg *msg = (Dns_Msg *) calloc(1, sizeof(Dns_Msg));
+		if (!msg)
+			log_fatal("Memory allocation error")
+		if (string_to_dnsmsg_limit(msg, conn->buf + offset + 2, msg_len)) {
+			print_dns_message(msg);
+			qpool->finish(qpool, msg, INDEX_SOCKET_TCP, (const struct sockaddr *) &conn->link->up->addr);
+		} else // The framing still holds, the connection goes on with the next message
+			log_error("Malformed DNS-over-TCP message from server dropped")
+		destroy_dnsmsg(msg);
+		offset += 2 + msg_len;
+	}
+	if (offset) {
+		memmove(conn->buf, conn->buf + offset, conn->len - offset);
+		conn->len -= offset;
+	}
+}
+
+/**
+ * @brief Callback function of the connect request
+ * @param req Connect request
+ * @param status Connect status
+ */
+static void on_connect(uv_connect_t *req, int status) {
+	Upstream_Conn *conn = (Upstream_Conn *) req->data;
+	Upstream_Link *link = conn->link;
+	if (status) {
+		if (status != UV_ECANCELED)
+			log_error("Failed to connect to the server over TCP, error %d", status)
+		close_conn(conn, true);
+		return;
+	}
+	log_debug("Connected to the server over TCP")
+	metrics_add(upstream_tcp_connects, 1);
+	conn->connected = true;
+	link->backoff = 0;
+	uv_tcp_nodelay(&conn->handle, 1);
+	uv_read_start((uv_stream_t *) &conn->handle, alloc_buffer, on_read);
+	while (link->backlog && link->conn == conn) {
+		Send_Slot *slot = link->backlog;
+		link->backlog = slot->next;
+		--link->backlog_len;
+		write_slot(conn, slot);
+	}
+}
+
+/**
+ * @brief Open a new connection on a link, established asynchronously
+ * @param link The link
+ */
+static void open_conn(Upstream_Link *link) {
+	Upstream_Conn *conn = (Upstream_Conn *) calloc(1, sizeof(Upstream_Conn));
+	if (!conn) {
+		log_fatal("Memory allocation error")
+		return;
+	}
+	conn->buf = (char *) malloc(TCP_BUFFER_INIT_SIZE);
+	if (!conn->buf)
+		log_fatal("Memory allocation error")
+	conn->cap = TCP_BUFFER_INIT_SIZE;
+	conn->link = link;
+	link->conn = conn;
+	uv_tcp_init(upstream_loop, &conn->handle);
+	conn->handle.data = conn->connect_req.data = conn;
+	int ret = uv_tcp_connect(&conn->connect_req, &conn->handle, (const struct sockaddr *) &link->up->addr, on_connect);
+	if (ret) {
+		log_error("Failed to connect to the server over TCP, error %d", ret)
+		close_conn(conn, true);
+	}
+}
+
+/**
+ * @brief Pick the link of the next query to a remote server
+ * @param up The server
+ * @return A link with an established connection if there is one, otherwise a link that is not backing off,
+ * otherwise the next link in round-robin order
+ */
+static Upstream_Link *pick_link(const Upstream *up) {
+	Upstream_Link *links = upstream_links[up->index];
+	unsigned int *next = &next_link[up->index];
+	Upstream_Link *idle = NULL;
+	for (unsigned int i = 0; i < link_count; ++i) {
+		Upstream_Link *link = &links[(*next + i) % link_count];
+		if (link->conn && link->conn->connected) {
+			*next = (*next + i + 1) % link_count;
+			return link;
+		}
+		if (!idle && !uv_is_active((uv_handle_t *) &link->reconnect_timer))
+			idle = link;
+	}
+	if (!idle)
+		idle = &links[*next];
+	*next = (unsigned int) (idle - links + 1) % link_count;
+	return idle;
+}
+
+/**
+ * @brief Initialize the TCP transport to the remote servers
+ * Connections are opened on first use and kept open for the queries that follow.
+ * The links of every position of REMOTE_HOSTS are set up, for the servers added at run time.
+ * @param loop The libuv event loop
+ */
+void init_upstream_tcp(uv_loop_t *loop) {
+	upstream_loop = loop;
+	link_count = UPSTREAM_TCP ? UPSTREAM_TCP_CONNECTIONS : 1;
+	for (int i = 0; i < REMOTE_MAX_HOSTS; ++i)
+		for (unsigned int j = 0; j < link_count; ++j) {
+			Upstream_Link *link = &upstream_links[i][j];
+			link->up = upstream_get(i);
+			uv_timer_init(loop, &link->reconnect_timer);
+			link->reconnect_timer.data = link;
+		}
+}
+
+/**
+ * @brief Send a DNS query message to a remote server over TCP
+ * @param up The remote server
+ * @param msg The DNS message to be sent
+ * @return false if no connection is established and the backlog of the link is full, the query is not sent
+ * @note The reply is handed to the query pool like a reply received over UDP
+ */
+bool send_to_remote_tcp(Upstream *up, const Dns_Msg *msg) {
+	Upstream_Link *link = pick_link(up);
+	if (!link->conn && !uv_is_active((uv_handle_t *) &link->reconnect_timer))
+		open_conn(link);
+	if (!(link->conn && link->conn->connected) && link->backlog_len >= UPSTREAM_TCP_BACKLOG_MAX) {
+		log_error("Upstream TCP backlog full, query not sent")
+		return false;
+	}
+	Send_Slot *slot = spool->alloc(spool);
+	unsigned int len = dnsmsg_to_string_limit(msg, slot->data + 2, DNS_STRING_MAX_SIZE - 2);
+	slot->data[0] = (char) (len >> 8);
+	slot->data[1] = (char) len;
+	slot->len = len + 2;
+
+	log_debug("Sending message to server over TCP")
+	print_dns_message(msg);
+	if (link->conn && link->conn->connected)
+		write_slot(link->conn, slot);
+	else { // Written once connected
+		slot->next = NULL;
+		if (link->backlog)
+			link->backlog_tail->next = slot;
+		else
+			link->backlog = slot;
+		link->backlog_tail = slot;
+		++link->backlog_len;
+	}
+	return true;
+}
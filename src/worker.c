@@ -0,0 +1,106 @@
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "../include/worker.h"
+
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "../include/log.h"
+#include "../include/buffer_pool.h"
+#include "../include/control.h"
+#include "../include/send_pool.h"
+#include "../include/dns_client.h"
+#include "../include/dns_server.h"
+#include "../include/metrics.h"
+#include "../include/metrics_http.h"
+#include "../include/pipeline.h"
+#include "../include/query_pool.h"
+#include "../include/rate_limit.h"
+#include "../include/tcp_server.h"
+#include "../include/trace.h"
+
+_Thread_local Query_Pool *qpool; ///< Query pool of the current worker
+_Thread_local Buffer_Pool *bpool; ///< Receive buffer pool of the current worker
+_Thread_local Send_Pool *spool; ///< Send slot pool of the current worker
+_Thread_local Pipeline *pipeline; ///< Parse workers of the current worker, NULL if PIPELINE_WORKERS is 0
+_Thread_local Rate_Limiter *rrl; ///< Response rate limiter of the current worker, NULL if RRL_RATE is 0
+
+/**
+ * @brief Pin the calling thread to a CPU core
+ * @param id Index of the worker, wrapped around the number of available cores
+ */
+static void pin_thread(unsigned int id) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(id % uv_available_parallelism(), &set);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	if (ret)
+		log_error("Failed to pin worker %u to a CPU core, error %d", id, ret)
+#else
+	log_error("Pinning worker threads is not supported on this platform")
+#endif
+}
+
+/**
+ * @brief Entry of a worker thread
+ * @param arg The worker
+ */
+static void worker_main(void *arg) {
+	Worker *worker = (Worker *) arg;
+	log_info("Starting worker %u", worker->id)
+	if (PIN_THREADS)
+		pin_thread(worker->id);
+	qpool = new_qpool(&worker->loop, worker->cache);
+	bpool = new_buffer_pool(BUFFER_POOL_SIZE, UDP_PAYLOAD_SIZE);
+	spool = new_send_pool(SEND_POOL_SIZE);
+	if (RRL_RATE)
+		rrl = new_rate_limiter(&worker->loop);
+	if (PIPELINE_WORKERS)
+		pipeline = new_pipeline(&worker->loop, worker->cache);
+	init_client(&worker->loop, worker->id);
+	init_server(&worker->loop);
+	if (TCP_MAX_CONNECTIONS)
+		init_tcp_server(&worker->loop);
+	init_metrics(&worker->loop, worker->id);
+	if (worker->id == 0 && METRICS_LISTEN)
+		init_metrics_http(&worker->loop, worker->cache);
+	if (worker->id == 0)
+		init_trace(&worker->loop);
+	if (worker->id == 0 && CONTROL_PATH)
+		init_control(&worker->loop, worker->cache);
+	uv_run(&worker->loop, UV_RUN_DEFAULT);
+}
+
+/**
+ * @brief Start THREAD_COUNT workers and wait for them to finish
+ * The calling thread runs the first worker itself.
+ * @param cache The cache shared by all workers
+ * @return The exit status of the event loops
+ */
+int run_workers(Cache *cache) {
+	Worker *workers = (Worker *) calloc(THREAD_COUNT, sizeof(Worker));
+	if (!workers) {
+		log_fatal("Memory allocation error")
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		workers[i].id = i;
+		workers[i].cache = cache;
+		if (uv_loop_init(&workers[i].loop))
+			log_fatal("Failed to initialize the event loop of worker %d", i)
+	}
+	for (int i = 1; i < THREAD_COUNT; ++i)
+		if (uv_thread_create(&workers[i].thread, worker_main, &workers[i]))
+			log_fatal("Failed to start worker %d", i)
+	worker_main(&workers[0]);
+	for (int i = 1; i < THREAD_COUNT; ++i)
+		uv_thread_join(&workers[i].thread);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#include "../include/query_log.h"
+
+static const char *const outcome_names[QUERY_LOG_OUTCOMES] = {
+	"-", "cache", "hosts", "blocked", "upstream", "timeout", "shed", "rrl-slip", "rrl-drop", "backlog", "unsent"
+};
+
+/**
+ * @brief Read a big-endian 16-bit number
+ * @param p Where to read it
+ * @return The number
+ */
+static uint16_t get16(const uint8_t *p) {
+	return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+/**
+ * @brief Read a big-endian 32-bit number
+ * @param p Where to read it
+ * @return The number
+ */
+static uint32_t get32(const uint8_t *p) {
+	return (uint32_t) get16(p) << 16 | get16(p + 2);
+}
+
+/**
+ * @brief Read a big-endian 64-bit number
+ * @param p Where to read it
+ * @return The number
+ */
+static uint64_t get64(const uint8_t *p) {
+	return (uint64_t) get32(p) << 32 | get32(p + 4);
+}
+
+/**
+ * @brief Name a query type
+ * @param qtype The type
+ * @param buf Storage for the name of an unknown type
+ * @return The name, as in the presentation format (RFC 3597 for the unknown ones)
+ */
+static const char *qtype_name(uint16_t qtype, char *buf) {
+	switch (qtype) {
+		case DNS_TYPE_A: return "A";
+		case DNS_TYPE_NS: return "NS";
+		case DNS_TYPE_CNAME: return "CNAME";
+		case DNS_TYPE_SOA: return "SOA";
+		case DNS_TYPE_PTR: return "PTR";
+		case DNS_TYPE_MX: return "MX";
+		case DNS_TYPE_TXT: return "TXT";
+		case DNS_TYPE_AAAA: return "AAAA";
+		case 33: return "SRV";
+		case 65: return "HTTPS";
+		case 255: return "ANY";
+		default:
+			sprintf(buf, "TYPE%u", qtype);
+			return buf;
+	}
+}
+
+/**
+ * @brief Name a response code
+ * @param rcode The code
+ * @param buf Storage for the name of an unknown code
+ * @return The name
+ */
+static const char *rcode_name(uint8_t rcode, char *buf) {
+	switch (rcode) {
+		case DNS_RCODE_OK: return "NOERROR";
+		case 1: return "FORMERR";
+		case DNS_RCODE_SERVFAIL: return "SERVFAIL";
+		case DNS_RCODE_NXDOMAIN: return "NXDOMAIN";
+		case 4: return "NOTIMP";
+		case DNS_RCODE_REFUSED: return "REFUSED";
+		default:
+			sprintf(buf, "RCODE%u", rcode);
+			return buf;
+	}
+}
+
+/**
+ * @brief Write a name as a JSON string, escaping quotes, backslashes and bytes outside printable ASCII
+ * @param name The name
+ * @param len Length of the name
+ */
+static void print_json_string(const uint8_t *name, size_t len) {
+	putchar('"');
+	for (size_t i = 0; i < len; ++i) {
+		if (name[i] == '"' || name[i] == '\\')
+			printf("\\%c", name[i]);
+		else if (name[i] < 0x20 || name[i] > 0x7e)
+			printf("\\u%04x", name[i]);
+		else
+			putchar(name[i]);
+	}
+	putchar('"');
+}
+
+/**
+ * @brief Print one record as a line of text or as a JSON object
+ * @param record The record, without its length
+ * @param len Length of the record
+ * @param json Whether to print JSON
+ * @return False if the record is malformed
+ */
+static bool print_record(const uint8_t *record, size_t len, bool json) {
+	if (len < QUERY_LOG_RECORD_FIXED)
+		return false;
+	uint8_t type = record[0], flags = record[1];
+	size_t addr_len = flags & QUERY_LOG_FLAG_IPV6 ? 16 : 4;
+	if (type < QUERY_LOG_QUERY || type > QUERY_LOG_DROP || len < QUERY_LOG_RECORD_FIXED + addr_len + 1)
+		return false;
+	const uint8_t *name = record + QUERY_LOG_RECORD_FIXED + addr_len + 1;
+	size_t name_len = name[-1];
+	if (len != QUERY_LOG_RECORD_FIXED + addr_len + 1 + name_len)
+		return false;
+
+	uint64_t time_us = get64(record + 2);
+	time_t seconds = (time_t) (time_us / 1000000);
+	char time_str[32], client[64], type_buf[16], rcode_buf[16];
+	strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", gmtime(&seconds));
+	uv_inet_ntop(flags & QUERY_LOG_FLAG_IPV6 ? AF_INET6 : AF_INET, record + QUERY_LOG_RECORD_FIXED, client,
+	             sizeof(client));
+	const char *kind = type == QUERY_LOG_QUERY ? "query" : type == QUERY_LOG_RESPONSE ? "response" : "drop";
+	const char *transport = flags & QUERY_LOG_FLAG_TCP ? "tcp" : "udp";
+	uint16_t id = get16(record + 10), port = get16(record + 20);
+	uint16_t qtype = get16(record + 12);
+	uint8_t rcode = record[14], outcome = record[15] < QUERY_LOG_OUTCOMES ? record[15] : 0;
+	uint32_t latency = get32(record + 16);
+
+	if (json) {
+		printf("{\"time\":\"%s.%06uZ\",\"type\":\"%s\",\"transport\":\"%s\",\"client\":\"%s\",\"port\":%u,"
+		       "\"id\":%u,\"qname\":", time_str, (unsigned int) (time_us % 1000000), kind, transport, client, port, id);
+		print_json_string(name, name_len);
+		printf(",\"qtype\":\"%s\"", qtype_name(qtype, type_buf));
+		if (type == QUERY_LOG_RESPONSE)
+			printf(",\"rcode\":\"%s\",\"outcome\":\"%s\",\"latency_us\":%u", rcode_name(rcode, rcode_buf),
+			       outcome_names[outcome], latency);
+		else if (type == QUERY_LOG_DROP)
+			printf(",\"outcome\":\"%s\"", outcome_names[outcome]);
+		printf("}\n");
+	} else {
+		printf("%s.%06uZ %-8s %s %s#%u id %u %.*s %s", time_str, (unsigned int) (time_us % 1000000), kind, transport,
+		       client, port, id, (int) name_len, (const char *) name, qtype_name(qtype, type_buf));
+		if (type == QUERY_LOG_RESPONSE)
+			printf(" %s %s %u us", rcode_name(rcode, rcode_buf), outcome_names[outcome], latency);
+		else if (type == QUERY_LOG_DROP)
+			printf(" %s", outcome_names[outcome]);
+		putchar('\n');
+	}
+	return true;
+}
+
+/**
+ * @brief Print every record of a query log
+ * @param file The log, a file written by the relay or the stream a collector received
+ * @param path Name of the log in error messages
+ * @param json Whether to print JSON
+ * @return 0 on success, 1 if the log is malformed
+ *
+ * The magic and the version may appear again between records, where a collector got reconnected.
+ */
+static int read_log(FILE *file, const char *path, bool json) {
+	uint8_t buf[QUERY_LOG_HEAD_SIZE > QUERY_LOG_RECORD_MAX ? QUERY_LOG_HEAD_SIZE : QUERY_LOG_RECORD_MAX];
+	bool head = false;
+	for (;;) {
+		size_t n = fread(buf, 1, 2, file);
+		if (n == 0)
+			return 0;
+		if (n < 2)
+			break;
+		if (memcmp(buf, QUERY_LOG_MAGIC, 2) == 0) { // No record is that long
+			if (fread(buf + 2, 1, QUERY_LOG_HEAD_SIZE - 2, file) != QUERY_LOG_HEAD_SIZE - 2 ||
+			    memcmp(buf, QUERY_LOG_MAGIC, QUERY_LOG_HEAD_SIZE - 2) != 0)
+				break;
+			uint16_t version = get16(buf + QUERY_LOG_HEAD_SIZE - 2);
+			if (!version || version > QUERY_LOG_VERSION) { // Version 2 only added drops and outcomes
+				fprintf(stderr, "%s: unsupported query log version %u\n", path, version);
+				return 1;
+			}
+			head = true;
+			continue;
+		}
+		size_t len = get16(buf);
+		if (!head || len > QUERY_LOG_RECORD_MAX || fread(buf, 1, len, file) != len || !print_record(buf, len, json))
+			break;
+	}
+	fprintf(stderr, "%s: not a query log or cut short\n", path);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	bool json = false;
+	int first = 1;
+	if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+		printf("Usage: query_log_reader [-j] [file...]\n");
+		printf("    Print the records of query logs written with --query-log, one per line, standard input without a file\n");
+		printf("    [-j] Print each record as a JSON object instead of text\n");
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+		json = true;
+		++first;
+	}
+	if (first == argc)
+		return read_log(stdin, "stdin", json);
+	int status = 0;
+	for (int i = first; i < argc; ++i) {
+		FILE *file = fopen(argv[i], "rb");
+		if (!file) {
+			fprintf(stderr, "%s: cannot open\n", argv[i]);
+			status = 1;
+			continue;
+		}
+		status |= read_log(file, argv[i], json);
+		fclose(file);
+	}
+	return status;
+}